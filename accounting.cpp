@@ -0,0 +1,115 @@
+#include "accounting.h"
+
+#include <utility>
+
+namespace browser {
+namespace {
+
+thread_local MemoryAccountPtr t_account;
+
+void raise_peak(std::atomic<size_t>& peak, size_t value) {
+    size_t seen = peak.load(std::memory_order_relaxed);
+    while (value > seen && !peak.compare_exchange_weak(seen, value, std::memory_order_relaxed)) {
+    }
+}
+
+}  // namespace
+
+const char* memory_category_name(MemoryCategory category) {
+    switch (category) {
+        case MemoryCategory::DOM_NODES: return "dom_nodes";
+        case MemoryCategory::DOM_ATTRIBUTES: return "dom_attributes";
+        case MemoryCategory::DOM_TEXT: return "dom_text";
+        case MemoryCategory::STYLE_RULES: return "style_rules";
+        case MemoryCategory::RESPONSE_BODY: return "response_body";
+        case MemoryCategory::RESPONSE_HEADERS: return "response_headers";
+    }
+    return "unknown";
+}
+
+void MemoryAccount::charge(MemoryCategory category, size_t bytes, size_t allocations) {
+    Slot& slot = slots_[static_cast<size_t>(category)];
+    raise_peak(slot.peak, slot.current.fetch_add(bytes, std::memory_order_relaxed) + bytes);
+    slot.allocations.fetch_add(allocations, std::memory_order_relaxed);
+    raise_peak(total_.peak, total_.current.fetch_add(bytes, std::memory_order_relaxed) + bytes);
+    total_.allocations.fetch_add(allocations, std::memory_order_relaxed);
+}
+
+void MemoryAccount::release(MemoryCategory category, size_t bytes, size_t allocations) {
+    Slot& slot = slots_[static_cast<size_t>(category)];
+    slot.current.fetch_sub(bytes, std::memory_order_relaxed);
+    slot.frees.fetch_add(allocations, std::memory_order_relaxed);
+    total_.current.fetch_sub(bytes, std::memory_order_relaxed);
+    total_.frees.fetch_add(allocations, std::memory_order_relaxed);
+}
+
+MemoryStats MemoryAccount::snapshot() const {
+    MemoryStats out;
+    for (size_t i = 0; i < kMemoryCategoryCount; ++i) {
+        out.categories[i].current_bytes = slots_[i].current.load(std::memory_order_relaxed);
+        out.categories[i].peak_bytes = slots_[i].peak.load(std::memory_order_relaxed);
+        out.categories[i].allocations = slots_[i].allocations.load(std::memory_order_relaxed);
+        out.categories[i].frees = slots_[i].frees.load(std::memory_order_relaxed);
+    }
+    out.current_bytes = total_.current.load(std::memory_order_relaxed);
+    out.peak_bytes = total_.peak.load(std::memory_order_relaxed);
+    return out;
+}
+
+const MemoryAccountPtr& active_memory_account() { return t_account; }
+
+MemoryAccountScope::MemoryAccountScope(MemoryAccountPtr account) : previous_(t_account) {
+    if (ZEPHYR_METRICS) t_account = std::move(account);
+}
+
+MemoryAccountScope::~MemoryAccountScope() { t_account = std::move(previous_); }
+
+MemoryCharge::MemoryCharge(const MemoryCharge& other) : account_(other.account_), category_(other.category_) {
+    set(other.bytes_, other.allocations_);
+}
+
+MemoryCharge::MemoryCharge(MemoryCharge&& other) noexcept
+    : account_(std::move(other.account_)), category_(other.category_), bytes_(other.bytes_), allocations_(other.allocations_) {
+    other.bytes_ = other.allocations_ = 0;
+}
+
+MemoryCharge& MemoryCharge::operator=(const MemoryCharge& other) {
+    if (this == &other) return *this;
+    clear();
+    account_ = other.account_;
+    category_ = other.category_;
+    set(other.bytes_, other.allocations_);
+    return *this;
+}
+
+MemoryCharge& MemoryCharge::operator=(MemoryCharge&& other) noexcept {
+    if (this == &other) return *this;
+    clear();
+    account_ = std::move(other.account_);
+    category_ = other.category_;
+    bytes_ = other.bytes_;
+    allocations_ = other.allocations_;
+    other.bytes_ = other.allocations_ = 0;
+    return *this;
+}
+
+MemoryCharge::~MemoryCharge() { clear(); }
+
+void MemoryCharge::set(size_t bytes, size_t allocations) {
+    if (!account_) return;
+    const size_t shrink_bytes = bytes_ > bytes ? bytes_ - bytes : 0;
+    const size_t shrink_allocations = allocations_ > allocations ? allocations_ - allocations : 0;
+    if (shrink_bytes || shrink_allocations) account_->release(category_, shrink_bytes, shrink_allocations);
+    const size_t grow_bytes = bytes > bytes_ ? bytes - bytes_ : 0;
+    const size_t grow_allocations = allocations > allocations_ ? allocations - allocations_ : 0;
+    if (grow_bytes || grow_allocations) account_->charge(category_, grow_bytes, grow_allocations);
+    bytes_ = bytes;
+    allocations_ = allocations;
+}
+
+void MemoryCharge::clear() {
+    if (account_ && (bytes_ || allocations_)) account_->release(category_, bytes_, allocations_);
+    bytes_ = allocations_ = 0;
+}
+
+}  // namespace browser
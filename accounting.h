@@ -0,0 +1,100 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+#include "metrics.h"
+
+namespace browser {
+
+enum class MemoryCategory { DOM_NODES, DOM_ATTRIBUTES, DOM_TEXT, STYLE_RULES, RESPONSE_BODY, RESPONSE_HEADERS };
+
+constexpr size_t kMemoryCategoryCount = 6;
+
+const char* memory_category_name(MemoryCategory category);
+
+struct MemoryCounter {
+    size_t current_bytes = 0;
+    size_t peak_bytes = 0;
+    size_t allocations = 0;
+    size_t frees = 0;
+};
+
+struct MemoryStats {
+    MemoryCounter categories[kMemoryCategoryCount];
+    size_t current_bytes = 0;
+    size_t peak_bytes = 0;
+
+    const MemoryCounter& operator[](MemoryCategory category) const { return categories[static_cast<size_t>(category)]; }
+};
+
+// Byte and allocation tally for one page. Objects created while the account is active
+// charge it on construction and release their charge when destroyed, so current_bytes
+// follows what is still alive and peak_bytes the high-water mark. Thread-safe.
+class MemoryAccount {
+public:
+    void charge(MemoryCategory category, size_t bytes, size_t allocations = 1);
+    void release(MemoryCategory category, size_t bytes, size_t allocations = 1);
+    MemoryStats snapshot() const;
+
+private:
+    struct Slot {
+        std::atomic<size_t> current{0};
+        std::atomic<size_t> peak{0};
+        std::atomic<size_t> allocations{0};
+        std::atomic<size_t> frees{0};
+    };
+
+    Slot slots_[kMemoryCategoryCount];
+    Slot total_;
+};
+
+using MemoryAccountPtr = std::shared_ptr<MemoryAccount>;
+
+// The account that objects created on this thread charge, or null.
+const MemoryAccountPtr& active_memory_account();
+
+class MemoryAccountScope {
+public:
+    explicit MemoryAccountScope(MemoryAccountPtr account);
+    ~MemoryAccountScope();
+
+    MemoryAccountScope(const MemoryAccountScope&) = delete;
+    MemoryAccountScope& operator=(const MemoryAccountScope&) = delete;
+
+private:
+    MemoryAccountPtr previous_;
+};
+
+// A charge owned by a value type. Copies charge the same account again, moves transfer
+// the charge, destruction releases it.
+class MemoryCharge {
+public:
+    explicit MemoryCharge(MemoryCategory category) : account_(active_memory_account()), category_(category) {}
+    MemoryCharge(const MemoryCharge& other);
+    MemoryCharge(MemoryCharge&& other) noexcept;
+    MemoryCharge& operator=(const MemoryCharge& other);
+    MemoryCharge& operator=(MemoryCharge&& other) noexcept;
+    ~MemoryCharge();
+
+    void set(size_t bytes, size_t allocations);
+    size_t bytes() const { return bytes_; }
+
+private:
+    void clear();
+
+    MemoryAccountPtr account_;
+    MemoryCategory category_;
+    size_t bytes_ = 0;
+    size_t allocations_ = 0;
+};
+
+// Heap bytes owned by a std::string beyond its inline buffer.
+inline size_t string_heap_bytes(const std::string& s) {
+    return s.capacity() > std::string().capacity() ? s.capacity() + 1 : 0;
+}
+
+}  // namespace browser
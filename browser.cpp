@@ -1,12 +1,355 @@
 #include "browser_core.h"
+#include "charset.h"
+#include "crawler.h"
+#include "fetch.h"
+#include "layout.h"
+#include "paint.h"
+#include "pipeline.h"
+#include "prefetch.h"
+#include "style_engine.h"
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cstdio>
+#include <fstream>
 #include <iostream>
+#include <memory>
+#include <optional>
+#include <sstream>
+#include <stdexcept>
 #include <string>
+#include <thread>
 #include <vector>
 
+namespace {
+
+struct BatchOptions {
+    std::string input = "-";
+    size_t workers = 0;
+    size_t fetchers = 16;
+    size_t wrap = 100;
+    bool subresources = true;
+    bool text = true;
+};
+
+bool read_file(const std::string& path, std::string& out) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in) return false;
+    std::ostringstream ss;
+    ss << in.rdbuf();
+    out = ss.str();
+    return true;
+}
+
+// The value following `flag`; throws std::invalid_argument unless it is a plain count.
+size_t count_arg(const std::string& flag, const std::string& value) {
+    size_t n = 0;
+    if (value.empty() || value.size() > 18 || value.find_first_not_of("0123456789") != std::string::npos) {
+        throw std::invalid_argument(flag + " expects a number, got '" + value + "'");
+    }
+    for (char c : value) n = n * 10 + static_cast<size_t>(c - '0');
+    return n;
+}
+
+// One NDJSON record per input line, in completion order. Entries that name an existing
+// file are rendered from disk; everything else is treated as a URL.
+int run_batch(int argc, char** argv) {
+    BatchOptions options;
+    for (int i = 2; i < argc; ++i) {
+        const std::string arg = argv[i];
+        if (arg == "--workers" && i + 1 < argc) options.workers = count_arg(arg, argv[++i]);
+        else if (arg == "--fetchers" && i + 1 < argc) options.fetchers = count_arg(arg, argv[++i]);
+        else if (arg == "--wrap" && i + 1 < argc) options.wrap = count_arg(arg, argv[++i]);
+        else if (arg == "--no-subresources") options.subresources = false;
+        else if (arg == "--no-text") options.text = false;
+        else options.input = arg;
+    }
+
+    std::ifstream file;
+    if (options.input != "-") {
+        file.open(options.input);
+        if (!file) {
+            std::cerr << "Error: cannot open " << options.input << "\n";
+            return 1;
+        }
+    }
+    std::istream& in = (options.input == "-") ? std::cin : file;
+
+    browser::PipelineOptions pipeline;
+    pipeline.cpu_workers = options.workers;
+    pipeline.fetch_workers = options.fetchers;
+    pipeline.wrap_width = options.wrap;
+    pipeline.fetch_subresources = options.subresources;
+    pipeline.subresource_options.fetch_scripts = false;
+    pipeline.fetcher = [](const std::string& url) {
+        if (url.find("://") != std::string::npos) return http_get(url);
+        std::string body;
+        if (!read_file(url, body)) throw std::runtime_error("cannot read " + url);
+        HttpResponse r;
+        r.body = std::move(body);
+        return r;
+    };
+
+    size_t ok = 0;
+    size_t failed = 0;
+    const auto started = std::chrono::steady_clock::now();
+    std::vector<browser::StageStats> stats;
+    {
+        browser::PagePipeline run(pipeline, [&](browser::PageResult&& r) {
+            std::cout << browser::page_result_json(r, options.text) << '\n';
+            if (r.ok) ++ok;
+            else ++failed;
+        });
+
+        std::string line;
+        while (std::getline(in, line)) {
+            if (!line.empty() && line.back() == '\r') line.pop_back();
+            if (line.empty() || line[0] == '#') continue;
+            const bool is_file = line.find("://") == std::string::npos && std::ifstream(line).good();
+            run.submit(is_file || line.find("://") != std::string::npos ? line : "https://" + line);
+        }
+        run.finish();
+        stats = run.stats();
+    }
+    std::cout.flush();
+
+    const double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+    std::cerr << "batch: " << ok << " ok, " << failed << " failed in " << secs << " s (" << ((ok + failed) / (secs > 0 ? secs : 1))
+              << " pages/s)\n";
+    for (const auto& st : stats) {
+        std::cerr << "  " << browser::stage_name(st.stage) << ": " << st.processed << " done, max queue " << st.max_queue_depth
+                  << ", busy " << st.busy_ms << " ms, utilization " << st.utilization * 100.0 << "%\n";
+    }
+    return failed ? 2 : 0;
+}
+
+// Renders a local file (or stdin for "-") while it is being read, for documents too
+// large to load whole.
+int run_stream(int argc, char** argv) {
+    std::string input = "-";
+    size_t wrap = 100;
+    for (int i = 2; i < argc; ++i) {
+        const std::string arg = argv[i];
+        if (arg == "--wrap" && i + 1 < argc) wrap = count_arg(arg, argv[++i]);
+        else input = arg;
+    }
+
+    std::ifstream file;
+    if (input != "-") {
+        file.open(input, std::ios::binary);
+        if (!file) {
+            std::cerr << "Error: cannot open " << input << "\n";
+            return 1;
+        }
+    }
+    std::istream& in = (input == "-") ? std::cin : file;
+
+    browser::TextRenderStream stream([](std::string_view line) { std::cout << line << '\n'; }, wrap);
+    std::vector<char> chunk(64 * 1024);
+    std::unique_ptr<browser::Utf8Decoder> decoder;  // picked from the first chunk
+    std::string utf8;
+    while (in.read(chunk.data(), static_cast<std::streamsize>(chunk.size())) || in.gcount() > 0) {
+        std::string_view bytes(chunk.data(), static_cast<size_t>(in.gcount()));
+        if (!decoder) {
+            const browser::CharsetSniff sniff = browser::sniff_stream_charset(bytes);
+            decoder = std::make_unique<browser::Utf8Decoder>(sniff.charset);
+            bytes.remove_prefix(sniff.bom_length);
+        }
+        utf8.clear();
+        decoder->decode(bytes, utf8);
+        stream.feed(utf8);
+    }
+    if (decoder) {
+        utf8.clear();
+        decoder->finish(utf8);
+        stream.feed(utf8);
+    }
+    stream.finish();
+    return 0;
+}
+
+// A local file, or else a URL whose stylesheets are fetched too.
+browser::RenderContext load_input(const std::string& input) {
+    std::string source;
+    if (input.find("://") == std::string::npos && read_file(input, source)) {
+        const browser::SharedBuffer html = browser::decode_to_utf8(browser::SharedBuffer(std::move(source)));
+        return browser::parse_document(html, extract_style_blocks(html.bytes()));
+    }
+    const std::string url = input.find("://") == std::string::npos ? "https://" + input : input;
+    const HttpResponse r = http_get(url);
+    return browser::load_document(browser::decode_response_body(r), url);
+}
+
+// Lays out a file or URL and writes the top of the page as a PNG (or PPM, by extension).
+int run_screenshot(int argc, char** argv) {
+    std::string input;
+    std::string output;
+    int32_t width = 1024;
+    int32_t height = 768;
+    size_t threads = std::max(1u, std::thread::hardware_concurrency());
+    for (int i = 2; i < argc; ++i) {
+        const std::string arg = argv[i];
+        if (arg == "--width" && i + 1 < argc) width = static_cast<int32_t>(count_arg(arg, argv[++i]));
+        else if (arg == "--height" && i + 1 < argc) height = static_cast<int32_t>(count_arg(arg, argv[++i]));
+        else if (arg == "--threads" && i + 1 < argc) threads = count_arg(arg, argv[++i]);
+        else if (input.empty()) input = arg;
+        else output = arg;
+    }
+    if (input.empty() || output.empty()) {
+        std::cerr << "Usage: zephyr_cli --screenshot INPUT OUT.png|OUT.ppm [--width N] [--height N] [--threads N]\n";
+        return 1;
+    }
+
+    try {
+        const browser::RenderContext ctx = load_input(input);
+        browser::StyleEngine styles(ctx.document, ctx.stylesheet);
+        browser::LayoutEngine layout(styles);
+        const browser::DisplayList list = browser::build_display_list(layout.layout(width));
+        browser::TileRasterizer raster(threads);
+        browser::write_image(output, raster.render(list, width, height));
+        std::cerr << "Wrote " << output << " (" << width << "x" << height << ", " << list.items.size() << " items, layout "
+                  << layout.lastStats().milliseconds << " ms, raster " << raster.lastStats().milliseconds << " ms)\n";
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << "\n";
+        return 1;
+    }
+    return 0;
+}
+
+// Styles a file or URL once with selector profiling on and prints the costliest rules.
+int run_profile_css(int argc, char** argv) {
+    std::string input;
+    size_t top = 20;
+    for (int i = 2; i < argc; ++i) {
+        const std::string arg = argv[i];
+        if (arg == "--top" && i + 1 < argc) top = count_arg(arg, argv[++i]);
+        else input = arg;
+    }
+    if (input.empty()) {
+        std::cerr << "Usage: zephyr_cli --profile-css INPUT [--top N]\n";
+        return 1;
+    }
+
+    try {
+        const browser::RenderContext ctx = load_input(input);
+        browser::SelectorProfile profile(ctx.stylesheet);
+        {
+            browser::SelectorProfileScope scope(profile);
+            browser::StyleEngine styles(ctx.document, ctx.stylesheet);
+        }
+        profile.write(std::cout, top);
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << "\n";
+        return 1;
+    }
+    return 0;
+}
+
+volatile std::sig_atomic_t g_interrupted = 0;
+
+void on_interrupt(int) { g_interrupted = 1; }
+
+// Crawls from the seed URLs, one NDJSON record per page fetched. The frontier and seen set
+// live in --dir, so a crawl stopped with Ctrl-C picks up again with --resume.
+int run_crawl(int argc, char** argv) {
+    browser::CrawlOptions options;
+    for (int i = 2; i < argc; ++i) {
+        const std::string arg = argv[i];
+        if (arg == "--dir" && i + 1 < argc) options.state_dir = argv[++i];
+        else if (arg == "--resume") options.resume = true;
+        else if (arg == "--max-pages" && i + 1 < argc) options.max_pages = count_arg(arg, argv[++i]);
+        else if (arg == "--depth" && i + 1 < argc) options.max_depth = count_arg(arg, argv[++i]);
+        else if (arg == "--concurrency" && i + 1 < argc) options.concurrency = count_arg(arg, argv[++i]);
+        else if (arg == "--per-host" && i + 1 < argc) options.per_host_concurrency = count_arg(arg, argv[++i]);
+        else if (arg == "--delay-ms" && i + 1 < argc) options.host_delay = std::chrono::milliseconds(count_arg(arg, argv[++i]));
+        else if (arg == "--checkpoint-every" && i + 1 < argc) options.checkpoint_every = count_arg(arg, argv[++i]);
+        else if (arg == "--any-host") options.same_host = false;
+        else options.seeds.push_back(arg.find("://") == std::string::npos ? "https://" + arg : arg);
+    }
+    if (options.state_dir.empty() || (options.seeds.empty() && !options.resume)) {
+        std::cerr << "Usage: zephyr_cli --crawl --dir DIR [SEED...] [--resume] [--max-pages N] [--depth N] [--concurrency N]\n"
+                     "                  [--per-host N] [--delay-ms N] [--checkpoint-every N] [--any-host]\n";
+        return 1;
+    }
+
+    try {
+        browser::Crawler crawler(options);
+        g_interrupted = 0;
+        const auto previous = std::signal(SIGINT, on_interrupt);
+        const browser::CrawlStats st = crawler.run([&](const browser::CrawlPage& page) {
+            std::cout << "{\"url\":\"" << browser::json_escape(page.url) << "\",\"depth\":" << page.depth;
+            if (!page.status_line.empty()) std::cout << ",\"http_status\":\"" << browser::json_escape(page.status_line) << '"';
+            if (!page.error.empty()) std::cout << ",\"error\":\"" << browser::json_escape(page.error) << '"';
+            std::cout << ",\"bytes\":" << page.bytes << ",\"new_links\":" << page.links << "}\n";
+            if (g_interrupted) crawler.stop();
+        });
+        std::signal(SIGINT, previous);
+        std::cout.flush();
+        std::cerr << "crawl: " << st.fetched << " fetched, " << st.failed << " failed, " << st.non_2xx << " non-2xx; " << st.discovered
+                  << " discovered, " << st.duplicates << " duplicate links, " << st.pending << " pending on " << st.hosts << " hosts\n";
+        std::cerr << "  this run: " << st.seconds << " s; Bloom filter " << st.bloom_bytes / 1024 << " KB, " << st.bloom_false_positives
+                  << " false positives settled on disk; seen-URL store " << st.seen_bytes / 1024 << " KB in memory\n";
+        if (st.pending) std::cerr << "  continue with: zephyr_cli --crawl --dir " << options.state_dir << " --resume\n";
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << "\n";
+        return 1;
+    }
+    return 0;
+}
+
+// Loads `url` on the shared fetcher's I/O thread while this thread reports progress;
+// Ctrl-C abandons the load instead of killing the browser.
+HttpResponse fetch_interactive(const std::string& url) {
+    auto received = std::make_shared<std::atomic<size_t>>(0);
+    browser::FetchCallbacks callbacks;
+    callbacks.on_progress = [received](size_t bytes, size_t) { *received = bytes; };
+    browser::FetchHandle handle = browser::AsyncFetcher::shared().fetch(url, callbacks);
+
+    g_interrupted = 0;
+    const auto previous = std::signal(SIGINT, on_interrupt);
+    bool shown = false;
+    while (handle.future().wait_for(std::chrono::milliseconds(100)) != std::future_status::ready) {
+        if (g_interrupted) {
+            handle.cancel();
+            break;
+        }
+        std::cerr << "\rLoading " << url << " ... " << (*received / 1024) << " KB" << std::flush;
+        shown = true;
+    }
+    std::signal(SIGINT, previous);
+    if (shown) std::cerr << '\n';
+    return handle.get();
+}
+
+}  // namespace
+
 int main(int argc, char** argv) {
+    try {
+        if (argc > 1 && std::string(argv[1]) == "--batch") return run_batch(argc, argv);
+        if (argc > 1 && std::string(argv[1]) == "--stream") return run_stream(argc, argv);
+        if (argc > 1 && std::string(argv[1]) == "--screenshot") return run_screenshot(argc, argv);
+        if (argc > 1 && std::string(argv[1]) == "--profile-css") return run_profile_css(argc, argv);
+        if (argc > 1 && std::string(argv[1]) == "--crawl") return run_crawl(argc, argv);
+    } catch (const std::invalid_argument& e) {
+        std::cerr << "Error: " << e.what() << "\n";
+        return 1;
+    }
+
+    // Links on the page being read are fetched in the background; following one renders
+    // from memory.
+    browser::PrefetchOptions prefetch_options;
+    if (argc > 1 && std::string(argv[1]) == "--no-prefetch") {
+        prefetch_options.max_links = 0;
+        ++argv;
+        --argc;
+    }
+    browser::Prefetcher prefetcher(prefetch_options);
+
     std::vector<std::string> history;
     int history_index = -1;
+    bool reload = false;
 
     std::string current;
     if (argc > 1) current = argv[1];
@@ -16,10 +359,28 @@ int main(int argc, char** argv) {
     }
     if (current.find("://") == std::string::npos) current = "https://" + current;
 
+    browser::PageMetrics metrics;
+    browser::MemoryAccountPtr memory;
+
     while (true) {
         try {
-            const HttpResponse r = http_get(current);
-            const std::string page = render_page_text(r.body, 100);
+            metrics = browser::PageMetrics();
+            memory = std::make_shared<browser::MemoryAccount>();
+            std::string page;
+            browser::SharedBuffer html;
+            bool prefetched = false;
+            {
+                browser::MetricsScope scope(metrics);
+                browser::MemoryAccountScope memory_scope(memory);
+                std::optional<HttpResponse> r;
+                if (!reload) r = prefetcher.take(current);
+                prefetched = r.has_value();
+                if (!r) r = fetch_interactive(current);
+                html = browser::decode_response_body(*r);
+                page = render_page_text(html, current, 100);
+            }
+            reload = false;
+            prefetcher.prefetch(current, html.bytes());
 
             if (history_index + 1 < static_cast<int>(history.size())) history.resize(history_index + 1);
             if (history.empty() || history.back() != current) {
@@ -27,14 +388,55 @@ int main(int argc, char** argv) {
                 history_index = static_cast<int>(history.size()) - 1;
             }
 
-            std::cout << "\n=== " << current << " ===\n\n";
+            std::cout << "\n=== " << current << (prefetched ? " (prefetched)" : "") << " ===\n\n";
             std::cout << (page.empty() ? "(No renderable content)" : page) << "\n\n";
-            std::cout << "Command (url <url>, back, forward, reload, quit): ";
 
             std::string cmd;
-            if (!std::getline(std::cin, cmd)) break;
+            for (;;) {
+                std::cout << "Command (url <url>, back, forward, reload, metrics, trace <file>, stats, prefetch, quit): ";
+                if (!std::getline(std::cin, cmd)) cmd = "quit";
+                if (cmd == "metrics") {
+                    for (size_t i = 0; i < browser::kPhaseCount; ++i) {
+                        std::cout << "  " << browser::phase_name(static_cast<browser::Phase>(i)) << ": " << metrics.phase_ms[i] << " ms\n";
+                    }
+                    std::cout << "  total: " << metrics.total_ms() << " ms\n";
+                    continue;
+                }
+                if (cmd == "stats") {
+                    const browser::MemoryStats st = memory->snapshot();
+                    for (size_t i = 0; i < browser::kMemoryCategoryCount; ++i) {
+                        const browser::MemoryCounter& c = st.categories[i];
+                        std::cout << "  " << browser::memory_category_name(static_cast<browser::MemoryCategory>(i)) << ": current "
+                                  << c.current_bytes << " B, peak " << c.peak_bytes << " B, " << c.allocations << " allocs, "
+                                  << c.frees << " frees\n";
+                    }
+                    std::cout << "  total: current " << st.current_bytes << " B, peak " << st.peak_bytes << " B\n";
+                    continue;
+                }
+                if (cmd == "prefetch") {
+                    const browser::Prefetcher::Stats st = prefetcher.stats();
+                    char rate[16];
+                    std::snprintf(rate, sizeof(rate), "%.1f%%", st.hitRate() * 100);
+                    std::cout << "  hits: " << st.hits << " of " << st.lookups << " navigations (" << rate << ")\n";
+                    std::cout << "  fetches: " << st.started << " started, " << st.completed << " cached, " << st.failed << " failed, "
+                              << st.cancelled << " cancelled, " << st.bytes << " B\n";
+                    std::cout << "  cache: " << st.entries << " entries, " << st.cached_bytes << " B, " << st.evictions << " evicted, "
+                              << st.unused << " never used\n";
+                    continue;
+                }
+                if (cmd.rfind("trace ", 0) == 0) {
+                    std::ofstream trace(cmd.substr(6));
+                    if (trace) browser::write_chrome_trace(metrics, trace);
+                    std::cout << (trace ? "Trace written.\n" : "Cannot open trace file.\n");
+                    continue;
+                }
+                break;
+            }
             if (cmd == "quit") break;
-            if (cmd == "reload") continue;
+            if (cmd == "reload") {
+                reload = true;
+                continue;
+            }
             if (cmd == "back") {
                 if (history_index > 0) current = history[--history_index];
                 else std::cout << "No back history.\n";
@@ -1,10 +1,18 @@
 #include "browser_core.h"
+#include "content_decoder.h"
+#include "http_parser.h"
+#include "thread_pool.h"
+#include "url.h"
 
 #include <algorithm>
 #include <cctype>
+#include <chrono>
 #include <functional>
+#include <mutex>
+#include <optional>
 #include <sstream>
 #include <stdexcept>
+#include <unordered_map>
 #include <unordered_set>
 
 #ifdef ZEPHYR_USE_CURL
@@ -31,6 +39,18 @@ using socklen_t = int;
 namespace {
 constexpr size_t kMaxResponseBytes = 2 * 1024 * 1024;
 
+using Clock = std::chrono::steady_clock;
+
+void record_span(browser::Phase phase, Clock::time_point start, Clock::time_point end) {
+#if ZEPHYR_METRICS
+    if (auto* m = browser::active_metrics()) m->record(phase, start, std::chrono::duration<double, std::micro>(end - start).count());
+#else
+    (void)phase;
+    (void)start;
+    (void)end;
+#endif
+}
+
 std::string lower(std::string s) {
     std::transform(s.begin(), s.end(), s.begin(), [](unsigned char c) { return static_cast<char>(std::tolower(c)); });
     return s;
@@ -43,80 +63,6 @@ std::string trim(const std::string& s) {
     return s.substr(b, e - b + 1);
 }
 
-std::string collapse_whitespace(const std::string& s) {
-    std::string out;
-    bool ws = false;
-    for (unsigned char ch : s) {
-        if (std::isspace(ch)) {
-            ws = true;
-        } else {
-            if (ws && !out.empty()) out.push_back(' ');
-            ws = false;
-            out.push_back(static_cast<char>(ch));
-        }
-    }
-    return trim(out);
-}
-
-std::string decode_html_entities(const std::string& text) {
-    std::string out;
-    out.reserve(text.size());
-    for (size_t i = 0; i < text.size(); ++i) {
-        if (text[i] != '&') {
-            out.push_back(text[i]);
-            continue;
-        }
-
-        const size_t semi = text.find(';', i + 1);
-        if (semi == std::string::npos) {
-            out.push_back('&');
-            continue;
-        }
-
-        const std::string ent = text.substr(i + 1, semi - i - 1);
-        if (ent == "amp") out.push_back('&');
-        else if (ent == "lt") out.push_back('<');
-        else if (ent == "gt") out.push_back('>');
-        else if (ent == "quot") out.push_back('"');
-        else if (ent == "apos" || ent == "#39") out.push_back('\'');
-        else if (ent == "nbsp") out.push_back(' ');
-        else if (!ent.empty() && ent[0] == '#') {
-            int code = -1;
-            try {
-                if (ent.size() > 2 && (ent[1] == 'x' || ent[1] == 'X')) code = std::stoi(ent.substr(2), nullptr, 16);
-                else code = std::stoi(ent.substr(1));
-            } catch (...) {
-                code = -1;
-            }
-            if (code >= 0 && code <= 127) out.push_back(static_cast<char>(code));
-        }
-
-        i = semi;
-    }
-    return out;
-}
-
-std::string normalize_path(const std::string& path) {
-    std::vector<std::string> segs;
-    std::stringstream ss(path);
-    std::string seg;
-    while (std::getline(ss, seg, '/')) {
-        if (seg.empty() || seg == ".") continue;
-        if (seg == "..") {
-            if (!segs.empty()) segs.pop_back();
-            continue;
-        }
-        segs.push_back(seg);
-    }
-
-    std::string out = "/";
-    for (size_t i = 0; i < segs.size(); ++i) {
-        out += segs[i];
-        if (i + 1 < segs.size()) out.push_back('/');
-    }
-    return out;
-}
-
 std::string extract_tag_attribute(const std::string& tag_text, const std::string& key) {
     const std::string low = lower(tag_text);
     const std::string needle = lower(key);
@@ -149,6 +95,101 @@ std::string extract_tag_attribute(const std::string& tag_text, const std::string
     return trim(tag_text.substr(i, end - i));
 }
 
+void account_response(HttpResponse& resp) {
+    size_t bytes = browser::string_heap_bytes(resp.status_line);
+    size_t allocations = bytes ? 1 : 0;
+    for (const auto& h : resp.headers) {
+        bytes += 32 + sizeof(h) + browser::string_heap_bytes(h.first) + browser::string_heap_bytes(h.second);
+        allocations += 1 + (browser::string_heap_bytes(h.first) ? 1 : 0) + (browser::string_heap_bytes(h.second) ? 1 : 0);
+    }
+    resp.header_memory.set(bytes, allocations);
+}
+
+bool has_token(const std::string& list, const std::string& token) {
+    std::istringstream iss(lower(list));
+    std::string t;
+    while (iss >> t) {
+        if (t == token) return true;
+    }
+    return false;
+}
+
+bool print_only_media(const std::string& media) {
+    const std::string m = lower(media);
+    return m.find("print") != std::string::npos && m.find("screen") == std::string::npos && m.find("all") == std::string::npos;
+}
+
+bool is_success(const HttpResponse& resp) {
+    std::istringstream iss(resp.status_line);
+    std::string version;
+    int code = 0;
+    iss >> version >> code;
+    return code == 0 || (code >= 200 && code < 300);
+}
+
+bool skips_subtree(const std::string& tag) {
+    return tag == "script" || tag == "style" || tag == "noscript" || tag == "meta" || tag == "link" || tag == "head";
+}
+
+bool is_block_tag(const std::string& tag) {
+    static const std::unordered_set<std::string> blocks = {
+        "html", "body", "main", "article", "section", "header", "footer", "nav", "aside", "div", "p", "ul", "ol", "li",
+        "h1", "h2", "h3", "h4", "h5", "h6", "pre", "blockquote", "table", "tr", "td", "th", "form"};
+    return blocks.count(tag) != 0;
+}
+
+// Start tags that end an open <p>.
+bool closes_paragraph(std::string_view tag) {
+    static constexpr std::string_view kClosers[] = {"address", "article", "aside", "blockquote", "dd", "div", "dl", "dt",
+                                                    "fieldset", "figure", "footer", "form", "h1", "h2", "h3", "h4", "h5", "h6",
+                                                    "header", "hr", "li", "main", "nav", "ol", "p", "pre", "section", "table", "ul"};
+    return std::find(std::begin(kClosers), std::end(kClosers), tag) != std::end(kClosers);
+}
+
+size_t element_bytes(const browser::Element& el) {
+    size_t bytes = sizeof(browser::Element) + browser::string_heap_bytes(el.tag_name);
+    for (const auto& [name, value] : el.attributes) bytes += 32 + sizeof(name) + sizeof(value) + browser::string_heap_bytes(name) + value.size();
+    return bytes;
+}
+
+bool hides_element(const browser::Element& el, const browser::StyleProperties& st) {
+    if (st.has(browser::Property::DISPLAY) && st.display == browser::Display::NONE) return true;
+    const std::string inline_style = lower(std::string(el.getAttribute("style")));
+    return inline_style.find("display:none") != std::string::npos;
+}
+
+// Options for a parse that only feeds render_text: everything it would skip is deferred.
+// `sheet` may be null; its rules count only when one of them declares display:none, and
+// then only the ones declaring a display.
+browser::ParseOptions render_parse_options(const browser::StyleSheetPtr& sheet) {
+    std::vector<const browser::StyleSheet::Rule*> display_rules;
+    bool hides = false;
+    if (sheet) {
+        for (const auto& r : sheet->rules()) {
+            if (!r.properties.has(browser::Property::DISPLAY)) continue;
+            display_rules.push_back(&r);
+            hides = hides || r.properties.display == browser::Display::NONE;
+        }
+    }
+    if (!hides) display_rules.clear();
+
+    browser::ParseOptions options;
+    // `sheet` keeps the rules alive.
+    options.defer = [display_rules = std::move(display_rules), sheet](const browser::ElementPtr& el) {
+        if (skips_subtree(el->tag_name)) return true;
+        // The cascade's last word on display, as computeStyle would find it.
+        const browser::StyleSheet::Rule* winner = nullptr;
+        for (const browser::StyleSheet::Rule* r : display_rules) {
+            if (winner && (r->specificity < winner->specificity || (r->specificity == winner->specificity && r->order < winner->order))) continue;
+            if (browser::selector_matches(r->selector, *el)) winner = r;
+        }
+        browser::StyleProperties st;
+        if (winner) st.merge(winner->properties);
+        return hides_element(*el, st);
+    };
+    return options;
+}
+
 #ifdef ZEPHYR_USE_CURL
 size_t curl_write_cb(char* ptr, size_t size, size_t nmemb, void* userdata) {
     const size_t bytes = size * nmemb;
@@ -172,6 +213,43 @@ size_t curl_header_cb(char* ptr, size_t size, size_t nmemb, void* userdata) {
     }
     return bytes;
 }
+
+// One easy handle per thread, reset between requests so that its connection, DNS and TLS
+// session caches carry over to the next request made on the same thread.
+CURL* thread_curl_handle() {
+    static std::once_flag global_init;
+    std::call_once(global_init, [] { curl_global_init(CURL_GLOBAL_DEFAULT); });
+
+    struct Handle {
+        CURL* curl = curl_easy_init();
+        ~Handle() {
+            if (curl) curl_easy_cleanup(curl);
+        }
+    };
+    thread_local Handle handle;
+    if (handle.curl) curl_easy_reset(handle.curl);
+    return handle.curl;
+}
+
+void record_curl_timings(CURL* curl, Clock::time_point start) {
+    if (!browser::active_metrics()) return;
+
+    // libcurl reports cumulative offsets from the start of the transfer.
+    curl_off_t dns = 0, connect = 0, tls = 0, first_byte = 0, total = 0;
+    curl_easy_getinfo(curl, CURLINFO_NAMELOOKUP_TIME_T, &dns);
+    curl_easy_getinfo(curl, CURLINFO_CONNECT_TIME_T, &connect);
+    curl_easy_getinfo(curl, CURLINFO_APPCONNECT_TIME_T, &tls);
+    curl_easy_getinfo(curl, CURLINFO_STARTTRANSFER_TIME_T, &first_byte);
+    curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME_T, &total);
+
+    const curl_off_t handshake_done = std::max(connect, tls);
+    auto at = [&](curl_off_t us) { return start + std::chrono::microseconds(us); };
+    record_span(browser::Phase::DNS, at(0), at(dns));
+    record_span(browser::Phase::CONNECT, at(dns), at(connect));
+    if (tls > 0) record_span(browser::Phase::TLS, at(connect), at(tls));
+    record_span(browser::Phase::FIRST_BYTE, at(handshake_done), at(std::max(first_byte, handshake_done)));
+    record_span(browser::Phase::DOWNLOAD, at(std::max(first_byte, handshake_done)), at(std::max(total, first_byte)));
+}
 #endif
 
 #ifndef ZEPHYR_USE_CURL
@@ -200,62 +278,29 @@ void close_socket(SOCKET s) {
 }  // namespace
 
 bool parse_url(const string& url, UrlParts& out) {
-    const size_t scheme = url.find("://");
-    if (scheme == string::npos) return false;
-
-    out.scheme = lower(url.substr(0, scheme));
-    if (out.scheme != "http" && out.scheme != "https") return false;
-
-    const std::string rest = url.substr(scheme + 3);
-    const size_t slash = rest.find('/');
-    std::string host_port = (slash == std::string::npos) ? rest : rest.substr(0, slash);
-    out.path = (slash == std::string::npos) ? "/" : rest.substr(slash);
-    if (out.path.empty()) out.path = "/";
-
-    const size_t colon = host_port.rfind(':');
-    if (colon != std::string::npos && host_port.find(']') == std::string::npos) {
-        out.host = host_port.substr(0, colon);
-        out.port = std::stoi(host_port.substr(colon + 1));
-    } else {
-        out.host = host_port;
-        out.port = (out.scheme == "https") ? 443 : 80;
-    }
-
-    return !out.host.empty();
+    browser::UrlView v;
+    if (!browser::UrlView::parse(url, v)) return false;
+    out.scheme = v.https ? "https" : "http";
+    out.host = string(v.host);
+    out.port = v.port;
+    out.path = string(v.path);
+    return true;
 }
 
-bool is_safe_navigation_target(const string& href) {
-    const std::string h = lower(trim(href));
-    return !(h.rfind("javascript:", 0) == 0 || h.rfind("data:", 0) == 0 || h.rfind("file:", 0) == 0 || h.rfind("vbscript:", 0) == 0);
-}
+bool is_safe_navigation_target(const string& href) { return browser::is_safe_navigation_target(std::string_view(href)); }
 
-string resolve_url(const string& base_url, const string& href) {
-    const std::string clean = trim(href);
-    if (clean.empty() || !is_safe_navigation_target(clean)) return "";
-    if (clean.rfind("http://", 0) == 0 || clean.rfind("https://", 0) == 0) return clean;
-
-    UrlParts base;
-    if (!parse_url(base_url, base)) return "";
-
-    if (clean[0] == '#') return base_url;
-    if (clean.rfind("//", 0) == 0) return base.scheme + ":" + clean;
-    if (clean[0] == '/') return base.scheme + "://" + base.host + normalize_path(clean);
-
-    std::string dir = base.path;
-    const size_t slash = dir.rfind('/');
-    dir = (slash == std::string::npos) ? "/" : dir.substr(0, slash + 1);
-    return base.scheme + "://" + base.host + normalize_path(dir + clean);
-}
+string resolve_url(const string& base_url, const string& href) { return browser::BaseUrl(base_url).resolve(href); }
 
 HttpResponse http_get(const string& url, int timeout_seconds, int redirect_limit) {
     UrlParts p;
     if (!parse_url(url, p)) throw std::runtime_error("Only http:// and https:// URLs are supported");
 
 #ifdef ZEPHYR_USE_CURL
-    CURL* curl = curl_easy_init();
+    CURL* curl = thread_curl_handle();
     if (!curl) throw std::runtime_error("curl initialization failed");
 
     HttpResponse resp;
+    std::string body;
     curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
     curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
     curl_easy_setopt(curl, CURLOPT_MAXREDIRS, static_cast<long>(redirect_limit));
@@ -268,21 +313,23 @@ HttpResponse http_get(const string& url, int timeout_seconds, int redirect_limit
     curl_easy_setopt(curl, CURLOPT_SSL_VERIFYHOST, 2L);
     curl_easy_setopt(curl, CURLOPT_USERAGENT, "Zephyr/Rewrite");
     curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, curl_write_cb);
-    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &resp.body);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &body);
     curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, curl_header_cb);
     curl_easy_setopt(curl, CURLOPT_HEADERDATA, &resp);
 
+    const Clock::time_point started = Clock::now();
     CURLcode rc = curl_easy_perform(curl);
     if (rc != CURLE_OK) {
         const std::string err = curl_easy_strerror(rc);
-        curl_easy_cleanup(curl);
         throw std::runtime_error("curl request failed: " + err);
     }
 
     long status = 0;
     curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &status);
     if (resp.status_line.empty()) resp.status_line = "HTTP/1.1 " + std::to_string(status);
-    curl_easy_cleanup(curl);
+    record_curl_timings(curl, started);
+    resp.body = std::move(body);
+    account_response(resp);
     return resp;
 #else
     if (p.scheme == "https") throw std::runtime_error("HTTPS requires libcurl in this build");
@@ -295,11 +342,14 @@ HttpResponse http_get(const string& url, int timeout_seconds, int redirect_limit
 
     addrinfo* res = nullptr;
     const std::string port = std::to_string(p.port);
+    Clock::time_point mark = Clock::now();
     if (getaddrinfo(p.host.c_str(), port.c_str(), &hints, &res) != 0 || !res) {
         cleanup_sockets();
         throw std::runtime_error("getaddrinfo failed");
     }
+    record_span(browser::Phase::DNS, mark, Clock::now());
 
+    mark = Clock::now();
     SOCKET s = INVALID_SOCKET;
     for (auto* cur = res; cur; cur = cur->ai_next) {
         s = socket(cur->ai_family, cur->ai_socktype, cur->ai_protocol);
@@ -314,64 +364,161 @@ HttpResponse http_get(const string& url, int timeout_seconds, int redirect_limit
         cleanup_sockets();
         throw std::runtime_error("connection failed");
     }
+    record_span(browser::Phase::CONNECT, mark, Clock::now());
 
     std::ostringstream req;
     req << "GET " << p.path << " HTTP/1.1\r\n";
     req << "Host: " << p.host << "\r\n";
+    if (*browser::accepted_content_encodings()) req << "Accept-Encoding: " << browser::accepted_content_encodings() << "\r\n";
     req << "Connection: close\r\n\r\n";
 
     std::string request = req.str();
+    mark = Clock::now();
     send(s, request.c_str(), static_cast<int>(request.size()), 0);
 
-    std::string raw;
+    HttpResponse resp;
+    browser::HttpResponseParser parser(resp, kMaxResponseBytes);
+    bool first = true;
     char buf[4096];
     for (;;) {
         int n = recv(s, buf, sizeof(buf), 0);
-        if (n <= 0) break;
-        raw.append(buf, n);
-        if (raw.size() > kMaxResponseBytes) break;
+        if (first) {
+            first = false;
+            const Clock::time_point now = Clock::now();
+            record_span(browser::Phase::FIRST_BYTE, mark, now);
+            mark = now;
+        }
+        if (n <= 0) {
+            parser.finishEof();
+            break;
+        }
+        if (!parser.feed(buf, static_cast<size_t>(n)) || parser.done()) break;
     }
+    record_span(browser::Phase::DOWNLOAD, mark, Clock::now());
 
     close_socket(s);
     cleanup_sockets();
 
-    HttpResponse resp;
-    resp.status_line = "HTTP/1.1 000";
-    resp.body = raw;
+    if (parser.failed()) throw std::runtime_error(parser.error());
+    resp.body = parser.takeBody();
+    account_response(resp);
     return resp;
 #endif
 }
 
-void extract_text_and_links(const string& html, string& out_text, std::vector<std::pair<string, string>>& out_links) {
-    out_text.clear();
-    out_links.clear();
+const char* http_backend() {
+#ifdef ZEPHYR_USE_CURL
+    return "curl";
+#else
+    return "socket";
+#endif
+}
 
-    size_t i = 0;
-    while (i < html.size()) {
-        if (html[i] != '<') {
-            out_text.push_back(html[i++]);
+namespace {
+
+// Appends `text` with runs of whitespace folded to one space and no leading space, across
+// calls as if the pieces were concatenated.
+void append_collapsed(std::string& out, std::string_view text, bool& pending_space) {
+    for (unsigned char ch : text) {
+        if (std::isspace(ch)) {
+            pending_space = true;
             continue;
         }
+        if (pending_space && !out.empty()) out.push_back(' ');
+        pending_space = false;
+        out.push_back(static_cast<char>(ch));
+    }
+}
 
-        size_t end = html.find('>', i + 1);
-        if (end == string::npos) break;
+void append_decoded(std::string& out, std::string_view text, bool& pending_space) {
+    if (text.find('&') == std::string_view::npos) append_collapsed(out, text, pending_space);
+    else append_collapsed(out, browser::decode_html_entities(text), pending_space);
+}
+
+// Attribute value with entities decoded, or "" when absent.
+std::string attribute_value(const std::vector<browser::HtmlAttribute>& attributes, std::string_view name) {
+    for (const auto& a : attributes) {
+        if (a.name == name) return a.value.find('&') == std::string_view::npos ? std::string(a.value) : browser::decode_html_entities(a.value);
+    }
+    return "";
+}
+
+class TextAndLinks : public browser::HtmlVisitor {
+public:
+    TextAndLinks(string& text, std::vector<std::pair<string, string>>& links) : text_(text), links_(links) {}
+
+    void startTag(std::string_view name, const std::vector<browser::HtmlAttribute>& attributes, bool self_closing) override {
+        if (name != "a" || self_closing) return;
+        finishLink();
+        in_link_ = true;
+        href_ = trim(attribute_value(attributes, "href"));
+    }
+
+    void endTag(std::string_view name) override {
+        if (name == "a") finishLink();
+    }
+
+    void text(std::string_view text) override {
+        append_decoded(text_, text, text_space_);
+        if (in_link_) append_decoded(link_text_, text, link_space_);
+    }
+
+    void finishLink() {
+        if (in_link_ && !link_text_.empty() && !href_.empty() && is_safe_navigation_target(href_)) links_.emplace_back(link_text_, href_);
+        in_link_ = false;
+        link_space_ = false;
+        link_text_.clear();
+    }
 
-        std::string tag = html.substr(i + 1, end - i - 1);
-        std::string low = lower(trim(tag));
+private:
+    string& text_;
+    std::vector<std::pair<string, string>>& links_;
+    bool text_space_ = false;
+    bool in_link_ = false;
+    bool link_space_ = false;
+    string link_text_;
+    string href_;
+};
+
+class SourceCollector : public browser::HtmlVisitor {
+public:
+    SourceCollector(const browser::SharedBuffer& source, SourceBundle& bundle) : source_(source), bundle_(bundle) {}
+
+    void startTag(std::string_view name, const std::vector<browser::HtmlAttribute>& attributes, bool) override {
+        if (name != "script") return;
+        src_ = attribute_value(attributes, "src");
+        type_ = lower(attribute_value(attributes, "type"));
+    }
 
-        if (low.rfind("a", 0) == 0) {
-            std::string href = extract_tag_attribute(tag, "href");
-            size_t close = lower(html).find("</a>", end + 1);
-            size_t text_end = (close == string::npos) ? html.size() : close;
-            std::string text = html.substr(end + 1, text_end - end - 1);
-            text = collapse_whitespace(decode_html_entities(text));
-            if (!text.empty() && is_safe_navigation_target(href)) out_links.emplace_back(text, trim(href));
+    void rawText(std::string_view name, std::string_view text) override {
+        const browser::BufferSlice body = source_.slice(static_cast<size_t>(text.data() - source_.data()), text.size());
+        if (name == "style") {
+            bundle_.css.push_back(body);
+            return;
         }
 
-        i = end + 1;
+        const bool has_body = text.find_first_not_of(" \t\r\n") != std::string_view::npos;
+        if (!has_body && src_.empty()) return;
+        SourceBundle::Script script{std::move(src_), body};
+        if (type_.find("typescript") != std::string::npos || type_.find("text/ts") != std::string::npos) bundle_.typescript.push_back(std::move(script));
+        else bundle_.javascript.push_back(std::move(script));
     }
 
-    out_text = collapse_whitespace(decode_html_entities(out_text));
+private:
+    const browser::SharedBuffer& source_;
+    SourceBundle& bundle_;
+    string src_;
+    string type_;
+};
+
+}  // namespace
+
+void extract_text_and_links(const string& html, string& out_text, std::vector<std::pair<string, string>>& out_links) {
+    out_text.clear();
+    out_links.clear();
+    TextAndLinks visitor(out_text, out_links);
+    browser::tokenize_html(html, visitor);
+    visitor.finishLink();
 }
 
 string extract_style_blocks(const string& html) {
@@ -389,60 +536,58 @@ string extract_style_blocks(const string& html) {
     return out;
 }
 
-SourceBundle extract_source_bundle(const string& html) {
+SourceBundle extract_source_bundle(const browser::SharedBuffer& source) {
     SourceBundle b;
-    b.html = html;
-    b.css = extract_style_blocks(html);
-
-    const std::string low = lower(html);
-    size_t i = 0;
-    while ((i = low.find("<script", i)) != string::npos) {
-        size_t open = low.find('>', i);
-        if (open == string::npos) break;
-        size_t close = low.find("</script>", open + 1);
-        if (close == string::npos) break;
-
-        std::string open_tag = html.substr(i + 1, open - i - 1);
-        std::string type = lower(extract_tag_attribute(open_tag, "type"));
-        std::string src = extract_tag_attribute(open_tag, "src");
-        std::string body = html.substr(open + 1, close - open - 1);
-
-        std::string block;
-        if (!src.empty()) block += "// external script src=" + src + "\n";
-        if (!trim(body).empty()) block += body + "\n";
-
-        if (!trim(block).empty()) {
-            if (type.find("typescript") != std::string::npos || type.find("text/ts") != std::string::npos) b.typescript += block + "\n";
-            else b.javascript += block + "\n";
-        }
+    b.html = source.slice(0);
+    SourceCollector collector(source, b);
+    browser::tokenize_html(source.view(), collector);
+    return b;
+}
 
-        i = close + 9;
+string render_page_text(const browser::SharedBuffer& html, size_t wrap_width) {
+    std::string css;
+    {
+        ZEPHYR_TRACE_PHASE(browser::Phase::CSS_PARSE);
+        css = extract_style_blocks(html.bytes());
     }
+    return browser::render_text(browser::parse_document(html, css, true), wrap_width);
+}
 
-    return b;
+string render_page_text(const browser::SharedBuffer& html, const string& base_url, size_t wrap_width, const browser::LoadOptions& options) {
+    browser::LoadOptions render_options = options;
+    render_options.render_only = true;
+    return browser::render_text(browser::load_document(html, base_url, render_options), wrap_width);
 }
 
-string render_page_text(const string& html, size_t wrap_width) {
-    const std::string css = extract_style_blocks(html);
-    browser::RenderContext ctx = browser::parse_document(html, css);
-    if (!ctx.document) return "";
+namespace browser {
 
-    auto is_block_tag = [](const std::string& tag) {
-        static const std::unordered_set<std::string> blocks = {
-            "html", "body", "main", "article", "section", "header", "footer", "nav", "aside", "div", "p", "ul", "ol", "li",
-            "h1", "h2", "h3", "h4", "h5", "h6", "pre", "blockquote", "table", "tr", "td", "th", "form"};
-        return blocks.count(tag) != 0;
+ComputedStyles resolve_styles(const RenderContext& ctx) {
+    ComputedStyles styles;
+    if (!ctx.document || !ctx.stylesheet) return styles;
+    ZEPHYR_TRACE_PHASE(Phase::STYLE);
+
+    std::function<void(const ElementPtr&)> visit = [&](const ElementPtr& el) {
+        if (skips_subtree(el->tag_name)) return;
+        const StyleProperties& st = styles.emplace(el.get(), ctx.stylesheet->computeStyle(el)).first->second;
+        if (hides_element(*el, st)) return;
+        for (const auto& c : el->children) {
+            if (c->type == NodeType::ELEMENT) visit(std::static_pointer_cast<Element>(c));
+        }
     };
+    visit(ctx.document);
+    return styles;
+}
 
-    auto should_skip_tag = [](const std::string& tag) {
-        return tag == "script" || tag == "style" || tag == "noscript" || tag == "meta" || tag == "link" || tag == "head";
-    };
+string render_text(const RenderContext& ctx, size_t wrap_width, const ComputedStyles* styles) {
+    if (!ctx.document) return "";
 
     auto is_hidden = [&](const browser::ElementPtr& el) {
-        const auto st = ctx.stylesheet.computeStyle(el);
-        if (st.has_display && st.display == "none") return true;
-        const std::string inline_style = lower(el->getAttribute("style"));
-        return inline_style.find("display:none") != std::string::npos;
+        if (styles) {
+            auto it = styles->find(el.get());
+            if (it != styles->end()) return hides_element(*el, it->second);
+        }
+        ZEPHYR_ACCUMULATE_PHASE(browser::Phase::STYLE);
+        return hides_element(*el, ctx.stylesheet->computeStyle(el));
     };
 
     std::string out;
@@ -459,12 +604,15 @@ string render_page_text(const string& html, size_t wrap_width) {
         if (node->type == browser::NodeType::TEXT) {
             auto t = std::dynamic_pointer_cast<browser::TextNode>(node);
             if (!t) return;
-            std::string text = collapse_whitespace(decode_html_entities(t->text));
-            if (text.empty()) return;
-
-            std::istringstream iss(text);
-            std::string w;
-            while (iss >> w) {
+            // Words straight out of the (already decoded) text; no intermediate copy.
+            const std::string_view text = t->text.view();
+            for (size_t i = 0; i < text.size();) {
+                while (i < text.size() && std::isspace(static_cast<unsigned char>(text[i]))) ++i;
+                size_t end = i;
+                while (end < text.size() && !std::isspace(static_cast<unsigned char>(text[end]))) ++end;
+                if (end == i) break;
+                const std::string_view w = text.substr(i, end - i);
+                i = end;
                 if (line > 0) {
                     if (line + 1 + w.size() > wrap_width) newline();
                     else {
@@ -481,7 +629,7 @@ string render_page_text(const string& html, size_t wrap_width) {
         auto el = std::dynamic_pointer_cast<browser::Element>(node);
         if (!el) return;
 
-        if (should_skip_tag(el->tag_name) || is_hidden(el)) return;
+        if (skips_subtree(el->tag_name) || is_hidden(el)) return;
 
         const bool is_block = is_block_tag(el->tag_name);
         if (el->tag_name == "br") newline();
@@ -495,7 +643,7 @@ string render_page_text(const string& html, size_t wrap_width) {
         for (const auto& c : el->children) walk(c);
 
         if (el->tag_name == "a") {
-            const std::string href = el->getAttribute("href");
+            const std::string href(el->getAttribute("href"));
             if (!href.empty() && is_safe_navigation_target(href)) {
                 const std::string suffix = " (" + href + ")";
                 if (line + suffix.size() > wrap_width && line > 0) newline();
@@ -507,18 +655,349 @@ string render_page_text(const string& html, size_t wrap_width) {
         if (is_block && line > 0) newline();
     };
 
-    walk(ctx.document);
+    {
+        ZEPHYR_TRACE_PHASE(browser::Phase::RENDER);
+        walk(ctx.document);
+    }
 
     while (out.find("\n\n\n") != std::string::npos) out.replace(out.find("\n\n\n"), 3, "\n\n");
     return trim(out);
 }
 
-namespace browser {
+TextRenderStream::TextRenderStream(LineSink sink, size_t wrap_width, const string& css)
+    : sink_(std::move(sink)), wrap_width_(wrap_width), sheet_(parse_css(css)), tokenizer_(*this) {
+    Open root;
+    root.name = "document";
+    root.element = Element::create("document");
+    open_.push_back(std::move(root));
+}
+
+void TextRenderStream::feed(std::string_view bytes) {
+    ZEPHYR_ACCUMULATE_PHASE(Phase::RENDER);
+    tokenizer_.feed(bytes);
+}
 
-RenderContext parse_document(const string& html, const string& css) {
+void TextRenderStream::finish() {
+    {
+        ZEPHYR_ACCUMULATE_PHASE(Phase::RENDER);
+        tokenizer_.finish();
+        flushWord();
+        while (open_.size() > 1) close();
+    }
+    newline();
+}
+
+size_t TextRenderStream::bufferedBytes() const {
+    size_t bytes = tokenizer_.bufferedBytes() + line_.size() + word_.size() + style_text_.size() + sheet_.footprintBytes();
+    bytes += open_.capacity() * sizeof(Open);
+    for (const auto& entry : open_) {
+        bytes += string_heap_bytes(entry.name) + string_heap_bytes(entry.href);
+        if (entry.element) bytes += element_bytes(*entry.element);
+    }
+    return bytes;
+}
+
+void TextRenderStream::startTag(std::string_view name, const std::vector<HtmlAttribute>& attributes, bool self_closing) {
+    flushWord();
+    closeImplied(name);
+    Open entry;
+    entry.name = std::string(name);
+    if (hidden_ == 0) {
+        auto el = Element::create(std::string(name));
+        for (const auto& a : attributes) {
+            const std::string value = !a.has_value ? "true" : a.value.find('&') == std::string_view::npos ? std::string(a.value) : decode_html_entities(a.value);
+            el->setAttribute(std::string(a.name), value);
+        }
+        el->parent = open_.back().element;
+        entry.hidden = skips_subtree(el->tag_name) || hides_element(*el, sheet_.computeStyle(el));
+        if (!entry.hidden) {
+            entry.block = is_block_tag(el->tag_name);
+            if (el->tag_name == "br") newline();
+            if (entry.block && !line_.empty()) newline();
+            if (el->tag_name == "li") {
+                newline();
+                line_ = "- ";
+            }
+            if (el->tag_name == "a") entry.href = std::string(el->getAttribute("href"));
+            entry.element = std::move(el);
+        }
+    } else {
+        entry.hidden = true;
+    }
+    if (entry.hidden) ++hidden_;
+    open_.push_back(std::move(entry));
+    if (self_closing || open_.size() > kMaxDepth) close();
+}
+
+void TextRenderStream::endTag(std::string_view name) {
+    flushWord();
+    if (name == "style" && !style_text_.empty()) {
+        const StyleSheet block = parse_css(style_text_);
+        for (const auto& r : block.rules()) sheet_.addRule(r.selector, r.properties);
+        style_bytes_ += style_text_.size();
+        style_text_.clear();
+    }
+    // A stray end tag is ignored; one inside a table or cell never closes what is outside it.
+    if (name == "table") closeNearest({name}, {});
+    else if (name == "tr" || name == "td" || name == "th" || name == "tbody" || name == "thead" || name == "tfoot" || name == "caption") closeNearest({name}, {"table"});
+    else closeNearest({name}, {"table", "td", "th", "caption"});
+}
+
+void TextRenderStream::text(std::string_view text) {
+    if (hidden_) return;
+    std::string decoded;
+    if (text.find('&') != std::string_view::npos) {
+        decoded = decode_html_entities(text);
+        text = decoded;
+    }
+    for (unsigned char ch : text) {
+        if (std::isspace(ch)) {
+            flushWord();
+            continue;
+        }
+        word_.push_back(static_cast<char>(ch));
+        if (word_.size() >= kMaxWordBytes) flushWord();
+    }
+}
+
+void TextRenderStream::comment(std::string_view) { flushWord(); }
+
+void TextRenderStream::rawText(std::string_view name, std::string_view text) {
+    if (name == "style" && style_bytes_ + style_text_.size() + text.size() <= kMaxStyleBytes) style_text_.append(text.data(), text.size());
+}
+
+void TextRenderStream::closeNearest(std::initializer_list<std::string_view> names, std::initializer_list<std::string_view> scope) {
+    auto listed = [](std::initializer_list<std::string_view> list, const std::string& tag) { return std::find(list.begin(), list.end(), tag) != list.end(); };
+    for (size_t i = open_.size(); i-- > 1;) {
+        if (listed(names, open_[i].name)) {
+            while (open_.size() > i) close();
+            return;
+        }
+        if (listed(scope, open_[i].name)) return;
+    }
+}
+
+void TextRenderStream::closeImplied(std::string_view name) {
+    if (name == "li") closeNearest({"li"}, {"ul", "ol", "table", "td", "th"});
+    else if (name == "dt" || name == "dd") closeNearest({"dt", "dd"}, {"dl", "table", "td", "th"});
+    else if (name == "tr") closeNearest({"tr"}, {"table", "tbody", "thead", "tfoot"});
+    else if (name == "td" || name == "th") closeNearest({"td", "th"}, {"tr", "table"});
+    else if (name == "option" || name == "optgroup") closeNearest({"option"}, {"select", "datalist", "optgroup"});
+    if (closes_paragraph(name)) closeNearest({"p"}, {"table", "td", "th", "caption", "button"});
+}
+
+void TextRenderStream::close() {
+    Open entry = std::move(open_.back());
+    open_.pop_back();
+    if (entry.hidden) {
+        --hidden_;
+        return;
+    }
+    if (!entry.href.empty() && is_safe_navigation_target(entry.href)) {
+        const std::string suffix = " (" + entry.href + ")";
+        if (line_.size() + suffix.size() > wrap_width_ && !line_.empty()) newline();
+        line_ += suffix;
+    }
+    if (entry.block) newline();
+}
+
+void TextRenderStream::flushWord() {
+    if (word_.empty()) return;
+    if (!line_.empty()) {
+        if (line_.size() + 1 + word_.size() > wrap_width_) newline();
+        else line_.push_back(' ');
+    }
+    line_ += word_;
+    word_.clear();
+}
+
+void TextRenderStream::newline() {
+    if (line_.empty()) return;
+    // render_text trims the start of its output.
+    const size_t start = emitted_ ? 0 : line_.find_first_not_of(" \t\r\n");
+    if (start != std::string::npos) {
+        sink_(std::string_view(line_).substr(start));
+        emitted_ = true;
+    }
+    line_.clear();
+}
+
+PreloadScan scan_subresources(const string& html, const string& base_url) {
+    PreloadScan scan;
+    scan.base_url = base_url;
+    std::unordered_map<std::string, int> seen;
+    bool base_seen = false;
+
+    browser::BaseUrl base(base_url);
+    auto add = [&](SubresourceKind kind, const std::string& href) -> int {
+        const std::string url = base.resolve(href);
+        if (url.empty()) return -1;
+        auto it = seen.find(url);
+        if (it != seen.end()) return it->second;
+        scan.subresources.push_back({kind, url, false, "", {}});
+        const int index = static_cast<int>(scan.subresources.size()) - 1;
+        seen.emplace(url, index);
+        return index;
+    };
+
+    const std::string low = lower(html);
+    size_t i = 0;
+    while ((i = low.find('<', i)) != string::npos) {
+        if (low.compare(i, 4, "<!--") == 0) {
+            const size_t end = low.find("-->", i + 4);
+            i = (end == string::npos) ? low.size() : end + 3;
+            continue;
+        }
+        const size_t end = low.find('>', i + 1);
+        if (end == string::npos) break;
+
+        size_t name_end = i + 1;
+        while (name_end < end && std::isalnum(static_cast<unsigned char>(low[name_end]))) ++name_end;
+        const std::string name = low.substr(i + 1, name_end - i - 1);
+        const std::string tag = html.substr(i + 1, end - i - 1);
+        i = end + 1;
+
+        if (name == "base" && !base_seen) {
+            const std::string href = extract_tag_attribute(tag, "href");
+            if (!href.empty()) {
+                const std::string resolved = base.resolve(href);
+                if (!resolved.empty()) {
+                    scan.base_url = resolved;
+                    base = BaseUrl(resolved);
+                }
+                base_seen = true;
+            }
+        } else if (name == "link") {
+            const std::string rel = extract_tag_attribute(tag, "rel");
+            if (!has_token(rel, "stylesheet") || has_token(rel, "alternate")) continue;
+            if (print_only_media(extract_tag_attribute(tag, "media"))) continue;
+            const int index = add(SubresourceKind::STYLESHEET, extract_tag_attribute(tag, "href"));
+            if (index >= 0) scan.styles.push_back({"", index});
+        } else if (name == "style") {
+            const size_t close = low.find("</style>", i);
+            if (close == string::npos) break;
+            if (!print_only_media(extract_tag_attribute(tag, "media"))) scan.styles.push_back({html.substr(i, close - i), -1});
+            i = close + 8;
+        } else if (name == "script") {
+            const std::string src = extract_tag_attribute(tag, "src");
+            if (!src.empty()) add(SubresourceKind::SCRIPT, src);
+            const size_t close = low.find("</script>", i);
+            if (close == string::npos) break;
+            i = close + 9;
+        }
+    }
+
+    return scan;
+}
+
+void fetch_subresources(PreloadScan& scan, const LoadOptions& options) {
+    std::vector<size_t> wanted;
+    for (size_t i = 0; i < scan.subresources.size(); ++i) {
+        if (scan.subresources[i].kind == SubresourceKind::STYLESHEET) wanted.push_back(i);
+    }
+    if (options.fetch_scripts) {
+        for (size_t i = 0; i < scan.subresources.size(); ++i) {
+            if (scan.subresources[i].kind == SubresourceKind::SCRIPT) wanted.push_back(i);
+        }
+    }
+    if (wanted.empty()) return;
+
+    // Stylesheets are queued ahead of scripts because they block rendering.
+    const Fetcher fetch = options.fetcher ? options.fetcher : Fetcher([](const string& url) { return http_get(url); });
+    // Bodies and network phases belong to the caller's page: the account is shared, while
+    // each fetch times into its own PageMetrics, merged once all are done.
+    const MemoryAccountPtr account = active_memory_account();
+    PageMetrics* const metrics = active_metrics();
+    std::vector<PageMetrics> timings(metrics ? wanted.size() : 0);
+    ThreadPool pool(std::min(std::max<size_t>(1, options.max_parallel), wanted.size()));
+    std::vector<std::future<void>> pending;
+    for (size_t i = 0; i < wanted.size(); ++i) {
+        Subresource* res = &scan.subresources[wanted[i]];
+        PageMetrics* timing = metrics ? &timings[i] : nullptr;
+        if (timing) timing->epoch = metrics->epoch;
+        pending.push_back(pool.submit([res, &fetch, account, timing] {
+            MemoryAccountScope accounted(account);
+            std::optional<MetricsScope> timed;
+            if (timing) timed.emplace(*timing);
+            try {
+                HttpResponse resp = fetch(res->url);
+                res->ok = is_success(resp);
+                if (res->ok) res->body = std::move(resp.body);
+                else res->error = resp.status_line;
+            } catch (const std::exception& ex) {
+                res->error = ex.what();
+            }
+        }));
+    }
+    for (auto& f : pending) f.get();
+    for (const PageMetrics& timing : timings) metrics->merge(timing);
+}
+
+string stylesheet_text(const PreloadScan& scan) {
+    std::string css;
+    for (const auto& source : scan.styles) {
+        if (source.subresource < 0) css += source.inline_css;
+        else if (scan.subresources[source.subresource].ok) css += scan.subresources[source.subresource].body.bytes();
+        css += "\n";
+    }
+    return css;
+}
+
+void attach_subresources(RenderContext& ctx, PreloadScan& scan) {
+    {
+        ZEPHYR_TRACE_PHASE(Phase::CSS_PARSE);
+        ctx.stylesheet = StyleSheetCache::shared().get(stylesheet_text(scan));
+        ctx.stylesheet_memory.set(ctx.stylesheet->footprintBytes(), 0);
+    }
+    ctx.subresources = std::move(scan.subresources);
+}
+
+RenderContext load_document(const SharedBuffer& html, const string& base_url, const LoadOptions& options) {
+    PreloadScan scan = scan_subresources(html.bytes(), base_url);
+
+    RenderContext r;
+    r.memory = active_memory_account();
+    {
+        // Subresource fetches overlap with tree construction, charging this page's account
+        // and timing into a PageMetrics of their own until they are joined.
+        PageMetrics* const metrics = active_metrics();
+        PageMetrics fetch_metrics;
+        if (metrics) fetch_metrics.epoch = metrics->epoch;
+        std::future<void> fetched;
+        if (!scan.subresources.empty()) {
+            fetched = std::async(std::launch::async, [&] {
+                MemoryAccountScope accounted(r.memory);
+                std::optional<MetricsScope> timed;
+                if (metrics) timed.emplace(fetch_metrics);
+                fetch_subresources(scan, options);
+            });
+        }
+        {
+            ZEPHYR_TRACE_PHASE(Phase::HTML_PARSE);
+            // The sheets are still loading, so only inline styles can defer anything here.
+            r.document = options.render_only ? parse_html(html, render_parse_options(nullptr)) : parse_html(html);
+        }
+        if (fetched.valid()) fetched.get();
+        if (metrics) metrics->merge(fetch_metrics);
+    }
+
+    attach_subresources(r, scan);
+    return r;
+}
+
+RenderContext parse_document(const SharedBuffer& html, const string& css, bool render_only) {
     RenderContext r;
-    r.document = parse_html(html);
-    r.stylesheet = parse_css(css);
+    r.memory = active_memory_account();
+    // Styles first: a render-only parse consults them.
+    {
+        ZEPHYR_TRACE_PHASE(Phase::CSS_PARSE);
+        r.stylesheet = StyleSheetCache::shared().get(css);
+        r.stylesheet_memory.set(r.stylesheet->footprintBytes(), 0);
+    }
+    {
+        ZEPHYR_TRACE_PHASE(Phase::HTML_PARSE);
+        r.document = render_only ? parse_html(html, render_parse_options(r.stylesheet)) : parse_html(html);
+    }
     return r;
 }
 
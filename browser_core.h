@@ -1,15 +1,24 @@
 #pragma once
 
+#include <functional>
+#include <initializer_list>
 #include <map>
 #include <string>
+#include <string_view>
+#include <unordered_map>
 #include <vector>
 
+#include "accounting.h"
+#include "buffer.h"
+
 using std::string;
 
 struct HttpResponse {
     string status_line;
     std::map<string, string> headers;
-    string body;
+    browser::SharedBuffer body;
+
+    browser::MemoryCharge header_memory{browser::MemoryCategory::RESPONSE_HEADERS};
 };
 
 struct UrlParts {
@@ -19,32 +28,174 @@ struct UrlParts {
     string path;
 };
 
+// Every field references the document passed to extract_source_bundle.
 struct SourceBundle {
-    string html;
-    string css;
-    string javascript;
-    string typescript;
+    struct Script {
+        string src;
+        browser::BufferSlice body;
+    };
+
+    browser::BufferSlice html;
+    std::vector<browser::BufferSlice> css;
+    std::vector<Script> javascript;
+    std::vector<Script> typescript;
 };
 
 bool parse_url(const string& url, UrlParts& out);
 bool is_safe_navigation_target(const string& href);
 string resolve_url(const string& base_url, const string& href);
 HttpResponse http_get(const string& url, int timeout_seconds = 10, int redirect_limit = 3);
+// "curl" or "socket": the transport http_get and AsyncFetcher were built with.
+const char* http_backend();
 void extract_text_and_links(const string& html, string& out_text, std::vector<std::pair<string, string>>& out_links);
 string extract_style_blocks(const string& html);
-SourceBundle extract_source_bundle(const string& html);
-string render_page_text(const string& html, size_t wrap_width = 100);
+SourceBundle extract_source_bundle(const browser::SharedBuffer& html);
+string render_page_text(const browser::SharedBuffer& html, size_t wrap_width = 100);
 
 #include "css.h"
 #include "dom.h"
+#include "metrics.h"
+#include "stylesheet_cache.h"
 
 namespace browser {
 
+enum class SubresourceKind { STYLESHEET, SCRIPT };
+
+struct Subresource {
+    SubresourceKind kind = SubresourceKind::STYLESHEET;
+    string url;
+    bool ok = false;
+    string error;
+    SharedBuffer body;
+};
+
+// Result of the preload scan: external resources in document order (deduplicated by URL)
+// and the page's stylesheet sources, each either inline <style> text or an index into
+// `subresources`.
+struct PreloadScan {
+    struct StyleSource {
+        string inline_css;
+        int subresource = -1;
+    };
+
+    string base_url;
+    std::vector<Subresource> subresources;
+    std::vector<StyleSource> styles;
+};
+
+using Fetcher = std::function<HttpResponse(const string& url)>;
+
+struct LoadOptions {
+    size_t max_parallel = 6;
+    bool fetch_scripts = true;
+    // As for parse_document, except that only inline styles can hide an element: the
+    // external sheets are still loading while the tree is built.
+    bool render_only = false;
+    Fetcher fetcher;  // http_get when empty
+};
+
 struct RenderContext {
-    ElementPtr document;
-    StyleSheet stylesheet;
+    DocumentPtr document;
+    StyleSheetPtr stylesheet;
+    MemoryAccountPtr memory;
+    // The page's share of the (possibly cached and shared) stylesheet.
+    MemoryCharge stylesheet_memory{MemoryCategory::STYLE_RULES};
+    std::vector<Subresource> subresources;
 };
 
-RenderContext parse_document(const string& html, const string& css = "");
+// With `render_only`, the subtrees render_text never shows are left unbuilt (see
+// ParseOptions::defer): <head>, <script>, <style>, <noscript>, and elements `css` or an
+// inline style sets to display:none. Element::materialize builds one when it is wanted.
+RenderContext parse_document(const SharedBuffer& html, const string& css = "", bool render_only = false);
+
+PreloadScan scan_subresources(const string& html, const string& base_url);
+
+// Blocking fetch of the scanned resources, at most options.max_parallel at a time.
+void fetch_subresources(PreloadScan& scan, const LoadOptions& options);
+
+// Inline and fetched external CSS concatenated in document order.
+string stylesheet_text(const PreloadScan& scan);
+
+// load_document's last step, for callers that fetch the scanned resources themselves:
+// builds ctx's stylesheet from `scan` and moves the subresources into `ctx`.
+void attach_subresources(RenderContext& ctx, PreloadScan& scan);
+
+// Like parse_document, but also fetches <link rel=stylesheet> and <script src> resources
+// concurrently (at most options.max_parallel at a time) while the HTML is being parsed.
+// External sheets are merged with inline <style> blocks in document order.
+RenderContext load_document(const SharedBuffer& html, const string& base_url, const LoadOptions& options = {});
+
+// Styles for every element the text renderer visits; hidden subtrees are not descended.
+ComputedStyles resolve_styles(const RenderContext& ctx);
+
+// Elements missing from `styles` (or all of them, when null) are styled on the fly.
+string render_text(const RenderContext& ctx, size_t wrap_width = 100, const ComputedStyles* styles = nullptr);
+
+// Streaming counterpart of render_page_text for documents too large to hold in memory.
+// Bytes are tokenized as they are fed and each wrapped line goes to `sink` as soon as it is
+// complete. Only the open-element stack, the current line and the rules of the <style>
+// blocks seen so far are kept; a block's rules apply to content after it. `css` (say, the
+// page's external sheets) applies from the start. End tags HTML lets a page omit (</p>,
+// </li>, </dt>, </dd>, </tr>, </td>, </th>, </option>) are implied by the next sibling's
+// start tag, so unclosed rows and items do not deepen the stack.
+class TextRenderStream : private HtmlVisitor {
+public:
+    using LineSink = std::function<void(std::string_view line)>;
+
+    // <style> text kept over the whole stream; later blocks are ignored.
+    static constexpr size_t kMaxStyleBytes = 1024 * 1024;
+    static constexpr size_t kMaxWordBytes = 64 * 1024;
+    // Elements nested deeper than this are treated as empty, their content going to the
+    // deepest open element.
+    static constexpr size_t kMaxDepth = 512;
+
+    explicit TextRenderStream(LineSink sink, size_t wrap_width = 100, const string& css = "");
+
+    void feed(std::string_view bytes);
+    // Closes any elements left open and flushes the last line.
+    void finish();
+
+    // Bytes held between calls: the tokenizer's unfinished tag, the current line and word,
+    // the open-element stack, the style rules and an unfinished <style> block.
+    size_t bufferedBytes() const;
+    size_t depth() const { return open_.size(); }
+
+private:
+    struct Open {
+        string name;
+        ElementPtr element;  // null inside hidden subtrees
+        bool hidden = false;
+        bool block = false;
+        string href;
+    };
+
+    void startTag(std::string_view name, const std::vector<HtmlAttribute>& attributes, bool self_closing) override;
+    void endTag(std::string_view name) override;
+    void text(std::string_view text) override;
+    void comment(std::string_view text) override;
+    void rawText(std::string_view name, std::string_view text) override;
+
+    void close();
+    // Closes the nearest open element named in `names`, and everything opened after it,
+    // unless an element in `scope` is open in between.
+    void closeNearest(std::initializer_list<std::string_view> names, std::initializer_list<std::string_view> scope);
+    void closeImplied(std::string_view name);
+    void flushWord();
+    void newline();
+
+    LineSink sink_;
+    size_t wrap_width_;
+    StyleSheet sheet_;
+    HtmlTokenizer tokenizer_;
+    std::vector<Open> open_;
+    size_t hidden_ = 0;
+    string line_;
+    string word_;
+    string style_text_;
+    size_t style_bytes_ = 0;  // of the <style> blocks already added to sheet_
+    bool emitted_ = false;
+};
 
 }  // namespace browser
+
+string render_page_text(const browser::SharedBuffer& html, const string& base_url, size_t wrap_width, const browser::LoadOptions& options = {});
@@ -0,0 +1,45 @@
+#include "buffer.h"
+
+#include <algorithm>
+
+namespace browser {
+namespace {
+
+constexpr size_t kControlBlockBytes = 16;
+
+const std::string& empty_bytes() {
+    static const std::string empty;
+    return empty;
+}
+
+}  // namespace
+
+SharedBuffer::Storage::Storage(std::string b, MemoryCategory category) : bytes(std::move(b)), memory(category) {
+    memory.set(sizeof(Storage) + kControlBlockBytes + string_heap_bytes(bytes), string_heap_bytes(bytes) ? 2 : 1);
+}
+
+SharedBuffer::SharedBuffer(std::string&& bytes, MemoryCategory category)
+    : storage_(std::make_shared<const Storage>(std::move(bytes), category)) {}
+
+SharedBuffer::SharedBuffer(const std::string& bytes, MemoryCategory category) : storage_(std::make_shared<const Storage>(bytes, category)) {}
+
+SharedBuffer::SharedBuffer(const char* bytes) : SharedBuffer(std::string(bytes ? bytes : "")) {}
+
+SharedBuffer::SharedBuffer(std::string_view bytes, MemoryCategory category) : SharedBuffer(std::string(bytes), category) {}
+
+const std::string& SharedBuffer::bytes() const { return storage_ ? storage_->bytes : empty_bytes(); }
+
+BufferSlice SharedBuffer::slice(size_t offset, size_t length) const {
+    offset = std::min(offset, size());
+    return BufferSlice(*this, offset, std::min(length, size() - offset));
+}
+
+BufferSlice::BufferSlice(SharedBuffer buffer, size_t offset, size_t length) : buffer_(std::move(buffer)), offset_(offset), size_(length) {}
+
+BufferSlice BufferSlice::copy(std::string_view text, MemoryCategory category) {
+    SharedBuffer buffer(text, category);
+    const size_t size = buffer.size();
+    return BufferSlice(std::move(buffer), 0, size);
+}
+
+}  // namespace browser
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <string_view>
+
+#include "accounting.h"
+
+namespace browser {
+
+class BufferSlice;
+
+// Immutable, reference-counted bytes. Copies share the storage; the storage is charged
+// once, to the memory account active when the buffer was created, and lives until the
+// last buffer or slice referring to it is gone.
+class SharedBuffer {
+public:
+    SharedBuffer() = default;
+    // Adopts `bytes` without copying them.
+    SharedBuffer(std::string&& bytes, MemoryCategory category = MemoryCategory::RESPONSE_BODY);
+    SharedBuffer(const std::string& bytes, MemoryCategory category = MemoryCategory::RESPONSE_BODY);
+    SharedBuffer(const char* bytes);
+    explicit SharedBuffer(std::string_view bytes, MemoryCategory category = MemoryCategory::RESPONSE_BODY);
+
+    const std::string& bytes() const;
+    std::string_view view() const { return bytes(); }
+    const char* data() const { return bytes().data(); }
+    size_t size() const { return storage_ ? storage_->bytes.size() : 0; }
+    bool empty() const { return size() == 0; }
+
+    // Clamped to the buffer; shares the storage.
+    BufferSlice slice(size_t offset, size_t length = std::string::npos) const;
+
+    friend bool operator==(const SharedBuffer& a, std::string_view b) { return a.view() == b; }
+    friend bool operator!=(const SharedBuffer& a, std::string_view b) { return a.view() != b; }
+
+private:
+    struct Storage {
+        Storage(std::string b, MemoryCategory category);
+
+        std::string bytes;
+        MemoryCharge memory;
+    };
+
+    std::shared_ptr<const Storage> storage_;
+};
+
+// A byte range of a SharedBuffer that keeps the buffer alive.
+class BufferSlice {
+public:
+    BufferSlice() = default;
+    BufferSlice(SharedBuffer buffer, size_t offset, size_t length);
+
+    // Copies `text` into a buffer of its own, for text that does not exist verbatim in
+    // any source buffer (decoded entities, values set by script).
+    static BufferSlice copy(std::string_view text, MemoryCategory category);
+
+    std::string_view view() const { return std::string_view(buffer_.data() + offset_, size_); }
+    const char* data() const { return buffer_.data() + offset_; }
+    size_t size() const { return size_; }
+    bool empty() const { return size_ == 0; }
+    std::string str() const { return std::string(view()); }
+    const SharedBuffer& buffer() const { return buffer_; }
+
+    friend bool operator==(const BufferSlice& a, std::string_view b) { return a.view() == b; }
+    friend bool operator!=(const BufferSlice& a, std::string_view b) { return a.view() != b; }
+
+private:
+    SharedBuffer buffer_;
+    size_t offset_ = 0;
+    size_t size_ = 0;
+};
+
+}  // namespace browser
@@ -0,0 +1,368 @@
+#include "charset.h"
+
+#include <array>
+#include <cstring>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define ZEPHYR_CHARSET_SSE2 1
+#endif
+
+namespace browser {
+namespace {
+
+constexpr char kReplacement[] = "\xEF\xBF\xBD";
+constexpr size_t kMetaPrescanBytes = 1024;
+
+char lower_char(char c) { return (c >= 'A' && c <= 'Z') ? static_cast<char>(c - 'A' + 'a') : c; }
+
+bool is_space(char c) { return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\f'; }
+
+size_t find_ci(std::string_view hay, std::string_view needle, size_t from) {
+    for (size_t i = from; i + needle.size() <= hay.size(); ++i) {
+        size_t k = 0;
+        while (k < needle.size() && lower_char(hay[i + k]) == needle[k]) ++k;
+        if (k == needle.size()) return i;
+    }
+    return std::string_view::npos;
+}
+
+// Length of the run of ASCII bytes at the start of `p`.
+size_t ascii_run(const char* p, size_t n) {
+    size_t i = 0;
+#ifdef ZEPHYR_CHARSET_SSE2
+    while (i + 16 <= n && _mm_movemask_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i))) == 0) i += 16;
+#else
+    for (uint64_t word; i + 8 <= n; i += 8) {
+        std::memcpy(&word, p + i, 8);
+        if (word & 0x8080808080808080ull) break;
+    }
+#endif
+    while (i < n && !(static_cast<unsigned char>(p[i]) & 0x80)) ++i;
+    return i;
+}
+
+enum class Sequence { VALID, INVALID, INCOMPLETE };
+
+// Classifies the UTF-8 sequence starting at a non-ASCII byte. VALID and INVALID set
+// `length` to the bytes to consume; an invalid sequence consumes its longest valid prefix,
+// so it becomes a single U+FFFD.
+Sequence check_sequence(const unsigned char* p, size_t n, size_t& length) {
+    const unsigned char b = p[0];
+    size_t need = 0;
+    unsigned char lo = 0x80;
+    unsigned char hi = 0xBF;
+    if (b >= 0xC2 && b <= 0xDF) {
+        need = 1;
+    } else if (b >= 0xE0 && b <= 0xEF) {
+        need = 2;
+        if (b == 0xE0) lo = 0xA0;
+        if (b == 0xED) hi = 0x9F;  // no surrogates
+    } else if (b >= 0xF0 && b <= 0xF4) {
+        need = 3;
+        if (b == 0xF0) lo = 0x90;
+        if (b == 0xF4) hi = 0x8F;  // nothing above U+10FFFF
+    } else {
+        length = 1;
+        return Sequence::INVALID;
+    }
+    for (size_t k = 1; k <= need; ++k) {
+        if (k >= n) return Sequence::INCOMPLETE;
+        if (p[k] < lo || p[k] > hi) {
+            length = k;
+            return Sequence::INVALID;
+        }
+        lo = 0x80;
+        hi = 0xBF;
+    }
+    length = need + 1;
+    return Sequence::VALID;
+}
+
+void append_utf8(std::string& out, uint32_t cp) {
+    if (cp < 0x80) {
+        out.push_back(static_cast<char>(cp));
+    } else if (cp < 0x800) {
+        out.push_back(static_cast<char>(0xC0 | (cp >> 6)));
+        out.push_back(static_cast<char>(0x80 | (cp & 0x3F)));
+    } else if (cp < 0x10000) {
+        out.push_back(static_cast<char>(0xE0 | (cp >> 12)));
+        out.push_back(static_cast<char>(0x80 | ((cp >> 6) & 0x3F)));
+        out.push_back(static_cast<char>(0x80 | (cp & 0x3F)));
+    } else {
+        out.push_back(static_cast<char>(0xF0 | (cp >> 18)));
+        out.push_back(static_cast<char>(0x80 | ((cp >> 12) & 0x3F)));
+        out.push_back(static_cast<char>(0x80 | ((cp >> 6) & 0x3F)));
+        out.push_back(static_cast<char>(0x80 | (cp & 0x3F)));
+    }
+}
+
+// 0x80-0x9F of windows-1252; the rest of the upper half is Latin-1.
+constexpr uint16_t kWindows1252High[32] = {0x20AC, 0x0081, 0x201A, 0x0192, 0x201E, 0x2026, 0x2020, 0x2021, 0x02C6, 0x2030, 0x0160,
+                                           0x2039, 0x0152, 0x008D, 0x017D, 0x008F, 0x0090, 0x2018, 0x2019, 0x201C, 0x201D, 0x2022,
+                                           0x2013, 0x2014, 0x02DC, 0x2122, 0x0161, 0x203A, 0x0153, 0x009D, 0x017E, 0x0178};
+
+struct Utf8Bytes {
+    char bytes[3];
+    uint8_t size;
+};
+
+void decode_windows_1252(std::string_view bytes, std::string& out) {
+    static const auto table = [] {
+        std::array<Utf8Bytes, 128> t{};
+        for (size_t i = 0; i < 128; ++i) {
+            std::string utf8;
+            append_utf8(utf8, i < 32 ? kWindows1252High[i] : static_cast<uint32_t>(0x80 + i));
+            std::memcpy(t[i].bytes, utf8.data(), utf8.size());
+            t[i].size = static_cast<uint8_t>(utf8.size());
+        }
+        return t;
+    }();
+    const char* p = bytes.data();
+    size_t n = bytes.size();
+    while (n) {
+        const size_t run = ascii_run(p, n);
+        out.append(p, run);
+        p += run;
+        n -= run;
+        for (; n && (static_cast<unsigned char>(*p) & 0x80); ++p, --n) {
+            const Utf8Bytes& e = table[static_cast<unsigned char>(*p) - 0x80];
+            out.append(e.bytes, e.size);
+        }
+    }
+}
+
+// The value of the first `charset=` parameter in `text`, or empty.
+std::string_view charset_parameter(std::string_view text) {
+    for (size_t at = find_ci(text, "charset", 0); at != std::string_view::npos; at = find_ci(text, "charset", at + 7)) {
+        size_t i = at + 7;
+        while (i < text.size() && is_space(text[i])) ++i;
+        if (i >= text.size() || text[i] != '=') continue;
+        ++i;
+        while (i < text.size() && is_space(text[i])) ++i;
+        const char quote = i < text.size() && (text[i] == '"' || text[i] == '\'') ? text[i++] : '\0';
+        const size_t start = i;
+        while (i < text.size()) {
+            const char c = text[i];
+            if (quote ? c == quote : (is_space(c) || c == ';' || c == '>' || c == '/' || c == '"' || c == '\'')) break;
+            ++i;
+        }
+        if (i > start) return text.substr(start, i - start);
+    }
+    return {};
+}
+
+// <meta charset=...> or <meta http-equiv=content-type content="...; charset=...">.
+bool meta_charset(std::string_view head, Charset& out) {
+    for (size_t at = find_ci(head, "<meta", 0); at != std::string_view::npos; at = find_ci(head, "<meta", at + 5)) {
+        const size_t end = head.find('>', at);
+        const std::string_view tag = head.substr(at, end == std::string_view::npos ? std::string_view::npos : end - at);
+        if (charset_from_label(charset_parameter(tag), out)) {
+            // A page read far enough to find its <meta> is not UTF-16; browsers take
+            // such a declaration to mean UTF-8.
+            if (out == Charset::UTF16LE || out == Charset::UTF16BE) out = Charset::UTF8;
+            return true;
+        }
+        if (end == std::string_view::npos) break;
+    }
+    return false;
+}
+
+}  // namespace
+
+const char* charset_name(Charset charset) {
+    switch (charset) {
+        case Charset::UTF8: return "utf-8";
+        case Charset::UTF16LE: return "utf-16le";
+        case Charset::UTF16BE: return "utf-16be";
+        case Charset::WINDOWS_1252: return "windows-1252";
+    }
+    return "utf-8";
+}
+
+bool charset_from_label(std::string_view label, Charset& out) {
+    while (!label.empty() && is_space(label.front())) label.remove_prefix(1);
+    while (!label.empty() && is_space(label.back())) label.remove_suffix(1);
+    std::string l(label);
+    for (char& c : l) c = lower_char(c);
+    if (l == "utf-8" || l == "utf8" || l == "unicode-1-1-utf-8" || l == "unicode11utf8" || l == "x-unicode20utf8") {
+        out = Charset::UTF8;
+    } else if (l == "utf-16" || l == "utf-16le" || l == "unicode" || l == "ucs-2" || l == "csunicode" || l == "iso-10646-ucs-2") {
+        out = Charset::UTF16LE;
+    } else if (l == "utf-16be" || l == "unicodefffe") {
+        out = Charset::UTF16BE;
+    } else if (l == "windows-1252" || l == "cp1252" || l == "x-cp1252" || l == "iso-8859-1" || l == "iso8859-1" || l == "iso_8859-1" ||
+               l == "iso_8859-1:1987" || l == "iso88591" || l == "latin1" || l == "l1" || l == "us-ascii" || l == "ascii" ||
+               l == "ansi_x3.4-1968" || l == "cp819" || l == "ibm819" || l == "iso-ir-100" || l == "csisolatin1") {
+        out = Charset::WINDOWS_1252;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+CharsetSniff sniff_charset(std::string_view bytes, std::string_view content_type) {
+    CharsetSniff sniff;
+    if (bytes.size() >= 3 && bytes.compare(0, 3, "\xEF\xBB\xBF") == 0) {
+        sniff.source = CharsetSource::BOM;
+        sniff.bom_length = 3;
+    } else if (bytes.size() >= 2 && (bytes.compare(0, 2, "\xFF\xFE") == 0 || bytes.compare(0, 2, "\xFE\xFF") == 0)) {
+        sniff.charset = bytes[0] == '\xFF' ? Charset::UTF16LE : Charset::UTF16BE;
+        sniff.source = CharsetSource::BOM;
+        sniff.bom_length = 2;
+    } else if (charset_from_label(charset_parameter(content_type), sniff.charset)) {
+        sniff.source = CharsetSource::HEADER;
+    } else if (meta_charset(bytes.substr(0, kMetaPrescanBytes), sniff.charset)) {
+        sniff.source = CharsetSource::META;
+    } else {
+        sniff.charset = Charset::UTF8;
+    }
+    return sniff;
+}
+
+CharsetSniff sniff_stream_charset(std::string_view prefix, std::string_view content_type) {
+    CharsetSniff sniff = sniff_charset(prefix, content_type);
+    if (sniff.source != CharsetSource::DEFAULT) return sniff;
+    size_t end = prefix.size();
+    for (int k = 0; k < 3 && end > 0 && (static_cast<unsigned char>(prefix[end - 1]) & 0xC0) == 0x80; ++k) --end;
+    if (end > 0 && (static_cast<unsigned char>(prefix[end - 1]) & 0xC0) == 0xC0) --end;
+    if (!is_valid_utf8(prefix.substr(0, end))) sniff.charset = Charset::WINDOWS_1252;
+    return sniff;
+}
+
+bool is_valid_utf8(std::string_view bytes) {
+    const char* p = bytes.data();
+    size_t n = bytes.size();
+    while (n) {
+        const size_t run = ascii_run(p, n);
+        p += run;
+        n -= run;
+        if (!n) break;
+        size_t length = 0;
+        if (check_sequence(reinterpret_cast<const unsigned char*>(p), n, length) != Sequence::VALID) return false;
+        p += length;
+        n -= length;
+    }
+    return true;
+}
+
+void Utf8Decoder::decode(std::string_view bytes, std::string& out) {
+    switch (charset_) {
+        case Charset::UTF8: decodeUtf8(bytes, out, false); break;
+        case Charset::UTF16LE:
+        case Charset::UTF16BE: decodeUtf16(bytes, out); break;
+        case Charset::WINDOWS_1252: decode_windows_1252(bytes, out); break;
+    }
+}
+
+void Utf8Decoder::finish(std::string& out) {
+    if (charset_ == Charset::UTF8) decodeUtf8({}, out, true);
+    else if (!carry_.empty() || high_surrogate_) out += kReplacement;
+    carry_.clear();
+    high_surrogate_ = 0;
+}
+
+void Utf8Decoder::decodeUtf8(std::string_view bytes, std::string& out, bool final) {
+    if (!carry_.empty()) {
+        // Finish the sequence split across chunks before the fast path takes over.
+        size_t taken = 0;
+        size_t length = 0;
+        Sequence s = check_sequence(reinterpret_cast<const unsigned char*>(carry_.data()), carry_.size(), length);
+        while (s == Sequence::INCOMPLETE && taken < bytes.size()) {
+            carry_.push_back(bytes[taken++]);
+            s = check_sequence(reinterpret_cast<const unsigned char*>(carry_.data()), carry_.size(), length);
+        }
+        if (s == Sequence::INCOMPLETE && !final) return;
+        if (s == Sequence::VALID) {
+            out += carry_;
+        } else {
+            out += kReplacement;
+            // Only the byte just taken can have broken the sequence; it starts the next one.
+            if (s == Sequence::INVALID) --taken;
+        }
+        bytes.remove_prefix(taken);
+        carry_.clear();
+    }
+
+    const char* p = bytes.data();
+    size_t n = bytes.size();
+    while (n) {
+        const size_t run = ascii_run(p, n);
+        out.append(p, run);
+        p += run;
+        n -= run;
+        while (n && (static_cast<unsigned char>(*p) & 0x80)) {
+            size_t length = 0;
+            const Sequence s = check_sequence(reinterpret_cast<const unsigned char*>(p), n, length);
+            if (s == Sequence::INCOMPLETE) {
+                if (final) out += kReplacement;
+                else carry_.assign(p, n);
+                return;
+            }
+            if (s == Sequence::VALID) out.append(p, length);
+            else out += kReplacement;
+            p += length;
+            n -= length;
+        }
+    }
+}
+
+void Utf8Decoder::decodeUtf16(std::string_view bytes, std::string& out) {
+    const bool big_endian = charset_ == Charset::UTF16BE;
+    const auto unit_at = [big_endian](char a, char b) {
+        const uint32_t first = static_cast<unsigned char>(a);
+        const uint32_t second = static_cast<unsigned char>(b);
+        return big_endian ? first << 8 | second : second << 8 | first;
+    };
+    const auto emit = [&](uint32_t unit) {
+        if (high_surrogate_) {
+            const uint32_t high = high_surrogate_;
+            high_surrogate_ = 0;
+            if (unit >= 0xDC00 && unit <= 0xDFFF) {
+                append_utf8(out, 0x10000 + ((high - 0xD800) << 10) + (unit - 0xDC00));
+                return;
+            }
+            out += kReplacement;
+        }
+        if (unit >= 0xD800 && unit <= 0xDBFF) high_surrogate_ = unit;
+        else if (unit >= 0xDC00 && unit <= 0xDFFF) out += kReplacement;
+        else append_utf8(out, unit);
+    };
+    size_t i = 0;
+    if (!carry_.empty() && !bytes.empty()) {
+        emit(unit_at(carry_[0], bytes[0]));
+        carry_.clear();
+        i = 1;
+    }
+    for (; i + 1 < bytes.size(); i += 2) emit(unit_at(bytes[i], bytes[i + 1]));
+    if (i < bytes.size()) carry_.assign(1, bytes[i]);
+}
+
+SharedBuffer decode_to_utf8(const SharedBuffer& body, std::string_view content_type, CharsetSniff* detected) {
+    const std::string_view bytes = body.view();
+    CharsetSniff sniff = sniff_charset(bytes, content_type);
+    if (sniff.charset == Charset::UTF8) {
+        if (is_valid_utf8(bytes)) {
+            if (detected) *detected = sniff;
+            if (!sniff.bom_length) return body;
+            return SharedBuffer(bytes.substr(sniff.bom_length));
+        }
+        // Undeclared and not UTF-8: most likely a legacy Western page.
+        if (sniff.source == CharsetSource::DEFAULT) sniff.charset = Charset::WINDOWS_1252;
+    }
+    if (detected) *detected = sniff;
+
+    std::string out;
+    out.reserve(bytes.size() + bytes.size() / 8);
+    Utf8Decoder decoder(sniff.charset);
+    decoder.decode(bytes.substr(sniff.bom_length), out);
+    decoder.finish(out);
+    return SharedBuffer(std::move(out));
+}
+
+SharedBuffer decode_response_body(const HttpResponse& response, CharsetSniff* detected) {
+    const auto it = response.headers.find("content-type");
+    return decode_to_utf8(response.body, it == response.headers.end() ? std::string_view() : std::string_view(it->second), detected);
+}
+
+}  // namespace browser
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+
+#include "browser_core.h"
+#include "buffer.h"
+
+namespace browser {
+
+// Encodings the ingest stage understands. Every ISO-8859-1 and ASCII label means
+// windows-1252, as in browsers.
+enum class Charset : uint8_t { UTF8, UTF16LE, UTF16BE, WINDOWS_1252 };
+
+enum class CharsetSource : uint8_t { BOM, HEADER, META, DEFAULT };
+
+const char* charset_name(Charset charset);
+// False for labels outside the supported set.
+bool charset_from_label(std::string_view label, Charset& out);
+
+struct CharsetSniff {
+    Charset charset = Charset::UTF8;
+    CharsetSource source = CharsetSource::DEFAULT;
+    size_t bom_length = 0;  // bytes to skip before decoding
+};
+
+// A byte order mark, then the charset parameter of `content_type`, then a <meta> in the
+// first 1024 bytes. With none of those the result is UTF-8 from DEFAULT, which
+// decode_to_utf8 replaces by windows-1252 when the body is not valid UTF-8.
+CharsetSniff sniff_charset(std::string_view bytes, std::string_view content_type = {});
+// sniff_charset on the first chunk of a stream. An undeclared chunk that is not valid
+// UTF-8 (a sequence cut off at its end aside) is taken as windows-1252.
+CharsetSniff sniff_stream_charset(std::string_view prefix, std::string_view content_type = {});
+
+bool is_valid_utf8(std::string_view bytes);
+
+// Converts chunks of `charset` to UTF-8, holding back a sequence split across chunks.
+// Malformed input becomes U+FFFD; UTF-8 input is validated on the way through, so the
+// output is always valid UTF-8.
+class Utf8Decoder {
+public:
+    explicit Utf8Decoder(Charset charset) : charset_(charset) {}
+
+    void decode(std::string_view bytes, std::string& out);
+    // Flushes a truncated trailing sequence as U+FFFD.
+    void finish(std::string& out);
+
+    Charset charset() const { return charset_; }
+
+private:
+    void decodeUtf8(std::string_view bytes, std::string& out, bool final);
+    void decodeUtf16(std::string_view bytes, std::string& out);
+
+    Charset charset_;
+    std::string carry_;            // bytes of an unfinished UTF-8 or UTF-16 sequence
+    uint32_t high_surrogate_ = 0;  // UTF-16 only
+};
+
+// The body as UTF-8 with any BOM removed. Valid UTF-8 without a BOM is returned as is,
+// sharing the buffer; anything else is transcoded in one pass.
+SharedBuffer decode_to_utf8(const SharedBuffer& body, std::string_view content_type = {}, CharsetSniff* detected = nullptr);
+// decode_to_utf8 with the response's Content-Type.
+SharedBuffer decode_response_body(const HttpResponse& response, CharsetSniff* detected = nullptr);
+
+}  // namespace browser
@@ -0,0 +1,177 @@
+#include "content_decoder.h"
+
+#include <cstdint>
+#include <stdexcept>
+
+#ifdef ZEPHYR_HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef ZEPHYR_HAVE_BROTLI
+#include <brotli/decode.h>
+#endif
+
+namespace browser {
+namespace {
+
+constexpr size_t kOutputChunk = 16 * 1024;
+
+std::string normalize(std::string_view coding) {
+    while (!coding.empty() && (coding.front() == ' ' || coding.front() == '\t')) coding.remove_prefix(1);
+    while (!coding.empty() && (coding.back() == ' ' || coding.back() == '\t')) coding.remove_suffix(1);
+    std::string out(coding);
+    for (char& c : out) c = (c >= 'A' && c <= 'Z') ? static_cast<char>(c - 'A' + 'a') : c;
+    return out;
+}
+
+#if defined(ZEPHYR_HAVE_ZLIB) || defined(ZEPHYR_HAVE_BROTLI)
+std::string too_large(size_t limit) { return "decoded response body exceeds " + std::to_string(limit) + " bytes"; }
+#endif
+
+#ifdef ZEPHYR_HAVE_ZLIB
+class ZlibDecoder : public ContentDecoder {
+public:
+    explicit ZlibDecoder(bool gzip) : gzip_(gzip) {}
+    ~ZlibDecoder() override {
+        if (started_) inflateEnd(&stream_);
+    }
+
+    bool decode(const char* data, size_t size, std::string& out, size_t limit) override {
+        if (!error().empty()) return false;
+        if (size == 0 || trailing_) return true;
+        std::string joined;
+        if (!held_.empty()) {
+            joined = held_ + std::string(data, size);
+            held_.clear();
+            data = joined.data();
+            size = joined.size();
+        }
+        if (done_ && !nextMember(data, size)) return true;
+        if (!started_) {
+            // "deflate" should be zlib-wrapped, but some servers send raw deflate. A zlib
+            // header names the deflate method in the low nibble of its first byte, and its
+            // two bytes read as a big-endian number are a multiple of 31.
+            if (!gzip_ && size < 2) {
+                held_.assign(data, size);
+                return true;
+            }
+            const unsigned cmf = static_cast<unsigned char>(data[0]);
+            const unsigned flg = size > 1 ? static_cast<unsigned char>(data[1]) : 0;
+            const bool zlib = (cmf & 0x0F) == 8 && ((cmf << 8) | flg) % 31 == 0;
+            if (inflateInit2(&stream_, gzip_ ? 16 + MAX_WBITS : (zlib ? MAX_WBITS : -MAX_WBITS)) != Z_OK) return fail("inflateInit failed");
+            started_ = true;
+        }
+        stream_.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data));
+        stream_.avail_in = static_cast<uInt>(size);
+        unsigned char buf[kOutputChunk];
+        do {
+            stream_.next_out = buf;
+            stream_.avail_out = sizeof(buf);
+            const int rc = inflate(&stream_, Z_NO_FLUSH);
+            const size_t produced = sizeof(buf) - stream_.avail_out;
+            if (out.size() + produced > limit) return fail(too_large(limit));
+            out.append(reinterpret_cast<const char*>(buf), produced);
+            if (rc == Z_STREAM_END) {
+                done_ = true;
+                if (stream_.avail_in == 0 || !nextMember(reinterpret_cast<const char*>(stream_.next_in), stream_.avail_in)) break;
+                continue;
+            }
+            if (rc == Z_BUF_ERROR && produced == 0) break;
+            if (rc != Z_OK && rc != Z_BUF_ERROR) return fail(std::string("corrupt ") + (gzip_ ? "gzip" : "deflate") + " body" + (stream_.msg ? std::string(": ") + stream_.msg : ""));
+        } while (stream_.avail_in > 0 || stream_.avail_out == 0);
+        return true;
+    }
+
+    bool finished() const override { return done_; }
+
+private:
+    // Gzip members may follow one another, decoding to their concatenation. Anything else
+    // after the stream (padding, say) is ignored.
+    bool nextMember(const char* data, size_t size) {
+        if (gzip_ && size == 1 && static_cast<unsigned char>(data[0]) == 0x1f) {
+            held_.assign(data, size);
+            return false;
+        }
+        if (!gzip_ || size < 2 || static_cast<unsigned char>(data[0]) != 0x1f || static_cast<unsigned char>(data[1]) != 0x8b) {
+            trailing_ = true;
+            return false;
+        }
+        inflateReset(&stream_);
+        done_ = false;
+        return true;
+    }
+
+    bool gzip_;
+    bool started_ = false;
+    bool done_ = false;
+    bool trailing_ = false;
+    std::string held_;  // a byte that means nothing until the next arrives
+    z_stream stream_{};
+};
+#endif
+
+#ifdef ZEPHYR_HAVE_BROTLI
+class BrotliDecoder : public ContentDecoder {
+public:
+    BrotliDecoder() : state_(BrotliDecoderCreateInstance(nullptr, nullptr, nullptr)) {
+        if (!state_) throw std::runtime_error("brotli decoder allocation failed");
+    }
+    ~BrotliDecoder() override { BrotliDecoderDestroyInstance(state_); }
+
+    bool decode(const char* data, size_t size, std::string& out, size_t limit) override {
+        if (!error().empty()) return false;
+        if (done_) return true;
+        const uint8_t* next_in = reinterpret_cast<const uint8_t*>(data);
+        size_t avail_in = size;
+        uint8_t buf[kOutputChunk];
+        for (;;) {
+            uint8_t* next_out = buf;
+            size_t avail_out = sizeof(buf);
+            const BrotliDecoderResult rc = BrotliDecoderDecompressStream(state_, &avail_in, &next_in, &avail_out, &next_out, nullptr);
+            const size_t produced = sizeof(buf) - avail_out;
+            if (out.size() + produced > limit) return fail(too_large(limit));
+            out.append(reinterpret_cast<const char*>(buf), produced);
+            if (rc == BROTLI_DECODER_RESULT_SUCCESS) {
+                done_ = true;
+                return true;
+            }
+            if (rc == BROTLI_DECODER_RESULT_NEEDS_MORE_INPUT) return true;
+            if (rc == BROTLI_DECODER_RESULT_ERROR) return fail(std::string("corrupt br body: ") + BrotliDecoderErrorString(BrotliDecoderGetErrorCode(state_)));
+        }
+    }
+
+    bool finished() const override { return done_; }
+
+private:
+    BrotliDecoderState* state_;
+    bool done_ = false;
+};
+#endif
+
+}  // namespace
+
+std::unique_ptr<ContentDecoder> ContentDecoder::create(std::string_view content_encoding) {
+    const std::string coding = normalize(content_encoding);
+    if (coding.empty() || coding == "identity") return nullptr;
+#ifdef ZEPHYR_HAVE_ZLIB
+    if (coding == "gzip" || coding == "x-gzip") return std::make_unique<ZlibDecoder>(true);
+    if (coding == "deflate") return std::make_unique<ZlibDecoder>(false);
+#endif
+#ifdef ZEPHYR_HAVE_BROTLI
+    if (coding == "br") return std::make_unique<BrotliDecoder>();
+#endif
+    throw std::runtime_error("unsupported Content-Encoding: " + coding);
+}
+
+const char* accepted_content_encodings() {
+#if defined(ZEPHYR_HAVE_ZLIB) && defined(ZEPHYR_HAVE_BROTLI)
+    return "gzip, deflate, br";
+#elif defined(ZEPHYR_HAVE_ZLIB)
+    return "gzip, deflate";
+#elif defined(ZEPHYR_HAVE_BROTLI)
+    return "br";
+#else
+    return "";
+#endif
+}
+
+}  // namespace browser
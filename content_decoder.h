@@ -0,0 +1,42 @@
+#pragma once
+
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <string_view>
+
+namespace browser {
+
+// Incremental decoder for one Content-Encoding: gzip and deflate with zlib, br with
+// libbrotlidec, whichever the build found.
+class ContentDecoder {
+public:
+    virtual ~ContentDecoder() = default;
+
+    // Null for an empty or "identity" coding; throws std::runtime_error for one this build
+    // cannot decode.
+    static std::unique_ptr<ContentDecoder> create(std::string_view content_encoding);
+
+    // Appends what `data` decodes to onto `out`. Fails (see error()) on corrupt input or
+    // once `out` would grow past `limit` bytes, so a small body cannot expand without
+    // bound.
+    virtual bool decode(const char* data, size_t size, std::string& out, size_t limit) = 0;
+    // True when the input seen so far ends a complete stream.
+    virtual bool finished() const = 0;
+
+    const std::string& error() const { return error_; }
+
+protected:
+    bool fail(std::string why) {
+        error_ = std::move(why);
+        return false;
+    }
+
+private:
+    std::string error_;
+};
+
+// Value for Accept-Encoding, or empty when the build can decode nothing.
+const char* accepted_content_encodings();
+
+}  // namespace browser
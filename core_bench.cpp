@@ -0,0 +1,619 @@
+#include "browser_core.h"
+#include "charset.h"
+#include "crawler.h"
+#include "layout.h"
+#include "paint.h"
+#include "snapshot.h"
+#include "style_engine.h"
+#include "url.h"
+
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cstring>
+#include <filesystem>
+#include <functional>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+double seconds_per_run(const std::function<void()>& fn, int min_runs, double min_seconds) {
+    int runs = 0;
+    const Clock::time_point start = Clock::now();
+    double elapsed = 0;
+    while (runs < min_runs || elapsed < min_seconds) {
+        fn();
+        ++runs;
+        elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+    }
+    return elapsed / runs;
+}
+
+void report(const std::string& name, double seconds, size_t bytes) {
+    std::cout << name << ": " << seconds * 1000.0 << " ms/run";
+    if (bytes) std::cout << ", " << (bytes / (1024.0 * 1024.0)) / seconds << " MB/s";
+    std::cout << "\n";
+}
+
+// Roughly the shape of a utility-class framework: many short rules, selector lists,
+// comments, media blocks and the odd string value.
+std::string make_framework_css(size_t target_bytes) {
+    std::string css;
+    size_t i = 0;
+    while (css.size() < target_bytes) {
+        const std::string n = std::to_string(i);
+        css += "/* block " + n + " */\n";
+        css += ".m-" + n + ", .mx-" + n + " > span, div.card-" + n + " p { margin: " + std::to_string(i % 40) + "px; padding: 2px 4px; }\n";
+        css += "#hero-" + n + " .title { color: #1a2b3c; font-size: " + std::to_string(10 + i % 20) + "px; font-weight: bold }\n";
+        css += "ul.nav-" + n + " li { display: inline-block; width: 120px; font-family: \"Helvetica Neue\", Arial; }\n";
+        if (i % 8 == 0) css += "@media (max-width: 600px) { .m-" + n + " { display: none } .x" + n + " { visibility: hidden } }\n";
+        ++i;
+    }
+    return css;
+}
+
+// parse_css as it was before the string_view scanner: comments stripped into a copy, then
+// std::string pieces split with istringstream. Kept as the baseline for bench_css_parse.
+namespace legacy {
+
+using namespace browser;
+
+std::string lower(std::string s) {
+    std::transform(s.begin(), s.end(), s.begin(), [](unsigned char c) { return static_cast<char>(std::tolower(c)); });
+    return s;
+}
+
+std::string trim(const std::string& s) {
+    const size_t b = s.find_first_not_of(" \t\r\n");
+    if (b == std::string::npos) return "";
+    const size_t e = s.find_last_not_of(" \t\r\n");
+    return s.substr(b, e - b + 1);
+}
+
+int parse_px(const std::string& s) {
+    size_t i = 0;
+    const bool negative = !s.empty() && s[0] == '-';
+    if (negative) ++i;
+    int v = 0;
+    for (; i < s.size() && s[i] >= '0' && s[i] <= '9'; ++i) v = std::min(v * 10 + (s[i] - '0'), 1000000);
+    return negative ? -v : v;
+}
+
+bool parse_color(const std::string& s, Color& out) {
+    const std::string v = lower(trim(s));
+    if (v == "red") out = {255, 0, 0, 255};
+    else if (v == "green") out = {0, 128, 0, 255};
+    else if (v == "blue") out = {0, 0, 255, 255};
+    else if (v == "black") out = {0, 0, 0, 255};
+    else if (v == "white") out = {255, 255, 255, 255};
+    else if (v.size() == 7 && v[0] == '#') {
+        auto h = [](char c) -> int {
+            if (c >= '0' && c <= '9') return c - '0';
+            c = static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+            if (c >= 'a' && c <= 'f') return 10 + c - 'a';
+            return 0;
+        };
+        auto byte = [&](size_t i) { return static_cast<uint8_t>(h(v[i]) * 16 + h(v[i + 1])); };
+        out = {byte(1), byte(3), byte(5), 255};
+    } else {
+        return false;
+    }
+    return true;
+}
+
+bool parse_display(const std::string& v, Display& out) {
+    if (v == "inline") out = Display::INLINE;
+    else if (v == "block") out = Display::BLOCK;
+    else if (v == "inline-block") out = Display::INLINE_BLOCK;
+    else if (v == "list-item") out = Display::LIST_ITEM;
+    else if (v == "flex" || v == "inline-flex") out = Display::FLEX;
+    else if (v == "grid" || v == "inline-grid") out = Display::GRID;
+    else if (v == "table") out = Display::TABLE;
+    else if (v == "none") out = Display::NONE;
+    else return false;
+    return true;
+}
+
+bool parse_visibility(const std::string& v, Visibility& out) {
+    if (v == "visible") out = Visibility::VISIBLE;
+    else if (v == "hidden") out = Visibility::HIDDEN;
+    else if (v == "collapse") out = Visibility::COLLAPSE;
+    else return false;
+    return true;
+}
+
+int16_t clamp16(int v) { return static_cast<int16_t>(std::max(-32768, std::min(32767, v))); }
+
+// 1-4 value box shorthand (top right bottom left), as used by padding and margin.
+void parse_edges(const std::string& value, int16_t* edges) {
+    std::istringstream iss(value);
+    std::vector<int16_t> v;
+    std::string part;
+    while (v.size() < 4 && iss >> part) v.push_back(clamp16(parse_px(part)));
+    if (v.empty()) v.push_back(0);
+    edges[0] = v[0];
+    edges[1] = v.size() > 1 ? v[1] : v[0];
+    edges[2] = v.size() > 2 ? v[2] : v[0];
+    edges[3] = v.size() > 3 ? v[3] : edges[1];
+}
+
+std::string strip_comments(const std::string& in) {
+    std::string out;
+    for (size_t i = 0; i < in.size();) {
+        if (i + 1 < in.size() && in[i] == '/' && in[i + 1] == '*') {
+            size_t end = in.find("*/", i + 2);
+            if (end == std::string::npos) break;
+            i = end + 2;
+            continue;
+        }
+        out.push_back(in[i++]);
+    }
+    return out;
+}
+
+Selector parse_selector(std::string text) {
+    Selector s;
+    text = trim(lower(text));
+
+    size_t space = text.find(' ');
+    if (space != std::string::npos) {
+        s.ancestor_tag = trim(text.substr(0, space));
+        text = trim(text.substr(space + 1));
+    }
+
+    std::string token;
+    for (size_t i = 0; i <= text.size(); ++i) {
+        const char c = (i < text.size()) ? text[i] : '\0';
+        if (c == '#' || c == '.' || c == '\0') {
+            if (!token.empty() && s.tag.empty()) s.tag = token;
+            token.clear();
+            if (c == '#') {
+                size_t j = i + 1;
+                while (j < text.size() && text[j] != '.' && text[j] != '#') ++j;
+                s.id = text.substr(i + 1, j - (i + 1));
+                i = j - 1;
+            } else if (c == '.') {
+                size_t j = i + 1;
+                while (j < text.size() && text[j] != '.' && text[j] != '#') ++j;
+                s.classes.push_back(text.substr(i + 1, j - (i + 1)));
+                i = j - 1;
+            }
+        } else {
+            token.push_back(c);
+        }
+    }
+
+    return s;
+}
+
+void apply_decl(StyleProperties& p, std::string name, std::string value) {
+    name = lower(trim(name));
+    value = trim(value);
+    const std::string v = lower(value);
+    if (name == "display") {
+        if (parse_display(v, p.display)) p.set(Property::DISPLAY);
+    } else if (name == "visibility") {
+        if (parse_visibility(v, p.visibility)) p.set(Property::VISIBILITY);
+    } else if (name == "color") {
+        if (parse_color(value, p.color)) p.set(Property::COLOR);
+    } else if (name == "font-size") {
+        p.font_size = clamp16(parse_px(value));
+        p.set(Property::FONT_SIZE);
+    } else if (name == "font-weight") {
+        if (v == "normal") p.font_weight = 400;
+        else if (v == "bold") p.font_weight = 700;
+        else p.font_weight = clamp16(parse_px(v));
+        if (p.font_weight > 0) p.set(Property::FONT_WEIGHT);
+    } else if (name == "width") {
+        if (v == "auto") return;
+        p.width = clamp16(parse_px(value));
+        p.set(Property::WIDTH);
+    } else if (name == "padding") {
+        parse_edges(value, &p.padding_top);
+        p.set(Property::PADDING);
+    } else if (name == "margin") {
+        parse_edges(value, &p.margin_top);
+        p.set(Property::MARGIN);
+    }
+}
+
+StyleSheet parse_css(const std::string& css_text) {
+    StyleSheet sheet;
+    const std::string clean = strip_comments(css_text);
+
+    size_t pos = 0;
+    while (pos < clean.size()) {
+        const size_t open = clean.find('{', pos);
+        if (open == std::string::npos) break;
+        const size_t close = clean.find('}', open + 1);
+        if (close == std::string::npos) break;
+
+        const std::string selectors = clean.substr(pos, open - pos);
+        const std::string body = clean.substr(open + 1, close - open - 1);
+
+        StyleProperties props;
+        std::istringstream decls(body);
+        std::string d;
+        while (std::getline(decls, d, ';')) {
+            size_t colon = d.find(':');
+            if (colon == std::string::npos) continue;
+            apply_decl(props, d.substr(0, colon), d.substr(colon + 1));
+        }
+
+        std::istringstream sels(selectors);
+        std::string s;
+        while (std::getline(sels, s, ',')) {
+            Selector parsed = parse_selector(s);
+            if (!parsed.tag.empty() || !parsed.id.empty() || !parsed.classes.empty() || !parsed.ancestor_tag.empty()) {
+                sheet.addRule(parsed, props);
+            }
+        }
+
+        pos = close + 1;
+    }
+
+    return sheet;
+}
+
+}  // namespace legacy
+
+void bench_css_parse() {
+    const std::string css = make_framework_css(512 * 1024);
+    size_t sink = 0;
+    const double baseline = seconds_per_run([&] { sink += legacy::parse_css(css).ruleCount(); }, 5, 1.0);
+    report("css_parse baseline, strip_comments + istringstream (512 KB framework sheet)", baseline, css.size());
+    const double s = seconds_per_run([&] { sink += browser::parse_css(css).ruleCount(); }, 5, 1.0);
+    report("css_parse (512 KB framework sheet)", s, css.size());
+    if (sink == 0) std::cout << "(no rules parsed)\n";
+}
+
+void bench_css_cache() {
+    const std::string css = make_framework_css(512 * 1024);
+    browser::StyleSheetCache cache;
+    cache.get(css);
+    size_t sink = 0;
+    const double s = seconds_per_run([&] { sink += cache.get(css)->ruleCount(); }, 20, 0.5);
+    report("css_cache hit (512 KB framework sheet)", s, css.size());
+    if (sink == 0) std::cout << "(no rules parsed)\n";
+}
+
+std::string make_article_html(size_t target_bytes) {
+    std::string html = "<html><head><title>bench</title></head><body>";
+    size_t i = 0;
+    while (html.size() < target_bytes) {
+        const std::string n = std::to_string(i++);
+        html += "<div class='card-" + n + " m-" + n + "' id='hero-" + n + "'><p class='title'>Item " + n + " &amp; friends</p>";
+        html += "<ul class='nav-" + n + "'><li><a href='/item/" + n + "'>open</a></li><li>share</li></ul></div>";
+    }
+    return html + "</body></html>";
+}
+
+// Ingest cost next to parsing: a page that is already UTF-8 (with some non-ASCII text)
+// and the same page saved as windows-1252.
+void bench_charset() {
+    std::string utf8 = make_article_html(4 * 1024 * 1024);
+    for (size_t i = 512; i + 8 < utf8.size(); i += 1024) {
+        if (utf8[i] != '<' && utf8[i] != '>') utf8.replace(i, 2, "\xC3\xA9");
+    }
+    std::string latin1;
+    for (size_t i = 0; i < utf8.size(); ++i) {
+        if (utf8.compare(i, 2, "\xC3\xA9") == 0) latin1 += '\xE9', ++i;
+        else latin1 += utf8[i];
+    }
+    const browser::SharedBuffer utf8_body(std::move(utf8));
+    const browser::SharedBuffer latin1_body(std::move(latin1));
+    size_t sink = 0;
+
+    report("is_valid_utf8 (4 MB page)", seconds_per_run([&] { sink += browser::is_valid_utf8(utf8_body.view()); }, 5, 1.0), utf8_body.size());
+    report("decode_to_utf8, UTF-8 pass-through", seconds_per_run([&] { sink += browser::decode_to_utf8(utf8_body).size(); }, 5, 1.0), utf8_body.size());
+    report("decode_to_utf8, windows-1252 transcode", seconds_per_run([&] { sink += browser::decode_to_utf8(latin1_body).size(); }, 5, 1.0), latin1_body.size());
+    report("parse_html (same page, for scale)", seconds_per_run([&] { sink += browser::parse_html(utf8_body)->indexedElements(); }, 3, 1.0), utf8_body.size());
+    if (sink == 0) std::cout << "(nothing decoded)\n";
+}
+
+void bench_links() {
+    const std::string html = make_article_html(512 * 1024);
+    std::string text;
+    std::vector<std::pair<std::string, std::string>> links;
+    const double s = seconds_per_run([&] { extract_text_and_links(html, text, links); }, 5, 1.0);
+    report("extract_text_and_links (512 KB page, " + std::to_string(links.size()) + " links)", s, html.size());
+}
+
+// The mix of references a link-heavy page (a forum index, a sitemap) carries.
+std::vector<std::string> make_hrefs(size_t count) {
+    static const char* const kShapes[] = {"/forum/topic-%/page-2", "../archive/%.html", "post-%?reply=1#top", "  ./img/%.png ",
+                                          "https://cdn.example.net/%.js", "//static.example.com/%.css", "#comment-%", "JavaScript:void(%)"};
+    std::vector<std::string> hrefs;
+    for (size_t i = 0; i < count; ++i) {
+        std::string h = kShapes[i % 8];
+        h.replace(h.find('%'), 1, std::to_string(i));
+        hrefs.push_back(h);
+    }
+    return hrefs;
+}
+
+// Crawl dedup: a million URLs through the scalable Bloom filter, then as many lookups of
+// URLs it has not seen.
+void bench_bloom() {
+    std::vector<std::string> urls;
+    urls.reserve(1000000);
+    for (size_t i = 0; i < 1000000; ++i) urls.push_back("https://site" + std::to_string(i % 97) + ".test/articles/" + std::to_string(i) + "?page=2");
+    browser::ScalableBloomFilter bloom(1 << 16, 0.01);
+    const double insert = seconds_per_run([&] {
+        bloom = browser::ScalableBloomFilter(1 << 16, 0.01);
+        for (const std::string& url : urls) bloom.add(url);
+    }, 3, 1.0);
+    report("bloom insert 1M URLs (" + std::to_string(bloom.stages()) + " stages, " + std::to_string(bloom.bytes() / 1024) + " KB)", insert, 0);
+    for (std::string& url : urls) url += "#unseen";
+    size_t hits = 0;
+    const double lookup = seconds_per_run([&] {
+        hits = 0;
+        for (const std::string& url : urls) hits += bloom.mayContain(url);
+    }, 3, 1.0);
+    report("bloom lookup 1M unseen URLs (" + std::to_string(hits) + " false positives)", lookup, 0);
+}
+
+// Crawl dedup end to end: 2M links, 80% of them repeats skewed toward early URLs (site
+// navigation), through the Bloom filter and, on its "maybe", the on-disk seen-URL store.
+void bench_seen() {
+    const std::filesystem::path dir = "core_bench_seen";
+    std::filesystem::remove_all(dir);
+    std::filesystem::create_directories(dir);
+    browser::ScalableBloomFilter bloom(1 << 16, 0.01);
+    browser::SeenUrlStore seen(dir.string());
+    std::vector<std::string> urls;
+    uint64_t rng = 88172645463325252ull;
+    auto next = [&] {
+        rng ^= rng << 13;
+        rng ^= rng >> 7;
+        rng ^= rng << 17;
+        return rng;
+    };
+    size_t links = 0;
+    size_t duplicates = 0;
+    size_t false_positives = 0;
+    size_t peak_bytes = 0;
+    const auto start = std::chrono::steady_clock::now();
+    for (; links < 2000000; ++links) {
+        std::string url;
+        if (!urls.empty() && next() % 100 < 80) {
+            const double u = static_cast<double>(next() % 1000000) / 1000000.0;
+            url = urls[static_cast<size_t>(u * u * u * static_cast<double>(urls.size()))];
+        } else {
+            url = "https://site" + std::to_string(urls.size() % 97) + ".test/articles/" + std::to_string(urls.size()) + "?page=2";
+            urls.push_back(url);
+        }
+        if (bloom.mayContain(url)) {
+            if (seen.contains(url)) {
+                ++duplicates;
+                continue;
+            }
+            ++false_positives;
+        }
+        bloom.add(url);
+        seen.add(url);
+        if (links % 65536 == 0) peak_bytes = std::max(peak_bytes, seen.memoryBytes());
+    }
+    seen.flush();
+    const double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    const browser::SeenUrlStore::Stats& st = seen.stats();
+    report("crawl dedup 2M links (" + std::to_string(seen.size()) + " unique, " + std::to_string(duplicates) + " duplicates, " + std::to_string(false_positives) +
+               " Bloom false positives)", elapsed, 0);
+    std::cout << "  seen store: " << std::max(peak_bytes, seen.memoryBytes()) / 1024 << " KB peak in memory for " << seen.size() * 8 / 1024 << " KB on disk; "
+              << st.lookups << " lookups, " << st.block_reads << " block reads, " << st.runs_written << " runs written, " << st.merges << " merges\n";
+    std::filesystem::remove_all(dir);
+}
+
+void bench_resolve() {
+    const std::string base = "https://example.com:8443/docs/guide/index.html";
+    const std::vector<std::string> hrefs = make_hrefs(10000);
+    size_t sink = 0;
+    const double s = seconds_per_run([&] {
+        for (const auto& h : hrefs) sink += resolve_url(base, h).size();
+    }, 10, 1.0);
+    report("resolve_url x10k (per-link base parse)", s, 0);
+
+    const browser::BaseUrl parsed(base);
+    const std::vector<std::string_view> views(hrefs.begin(), hrefs.end());
+    browser::ResolvedUrls urls;
+    const double batch = seconds_per_run([&] {
+        urls.clear();
+        parsed.resolveAll(views, urls);
+        sink += urls.arenaBytes();
+    }, 10, 1.0);
+    report("BaseUrl::resolveAll x10k (one arena)", batch, 0);
+    if (sink == 0) std::cout << "(nothing resolved)\n";
+}
+
+void bench_snapshot() {
+    const browser::SharedBuffer html(make_article_html(512 * 1024));
+    const browser::StyleSheet sheet = browser::parse_css(make_framework_css(64 * 1024));
+    const browser::SharedBuffer bytes = browser::DomSnapshot::serialize(browser::parse_html(html), &sheet);
+    size_t sink = 0;
+    const double parse = seconds_per_run([&] { sink += browser::parse_html(html)->children.size(); }, 5, 1.0);
+    report("snapshot baseline: parse_html (512 KB page)", parse, html.size());
+    const double load = seconds_per_run([&] { sink += browser::DomSnapshot::load(bytes).nodeCount(); }, 20, 0.5);
+    report("snapshot load (" + std::to_string(bytes.size() / 1024) + " KB, DOM + rules)", load, bytes.size());
+    if (sink == 0) std::cout << "(empty document)\n";
+}
+
+// An ad- and script-heavy page parsed in full and for rendering only, where <head>, scripts,
+// <noscript> and display:none ad slots stay unbuilt.
+void bench_lazy_parse() {
+    std::string html = "<html><head><title>bench</title>";
+    for (int i = 0; i < 40; ++i) html += "<meta name='m" + std::to_string(i) + "' content='x'><link rel='preload' href='/a" + std::to_string(i) + ".js'>";
+    html += "<style>div.ad-slot { display: none } p.title { font-weight: bold }</style></head><body>";
+    size_t i = 0;
+    while (html.size() < 512 * 1024) {
+        const std::string n = std::to_string(i++);
+        html += "<div class='card-" + n + "'><p class='title'>Item " + n + " &amp; friends</p><ul><li><a href='/item/" + n + "'>open</a></li></ul></div>";
+        html += "<script>window.q" + n + " = [1, 2, '<div>']; track('view', " + n + ");</script>";
+        html += "<noscript><img src='/pixel?n=" + n + "'></noscript>";
+        html += "<div class='ad-slot' data-slot='" + n + "'><div class='ad'><a href='/ad/" + n + "'><img src='/ad.png'><span>Sponsored &amp; more</span></a>"
+                "<p>Buy <b>now</b></p></div></div>";
+    }
+    html += "</body></html>";
+    const browser::SharedBuffer source(html);
+    const std::string css = extract_style_blocks(html);
+
+    for (bool render_only : {false, true}) {
+        const std::string mode = render_only ? "render-only" : "full";
+        const size_t elements = browser::parse_document(source, css, render_only).document->indexedElements();
+        size_t sink = 0;
+        const double parse = seconds_per_run([&] { sink += browser::parse_document(source, css, render_only).document->children.size(); }, 5, 1.0);
+        report("parse_document, " + mode + " (512 KB ad-heavy page, " + std::to_string(elements) + " elements)", parse, source.size());
+#if ZEPHYR_METRICS
+        auto account = std::make_shared<browser::MemoryAccount>();
+        {
+            browser::MemoryAccountScope scope(account);
+            const browser::RenderContext ctx = browser::parse_document(source, css, render_only);
+            const browser::MemoryStats stats = account->snapshot();
+            std::cout << "  DOM bytes, " << mode << ": "
+                      << stats[browser::MemoryCategory::DOM_NODES].current_bytes + stats[browser::MemoryCategory::DOM_ATTRIBUTES].current_bytes +
+                             stats[browser::MemoryCategory::DOM_TEXT].current_bytes
+                      << "\n";
+        }
+#endif
+        if (sink == 0) std::cout << "(empty document)\n";
+    }
+    const double render = seconds_per_run([&] { render_page_text(source, 100); }, 5, 1.0);
+    report("render_page_text (same page)", render, source.size());
+}
+
+// Lookups a script or extractor makes against a parsed page, by index and by full walk.
+void bench_query() {
+    const browser::DocumentPtr doc = browser::parse_html(browser::SharedBuffer(make_article_html(512 * 1024)));
+    const std::vector<std::string> queries = {"#hero-2000", ".card-1500", "ul.nav-900 li", "a", "p.title, li"};
+    size_t sink = 0;
+    const double indexed = seconds_per_run([&] {
+        for (const auto& q : queries) sink += doc->querySelectorAll(q).size();
+    }, 10, 1.0);
+    report("querySelectorAll x" + std::to_string(queries.size()) + " (indexed, " + std::to_string(doc->indexedElements()) + " elements)", indexed, 0);
+
+    const double walked = seconds_per_run([&] {
+        for (const auto& q : queries) {
+            const std::vector<browser::Selector> list = browser::parse_selector_list(q);
+            std::vector<browser::ElementPtr> stack{doc};
+            while (!stack.empty()) {
+                const browser::ElementPtr el = std::move(stack.back());
+                stack.pop_back();
+                for (const auto& s : list) {
+                    if (el != doc && browser::selector_matches(s, *el)) {
+                        ++sink;
+                        break;
+                    }
+                }
+                for (auto it = el->children.rbegin(); it != el->children.rend(); ++it) {
+                    if ((*it)->type == browser::NodeType::ELEMENT) stack.push_back(std::static_pointer_cast<browser::Element>(*it));
+                }
+            }
+        }
+    }, 5, 1.0);
+    report("querySelectorAll x" + std::to_string(queries.size()) + " baseline: full tree walk", walked, 0);
+    if (sink == 0) std::cout << "(nothing matched)\n";
+}
+
+// Script-style churn: one class flip at a time, with styles brought up to date after each.
+void bench_restyle() {
+    const browser::DocumentPtr doc = browser::parse_html(browser::SharedBuffer(make_article_html(512 * 1024)));
+    const auto sheet = std::make_shared<const browser::StyleSheet>(browser::parse_css(make_framework_css(64 * 1024)));
+    const std::vector<browser::ElementPtr> cards = doc->getElementsByTagName("div");
+    size_t sink = 0;
+
+    const double full = seconds_per_run([&] { sink += browser::StyleEngine(doc, sheet).styles().size(); }, 3, 1.0);
+    report("restyle baseline: full document (" + std::to_string(doc->indexedElements()) + " elements, " + std::to_string(sheet->ruleCount()) + " rules)", full, 0);
+
+    browser::StyleEngine engine(doc, sheet);
+    size_t flip = 0;
+    constexpr size_t kMutations = 1000;
+    const double incremental = seconds_per_run([&] {
+        for (size_t i = 0; i < kMutations; ++i, ++flip) {
+            const std::string n = std::to_string(flip * 7919 % cards.size());
+            cards[flip * 7919 % cards.size()]->setAttribute("class", (flip / cards.size()) % 2 ? "card-" + n + " m-" + n : "card-" + n + " hidden m-0");
+            sink += engine.restyle();
+        }
+    }, 3, 1.0);
+    report("restyle incremental: " + std::to_string(kMutations) + " class flips, restyle after each", incremental, 0);
+    std::cout << "  per mutation: " << incremental / kMutations * 1e6 << " us incremental vs " << full * 1e6 << " us full\n";
+    if (sink == 0) std::cout << "(nothing styled)\n";
+}
+
+void bench_layout() {
+    const browser::DocumentPtr doc = browser::parse_html(browser::SharedBuffer(make_article_html(512 * 1024)));
+    const auto sheet = std::make_shared<const browser::StyleSheet>(browser::parse_css(".title { font-size: 20px; padding: 4px } .big { font-size: 28px } li { margin: 2px }"));
+    browser::StyleEngine styles(doc, sheet);
+    browser::LayoutEngine layout(styles);
+    const std::vector<browser::ElementPtr> titles = doc->getElementsByClassName("title");
+
+    int32_t width = 800;
+    const double full = seconds_per_run([&] { layout.layout(width ^= 64); }, 5, 1.0);
+    report("layout full (" + std::to_string(doc->indexedElements()) + " elements, viewport resize each run)", full, 0);
+
+    size_t flip = 0;
+    const double incremental = seconds_per_run([&] {
+        ++flip;
+        titles[flip * 7919 % titles.size()]->setAttribute("class", flip % 2 ? "big title" : "title");
+        layout.layout(width);
+    }, 50, 1.0);
+    const browser::LayoutStats& st = layout.lastStats();
+    report("layout incremental (one element changed; " + std::to_string(st.blocks_laid_out) + " blocks laid out, " + std::to_string(st.blocks_reused) + " reused)", incremental, 0);
+    std::cout << "  text cache: " << layout.metrics().cachedWords() << " words, " << layout.metrics().hits() << " hits / " << layout.metrics().misses() << " misses\n";
+}
+
+void bench_raster() {
+    const browser::DocumentPtr doc = browser::parse_html(browser::SharedBuffer(make_article_html(128 * 1024)));
+    const auto sheet = std::make_shared<const browser::StyleSheet>(browser::parse_css(".title { font-size: 20px; padding: 4px } .big { color: red } li { margin: 2px }"));
+    browser::StyleEngine styles(doc, sheet);
+    browser::LayoutEngine layout(styles);
+    browser::DisplayList list = browser::build_display_list(layout.layout(1024));
+    const browser::ElementPtr title = doc->getElementsByClassName("title").front();
+
+    for (const size_t threads : {size_t(0), size_t(std::max(2u, std::thread::hardware_concurrency()))}) {
+        browser::TileRasterizer raster(threads);
+        int32_t scroll = 0;
+        const double full = seconds_per_run([&] { raster.render(list, 1024, 768, scroll ^= 16); }, 10, 1.0);
+        report("raster full frame 1024x768 (" + std::to_string(threads) + " threads, " + std::to_string(list.items.size()) + " items)", full, 0);
+        const double reuse = seconds_per_run([&] { raster.render(list, 1024, 768, scroll); }, 10, 1.0);
+        report("raster unchanged frame (" + std::to_string(raster.lastStats().reused) + " tiles reused)", reuse, 0);
+    }
+
+    browser::TileRasterizer raster(0);
+    raster.render(list, 1024, 768);
+    size_t flip = 0;
+    const double mutated = seconds_per_run([&] {
+        title->setAttribute("class", ++flip % 2 ? "big title" : "title");
+        list = browser::build_display_list(layout.layout(1024));
+        raster.render(list, 1024, 768);
+    }, 10, 1.0);
+    report("relayout + display list + raster after one change (" + std::to_string(raster.lastStats().painted) + " of " + std::to_string(raster.lastStats().tiles) + " tiles painted)", mutated, 0);
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+    const std::string only = argc > 1 ? argv[1] : "";
+    auto want = [&](const char* name) { return only.empty() || only == name; };
+
+    if (want("css")) bench_css_parse();
+    if (want("css_cache")) bench_css_cache();
+    if (want("links")) bench_links();
+    if (want("charset")) bench_charset();
+    if (want("bloom")) bench_bloom();
+    if (want("seen")) bench_seen();
+    if (want("resolve")) bench_resolve();
+    if (want("snapshot")) bench_snapshot();
+    if (want("lazy_parse")) bench_lazy_parse();
+    if (want("query")) bench_query();
+    if (want("restyle")) bench_restyle();
+    if (want("layout")) bench_layout();
+    if (want("raster")) bench_raster();
+    return 0;
+}
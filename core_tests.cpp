@@ -1,7 +1,43 @@
 #include "browser_core.h"
+#include "charset.h"
+#include "crawler.h"
+#include "fetch.h"
+#include "http_parser.h"
+#include "layout.h"
+#include "load_test.h"
+#include "paint.h"
+#include "pipeline.h"
+#include "prefetch.h"
+#include "snapshot.h"
+#include "style_engine.h"
+#include "test_server.h"
+#include "url.h"
 
+#include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <functional>
 #include <iostream>
+#include <optional>
+#include <set>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#ifdef ZEPHYR_HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#ifndef _WIN32
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
 
 int main() {
     UrlParts parts;
@@ -14,16 +50,57 @@ int main() {
 
     assert(resolve_url("https://example.com/a/b", "../c") == "https://example.com/c");
     assert(resolve_url("https://example.com/a/b", "javascript:alert(1)").empty());
+    assert(resolve_url("http://127.0.0.1:8080/a/b", "/c") == "http://127.0.0.1:8080/c");
+
+    {
+        browser::UrlView v;
+        assert(browser::UrlView::parse("HTTPS://Host:8443/p?q", v) && v.https && v.port == 8443 && v.host == "Host" && v.path == "/p?q");
+        assert(!browser::UrlView::parse("http://host:99999/", v) && !browser::UrlView::parse("http://host:8o/", v));
+        assert(!parse_url("http://host:x/", parts));
+
+        const browser::BaseUrl base("http://example.com:8080/docs/guide/index.html");
+        const std::vector<std::string_view> hrefs = {"../api/./x.html", " #top ", "//cdn.example.net/a.js", "VBScript:x", "/", "img/"};
+        browser::ResolvedUrls urls;
+        base.resolveAll(hrefs, urls);
+        assert(urls.size() == hrefs.size());
+        assert(urls[0] == "http://example.com:8080/docs/api/x.html");
+        assert(urls[1] == base.str());
+        assert(urls[2] == "http://cdn.example.net/a.js");
+        assert(urls[3].empty());
+        assert(urls[4] == "http://example.com:8080/");
+        assert(urls[5] == "http://example.com:8080/docs/guide/img/");
+        assert(resolve_url(base.str(), "../api/./x.html") == "http://example.com:8080/docs/api/x.html");
+        assert(resolve_url(base.str(), "img/") == "http://example.com:8080/docs/guide/img/");
+        assert(resolve_url("https://example.com:443/a/", "b/../c/") == "https://example.com/a/c/");
+        const size_t capacity_probe = urls.arenaBytes();
+        urls.clear();
+        assert(urls.size() == 0 && urls.arenaBytes() == 0 && capacity_probe > 0);
+    }
 
     const std::string html =
         "<html><head><style>p{padding:4px;} span{display:none;}</style></head>"
         "<body><h1>Hello</h1><p id='x' class='c'>World <a href='https://x'>link</a></p><span>hidden</span>"
         "<script>console.log('a')</script><script type='text/typescript'>let t:number=1;</script></body></html>";
 
-    SourceBundle src = extract_source_bundle(html);
-    assert(src.css.find("padding:4px") != std::string::npos);
-    assert(src.javascript.find("console.log") != std::string::npos);
-    assert(src.typescript.find("number") != std::string::npos);
+    const browser::SharedBuffer html_buffer(html);
+    SourceBundle src = extract_source_bundle(html_buffer);
+    assert(src.html.data() == html_buffer.data() && src.html.size() == html.size());
+    assert(src.css.size() == 1 && src.css[0].view().find("padding:4px") != std::string::npos);
+    assert(src.javascript.size() == 1 && src.javascript[0].body == "console.log('a')");
+    assert(src.typescript.size() == 1 && src.typescript[0].body.view().find("number") != std::string::npos);
+
+    {
+        const browser::SharedBuffer source("<p title='a &amp; b' id=x>fish &amp; chips</p><p>plain text</p>");
+        const browser::ElementPtr doc = browser::parse_html(source);
+        auto first = std::static_pointer_cast<browser::Element>(doc->children[0]);
+        auto second = std::static_pointer_cast<browser::Element>(doc->children[1]);
+        auto decoded = std::static_pointer_cast<browser::TextNode>(first->children[0]);
+        auto plain = std::static_pointer_cast<browser::TextNode>(second->children[0]);
+        assert(decoded->text == "fish & chips" && decoded->text.buffer().data() != source.data());
+        assert(plain->text == "plain text" && plain->text.data() == source.data() + source.view().find("plain"));
+        assert(first->getAttribute("title") == "a & b");
+        assert(first->getAttribute("id").data() == source.data() + source.view().find("x>"));
+    }
 
     std::string rendered = render_page_text(html, 80);
     assert(rendered.find("Hello") != std::string::npos);
@@ -37,6 +114,1194 @@ int main() {
     assert(!text.empty());
     assert(!links.empty());
 
+    {
+        struct Recorder : browser::HtmlVisitor {
+            std::string log;
+            void startTag(std::string_view name, const std::vector<browser::HtmlAttribute>& attributes, bool self_closing) override {
+                log += "<" + std::string(name);
+                for (const auto& a : attributes) log += " " + std::string(a.name) + (a.has_value ? "=" + std::string(a.value) : "");
+                log += self_closing ? "/>" : ">";
+            }
+            void endTag(std::string_view name) override { log += "</" + std::string(name) + ">"; }
+            void text(std::string_view text) override { log += "[" + std::string(text) + "]"; }
+            void comment(std::string_view text) override { log += "{" + std::string(text) + "}"; }
+            void rawText(std::string_view, std::string_view text) override { log += "(" + std::string(text) + ")"; }
+        } rec;
+        browser::tokenize_html("<DIV Class='x' hidden>a &amp; b<br><!--c--><Script>if (a<b) {}</SCRIPT></div>", rec);
+        assert(rec.log == "<div class=x hidden>[a &amp; b]<br/>{c}<script>(if (a<b) {})</script></div>");
+
+        extract_text_and_links("<abbr>x</abbr> <a href=' /one?a=1&amp;b=2 '>One <b>&amp;</b>\n two</a> <a name=n>anchor</a> "
+                               "<script>var s = '<a href=/bad>';</script><a href='javascript:x'>bad</a>",
+                               text, links);
+        assert(text == "x One & two anchor bad");
+        assert(links.size() == 1 && links[0].first == "One & two" && links[0].second == "/one?a=1&b=2");
+    }
+
+    {
+        const std::string page =
+            "<html><head><title>t</title><style>.hide { display: none } ul li.x { display: none }</style></head><body>"
+            "<h1>Stream &amp; render</h1><p>Some words that need wrapping across more than one line of output.</p>"
+            "<ul><li>one</li><li class='x'>gone</li><li>t<b>w</b>o <a href='/next'>next page</a></li></ul>"
+            "<div class='hide'>hidden <p>also hidden</p></div><!-- c --><script>var x = '</div>';</script>"
+            "<p>tail<br>end &copy; &#65;</p></body></html>";
+        const std::string expected = render_page_text(page, 24);
+        for (size_t chunk : {size_t(1), size_t(3), size_t(17), page.size()}) {
+            std::string out;
+            browser::TextRenderStream stream([&](std::string_view line) { out += std::string(line) + "\n"; }, 24);
+            for (size_t i = 0; i < page.size(); i += chunk) stream.feed(std::string_view(page).substr(i, chunk));
+            stream.finish();
+            assert(out == expected + "\n");
+        }
+
+        // A huge table never holds more than a row's worth of state, with or without the
+        // end tags HTML lets it omit.
+        for (const std::string cell_end : {"</td>", ""}) {
+            auto account = std::make_shared<browser::MemoryAccount>();
+            size_t lines = 0;
+            size_t max_buffered = 0;
+            size_t max_depth = 0;
+            {
+                browser::MemoryAccountScope scope(account);
+                browser::TextRenderStream stream([&](std::string_view) { ++lines; }, 80);
+                stream.feed("<html><body><table>");
+                std::string rows;
+                for (size_t i = 0; i < 20000; ++i) {
+                    rows += "<tr><td class='c'>row " + std::to_string(i) + cell_end + "<td>value &amp; more text" + cell_end + (cell_end.empty() ? "" : "</tr>");
+                    if (rows.size() >= 4000) {
+                        stream.feed(rows);
+                        rows.clear();
+                        max_buffered = std::max(max_buffered, stream.bufferedBytes());
+                        max_depth = std::max(max_depth, stream.depth());
+                    }
+                }
+                stream.feed(rows);
+                stream.finish();
+            }
+            assert(lines == 40000);
+            assert(max_buffered < 4096 && max_depth <= 6);
+#if ZEPHYR_METRICS
+            assert(account->snapshot().peak_bytes < 64 * 1024);
+#endif
+        }
+    }
+
+    {
+        const std::string page =
+            "<html><head><title>t</title><style>div.ad { display: none } #keep { display: block }</style></head><body>"
+            "<h1>Lazy &amp; render</h1><script>var s = '<div>'; document.write('</p>');</script>"
+            "<noscript><p>enable scripts</p></noscript><div class='ad'><div><p>ad <b>one</b></p></div><span class='x'>ad</span></div>"
+            "<div id='keep' class='ad'>kept <i>text</i></div><p style='color: red; DISPLAY:NONE'>inline <em>gone</em></p>"
+            "<p>tail</p><div class='ad'><p>unclosed <span class='x'>ad";
+        const std::string css = extract_style_blocks(page);
+        const browser::SharedBuffer source(page);
+        const browser::RenderContext eager = browser::parse_document(source, css);
+        const browser::RenderContext lazy = browser::parse_document(source, css, true);
+        for (size_t width : {size_t(12), size_t(80)}) assert(browser::render_text(lazy, width) == browser::render_text(eager, width));
+        assert(render_page_text(source, 80) == browser::render_text(eager, 80));
+        assert(lazy.document->indexedElements() == 12 && eager.document->indexedElements() == 22);
+        assert(lazy.document->getElementById("keep") && lazy.document->getElementsByClassName("x").empty());
+
+        // Deferred elements keep their attributes; materialize() builds what a full parse would.
+        const auto outline = [](const browser::NodePtr& node) {
+            std::function<std::string(const browser::NodePtr&)> walk = [&](const browser::NodePtr& n) {
+                if (n->type == browser::NodeType::TEXT) return "[" + std::string(static_cast<browser::TextNode&>(*n).text.view()) + "]";
+                const auto& el = static_cast<const browser::Element&>(*n);
+                std::string out = "<" + el.tag_name + " " + std::string(el.getAttribute("class")) + ">";
+                for (const auto& c : el.children) out += walk(c);
+                return out + "</>";
+            };
+            return walk(node);
+        };
+        // A snapshot holds the whole document whichever way it was parsed.
+        {
+            const browser::RenderContext deferred = browser::parse_document(source, css, true);
+            const browser::SharedBuffer full = browser::DomSnapshot::serialize(eager.document);
+            const browser::DomSnapshot frozen = browser::DomSnapshot::load(browser::DomSnapshot::serialize(deferred.document));
+            assert(frozen.nodeCount() == browser::DomSnapshot::load(full).nodeCount());
+            assert(outline(frozen.toDocument()) == outline(eager.document));
+            assert(!deferred.document->getElementsByTagName("script").at(0)->deferred());
+        }
+        const auto lazy_divs = lazy.document->getElementsByTagName("div");
+        const auto eager_divs = eager.document->getElementsByTagName("div");
+        assert(lazy_divs.size() == 3 && eager_divs.size() == 4);
+        assert(lazy_divs[0]->deferred() && lazy_divs[0]->children.empty() && !lazy_divs[1]->deferred());
+        const auto script = lazy.document->getElementsByTagName("script").at(0);
+        assert(script->deferred() && script->materialize() && !script->deferred() && !script->materialize());
+        assert(outline(script) == outline(eager.document->getElementsByTagName("script").at(0)));
+        for (const auto& el : lazy.document->getElementsByTagName("html")) {
+            std::function<void(const browser::ElementPtr&)> expand = [&](const browser::ElementPtr& e) {
+                e->materialize();
+                for (const auto& c : e->children) {
+                    if (c->type == browser::NodeType::ELEMENT) expand(std::static_pointer_cast<browser::Element>(c));
+                }
+            };
+            expand(el);
+        }
+        assert(outline(lazy.document) == outline(eager.document));
+        assert(lazy.document->indexedElements() == eager.document->indexedElements());
+        assert(lazy.document->getElementsByClassName("x").size() == 2);
+        assert(browser::render_text(lazy, 80) == browser::render_text(eager, 80));
+
+        // Tag offsets survive any chunking.
+        struct Spans : browser::HtmlVisitor {
+            const browser::HtmlTokenizer* tokenizer = nullptr;
+            std::vector<std::pair<size_t, size_t>> spans;
+            void startTag(std::string_view, const std::vector<browser::HtmlAttribute>&, bool) override { spans.emplace_back(tokenizer->tagBegin(), tokenizer->tagEnd()); }
+            void endTag(std::string_view) override { spans.emplace_back(tokenizer->tagBegin(), tokenizer->tagEnd()); }
+        };
+        std::vector<std::pair<size_t, size_t>> whole;
+        for (size_t chunk : {page.size(), size_t(1), size_t(7)}) {
+            Spans spans;
+            browser::HtmlTokenizer tokenizer(spans);
+            spans.tokenizer = &tokenizer;
+            for (size_t i = 0; i < page.size(); i += chunk) tokenizer.feed(std::string_view(page).substr(i, chunk));
+            tokenizer.finish();
+            if (whole.empty()) whole = spans.spans;
+            assert(spans.spans == whole);
+        }
+        assert(page.substr(whole[0].first, whole[0].second - whole[0].first) == "<html>");
+        const size_t script_close = page.find("</script>");
+        assert(std::count(whole.begin(), whole.end(), std::make_pair(script_close, script_close + 9)) == 1);
+    }
+
+    browser::PageMetrics metrics;
+    {
+        browser::MetricsScope scope(metrics);
+        render_page_text(html, 80);
+    }
+#if ZEPHYR_METRICS
+    assert(!metrics.events.empty());
+    assert(metrics.ms(browser::Phase::HTML_PARSE) > 0);
+    std::ostringstream trace;
+    browser::write_chrome_trace(metrics, trace);
+    assert(trace.str().find("\"html_parse\"") != std::string::npos);
+#endif
+    assert(!browser::active_metrics());
+
+    {
+        browser::StyleSheet sheet = browser::parse_css(
+            "p { color: red; padding: 1px 2px; } p.c { font-weight: bold; display: block } #x { color: #0000ff; margin: 3px }");
+        browser::RenderContext ctx = browser::parse_document("<p id='x' class='c'>t</p>");
+        auto p = std::static_pointer_cast<browser::Element>(ctx.document->children.at(0));
+        const browser::StyleProperties st = sheet.computeStyle(p);
+        assert(st.has(browser::Property::COLOR) && st.color.b == 255 && st.color.r == 0);
+        assert(st.padding_top == 1 && st.padding_right == 2 && st.padding_left == 2);
+        assert(st.margin_bottom == 3);
+        assert(st.font_weight == 700 && st.display == browser::Display::BLOCK);
+        assert(!st.has(browser::Property::WIDTH));
+
+        browser::StyleSheet nested = browser::parse_css(
+            "@import url('x.css');\n"
+            "a::before { content: \"}{;\" } /* } */\n"
+            "@media screen and (min-width: 10px) { h1 { display: none } @media print { h2 { display: none } } }\n"
+            "@font-face { font-family: x; src: url(x.woff) }\n"
+            "h3 { color: /* inline */ blue !important; }");
+        assert(nested.ruleCount() == 3);
+        auto h1 = browser::Element::create("h1");
+        auto h3 = browser::Element::create("h3");
+        assert(nested.computeStyle(h1).display == browser::Display::NONE);
+        assert(nested.computeStyle(h3).color.b == 255);
+        static_assert(sizeof(browser::StyleProperties) <= 32, "compiled style should stay compact");
+    }
+
+    {
+        browser::StyleSheetCache cache(1024 * 1024);
+        const std::string css = "p { color: red } .x { display: none }";
+        browser::StyleSheetPtr a = cache.get(css);
+        browser::StyleSheetPtr b = cache.get(std::string(css));
+        assert(a == b && a->ruleCount() == 2);
+        assert(cache.get("p { color: blue }") != a);
+        assert(cache.stats().hits == 1 && cache.stats().misses == 2);
+        cache.setCapacity(0);
+        assert(cache.stats().entries == 0 && cache.stats().evictions == 2);
+        assert(browser::parse_document("<p>x</p>", css).stylesheet == browser::parse_document("<b>y</b>", css).stylesheet);
+    }
+
+    {
+        const browser::DocumentPtr doc = browser::parse_html(browser::SharedBuffer(
+            "<div id='main' class='card wide card'><p class='note'>a</p><section><p id='x' class='note wide'>b</p></section></div>"
+            "<p>c</p><span class='wide'>d</span>"));
+        assert(doc->getElementById("main")->tag_name == "div" && !doc->getElementById("none"));
+        assert(doc->getElementsByTagName("P").size() == 3 && doc->getElementsByClassName("wide").size() == 3);
+        assert(doc->getElementsByClassName("card").size() == 1);
+
+        const auto brute = [&](const std::string& selectors) {
+            std::vector<browser::ElementPtr> out;
+            const std::vector<browser::Selector> list = browser::parse_selector_list(selectors);
+            std::function<void(const browser::ElementPtr&)> walk = [&](const browser::ElementPtr& el) {
+                for (const auto& child : el->children) {
+                    if (child->type != browser::NodeType::ELEMENT) continue;
+                    auto c = std::static_pointer_cast<browser::Element>(child);
+                    for (const auto& s : list) {
+                        if (browser::selector_matches(s, *c)) {
+                            out.push_back(c);
+                            break;
+                        }
+                    }
+                    walk(c);
+                }
+            };
+            walk(doc);
+            return out;
+        };
+        for (const std::string q : {"p", ".note", "p.note.wide", "#x", "div p", "section", ".wide, p", "#main .note", "li", ".none, span"}) {
+            assert(doc->querySelectorAll(q) == brute(q));
+        }
+        assert(doc->querySelector(".wide, p") == doc->getElementById("main") && !doc->querySelector("li"));
+
+        // Mutations keep the indexes current, and out-of-order inserts still come back in document order.
+        auto main = doc->getElementById("main");
+        main->setAttribute("id", "primary");
+        assert(!doc->getElementById("main") && doc->getElementById("primary") == main);
+        main->setAttribute("class", "plain");
+        assert(doc->getElementsByClassName("card").empty() && doc->getElementsByClassName("wide").size() == 2);
+        auto first = browser::Element::create("p");
+        first->setAttribute("class", "note");
+        auto early = browser::Element::create("em");
+        early->appendChild(first);
+        doc->getElementById("x")->appendChild(browser::Element::create("b"));
+        main->appendChild(early);
+        assert(first->ownerDocument() == doc.get() && doc->querySelectorAll(".note") == brute(".note"));
+        const size_t before = doc->indexedElements();
+        assert(main->removeChild(early) && !first->ownerDocument() && doc->indexedElements() == before - 2);
+        assert(!main->removeChild(early) && doc->querySelectorAll("em, .note") == brute("em, .note"));
+        const auto copy = std::dynamic_pointer_cast<browser::Document>(browser::DomSnapshot::load(browser::DomSnapshot::serialize(doc)).toDocument());
+        assert(copy && copy->getElementById("x") && copy->querySelectorAll("p").size() == 3);
+    }
+
+    {
+        const browser::DocumentPtr doc = browser::parse_html(browser::SharedBuffer(
+            "<div id='a' class='box'><p class='x'>one</p><p>two</p></div><section><p id='b' class='plain'>three</p></section>"));
+        const auto sheet = std::make_shared<const browser::StyleSheet>(
+            browser::parse_css(".hot { display: none } #b { color: red } section p.big { padding: 3px } div p { margin: 1px }"));
+        browser::StyleEngine engine(doc, sheet);
+        const auto consistent = [&] {
+            size_t elements = 0;
+            std::function<void(const browser::Element&)> walk = [&](const browser::Element& el) {
+                ++elements;
+                const auto it = engine.styles().find(&el);
+                assert(it != engine.styles().end());
+                const browser::StyleProperties fresh = sheet->computeStyle(el);
+                assert(it->second.mask == fresh.mask && it->second.display == fresh.display && it->second.padding_top == fresh.padding_top);
+                for (const auto& c : el.children) {
+                    if (c->type == browser::NodeType::ELEMENT) walk(static_cast<const browser::Element&>(*c));
+                }
+            };
+            walk(*doc);
+            return elements == engine.styles().size();
+        };
+        assert(consistent() && !doc->styleDirty());
+
+        // Classes and ids no rule mentions restyle nothing; the rest restyle only their element.
+        auto b = doc->getElementById("b");
+        b->setAttribute("class", "plain other");
+        b->setAttribute("title", "t");
+        assert(!doc->styleDirty() && engine.restyle() == 0);
+        b->setAttribute("class", "other big");
+        doc->getElementById("a")->setAttribute("class", "box hot");
+        assert(b->styleDirty() && engine.restyle() == 2 && consistent());
+        b->setAttribute("id", "c");
+        assert(engine.restyle() == 1 && consistent());
+
+        // Inserted subtrees are styled, removed ones dropped.
+        auto extra = browser::Element::create("div");
+        extra->appendChild(browser::Element::create("p"));
+        extra->appendChild(browser::Element::create("span"));
+        doc->getElementById("a")->appendChild(extra);
+        assert(engine.restyle() == 3 && consistent());
+        assert(doc->removeChild(doc->children[1]) && engine.restyle() == 0 && consistent());
+    }
+
+    {
+        const browser::DocumentPtr doc = browser::parse_html(browser::SharedBuffer("<div id='x'><p class='a'>one</p><p>two</p></div><span class='a'>three</span>"));
+        const auto sheet = std::make_shared<const browser::StyleSheet>(browser::parse_css("div p { color: red } .a { color: blue } #x { color: green } section * { color: black }"));
+        const auto other = std::make_shared<const browser::StyleSheet>(browser::parse_css("p { color: red }"));
+        browser::SelectorProfile profile(sheet);
+        {
+            browser::SelectorProfileScope scope(profile);
+            browser::StyleEngine engine(doc, sheet);
+            browser::StyleEngine(doc, other).styles();
+        }
+        browser::StyleEngine(doc, sheet).styles();  // not profiled outside the scope
+
+        const size_t elements = profile.elements();
+        assert(elements == doc->indexedElements() + 1);  // the document node too
+        const std::vector<browser::RuleProfile> report = profile.report();
+        assert(report.size() == 4);
+        for (size_t i = 0; i < report.size(); ++i) {
+            assert(report[i].attempts == elements);
+            assert(i == 0 || report[i - 1].milliseconds >= report[i].milliseconds);
+            const size_t expected[] = {2, 2, 1, 0};
+            assert(report[i].matches == expected[report[i].rule]);
+        }
+        const auto descendant = std::find_if(report.begin(), report.end(), [](const browser::RuleProfile& r) { return r.rule == 3; });
+        assert(descendant->selector == "section *");
+
+        std::ostringstream out;
+        profile.write(out, 2);
+        const std::string table = out.str();
+        assert(table.find("4 rules") != std::string::npos && std::count(table.begin(), table.end(), '\n') == 4);
+        profile.reset();
+        assert(profile.elements() == 0 && profile.report()[0].attempts == 0);
+    }
+
+    {
+        const std::string page =
+            "<html><head><title>t</title></head><body><h1>Title here</h1><div class='pad'><p>Some words that wrap across lines "
+            "in a narrow box</p><p>second <b>bold</b> para<br>after break</p></div><ul><li id='item'>one</li><li>two</li></ul>"
+            "<p class='gone'>hidden</p></body></html>";
+        const auto sheet = std::make_shared<const browser::StyleSheet>(
+            browser::parse_css(".pad { padding: 10px; margin: 4px } .gone { display: none } .big { font-size: 32px } .wide { width: 100px }"));
+        const browser::DocumentPtr doc = browser::parse_html(browser::SharedBuffer(page));
+        browser::StyleEngine styles(doc, sheet);
+        browser::LayoutEngine layout(styles);
+
+        const browser::LayoutBox& root = layout.layout(200);
+        assert(layout.lastStats().full && root.width == 200);
+        const browser::LayoutBox& body = *root.children[0]->children[0];
+        assert(body.children.size() == 3);
+        const browser::LayoutBox& h1 = *body.children[0];
+        const browser::LayoutBox& pad = *body.children[1];
+        assert(h1.style.font_size == 32 && h1.style.font_weight == 700);
+        assert(pad.x == 4 && pad.y == h1.height + 4 && pad.width == 192);
+        assert(pad.children[0]->x == 10 && pad.children[0]->width == 172 && pad.children[0]->children.size() > 1);
+        const browser::LayoutBox& second = *pad.children[1];
+        assert(second.children.size() == 2 && second.children[0]->children.size() == 3);
+        assert(second.children[0]->children[1]->text == "bold" && second.children[0]->children[1]->style.font_weight == 700);
+        assert(body.height == body.children[2]->y + body.children[2]->height);
+
+        // Reused when nothing changed; a narrower viewport reflows everything.
+        layout.layout(200);
+        assert(layout.lastStats().blocks_laid_out == 0 && layout.lastStats().blocks_reused == 1);
+        layout.layout(120);
+        assert(layout.lastStats().full && layout.lastStats().measure_misses == 0);
+
+        // One changed element relays out its block and the path above it, nothing else.
+        doc->getElementById("item")->setAttribute("class", "big");
+        layout.layout(120);
+        assert(!layout.lastStats().full && layout.lastStats().blocks_laid_out == 5);
+        std::function<void(const browser::LayoutBox&, const browser::LayoutBox&)> same = [&](const browser::LayoutBox& a, const browser::LayoutBox& b) {
+            assert(a.kind == b.kind && a.x == b.x && a.y == b.y && a.width == b.width && a.height == b.height && a.text == b.text);
+            assert(a.children.size() == b.children.size());
+            for (size_t i = 0; i < a.children.size(); ++i) same(*a.children[i], *b.children[i]);
+        };
+        const auto fresh_layout = [&] {
+            const auto copy = std::dynamic_pointer_cast<browser::Document>(browser::DomSnapshot::load(browser::DomSnapshot::serialize(doc)).toDocument());
+            browser::StyleEngine copy_styles(copy, sheet);
+            browser::LayoutEngine copy_layout(copy_styles);
+            same(*layout.root(), copy_layout.layout(120));
+        };
+        fresh_layout();
+
+        auto extra = browser::Element::create("p");
+        extra->appendChild(browser::TextNode::create("appended words"));
+        doc->getElementById("item")->parent.lock()->appendChild(extra);
+        doc->getElementById("item")->parent.lock()->setAttribute("class", "wide");
+        layout.layout(120);
+        assert(layout.lastStats().blocks_reused > 0);
+        fresh_layout();
+    }
+
+    {
+        const std::string page =
+            "<html><body><h1>Heading</h1><p>Plain <a href='/x'>link text</a> here</p><ul><li>first</li><li>second</li></ul>"
+            "<table border='1'><tr><td>cell</td></tr></table><p class='hide'>invisible</p><p id='last'>last line</p></body></html>";
+        const auto sheet = std::make_shared<const browser::StyleSheet>(
+            browser::parse_css(".hide { visibility: hidden } .red { color: red } table, tr { display: block }"));
+        const browser::DocumentPtr doc = browser::parse_html(browser::SharedBuffer(page));
+        browser::StyleEngine styles(doc, sheet);
+        browser::LayoutEngine layout(styles);
+
+        browser::DisplayList list = browser::build_display_list(layout.layout(400));
+        size_t texts = 0, rects = 0, borders = 0;
+        const browser::DisplayItem* heading = nullptr;
+        for (const auto& item : list.items) {
+            texts += item.type == browser::DisplayItem::Type::TEXT;
+            rects += item.type == browser::DisplayItem::Type::RECT;
+            borders += item.type == browser::DisplayItem::Type::BORDER;
+            assert(item.text != "invisible");
+            if (item.text == "Heading") heading = &item;
+        }
+        assert(texts == 8 && rects == 3 && borders == 2);
+        assert(heading && heading->bold && heading->font_size == 32);
+
+        browser::TileRasterizer raster(0);
+        const browser::Image& image = raster.render(list, 400, 300);
+        assert(image.width == 400 && image.height == 300 && image.rgba.size() == 400u * 300 * 4);
+        assert(raster.lastStats().tiles == 7u * 5 && raster.lastStats().painted == 35);
+        const auto pixel = [&](int32_t x, int32_t y) { return image.rgba[(static_cast<size_t>(y) * image.width + x) * 4]; };
+        bool inked = false;
+        for (int32_t x = heading->x; x < heading->x + heading->width; ++x) inked |= pixel(x, heading->y + heading->height / 2) == 0;
+        assert(inked && pixel(399, 299) == 255);
+
+        // Unchanged frames keep every tile; a recolored paragraph repaints only its own.
+        raster.render(list, 400, 300);
+        assert(raster.lastStats().painted == 0 && raster.lastStats().reused == 35);
+        doc->getElementById("last")->setAttribute("class", "red");
+        list = browser::build_display_list(layout.layout(400));
+        raster.render(list, 400, 300);
+        assert(raster.lastStats().painted > 0 && raster.lastStats().painted <= 4);
+
+        browser::TileRasterizer threaded(2);
+        assert(threaded.render(list, 400, 300).rgba == image.rgba);
+        raster.render(list, 400, 300, 40);
+        assert(raster.lastStats().painted == 35 && threaded.render(list, 400, 300, 40).rgba == image.rgba);
+
+        const std::string png = browser::encode_png(image);
+        assert(png.compare(0, 8, "\x89PNG\r\n\x1a\n") == 0 && png.compare(png.size() - 8, 4, "IEND") == 0);
+        assert(png.size() > image.rgba.size());
+        const std::string ppm = browser::encode_ppm(image);
+        assert(ppm.compare(0, 15, "P6\n400 300\n255\n") == 0 && ppm.size() == 15 + 400u * 300 * 3);
+    }
+
+    {
+        const browser::SharedBuffer source(
+            "<div id='main' class='a b'><p class='a'>one &amp; two</p><!-- gone --><ul><li>x</li><li title='t'>y</li></ul></div><p>tail</p>");
+        const browser::ElementPtr doc = browser::parse_html(source);
+        const browser::StyleSheet sheet = browser::parse_css("p { color: red } div p.a { font-weight: bold } #main { display: block } li { margin: 2px } .b { width: 10px }");
+        const browser::SharedBuffer bytes = browser::DomSnapshot::serialize(doc, &sheet);
+        const browser::DomSnapshot snap = browser::DomSnapshot::load(bytes);
+        assert(snap.ruleCount() == sheet.ruleCount());
+
+        std::function<void(const browser::NodePtr&, const browser::DomSnapshot::Node&)> same = [&](const browser::NodePtr& live, const browser::DomSnapshot::Node& frozen) {
+            assert(live->type == frozen.type());
+            if (live->type == browser::NodeType::TEXT) {
+                assert(std::static_pointer_cast<browser::TextNode>(live)->text == frozen.text());
+                return;
+            }
+            auto el = std::static_pointer_cast<browser::Element>(live);
+            assert(el->tag_name == frozen.tagName() && el->attributes.size() == frozen.attributeCount());
+            for (const auto& [name, value] : el->attributes) assert(frozen.getAttribute(name) == value.view());
+            const browser::StyleProperties a = sheet.computeStyle(el);
+            const browser::StyleProperties b = snap.computeStyle(frozen);
+            assert(std::memcmp(&a, &b, sizeof(a)) == 0);
+            size_t c = 0;
+            for (const auto& child : el->children) {
+                if (child->type != browser::NodeType::COMMENT) same(child, frozen.child(c++));
+            }
+            assert(c == frozen.childCount());
+        };
+        same(doc, snap.root());
+        assert(snap.root().child(0).child(0).child(0).text() == "one & two");
+        assert(snap.root().child(0).child(1).child(1).parent().tagName() == "ul");
+
+        // Rebuilding and snapshotting again reproduces the same bytes.
+        const browser::StyleSheet restored = snap.toStyleSheet();
+        assert(browser::DomSnapshot::serialize(snap.toDocument(), &restored) == bytes.view());
+
+        const std::string path = "core_tests_snapshot.bin";
+        browser::DomSnapshot::write(path, bytes);
+        {
+            const browser::DomSnapshot mapped = browser::DomSnapshot::map(path);
+            assert(mapped.sizeBytes() == bytes.size() && mapped.nodeCount() == snap.nodeCount());
+            assert(mapped.root().child(1).child(0).text() == "tail");
+        }
+        std::remove(path.c_str());
+
+        const auto rejects = [](std::string raw) {
+            try {
+                browser::DomSnapshot::load(browser::SharedBuffer(std::move(raw)));
+            } catch (const std::runtime_error&) {
+                return true;
+            }
+            return false;
+        };
+        std::string bad = bytes.bytes();
+        bad[0] = 'X';
+        assert(rejects(bad));
+        assert(rejects(bytes.bytes().substr(0, bytes.size() - 1)));
+        assert(rejects(""));
+    }
+
+    {
+        const std::string page =
+            "<html><head><base href='/site/'><link rel='stylesheet' href='a.css'><style>.b { display: none }</style>"
+            "<link rel=stylesheet href='https://cdn.example/c.css'><link rel='stylesheet' media='print' href='p.css'>"
+            "<script src='app.js'></script></head>"
+            "<body><p class='a'>one</p><p class='b'>two</p><p class='c'>three</p><p>four</p></body></html>";
+        browser::PreloadScan scan = browser::scan_subresources(page, "https://example.com/index.html");
+        assert(scan.subresources.size() == 3);
+        assert(scan.subresources[0].url == "https://example.com/site/a.css");
+        assert(scan.styles.size() == 3 && scan.styles[1].subresource == -1);
+
+        std::atomic<int> in_flight{0};
+        std::atomic<int> max_in_flight{0};
+        browser::LoadOptions options;
+        options.fetcher = [&](const std::string& url) {
+            const int now = ++in_flight;
+            int seen = max_in_flight.load();
+            while (now > seen && !max_in_flight.compare_exchange_weak(seen, now)) {
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(30));
+            --in_flight;
+            HttpResponse r;
+            r.status_line = "HTTP/1.1 200 OK";
+            if (url.find("a.css") != std::string::npos) r.body = ".a { display: none }";
+            else if (url.find("c.css") != std::string::npos) r.body = ".c { display: none } .b { display: block }";
+            return r;
+        };
+        const std::string text = render_page_text(page, "https://example.com/index.html", 80, options);
+        assert(text.find("one") == std::string::npos);
+        assert(text.find("two") != std::string::npos);
+        assert(text.find("three") == std::string::npos);
+        assert(text.find("four") != std::string::npos);
+        assert(max_in_flight.load() > 1);
+
+        // Fetch threads charge and time the page that started them.
+        options.fetcher = [](const std::string&) {
+            browser::ScopedPhase download(browser::Phase::DOWNLOAD);
+            HttpResponse r;
+            r.status_line = "HTTP/1.1 200 OK";
+            r.body = browser::SharedBuffer(std::string(64 * 1024, ' '));
+            return r;
+        };
+        auto account = std::make_shared<browser::MemoryAccount>();
+        browser::PageMetrics page_metrics;
+        {
+            browser::MemoryAccountScope accounted(account);
+            browser::MetricsScope timed(page_metrics);
+            const browser::RenderContext ctx = browser::load_document(page, "https://example.com/index.html", options);
+            assert(ctx.subresources.size() == 3);
+#if ZEPHYR_METRICS
+            assert(ctx.memory == account);
+            assert(account->snapshot()[browser::MemoryCategory::RESPONSE_BODY].current_bytes >= 3 * 64 * 1024);
+#endif
+        }
+#if ZEPHYR_METRICS
+        assert(std::count_if(page_metrics.events.begin(), page_metrics.events.end(), [](const browser::TraceEvent& e) { return e.phase == browser::Phase::DOWNLOAD; }) == 3);
+        assert(page_metrics.ms(browser::Phase::DOWNLOAD) > 0 && page_metrics.ms(browser::Phase::HTML_PARSE) > 0);
+#endif
+    }
+
+    {
+        browser::PipelineOptions options;
+        options.fetch_workers = 4;
+        options.cpu_workers = 2;
+        options.queue_capacity = 2;
+        options.fetch_subresources = false;
+        options.fetcher = [](const std::string& url) {
+            if (url.find("bad") != std::string::npos) throw std::runtime_error("unreachable");
+            HttpResponse r;
+            r.status_line = "HTTP/1.1 200 OK";
+            r.body = "<style>.x{display:none}</style><p>page " + url + "</p><p class='x'>secret</p>";
+            return r;
+        };
+        std::vector<browser::PageResult> results;
+        browser::PagePipeline pipeline(options, [&](browser::PageResult&& r) { results.push_back(std::move(r)); });
+        for (int i = 0; i < 20; ++i) pipeline.submit(i == 7 ? "bad" : "u" + std::to_string(i));
+        pipeline.finish();
+        assert(results.size() == 20);
+        for (const auto& r : results) {
+            if (r.url == "bad") {
+                assert(!r.ok && r.error == "unreachable");
+                continue;
+            }
+            assert(r.ok && r.text == "page " + r.url);
+        }
+        const auto stats = pipeline.stats();
+        assert(stats[0].processed == 20 && stats[3].processed == 19);
+        for (const auto& st : stats) assert(st.max_queue_depth <= options.queue_capacity && st.queue_depth == 0);
+
+        // The --batch records: every input once, indexed by submission order whatever the
+        // completion order.
+        std::set<size_t> indices;
+        for (const auto& r : results) {
+            assert(indices.insert(r.index).second && r.url == (r.index == 7 ? "bad" : "u" + std::to_string(r.index)));
+            const std::string line = browser::page_result_json(r, false);
+            assert(line.rfind("{\"index\":" + std::to_string(r.index) + ",\"input\":\"" + r.url + "\",\"status\":", 0) == 0);
+            assert(line.back() == '}' && line.find('\n') == std::string::npos && line.find("\"text\"") == std::string::npos);
+            assert(line.find("\"phases_ms\":{\"dns\":") != std::string::npos);
+            if (r.index == 7) assert(line.find("\"status\":\"error\",\"error\":\"unreachable\"") != std::string::npos);
+            else assert(line.find("\"status\":\"ok\",\"http_status\":\"HTTP/1.1 200 OK\"") != std::string::npos);
+        }
+        assert(indices.size() == 20 && *indices.rbegin() == 19);
+        browser::PageResult quoted;
+        quoted.ok = true;
+        quoted.url = "a\\b";
+        quoted.text = "say \"hi\"\n\x01";
+        const std::string line = browser::page_result_json(quoted);
+        assert(line.find("\"input\":\"a\\\\b\"") != std::string::npos);
+        assert(line.find("\"text\":\"say \\\"hi\\\"\\n\\u0001\"}") != std::string::npos);
+
+        // External sheets are fetched on the fetch threads once the parse has found them.
+        options.fetch_subresources = true;
+        options.fetcher = [](const std::string& url) {
+            HttpResponse r;
+            r.status_line = "HTTP/1.1 200 OK";
+            if (url.find(".css") != std::string::npos) r.body = ".x{display:none}";
+            else r.body = "<link rel=stylesheet href='/site.css'><p>page</p><p class='x'>secret</p>";
+            return r;
+        };
+        std::vector<browser::PageResult> styled;
+        browser::PagePipeline with_sheets(options, [&](browser::PageResult&& r) { styled.push_back(std::move(r)); });
+        for (int i = 0; i < 8; ++i) with_sheets.submit("https://example.com/p" + std::to_string(i));
+        with_sheets.finish();
+        assert(styled.size() == 8);
+        for (const auto& r : styled) assert(r.ok && r.text == "page");
+        for (const auto& st : with_sheets.stats()) assert(st.max_queue_depth <= options.queue_capacity && st.queue_depth == 0);
+        bool rejected = false;
+        try {
+            with_sheets.submit("https://example.com/late");
+        } catch (const std::logic_error&) {
+            rejected = true;
+        }
+        assert(rejected);
+        assert(browser::json_escape("a\"b\\c\td") == "a\\\"b\\\\c\\td");
+    }
+
+    {
+        HttpResponse resp;
+        browser::HttpResponseParser parser(resp, 1024);
+        const std::string wire = "HTTP/1.1 100 Continue\r\n\r\nHTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\nX-Test: a b \r\n\r\n"
+                                 "5;ext\r\nhello\r\n6\r\n world\r\n0\r\n\r\n";
+        for (char c : wire) assert(parser.feed(&c, 1));
+        assert(parser.done() && parser.statusCode() == 200 && parser.takeBody() == "hello world" && resp.headers["x-test"] == "a b");
+
+        HttpResponse big;
+        browser::HttpResponseParser limited(big, 4);
+        assert(!limited.feed("HTTP/1.0 200 OK\r\n\r\n12345", 24) && limited.failed());
+
+        HttpResponse cut;
+        browser::HttpResponseParser truncated(cut, 1024);
+        assert(truncated.feed("HTTP/1.1 200 OK\r\nContent-Length: 10\r\n\r\nabc", 43) && !truncated.done());
+        truncated.finishEof();
+        assert(truncated.failed());
+    }
+
+    {
+        const auto respond = [](const std::string& coding, const std::string& body) {
+            return "HTTP/1.1 200 OK\r\nContent-Encoding: " + coding + "\r\nContent-Length: " + std::to_string(body.size()) + "\r\n\r\n" + body;
+        };
+        HttpResponse odd;
+        browser::HttpResponseParser unsupported(odd, 1024);
+        const std::string compress = respond("compress", "x");
+        assert(!unsupported.feed(compress.data(), compress.size()) && unsupported.error() == "unsupported Content-Encoding: compress");
+#ifdef ZEPHYR_HAVE_ZLIB
+        const auto deflate_with = [](const std::string& data, int window_bits) {
+            z_stream zs{};
+            deflateInit2(&zs, Z_BEST_COMPRESSION, Z_DEFLATED, window_bits, 8, Z_DEFAULT_STRATEGY);
+            std::string out(deflateBound(&zs, static_cast<uLong>(data.size())), '\0');
+            zs.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data.data()));
+            zs.avail_in = static_cast<uInt>(data.size());
+            zs.next_out = reinterpret_cast<Bytef*>(&out[0]);
+            zs.avail_out = static_cast<uInt>(out.size());
+            deflate(&zs, Z_FINISH);
+            out.resize(zs.total_out);
+            deflateEnd(&zs);
+            return out;
+        };
+        std::string page;
+        for (int i = 0; i < 2000; ++i) page += "<p>item " + std::to_string(i) + "</p>\n";
+        // gzip, zlib-wrapped deflate and the raw deflate some servers send, a byte at a time.
+        const std::vector<std::pair<std::string, int>> codings = {{"gzip", 16 + MAX_WBITS}, {"deflate", MAX_WBITS}, {"Deflate", -MAX_WBITS}};
+        for (const auto& [coding, bits] : codings) {
+            const std::string wire = respond(coding, deflate_with(page, bits));
+            HttpResponse resp;
+            browser::HttpResponseParser parser(resp, page.size());
+            for (char c : wire) assert(parser.feed(&c, 1));
+            assert(parser.done() && parser.expectedBytes() == 0 && parser.takeBody() == page && resp.headers["content-encoding"] == coding);
+        }
+
+        // Chunk boundaries need not line up with the compressed stream.
+        const std::string gz = deflate_with(page, 16 + MAX_WBITS);
+        std::string chunked = "HTTP/1.1 200 OK\r\nContent-Encoding: gzip\r\nTransfer-Encoding: chunked\r\n\r\n";
+        for (size_t i = 0; i < gz.size(); i += 777) {
+            const std::string part = gz.substr(i, 777);
+            char size[16];
+            std::snprintf(size, sizeof(size), "%zx\r\n", part.size());
+            chunked += size + part + "\r\n";
+        }
+        chunked += "0\r\n\r\n";
+        HttpResponse resp;
+        browser::HttpResponseParser parser(resp, 1 << 20);
+        assert(parser.feed(chunked.data(), chunked.size()) && parser.done() && parser.bodyBytes() == page.size());
+
+        // The limit is on the decoded size: 8 MB of zeros gzips to a few KB.
+        const std::string bomb = respond("gzip", deflate_with(std::string(8 << 20, '\0'), 16 + MAX_WBITS));
+        assert(bomb.size() < 16 * 1024);
+        HttpResponse boom;
+        browser::HttpResponseParser guarded(boom, 1 << 20);
+        assert(!guarded.feed(bomb.data(), bomb.size()) && guarded.error() == "decoded response body exceeds 1048576 bytes");
+        assert(guarded.bodyBytes() <= (1 << 20));
+
+        // Framing that ends before the compressed stream does is an error, as is garbage.
+        HttpResponse cut;
+        browser::HttpResponseParser truncated(cut, 1 << 20);
+        const std::string half = respond("gzip", gz.substr(0, gz.size() / 2));
+        assert(!truncated.feed(half.data(), half.size()) && truncated.error() == "encoded response body ended early");
+        HttpResponse junk;
+        browser::HttpResponseParser corrupt(junk, 1 << 20);
+        const std::string garbage = respond("gzip", "not gzip at all");
+        assert(!corrupt.feed(garbage.data(), garbage.size()) && corrupt.error().rfind("corrupt gzip body", 0) == 0);
+
+        // An empty body is complete even though no stream was sent.
+        for (const std::string& empty : {respond("gzip", ""), std::string("HTTP/1.1 200 OK\r\nContent-Encoding: gzip\r\nTransfer-Encoding: chunked\r\n\r\n0\r\n\r\n")}) {
+            HttpResponse none;
+            browser::HttpResponseParser nothing(none, 1024);
+            assert(nothing.feed(empty.data(), empty.size()) && nothing.done() && nothing.bodyBytes() == 0);
+        }
+
+        // Concatenated gzip members decode to the concatenation, even split a byte at a time.
+        const std::string members = respond("gzip", deflate_with("first ", 16 + MAX_WBITS) + deflate_with("second", 16 + MAX_WBITS));
+        for (size_t chunk : {size_t(1), members.size()}) {
+            HttpResponse both;
+            browser::HttpResponseParser joined(both, 1024);
+            for (size_t i = 0; i < members.size(); i += chunk) assert(joined.feed(members.data() + i, std::min(chunk, members.size() - i)));
+            assert(joined.done() && joined.takeBody() == "first second");
+        }
+
+        // Raw deflate opening with a stored block looks like a zlib header by its first byte
+        // alone; the header checksum tells them apart.
+        const std::string stored = respond("deflate", std::string("\x08\x05\x00\xfa\xffhello\x01\x00\x00\xff\xff", 15));
+        for (size_t chunk : {size_t(1), stored.size()}) {
+            HttpResponse raw;
+            browser::HttpResponseParser inflated(raw, 1024);
+            for (size_t i = 0; i < stored.size(); i += chunk) assert(inflated.feed(stored.data() + i, std::min(chunk, stored.size() - i)));
+            assert(inflated.done() && inflated.takeBody() == "hello");
+        }
+#endif
+#ifdef ZEPHYR_HAVE_BROTLI
+        const std::string br("\x1b\x76\x00\xf8\x9d\x09\x36\x2e\xa8\x77\xc7\x78\xc9\x23\x06\x57\x20\x74\xe5\x23\x97\x69\x6c\x6f\x25\x48\x80\x95\x00\x32\x19\xd6\x07\x1f", 34);
+        std::string expected = "<p>";
+        for (int i = 0; i < 16; ++i) expected += "brotli ";
+        expected += "</p>";
+        const std::string wire = respond("br", br);
+        HttpResponse brotli;
+        browser::HttpResponseParser decoded(brotli, 1024);
+        for (char c : wire) assert(decoded.feed(&c, 1));
+        assert(decoded.done() && decoded.takeBody() == expected);
+        HttpResponse small;
+        browser::HttpResponseParser capped(small, 64);
+        assert(!capped.feed(wire.data(), wire.size()) && capped.error() == "decoded response body exceeds 64 bytes");
+#endif
+    }
+
+    {
+        assert(browser::sniff_charset("\xEF\xBB\xBFhi").source == browser::CharsetSource::BOM && browser::sniff_charset("\xEF\xBB\xBFhi").bom_length == 3);
+        assert(browser::sniff_charset("\xFE\xFF\0h", "text/html; charset=utf-8").charset == browser::Charset::UTF16BE);
+        const browser::CharsetSniff header = browser::sniff_charset("<meta charset=utf-8>", "text/html; Charset=\"ISO-8859-1\"");
+        assert(header.charset == browser::Charset::WINDOWS_1252 && header.source == browser::CharsetSource::HEADER);
+        const browser::CharsetSniff meta = browser::sniff_charset("<html><head><META http-equiv='Content-Type' content='text/html; charset=latin1'>");
+        assert(meta.charset == browser::Charset::WINDOWS_1252 && meta.source == browser::CharsetSource::META);
+        assert(browser::sniff_charset("<meta charset='utf-16'>").charset == browser::Charset::UTF8);
+        assert(browser::sniff_charset("<p>plain", "text/html; charset=klingon").source == browser::CharsetSource::DEFAULT);
+
+        const std::string mixed = std::string(40, 'a') + "caf\xC3\xA9 \xE2\x82\xAC \xF0\x9F\x98\x80" + std::string(40, 'b');
+        assert(browser::is_valid_utf8(mixed) && browser::is_valid_utf8(""));
+        for (const char* bad : {"\xC0\x80", "\xED\xA0\x80", "\xF4\x90\x80\x80", "\xE2\x82", "\x80", "\xF8\x88\x80\x80\x80"}) {
+            assert(!browser::is_valid_utf8(std::string(20, 'x') + bad));
+        }
+
+        // Valid UTF-8 is passed through without a copy; undeclared legacy bytes are windows-1252.
+        const browser::SharedBuffer utf8(mixed);
+        assert(browser::decode_to_utf8(utf8).data() == utf8.data());
+        browser::CharsetSniff detected;
+        assert(browser::decode_to_utf8(browser::SharedBuffer("caf\xE9 \x80 \x93q\x94"), {}, &detected) == "caf\xC3\xA9 \xE2\x82\xAC \xE2\x80\x9Cq\xE2\x80\x9D");
+        assert(detected.charset == browser::Charset::WINDOWS_1252 && detected.source == browser::CharsetSource::DEFAULT);
+        assert(browser::decode_to_utf8(browser::SharedBuffer("a\xFF" "b"), "text/html; charset=utf-8") == "a\xEF\xBF\xBD" "b");
+        assert(browser::decode_to_utf8(browser::SharedBuffer("\xEF\xBB\xBFok")) == "ok");
+        HttpResponse latin;
+        latin.headers["content-type"] = "text/html; charset=iso-8859-1";
+        latin.body = browser::SharedBuffer("<p>na\xEFve</p>");
+        assert(render_page_text(browser::decode_response_body(latin)).find("na\xC3\xAFve") != std::string::npos);
+
+        // Chunk boundaries anywhere give the same output as one pass.
+        const auto chunked = [](browser::Charset charset, const std::string& bytes, size_t step) {
+            browser::Utf8Decoder decoder(charset);
+            std::string out;
+            for (size_t i = 0; i < bytes.size(); i += step) decoder.decode(std::string_view(bytes).substr(i, step), out);
+            decoder.finish(out);
+            return out;
+        };
+        const std::string messy = mixed + "\xE2\x82" "A\xC3" "\xF0\x9F\x98";
+        const std::string whole = chunked(browser::Charset::UTF8, messy, messy.size());
+        assert(whole == mixed + "\xEF\xBF\xBD" "A\xEF\xBF\xBD\xEF\xBF\xBD" && browser::is_valid_utf8(whole));
+        for (size_t step = 1; step < 8; ++step) assert(chunked(browser::Charset::UTF8, messy, step) == whole);
+        const std::string utf16("h\0\xE9\0=\xD8\0\xDE\0\xD8", 10);
+        for (size_t step = 1; step < 4; ++step) {
+            assert(chunked(browser::Charset::UTF16LE, utf16, step) == "h\xC3\xA9\xF0\x9F\x98\x80\xEF\xBF\xBD");
+        }
+    }
+
+    {
+        browser::ScalableBloomFilter bloom(1000, 0.01);
+        for (int i = 0; i < 20000; ++i) bloom.add("https://a.test/page/" + std::to_string(i));
+        assert(bloom.size() == 20000 && bloom.stages() == 5);
+        for (int i = 0; i < 20000; ++i) assert(bloom.mayContain("https://a.test/page/" + std::to_string(i)));
+        size_t false_positives = 0;
+        for (int i = 0; i < 20000; ++i) false_positives += bloom.mayContain("https://b.test/page/" + std::to_string(i));
+        assert(false_positives < 200);
+
+        std::stringstream saved;
+        bloom.write(saved);
+        const browser::ScalableBloomFilter restored = browser::ScalableBloomFilter::read(saved);
+        assert(restored.size() == bloom.size() && restored.bytes() == bloom.bytes() && restored.mayContain("https://a.test/page/19999"));
+        std::stringstream cut(saved.str().substr(0, saved.str().size() / 2));
+        bool threw = false;
+        try {
+            browser::ScalableBloomFilter::read(cut);
+        } catch (const std::runtime_error&) {
+            threw = true;
+        }
+        assert(threw);
+        (void)false_positives;
+        (void)threw;
+    }
+
+    {
+        const std::filesystem::path dir = "core_tests_seen";
+        std::filesystem::remove_all(dir);
+        std::filesystem::create_directories(dir);
+        const auto url = [](int i) { return "https://a.test/page/" + std::to_string(i); };
+        browser::SeenUrlStore seen(dir.string(), 4);
+        // Flushing every 1000 URLs keeps merging runs, so a shard stays at a few of them.
+        for (int i = 0; i < 20000; ++i) {
+            seen.add(url(i));
+            if (i % 1000 == 999) seen.flush();
+        }
+        assert(seen.size() == 20000 && seen.stats().merges > 0);
+        for (int i = 0; i < 20000; i += 7) assert(seen.contains(url(i)));
+        for (int i = 20000; i < 22000; ++i) assert(!seen.contains(url(i)));
+        const std::vector<browser::SeenUrlStore::Run> runs = seen.runs();
+        assert(runs.size() <= 256 * 6);
+        seen.commit();
+        assert(static_cast<size_t>(std::distance(std::filesystem::directory_iterator(dir), std::filesystem::directory_iterator())) == runs.size());
+
+        // Restoring drops what came after, merged runs included, and needs every file.
+        for (int i = 20000; i < 40000; ++i) seen.add(url(i));
+        seen.flush();
+        seen.restore(runs);
+        assert(seen.size() == 20000 && seen.contains(url(19999)) && !seen.contains(url(20000)));
+        std::filesystem::resize_file(dir / (std::to_string(runs.front().serial) + ".run"), 8);
+        bool threw = false;
+        try {
+            seen.restore(runs);
+        } catch (const std::runtime_error&) {
+            threw = true;
+        }
+        assert(threw);
+        (void)threw;
+        std::filesystem::remove_all(dir);
+    }
+
+#ifndef _WIN32
+    {
+        // Loopback server: /old redirects to /data (chunked), /hang never answers.
+        const int listener = socket(AF_INET, SOCK_STREAM, 0);
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        socklen_t len = sizeof(addr);
+        const bool listening = bind(listener, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0 && listen(listener, 8) == 0;
+        assert(listening);
+        (void)listening;
+        getsockname(listener, reinterpret_cast<sockaddr*>(&addr), &len);
+        const std::string origin = "http://127.0.0.1:" + std::to_string(ntohs(addr.sin_port));
+        std::atomic<bool> hang_seen{false};
+        std::atomic<bool> hang_closed{false};
+
+        std::thread server([&] {
+            for (int served = 0; served < 3; ++served) {
+                const int c = accept(listener, nullptr, nullptr);
+                std::string req;
+                char buf[1024];
+                while (req.find("\r\n\r\n") == std::string::npos) {
+                    const ssize_t n = recv(c, buf, sizeof(buf), 0);
+                    if (n <= 0) break;
+                    req.append(buf, static_cast<size_t>(n));
+                }
+                std::string reply;
+                if (req.rfind("GET /old ", 0) == 0) {
+                    reply = "HTTP/1.1 302 Found\r\nLocation: /data\r\nContent-Length: 0\r\n\r\n";
+                } else if (req.rfind("GET /data ", 0) == 0) {
+                    reply = "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n4\r\nasyn\r\n1\r\nc\r\n0\r\n\r\n";
+                } else {
+                    hang_seen = true;
+                    while (recv(c, buf, sizeof(buf), 0) > 0) {
+                    }
+                    hang_closed = true;
+                }
+                if (!reply.empty()) send(c, reply.data(), reply.size(), 0);
+                close(c);
+            }
+        });
+
+        browser::AsyncFetcher fetcher;
+        std::atomic<int> header_calls{0};
+        std::atomic<size_t> progress{0};
+        browser::FetchCallbacks callbacks;
+        callbacks.on_headers = [&](const HttpResponse& h) {
+            ++header_calls;
+            assert(h.status_line == "HTTP/1.1 200 OK" && h.body.empty());
+        };
+        callbacks.on_progress = [&](size_t received, size_t) { progress = received; };
+        browser::FetchHandle ok = fetcher.fetch(origin + "/old", callbacks);
+        const HttpResponse resp = ok.get();
+        assert(resp.body == "async" && header_calls == 1 && progress == 5);
+
+        browser::FetchHandle hang = fetcher.fetch(origin + "/hang");
+        while (!hang_seen) std::this_thread::sleep_for(std::chrono::milliseconds(5));
+        assert(!hang.ready() && fetcher.pending() == 1);
+        hang.cancel();
+        assert(hang.ready() && hang.cancelled() && fetcher.pending() == 0);
+        bool threw = false;
+        try {
+            hang.get();
+        } catch (const std::runtime_error& ex) {
+            threw = std::string(ex.what()) == "fetch cancelled";
+        }
+        assert(threw);
+        server.join();
+        assert(hang_closed);
+        close(listener);
+    }
+
+    {
+        browser::TestHttpServer server;
+        browser::TestRoute page;
+        page.body = std::string(3000, 'p');
+        server.route("/page", page);
+        browser::TestRoute chunked = page;
+        chunked.chunk_size = 1000;
+        chunked.trickle_bytes = 700;
+        chunked.trickle_delay = std::chrono::milliseconds(1);
+        server.route("/chunked", chunked);
+        browser::TestRoute gzip = page;
+        gzip.gzip = true;
+        server.route("/gzip", gzip);
+        server.route("/moved", browser::redirect_route("/chunked"));
+
+        // Two pipelined requests share one connection; the second asks to close it.
+        const int s = socket(AF_INET, SOCK_STREAM, 0);
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        addr.sin_port = htons(server.port());
+        const bool connected = connect(s, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0;
+        assert(connected);
+        (void)connected;
+        const std::string requests =
+            "GET /gzip?x=1 HTTP/1.1\r\nHost: t\r\nAccept-Encoding: br, gzip\r\n\r\nGET /none HTTP/1.1\r\nHost: t\r\nConnection: close\r\n\r\n";
+        send(s, requests.data(), requests.size(), 0);
+        std::string replies;
+        char buf[4096];
+        for (ssize_t n; (n = recv(s, buf, sizeof(buf), 0)) > 0;) replies.append(buf, static_cast<size_t>(n));
+        close(s);
+        const std::string encoded = browser::gzip_stored(page.body);
+        assert(encoded.size() == page.body.size() + 23 && encoded.compare(0, 3, "\x1f\x8b\x08") == 0);
+        const std::string compressed = browser::gzip_compress(page.body);
+        assert(replies.find("Content-Encoding: gzip\r\nContent-Length: " + std::to_string(compressed.size())) != std::string::npos);
+        assert(replies.find(compressed) != std::string::npos);
+        assert(replies.find("HTTP/1.1 404 Not Found\r\n") != std::string::npos && replies.find("Connection: close") != std::string::npos);
+        assert(server.connections() == 1 && server.requests() == 2);
+
+        // Redirected, chunked and trickled, the body still arrives whole.
+        browser::AsyncFetcher fetcher;
+        assert(fetcher.fetch(server.url("/moved")).get().body == page.body);
+        // The socket transport asks for gzip and decodes it; curl does the same on its own.
+        assert(fetcher.fetch(server.url("/gzip")).get().body == page.body);
+
+        server.resetCounts();
+        browser::LoadTestOptions load;
+        load.urls = {server.url("/page"), server.url("/chunked")};
+        load.requests = 40;
+        load.concurrency = 4;
+        const browser::LoadTestReport report = browser::run_load_test(load);
+        assert(report.requests == 40 && report.errors == 0 && report.non_2xx == 0 && report.body_bytes == 40 * page.body.size());
+        assert(report.p50_ms <= report.p90_ms && report.p90_ms <= report.p99_ms && report.p99_ms <= report.max_ms && report.requests_per_second > 0);
+        assert(server.requests() == 40 && server.connections() >= 1);
+        if (std::string(http_backend()) == "socket") assert(server.connections() == 40);
+    }
+
+    {
+        browser::TestHttpServer server;
+        for (const char* path : {"/a", "/b", "/c", "/d"}) {
+            browser::TestRoute r;
+            r.body = std::string("<p>page ") + path + "</p>";
+            server.route(path, r);
+        }
+        browser::TestRoute big;
+        big.body = std::string(256 * 1024, 'x');
+        server.route("/big", big);
+        browser::TestRoute private_page;
+        private_page.headers.emplace_back("Cache-Control", "no-store");
+        server.route("/private", private_page);
+        browser::TestRoute slow;
+        slow.body = std::string(8 * 1024, 's');
+        slow.trickle_bytes = 512;
+        slow.trickle_delay = std::chrono::milliseconds(100);
+        server.route("/slow", slow);
+
+        const std::string index = server.url("/index");
+        const std::string html = "<a href='/b'>b</a> <a href='/index#top'>self</a> <a href='http://example.com/x'>other</a> "
+                                 "<a href='a'>a</a> <a href='/b#more'>b again</a> <a href='/private'>p</a> <a href='/c'>c</a>";
+        const std::vector<std::string> links = browser::Prefetcher::candidates(index, html, 3);
+        assert(links == (std::vector<std::string>{server.url("/b"), server.url("/a"), server.url("/private")}));
+
+        browser::PrefetchOptions options;
+        options.max_links = 4;
+        options.max_concurrent = 1;
+        {
+            browser::Prefetcher prefetcher(options);
+            const size_t queued = prefetcher.prefetch(index, html);
+            assert(queued == 4);
+            (void)queued;
+            // take() never waits, so let every prefetch finish first.
+            while (prefetcher.stats().completed + prefetcher.stats().failed < 4) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            // The fragment does not matter.
+            const std::optional<HttpResponse> b = prefetcher.take(server.url("/b#x"));
+            assert(b && b->body == "<p>page /b</p>");
+            const bool hits = prefetcher.take(server.url("/c")) && prefetcher.take(server.url("/b"));
+            const bool misses = !prefetcher.take(server.url("/private")) && !prefetcher.take(server.url("/d"));
+            assert(hits && misses);
+            (void)hits;
+            (void)misses;
+            const browser::Prefetcher::Stats st = prefetcher.stats();
+            assert(st.lookups == 5 && st.hits == 3 && st.hitRate() == 0.6);
+            assert(st.started == 4 && st.completed == 3 && st.failed == 1 && st.entries == 3);
+            assert(server.requests() == 4);
+            (void)st;
+            // Links already cached are not fetched again for the next page.
+            const size_t fresh = prefetcher.prefetch(server.url("/c"), "<a href='/a'>a</a><a href='/d'>d</a>");
+            while (prefetcher.stats().completed < 4) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            const bool d = prefetcher.take(server.url("/d")).has_value();
+            assert(fresh == 1 && d && server.requests() == 5);
+            (void)fresh;
+            (void)d;
+        }
+
+        // Past the page's byte budget a prefetch is cancelled and nothing more starts.
+        options.max_page_bytes = 64 * 1024;
+        {
+            browser::Prefetcher prefetcher(options);
+            const size_t queued = prefetcher.prefetch(index, "<a href='/big'>big</a><a href='/a'>a</a>");
+            while (prefetcher.stats().cancelled < 1) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            const bool misses = !prefetcher.take(server.url("/big")) && !prefetcher.take(server.url("/a"));
+            const browser::Prefetcher::Stats st = prefetcher.stats();
+            assert(queued == 2 && misses && st.started == 1 && st.cancelled == 1 && st.entries == 0);
+            (void)queued;
+            (void)misses;
+            (void)st;
+        }
+
+        // Taking a link still in flight does not wait for it: it is a miss, and the prefetch
+        // is cancelled in favour of the caller's fetch.
+        {
+            browser::Prefetcher prefetcher(options);
+            prefetcher.prefetch(index, "<a href='/slow'>slow</a>");
+            const auto started = std::chrono::steady_clock::now();
+            const bool miss = !prefetcher.take(server.url("/slow"));
+            const double waited_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - started).count();
+            const browser::Prefetcher::Stats st = prefetcher.stats();
+            assert(miss && waited_ms < 500 && st.started == 1 && st.cancelled == 1 && st.hits == 0 && st.entries == 0);
+            (void)miss;
+            (void)waited_ms;
+            (void)st;
+        }
+
+        // The cache keeps the most recently used entries.
+        options.max_page_bytes = 4 * 1024 * 1024;
+        options.max_entries = 2;
+        options.max_concurrent = 4;
+        {
+            browser::Prefetcher prefetcher(options);
+            prefetcher.prefetch(index, "<a href='/a'>a</a><a href='/b'>b</a><a href='/c'>c</a>");
+            while (prefetcher.stats().completed < 3) std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            const browser::Prefetcher::Stats st = prefetcher.stats();
+            assert(st.entries == 2 && st.evictions == 1 && st.unused == 1 && st.cached_bytes == 2 * std::strlen("<p>page /a</p>"));
+            (void)st;
+        }
+    }
+    {
+        browser::TestHttpServer server;
+        browser::add_link_graph(server, "/g", 300, 4);
+        browser::CrawlOptions options;
+        options.seeds = {server.url("/g/0")};
+        options.state_dir = "core_tests_crawl";
+        options.concurrency = 8;
+        options.per_host_concurrency = 4;
+        options.host_delay = std::chrono::milliseconds(0);
+        options.max_pages = 100;
+        options.checkpoint_every = 25;
+        options.bloom_capacity = 64;
+        options.seen_cache_blocks = 2;
+        {
+            browser::Crawler crawler(options);
+            size_t ok = 0;
+            const browser::CrawlStats st = crawler.run([&](const browser::CrawlPage& page) { ok += page.error.empty() && page.status_line == "HTTP/1.1 200 OK"; });
+            assert(st.fetched == 100 && ok == 100 && st.checkpoints == 5 && st.pending > 0 && st.hosts == 1);
+            (void)st;
+        }
+
+        // Resuming from the checkpoint fetches the rest, and nothing twice.
+        options.resume = true;
+        options.max_pages = 0;
+        options.seeds.clear();
+        std::set<std::string> urls;
+        {
+            browser::Crawler crawler(options);
+            const browser::CrawlStats st = crawler.run([&](const browser::CrawlPage& page) { urls.insert(page.url); });
+            assert(st.fetched == 300 && st.failed == 0 && st.pending == 0 && st.discovered == 300 && st.duplicates > 600);
+            (void)st;
+        }
+        assert(urls.size() == 200 && !urls.count(server.url("/g/0")) && server.requests() == 300);
+
+        // A stopped crawl puts what was in flight back into the frontier.
+        server.resetCounts();
+        options.resume = false;
+        options.seeds = {server.url("/g/0")};
+        {
+            browser::Crawler crawler(options);
+            size_t seen = 0;
+            crawler.run([&](const browser::CrawlPage&) {
+                if (++seen == 40) crawler.stop();
+            });
+        }
+        options.resume = true;
+        options.seeds.clear();
+        {
+            browser::Crawler crawler(options);
+            const browser::CrawlStats st = crawler.run();
+            assert(st.fetched == 300 && st.pending == 0 && server.requests() >= 300);
+            (void)st;
+        }
+
+        // One request at a time per host, host_delay apart.
+        options.resume = false;
+        options.seeds = {server.url("/g/0")};
+        options.per_host_concurrency = 1;
+        options.host_delay = std::chrono::milliseconds(20);
+        options.max_pages = 6;
+        {
+            browser::Crawler crawler(options);
+            const browser::CrawlStats st = crawler.run();
+            assert(st.fetched == 6 && st.seconds >= 0.1);
+            (void)st;
+        }
+        std::filesystem::remove_all(options.state_dir);
+    }
+#endif
+
+    auto account = std::make_shared<browser::MemoryAccount>();
+    {
+        browser::MemoryAccountScope scope(account);
+        browser::RenderContext ctx = browser::parse_document(html, extract_style_blocks(html));
+#if ZEPHYR_METRICS
+        // Text without entities is sliced out of the one source copy.
+        const browser::MemoryStats live = account->snapshot();
+        assert(live[browser::MemoryCategory::DOM_NODES].current_bytes > 0);
+        assert(live[browser::MemoryCategory::DOM_ATTRIBUTES].allocations > 0);
+        assert(live[browser::MemoryCategory::DOM_TEXT].current_bytes == 0);
+        assert(live[browser::MemoryCategory::RESPONSE_BODY].current_bytes > html.size());
+        assert(live[browser::MemoryCategory::STYLE_RULES].current_bytes > 0);
+#endif
+    }
+    const browser::MemoryStats after = account->snapshot();
+    assert(after.current_bytes == 0);
+#if ZEPHYR_METRICS
+    assert(after.peak_bytes > 0);
+#endif
+
     std::cout << "core_tests passed\n";
     return 0;
 }
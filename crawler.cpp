@@ -0,0 +1,835 @@
+#include "crawler.h"
+#include "browser_core.h"
+#include "charset.h"
+#include "fetch.h"
+#include "stylesheet_cache.h"
+#include "url.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <filesystem>
+#include <fstream>
+#include <list>
+#include <mutex>
+#include <queue>
+#include <sstream>
+#include <stdexcept>
+#include <unordered_map>
+#include <unordered_set>
+
+namespace browser {
+namespace {
+
+namespace fs = std::filesystem;
+using Clock = std::chrono::steady_clock;
+
+constexpr size_t kSeenShards = 256;
+constexpr size_t kSeenBlock = 512;  // fingerprints, 4 KB
+constexpr size_t kSeenBufferBytes = 1 << 20;
+constexpr uint64_t kSeenFingerprintSeed = 0x5EE9F1A6E4C3B2D1ull;
+constexpr size_t kHostBufferBytes = 64 * 1024;
+constexpr size_t kFrontierBufferBytes = 4 << 20;
+constexpr size_t kReadAhead = 64;
+constexpr char kBloomMagic[4] = {'Z', 'B', 'L', 'M'};
+constexpr uint32_t kBloomVersion = 1;
+constexpr const char* kCheckpointHeader = "zephyr-crawl 2";
+
+struct KeyHash {
+    uint64_t a;
+    uint64_t b;
+};
+
+KeyHash key_hash(std::string_view key) {
+    const uint64_t a = hash_bytes(key.data(), key.size());
+    return {a, hash_bytes(key.data(), key.size(), a) | 1};
+}
+
+template <typename T>
+void put(std::ostream& out, T value) {
+    out.write(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+template <typename T>
+T take(std::istream& in) {
+    T value{};
+    in.read(reinterpret_cast<char*>(&value), sizeof(value));
+    if (!in) throw std::runtime_error("truncated Bloom filter");
+    return value;
+}
+
+std::string without_fragment(std::string url) {
+    const size_t hash = url.find('#');
+    if (hash != std::string::npos) url.resize(hash);
+    return url;
+}
+
+std::string host_key(const UrlView& url) {
+    std::string key(url.host);
+    for (char& c : key) c = static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+    return key + ":" + std::to_string(url.port);
+}
+
+// Frontier and seen-store files hold one URL per line.
+bool storable(const std::string& url) {
+    return std::none_of(url.begin(), url.end(), [](unsigned char c) { return c <= ' ' || c == 0x7F; });
+}
+
+void append_file(const fs::path& path, const std::string& data) {
+    std::ofstream out(path, std::ios::binary | std::ios::app);
+    out.write(data.data(), static_cast<std::streamsize>(data.size()));
+    if (!out) throw std::runtime_error("cannot write " + path.string());
+}
+
+// Drops whatever was appended after the checkpoint that recorded `size`.
+void truncate_to(const fs::path& path, uint64_t size) {
+    std::error_code ec;
+    const uint64_t actual = fs::exists(path, ec) ? fs::file_size(path, ec) : 0;
+    if (actual < size) throw std::runtime_error("crawl state is missing data in " + path.string());
+    if (actual > size) fs::resize_file(path, size);
+}
+
+size_t seen_shard(std::string_view url) { return hash_bytes(url.data(), url.size(), kSeenShards) % kSeenShards; }
+
+uint64_t seen_fingerprint(std::string_view url) { return hash_bytes(url.data(), url.size(), kSeenFingerprintSeed); }
+
+// Streams a run file's fingerprints a block at a time.
+class RunReader {
+public:
+    RunReader(const std::string& path, uint64_t count) : in_(path, std::ios::binary), left_(count) {}
+
+    bool next(uint64_t& fingerprint) {
+        if (at_ == block_.size()) {
+            if (!left_) return false;
+            block_.resize(static_cast<size_t>(std::min<uint64_t>(left_, kSeenBlock)));
+            in_.read(reinterpret_cast<char*>(block_.data()), static_cast<std::streamsize>(block_.size() * sizeof(uint64_t)));
+            if (!in_) throw std::runtime_error("crawl seen-URL store is short");
+            left_ -= block_.size();
+            at_ = 0;
+        }
+        fingerprint = block_[at_++];
+        return true;
+    }
+
+private:
+    std::ifstream in_;
+    uint64_t left_;
+    std::vector<uint64_t> block_;
+    size_t at_ = 0;
+};
+
+// Writes ascending fingerprints, dropping repeats, and notes the first of each block.
+class RunWriter {
+public:
+    RunWriter(const std::string& path, std::vector<uint64_t>& firsts) : path_(path), out_(path, std::ios::binary | std::ios::trunc), firsts_(firsts) {
+        block_.reserve(kSeenBlock);
+    }
+
+    void add(uint64_t fingerprint) {
+        if (count_ && fingerprint == last_) return;
+        if (count_ % kSeenBlock == 0) firsts_.push_back(fingerprint);
+        block_.push_back(fingerprint);
+        last_ = fingerprint;
+        ++count_;
+        if (block_.size() == kSeenBlock) write();
+    }
+
+    void finish() {
+        write();
+        out_.close();
+        if (!out_) throw std::runtime_error("cannot write " + path_);
+    }
+
+    uint64_t count() const { return count_; }
+    uint64_t last() const { return last_; }
+
+private:
+    void write() {
+        out_.write(reinterpret_cast<const char*>(block_.data()), static_cast<std::streamsize>(block_.size() * sizeof(uint64_t)));
+        block_.clear();
+    }
+
+    std::string path_;
+    std::ofstream out_;
+    std::vector<uint64_t>& firsts_;
+    std::vector<uint64_t> block_;
+    uint64_t count_ = 0;
+    uint64_t last_ = 0;
+};
+
+struct CrawlItem {
+    std::string url;
+    size_t depth = 0;
+    uint64_t end = 0;  // file offset just past the item's line
+};
+
+// One host's share of the frontier: "depth url" lines appended to its own file, read
+// back in order a few at a time.
+struct HostQueue {
+    std::string name;
+    size_t id = 0;
+    std::string buffer;       // appended, not in the file yet
+    uint64_t file_bytes = 0;
+    uint64_t read_offset = 0; // loaded into read_ahead up to here
+    uint64_t consumed = 0;    // handed out up to here
+    std::deque<CrawlItem> read_ahead;
+    size_t pending = 0;
+    size_t in_flight = 0;
+    Clock::time_point next_start;
+    bool scheduled = false;
+};
+
+struct Flight {
+    CrawlItem item;
+    size_t host = 0;
+    FetchHandle handle;
+};
+
+}  // namespace
+
+ScalableBloomFilter::ScalableBloomFilter(size_t initial_capacity, double error_rate)
+    : initial_capacity_(std::max<size_t>(initial_capacity, 64)), error_rate_(error_rate) {
+    if (!(error_rate > 0 && error_rate < 1)) throw std::runtime_error("Bloom filter error rate must be between 0 and 1");
+    grow();
+}
+
+void ScalableBloomFilter::grow() {
+    Stage stage;
+    stage.capacity = initial_capacity_ << std::min<size_t>(stages_.size(), 40);
+    const double p = error_rate_ / std::pow(2.0, static_cast<double>(stages_.size() + 1));
+    const double ln2 = std::log(2.0);
+    stage.bit_count = std::max<uint64_t>(64, static_cast<uint64_t>(std::ceil(-static_cast<double>(stage.capacity) * std::log(p) / (ln2 * ln2))));
+    stage.hashes = std::max<uint32_t>(1, static_cast<uint32_t>(std::lround(static_cast<double>(stage.bit_count) / stage.capacity * ln2)));
+    stage.words.assign((stage.bit_count + 63) / 64, 0);
+    stages_.push_back(std::move(stage));
+}
+
+bool ScalableBloomFilter::mayContain(std::string_view key) const {
+    const KeyHash h = key_hash(key);
+    for (const Stage& stage : stages_) {
+        bool all = true;
+        for (uint32_t j = 0; j < stage.hashes && all; ++j) {
+            const uint64_t bit = (h.a + j * h.b) % stage.bit_count;
+            all = (stage.words[bit / 64] >> (bit % 64)) & 1;
+        }
+        if (all) return true;
+    }
+    return false;
+}
+
+void ScalableBloomFilter::add(std::string_view key) {
+    if (stages_.back().count >= stages_.back().capacity) grow();
+    Stage& stage = stages_.back();
+    const KeyHash h = key_hash(key);
+    for (uint32_t j = 0; j < stage.hashes; ++j) {
+        const uint64_t bit = (h.a + j * h.b) % stage.bit_count;
+        stage.words[bit / 64] |= uint64_t(1) << (bit % 64);
+    }
+    ++stage.count;
+    ++size_;
+}
+
+size_t ScalableBloomFilter::bytes() const {
+    size_t total = 0;
+    for (const Stage& stage : stages_) total += stage.words.size() * sizeof(uint64_t);
+    return total;
+}
+
+void ScalableBloomFilter::write(std::ostream& out) const {
+    out.write(kBloomMagic, sizeof(kBloomMagic));
+    put<uint32_t>(out, kBloomVersion);
+    put<uint64_t>(out, initial_capacity_);
+    put<double>(out, error_rate_);
+    put<uint64_t>(out, size_);
+    put<uint32_t>(out, static_cast<uint32_t>(stages_.size()));
+    for (const Stage& stage : stages_) {
+        put<uint64_t>(out, stage.capacity);
+        put<uint64_t>(out, stage.count);
+        put<uint32_t>(out, stage.hashes);
+        put<uint64_t>(out, stage.bit_count);
+        out.write(reinterpret_cast<const char*>(stage.words.data()), static_cast<std::streamsize>(stage.words.size() * sizeof(uint64_t)));
+    }
+}
+
+ScalableBloomFilter ScalableBloomFilter::read(std::istream& in) {
+    char magic[sizeof(kBloomMagic)];
+    in.read(magic, sizeof(magic));
+    if (!in || std::memcmp(magic, kBloomMagic, sizeof(magic)) != 0) throw std::runtime_error("not a Bloom filter");
+    if (take<uint32_t>(in) != kBloomVersion) throw std::runtime_error("unsupported Bloom filter version");
+    const uint64_t initial = take<uint64_t>(in);
+    const double error_rate = take<double>(in);
+    ScalableBloomFilter filter(initial, error_rate);
+    filter.size_ = take<uint64_t>(in);
+    const uint32_t stages = take<uint32_t>(in);
+    if (stages == 0 || stages > 64) throw std::runtime_error("corrupt Bloom filter");
+    filter.stages_.clear();
+    for (uint32_t i = 0; i < stages; ++i) {
+        Stage stage;
+        stage.capacity = take<uint64_t>(in);
+        stage.count = take<uint64_t>(in);
+        stage.hashes = take<uint32_t>(in);
+        stage.bit_count = take<uint64_t>(in);
+        if (stage.bit_count == 0 || stage.bit_count > (uint64_t(1) << 40) || stage.hashes == 0 || stage.hashes > 64) {
+            throw std::runtime_error("corrupt Bloom filter");
+        }
+        stage.words.resize((stage.bit_count + 63) / 64);
+        in.read(reinterpret_cast<char*>(stage.words.data()), static_cast<std::streamsize>(stage.words.size() * sizeof(uint64_t)));
+        if (!in) throw std::runtime_error("truncated Bloom filter");
+        filter.stages_.push_back(std::move(stage));
+    }
+    return filter;
+}
+
+SeenUrlStore::SeenUrlStore(std::string dir, size_t cache_blocks)
+    : dir_(std::move(dir)), cache_blocks_(std::max<size_t>(cache_blocks, 1)), shards_(kSeenShards), buffers_(kSeenShards) {}
+
+bool SeenUrlStore::contains(std::string_view url) {
+    ++stats_.lookups;
+    const size_t shard = seen_shard(url);
+    const uint64_t fingerprint = seen_fingerprint(url);
+    const std::vector<uint64_t>& buffer = buffers_[shard];
+    if (std::find(buffer.begin(), buffer.end(), fingerprint) != buffer.end()) return true;
+    // Newest first: small runs are the likeliest to be cached.
+    const std::vector<RunIndex>& runs = shards_[shard];
+    for (auto it = runs.rbegin(); it != runs.rend(); ++it) {
+        if (find(*it, fingerprint)) return true;
+    }
+    return false;
+}
+
+void SeenUrlStore::add(std::string_view url) {
+    buffers_[seen_shard(url)].push_back(seen_fingerprint(url));
+    if (++buffered_ * sizeof(uint64_t) >= kSeenBufferBytes) flush();
+}
+
+void SeenUrlStore::flush() {
+    for (size_t shard = 0; shard < kSeenShards; ++shard) {
+        std::vector<uint64_t>& buffer = buffers_[shard];
+        if (buffer.empty()) continue;
+        std::sort(buffer.begin(), buffer.end());
+        RunIndex run;
+        run.run.shard = shard;
+        run.run.serial = next_serial_++;
+        RunWriter out(path(run.run.serial), run.firsts);
+        for (const uint64_t fingerprint : buffer) out.add(fingerprint);
+        out.finish();
+        run.run.count = out.count();
+        run.last = out.last();
+        shards_[shard].push_back(std::move(run));
+        ++stats_.runs_written;
+        buffer.clear();
+        buffer.shrink_to_fit();
+        mergeTail(shard);
+    }
+    buffered_ = 0;
+}
+
+std::vector<SeenUrlStore::Run> SeenUrlStore::runs() const {
+    std::vector<Run> out;
+    for (const auto& runs : shards_) {
+        for (const RunIndex& run : runs) out.push_back(run.run);
+    }
+    return out;
+}
+
+void SeenUrlStore::commit() {
+    std::error_code ec;
+    for (const uint64_t serial : retired_) fs::remove(path(serial), ec);
+    retired_.clear();
+}
+
+void SeenUrlStore::restore(const std::vector<Run>& runs) {
+    for (auto& shard : shards_) shard.clear();
+    for (auto& buffer : buffers_) buffer.clear();
+    buffered_ = 0;
+    retired_.clear();
+    cache_.clear();
+    cached_.clear();
+    next_serial_ = 1;
+
+    std::unordered_set<std::string> keep;
+    for (const Run& run : runs) {
+        if (run.shard >= kSeenShards) throw std::runtime_error("corrupt crawl seen-URL store: shard " + std::to_string(run.shard));
+        std::error_code ec;
+        const uint64_t bytes = fs::exists(path(run.serial), ec) ? fs::file_size(path(run.serial), ec) : 0;
+        if (bytes != run.count * sizeof(uint64_t)) throw std::runtime_error("crawl state is missing data in " + path(run.serial));
+        // The index is rebuilt rather than stored: one sequential read per run.
+        RunIndex index;
+        index.run = run;
+        RunReader in(path(run.serial), run.count);
+        uint64_t at = 0;
+        for (uint64_t fingerprint = 0; in.next(fingerprint); ++at) {
+            if (at % kSeenBlock == 0) index.firsts.push_back(fingerprint);
+            index.last = fingerprint;
+        }
+        shards_[run.shard].push_back(std::move(index));
+        keep.insert(fs::path(path(run.serial)).filename().string());
+        next_serial_ = std::max(next_serial_, run.serial + 1);
+    }
+    // Runs written after the checkpoint, and those merged away before it was recorded.
+    std::error_code ec;
+    for (const auto& entry : fs::directory_iterator(dir_, ec)) {
+        if (!keep.count(entry.path().filename().string())) fs::remove(entry.path(), ec);
+    }
+}
+
+uint64_t SeenUrlStore::size() const {
+    uint64_t total = buffered_;
+    for (const auto& runs : shards_) {
+        for (const RunIndex& run : runs) total += run.run.count;
+    }
+    return total;
+}
+
+size_t SeenUrlStore::memoryBytes() const {
+    size_t bytes = sizeof(*this) + shards_.capacity() * sizeof(shards_[0]) + buffers_.capacity() * sizeof(buffers_[0]);
+    for (const auto& runs : shards_) {
+        bytes += runs.capacity() * sizeof(RunIndex);
+        for (const RunIndex& run : runs) bytes += run.firsts.capacity() * sizeof(uint64_t);
+    }
+    for (const auto& buffer : buffers_) bytes += buffer.capacity() * sizeof(uint64_t);
+    for (const auto& entry : cache_) bytes += 2 * 32 + sizeof(entry) + entry.second.capacity() * sizeof(uint64_t);
+    return bytes + retired_.capacity() * sizeof(uint64_t);
+}
+
+bool SeenUrlStore::find(const RunIndex& run, uint64_t fingerprint) {
+    if (run.firsts.empty() || fingerprint < run.firsts.front() || fingerprint > run.last) return false;
+    const size_t index = static_cast<size_t>(std::upper_bound(run.firsts.begin(), run.firsts.end(), fingerprint) - run.firsts.begin()) - 1;
+    if (run.firsts[index] == fingerprint) return true;
+    const std::vector<uint64_t>& fingerprints = block(run, index);
+    return std::binary_search(fingerprints.begin(), fingerprints.end(), fingerprint);
+}
+
+const std::vector<uint64_t>& SeenUrlStore::block(const RunIndex& run, size_t index) {
+    const uint64_t key = run.run.serial << 32 | index;
+    const auto found = cached_.find(key);
+    if (found != cached_.end()) {
+        cache_.splice(cache_.begin(), cache_, found->second);
+        return cache_.front().second;
+    }
+    ++stats_.block_reads;
+    const uint64_t offset = static_cast<uint64_t>(index) * kSeenBlock;
+    std::vector<uint64_t> fingerprints(static_cast<size_t>(std::min<uint64_t>(kSeenBlock, run.run.count - offset)));
+    std::ifstream in(path(run.run.serial), std::ios::binary);
+    in.seekg(static_cast<std::streamoff>(offset * sizeof(uint64_t)));
+    in.read(reinterpret_cast<char*>(fingerprints.data()), static_cast<std::streamsize>(fingerprints.size() * sizeof(uint64_t)));
+    if (!in) throw std::runtime_error("cannot read " + path(run.run.serial));
+    if (cache_.size() >= cache_blocks_) {
+        // Reuse the evicted block's storage.
+        cache_.splice(cache_.begin(), cache_, std::prev(cache_.end()));
+        cached_.erase(cache_.front().first);
+        cache_.front().first = key;
+        cache_.front().second = std::move(fingerprints);
+    } else {
+        cache_.emplace_front(key, std::move(fingerprints));
+    }
+    cached_[key] = cache_.begin();
+    return cache_.front().second;
+}
+
+std::string SeenUrlStore::path(uint64_t serial) const { return (fs::path(dir_) / (std::to_string(serial) + ".run")).string(); }
+
+// Merges the newest run into the one before while that is no larger, so a shard keeps
+// O(log n) runs and each fingerprint is rewritten O(log n) times.
+void SeenUrlStore::mergeTail(size_t shard) {
+    std::vector<RunIndex>& runs = shards_[shard];
+    while (runs.size() >= 2 && runs[runs.size() - 2].run.count <= runs.back().run.count) {
+        const RunIndex& older = runs[runs.size() - 2];
+        const RunIndex& newer = runs.back();
+        RunIndex merged;
+        merged.run.shard = shard;
+        merged.run.serial = next_serial_++;
+        RunWriter out(path(merged.run.serial), merged.firsts);
+        RunReader a(path(older.run.serial), older.run.count);
+        RunReader b(path(newer.run.serial), newer.run.count);
+        uint64_t x = 0;
+        uint64_t y = 0;
+        bool has_x = a.next(x);
+        bool has_y = b.next(y);
+        while (has_x || has_y) {
+            if (has_x && (!has_y || x <= y)) {
+                out.add(x);
+                has_x = a.next(x);
+            } else {
+                out.add(y);
+                has_y = b.next(y);
+            }
+        }
+        out.finish();
+        merged.run.count = out.count();
+        merged.last = out.last();
+        forget(older.run.serial);
+        forget(newer.run.serial);
+        runs.pop_back();
+        runs.back() = std::move(merged);
+        ++stats_.merges;
+    }
+}
+
+// The file stays until commit(): the last checkpoint may still name it.
+void SeenUrlStore::forget(uint64_t serial) {
+    retired_.push_back(serial);
+    for (auto it = cache_.begin(); it != cache_.end();) {
+        if (it->first >> 32 != serial) {
+            ++it;
+            continue;
+        }
+        cached_.erase(it->first);
+        it = cache_.erase(it);
+    }
+}
+
+struct Crawler::State {
+    explicit State(CrawlOptions opts)
+        : options(std::move(opts)),
+          dir(options.state_dir),
+          seen((dir / "seen").string(), options.seen_cache_blocks),
+          bloom(options.bloom_capacity, options.bloom_error_rate) {}
+
+    using Ready = std::pair<Clock::time_point, size_t>;
+
+    CrawlOptions options;
+    fs::path dir;
+    SeenUrlStore seen;
+    ScalableBloomFilter bloom;
+    std::unordered_set<std::string> scope;  // host keys links may lead to
+    std::vector<std::unique_ptr<HostQueue>> hosts;
+    std::unordered_map<std::string, size_t> host_ids;
+    std::priority_queue<Ready, std::vector<Ready>, std::greater<Ready>> ready;
+    size_t frontier_buffered = 0;
+    std::unordered_map<uint64_t, Flight> flights;
+    uint64_t next_flight = 0;
+    CrawlStats totals;
+    Clock::time_point started = Clock::now();
+
+    std::mutex mu;
+    std::condition_variable cv;
+    std::vector<uint64_t> done;  // flights whose result is ready; guarded by mu
+
+    // Last, so its I/O thread is joined before the state its callbacks touch goes away.
+    AsyncFetcher fetcher;
+
+    fs::path hostPath(size_t id) const { return dir / "frontier" / (std::to_string(id) + ".q"); }
+
+    HostQueue& host(const std::string& name) {
+        const auto found = host_ids.find(name);
+        if (found != host_ids.end()) return *hosts[found->second];
+        auto h = std::make_unique<HostQueue>();
+        h->name = name;
+        h->id = hosts.size();
+        host_ids.emplace(name, h->id);
+        hosts.push_back(std::move(h));
+        return *hosts.back();
+    }
+
+    void schedule(HostQueue& h) {
+        if (h.scheduled || h.pending == 0 || h.in_flight >= std::max<size_t>(options.per_host_concurrency, 1)) return;
+        h.scheduled = true;
+        ready.emplace(h.next_start, h.id);
+    }
+
+    void flushHost(HostQueue& h) {
+        if (h.buffer.empty()) return;
+        append_file(hostPath(h.id), h.buffer);
+        h.file_bytes += h.buffer.size();
+        frontier_buffered -= h.buffer.size();
+        h.buffer.clear();
+    }
+
+    void flushFrontier() {
+        for (auto& h : hosts) flushHost(*h);
+    }
+
+    void push(HostQueue& h, size_t depth, const std::string& url) {
+        const std::string line = std::to_string(depth) + " " + url + "\n";
+        h.buffer += line;
+        frontier_buffered += line.size();
+        ++h.pending;
+        if (h.buffer.size() > kHostBufferBytes) flushHost(h);
+        if (frontier_buffered > kFrontierBufferBytes) flushFrontier();
+        schedule(h);
+    }
+
+    CrawlItem pop(HostQueue& h) {
+        if (h.read_ahead.empty()) {
+            if (h.read_offset == h.file_bytes) flushHost(h);
+            std::ifstream in(hostPath(h.id), std::ios::binary);
+            in.seekg(static_cast<std::streamoff>(h.read_offset));
+            std::string line;
+            while (h.read_ahead.size() < kReadAhead && h.read_offset < h.file_bytes && std::getline(in, line)) {
+                h.read_offset += line.size() + 1;
+                const size_t sp = line.find(' ');
+                if (sp == std::string::npos) throw std::runtime_error("corrupt crawl frontier " + hostPath(h.id).string());
+                h.read_ahead.push_back({line.substr(sp + 1), std::stoul(line.substr(0, sp)), h.read_offset});
+            }
+            if (h.read_ahead.empty()) throw std::runtime_error("crawl frontier " + hostPath(h.id).string() + " ended early");
+        }
+        CrawlItem item = std::move(h.read_ahead.front());
+        h.read_ahead.pop_front();
+        h.consumed = item.end;
+        --h.pending;
+        return item;
+    }
+
+    // Queues `url` unless it is out of scope or was queued before.
+    bool enqueue(const std::string& raw, size_t depth) {
+        const std::string url = without_fragment(raw);
+        UrlView view;
+        if (depth > options.max_depth || !storable(url) || !UrlView::parse(url, view)) return false;
+        const std::string key = host_key(view);
+        if (options.same_host && !scope.count(key)) return false;
+        if (bloom.mayContain(url)) {
+            if (seen.contains(url)) {
+                ++totals.duplicates;
+                return false;
+            }
+            ++totals.bloom_false_positives;
+        }
+        bloom.add(url);
+        seen.add(url);
+        push(host(key), depth, url);
+        ++totals.discovered;
+        return true;
+    }
+
+    void start(HostQueue& h, Clock::time_point now) {
+        Flight flight;
+        flight.item = pop(h);
+        flight.host = h.id;
+        ++h.in_flight;
+        h.next_start = now + options.host_delay;
+        const uint64_t id = ++next_flight;
+        FetchCallbacks callbacks;
+        callbacks.on_done = [this, id] {
+            {
+                std::lock_guard<std::mutex> lock(mu);
+                done.push_back(id);
+            }
+            cv.notify_all();
+        };
+        flight.handle = fetcher.fetch(flight.item.url, std::move(callbacks), options.timeout_seconds);
+        flights.emplace(id, std::move(flight));
+        schedule(h);
+    }
+
+    CrawlPage finish(Flight& flight) {
+        HostQueue& h = *hosts[flight.host];
+        --h.in_flight;
+        schedule(h);
+        CrawlPage page;
+        page.url = flight.item.url;
+        page.depth = flight.item.depth;
+        try {
+            const HttpResponse resp = flight.handle.get();
+            page.status_line = resp.status_line;
+            page.bytes = resp.body.size();
+            totals.body_bytes += page.bytes;
+            ++totals.fetched;
+            const size_t sp = resp.status_line.find(' ');
+            const int status = sp == std::string::npos ? 0 : std::atoi(resp.status_line.c_str() + sp + 1);
+            const auto type = resp.headers.find("content-type");
+            const bool html = type == resp.headers.end() || type->second.find("html") != std::string::npos;
+            if (status < 200 || status >= 300) ++totals.non_2xx;
+            else if (html && page.depth < options.max_depth) {
+                std::string text;
+                std::vector<std::pair<std::string, std::string>> links;
+                extract_text_and_links(decode_response_body(resp).bytes(), text, links);
+                const BaseUrl base(page.url);
+                for (const auto& link : links) page.links += enqueue(base.resolve(link.second), page.depth + 1);
+            }
+        } catch (const std::exception& e) {
+            page.error = e.what();
+            ++totals.failed;
+        }
+        return page;
+    }
+
+    void reset() {
+        std::error_code ec;
+        fs::remove_all(dir / "frontier", ec);
+        fs::remove_all(dir / "seen", ec);
+        fs::remove(dir / "bloom.bin", ec);
+        fs::remove(dir / "checkpoint", ec);
+        fs::create_directories(dir / "frontier", ec);
+        fs::create_directories(dir / "seen", ec);
+        if (!fs::is_directory(dir / "frontier") || !fs::is_directory(dir / "seen")) {
+            throw std::runtime_error("cannot create crawl state in " + dir.string());
+        }
+    }
+
+    void save() {
+        seen.flush();
+        flushFrontier();
+        {
+            std::ofstream out(dir / "bloom.tmp", std::ios::binary | std::ios::trunc);
+            bloom.write(out);
+            if (!out) throw std::runtime_error("cannot write " + (dir / "bloom.tmp").string());
+        }
+        fs::rename(dir / "bloom.tmp", dir / "bloom.bin");
+
+        std::ofstream out(dir / "checkpoint.tmp", std::ios::binary | std::ios::trunc);
+        out << kCheckpointHeader << "\n";
+        out << "stats " << totals.fetched << " " << totals.failed << " " << totals.non_2xx << " " << totals.discovered << " "
+            << totals.duplicates << " " << totals.bloom_false_positives << " " << totals.body_bytes << " " << totals.checkpoints << "\n";
+        for (const std::string& key : scope) out << "scope " << key << "\n";
+        for (const SeenUrlStore::Run& run : seen.runs()) out << "seen " << run.shard << " " << run.serial << " " << run.count << "\n";
+        for (const auto& h : hosts) out << "host " << h->id << " " << h->file_bytes << " " << h->consumed << " " << h->pending << " " << h->name << "\n";
+        for (const auto& [id, flight] : flights) out << "inflight " << flight.host << " " << flight.item.depth << " " << flight.item.url << "\n";
+        out.close();
+        if (!out) throw std::runtime_error("cannot write " + (dir / "checkpoint.tmp").string());
+        fs::rename(dir / "checkpoint.tmp", dir / "checkpoint");
+        seen.commit();
+    }
+
+    void load() {
+        std::ifstream in(dir / "checkpoint", std::ios::binary);
+        std::string line;
+        if (!in || !std::getline(in, line) || line != kCheckpointHeader) throw std::runtime_error("no crawl checkpoint in " + dir.string());
+        std::vector<SeenUrlStore::Run> runs;
+        std::vector<CrawlItem> inflight;
+        std::vector<size_t> inflight_hosts;
+        while (std::getline(in, line)) {
+            std::istringstream fields(line);
+            std::string kind;
+            fields >> kind;
+            if (kind == "stats") {
+                fields >> totals.fetched >> totals.failed >> totals.non_2xx >> totals.discovered >> totals.duplicates >> totals.bloom_false_positives >>
+                    totals.body_bytes >> totals.checkpoints;
+            } else if (kind == "scope") {
+                std::string key;
+                fields >> key;
+                scope.insert(key);
+            } else if (kind == "seen") {
+                SeenUrlStore::Run run;
+                fields >> run.shard >> run.serial >> run.count;
+                runs.push_back(run);
+            } else if (kind == "host") {
+                auto h = std::make_unique<HostQueue>();
+                fields >> h->id >> h->file_bytes >> h->consumed >> h->pending >> h->name;
+                if (!fields || h->id != hosts.size()) throw std::runtime_error("corrupt crawl checkpoint: " + line);
+                h->read_offset = h->consumed;
+                truncate_to(hostPath(h->id), h->file_bytes);
+                host_ids.emplace(h->name, h->id);
+                hosts.push_back(std::move(h));
+            } else if (kind == "inflight") {
+                CrawlItem item;
+                size_t id = 0;
+                fields >> id >> item.depth >> item.url;
+                if (!fields || id >= hosts.size()) throw std::runtime_error("corrupt crawl checkpoint: " + line);
+                inflight_hosts.push_back(id);
+                inflight.push_back(std::move(item));
+            }
+            if (!fields) throw std::runtime_error("corrupt crawl checkpoint: " + line);
+        }
+        seen.restore(runs);
+        std::ifstream bloom_in(dir / "bloom.bin", std::ios::binary);
+        bloom = ScalableBloomFilter::read(bloom_in);
+        for (auto& h : hosts) schedule(*h);
+        // Fetches cut short by the stop are queued again.
+        for (size_t i = 0; i < inflight.size(); ++i) push(*hosts[inflight_hosts[i]], inflight[i].depth, inflight[i].url);
+    }
+};
+
+Crawler::Crawler(CrawlOptions options) {
+    if (options.state_dir.empty()) throw std::runtime_error("crawl needs a state directory");
+    state_ = std::make_unique<State>(std::move(options));
+    State& s = *state_;
+    if (s.options.resume) {
+        s.load();
+    } else {
+        s.reset();
+    }
+    for (const std::string& seed : s.options.seeds) {
+        const std::string url = without_fragment(seed);
+        UrlView view;
+        if (UrlView::parse(url, view)) s.scope.insert(host_key(view));
+    }
+    for (const std::string& seed : s.options.seeds) s.enqueue(seed, 0);
+}
+
+Crawler::~Crawler() {
+    for (auto& [id, flight] : state_->flights) flight.handle.cancel();
+}
+
+CrawlStats Crawler::run(const std::function<void(const CrawlPage&)>& on_page) {
+    State& s = *state_;
+    s.started = Clock::now();
+    const size_t per_host = std::max<size_t>(s.options.per_host_concurrency, 1);
+    size_t attempted = 0;
+    size_t since_checkpoint = 0;
+    const size_t concurrency = std::max<size_t>(s.options.concurrency, 1);
+    const auto more = [&] { return !stopping_ && (s.options.max_pages == 0 || attempted + s.flights.size() < s.options.max_pages); };
+    for (;;) {
+        const Clock::time_point now = Clock::now();
+        while (more() && s.flights.size() < concurrency && !s.ready.empty() && s.ready.top().first <= now) {
+            HostQueue& h = *s.hosts[s.ready.top().second];
+            s.ready.pop();
+            h.scheduled = false;
+            if (h.pending && h.in_flight < per_host) s.start(h, now);
+        }
+        if (s.flights.empty() && (!more() || s.ready.empty())) break;
+
+        std::vector<uint64_t> done;
+        {
+            std::unique_lock<std::mutex> lock(s.mu);
+            // Wake for a result, a stop, or the next host whose politeness delay runs out.
+            Clock::time_point wake = now + std::chrono::milliseconds(100);
+            if (more() && s.flights.size() < concurrency && !s.ready.empty()) wake = std::min(wake, s.ready.top().first);
+            s.cv.wait_until(lock, wake, [&] { return !s.done.empty() || stopping_; });
+            done.swap(s.done);
+        }
+        if (stopping_) {
+            // Abandon what is in flight; it goes back into the frontier below.
+            for (auto& [id, flight] : s.flights) flight.handle.cancel();
+            for (auto& [id, flight] : s.flights) {
+                HostQueue& h = *s.hosts[flight.host];
+                --h.in_flight;
+                s.push(h, flight.item.depth, flight.item.url);
+            }
+            s.flights.clear();
+            break;
+        }
+        for (const uint64_t id : done) {
+            const auto it = s.flights.find(id);
+            if (it == s.flights.end()) continue;
+            Flight flight = std::move(it->second);
+            s.flights.erase(it);
+            const CrawlPage page = s.finish(flight);
+            ++attempted;
+            if (on_page) on_page(page);
+            if (s.options.checkpoint_every && ++since_checkpoint >= s.options.checkpoint_every) {
+                checkpoint();
+                since_checkpoint = 0;
+            }
+        }
+    }
+    checkpoint();
+    return stats();
+}
+
+void Crawler::stop() {
+    stopping_ = true;
+    state_->cv.notify_all();
+}
+
+void Crawler::checkpoint() {
+    ++state_->totals.checkpoints;
+    state_->save();
+}
+
+CrawlStats Crawler::stats() const {
+    const State& s = *state_;
+    CrawlStats out = s.totals;
+    out.pending = 0;
+    for (const auto& h : s.hosts) out.pending += h->pending;
+    out.hosts = s.hosts.size();
+    out.bloom_bytes = s.bloom.bytes();
+    out.seen_bytes = s.seen.memoryBytes();
+    out.seconds = std::chrono::duration<double>(Clock::now() - s.started).count();
+    return out;
+}
+
+}  // namespace browser
@@ -0,0 +1,200 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <iosfwd>
+#include <list>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace browser {
+
+// Bloom filter that grows by adding stages, each twice the capacity of the last with half
+// its error rate, so the combined false-positive rate stays under `error_rate` however many
+// keys go in.
+class ScalableBloomFilter {
+public:
+    explicit ScalableBloomFilter(size_t initial_capacity = 1 << 16, double error_rate = 0.01);
+
+    bool mayContain(std::string_view key) const;
+    void add(std::string_view key);
+
+    size_t size() const { return size_; }
+    size_t stages() const { return stages_.size(); }
+    size_t bytes() const;
+
+    // Binary form for checkpoints; read() throws std::runtime_error on a malformed stream.
+    void write(std::ostream& out) const;
+    static ScalableBloomFilter read(std::istream& in);
+
+private:
+    struct Stage {
+        size_t capacity = 0;
+        size_t count = 0;
+        uint32_t hashes = 0;
+        uint64_t bit_count = 0;
+        std::vector<uint64_t> words;
+    };
+
+    void grow();
+
+    size_t initial_capacity_;
+    double error_rate_;
+    size_t size_ = 0;
+    std::vector<Stage> stages_;
+};
+
+// Set of the URLs a crawl has queued, kept as 64-bit fingerprints on disk rather than the
+// URLs themselves, so it is approximate on purpose: a URL's shard (one of 256) and its
+// fingerprint come from independent hashes, and a new URL is wrongly called seen only on a
+// 72-bit collision, about a 1e-4 chance over a whole billion-URL crawl. Comparing URL bytes
+// would cost a block read per duplicate link. Each shard is a few sorted run files whose
+// sizes at least double from newest to oldest. Memory holds every 512th fingerprint of each
+// run, the fingerprints not written yet and an LRU of 4 KB blocks, so a lookup reads at
+// most one block per run and memory grows with the store only through that sparse index.
+class SeenUrlStore {
+public:
+    struct Run {
+        size_t shard = 0;
+        uint64_t serial = 0;  // names the file
+        uint64_t count = 0;
+    };
+
+    struct Stats {
+        size_t lookups = 0;
+        size_t block_reads = 0;  // cache misses
+        size_t runs_written = 0;
+        size_t merges = 0;
+    };
+
+    // Run files go in `dir`, which must exist.
+    explicit SeenUrlStore(std::string dir, size_t cache_blocks = 256);
+
+    bool contains(std::string_view url);
+    void add(std::string_view url);
+
+    // Writes the buffered fingerprints out as runs, merging where sizes call for it.
+    void flush();
+    // Everything added, once flush()ed; restore() returns to it.
+    std::vector<Run> runs() const;
+    // Deletes the files of runs merged away since the last commit(). Until then the runs()
+    // recorded earlier stay restorable.
+    void commit();
+    // Drops anything added since `runs` was recorded, deleting every other run file; throws
+    // std::runtime_error when one of `runs` is missing or short.
+    void restore(const std::vector<Run>& runs);
+
+    uint64_t size() const;
+    size_t memoryBytes() const;
+    const Stats& stats() const { return stats_; }
+
+private:
+    struct RunIndex {
+        Run run;
+        uint64_t last = 0;
+        std::vector<uint64_t> firsts;  // of each block
+    };
+
+    bool find(const RunIndex& run, uint64_t fingerprint);
+    const std::vector<uint64_t>& block(const RunIndex& run, size_t index);
+    std::string path(uint64_t serial) const;
+    void mergeTail(size_t shard);
+    void forget(uint64_t serial);
+
+    std::string dir_;
+    size_t cache_blocks_;
+    std::vector<std::vector<RunIndex>> shards_;   // oldest run first
+    std::vector<std::vector<uint64_t>> buffers_;  // not written yet
+    size_t buffered_ = 0;
+    uint64_t next_serial_ = 1;
+    std::vector<uint64_t> retired_;
+    // Blocks by (serial << 32 | block), most recently used first.
+    std::list<std::pair<uint64_t, std::vector<uint64_t>>> cache_;
+    std::unordered_map<uint64_t, std::list<std::pair<uint64_t, std::vector<uint64_t>>>::iterator> cached_;
+    Stats stats_;
+};
+
+struct CrawlOptions {
+    std::vector<std::string> seeds;
+    // Frontier, seen-URL store and checkpoints live here.
+    std::string state_dir;
+    // Continue from state_dir's last checkpoint instead of starting over from the seeds.
+    bool resume = false;
+    size_t max_pages = 0;  // pages fetched by one run(); 0 runs until the frontier is empty
+    size_t max_depth = static_cast<size_t>(-1);
+    size_t concurrency = 16;
+    size_t per_host_concurrency = 1;
+    std::chrono::milliseconds host_delay{250};  // between request starts on one host
+    bool same_host = true;  // follow links only to the seeds' hosts
+    size_t checkpoint_every = 1000;  // pages; 0 checkpoints only when run() returns
+    size_t bloom_capacity = 1 << 20;
+    double bloom_error_rate = 0.01;
+    size_t seen_cache_blocks = 256;  // 4 KB blocks of the seen-URL store kept in memory
+    int timeout_seconds = 10;
+};
+
+struct CrawlPage {
+    std::string url;
+    size_t depth = 0;
+    std::string status_line;
+    std::string error;  // empty when the fetch succeeded
+    size_t bytes = 0;
+    size_t links = 0;   // new URLs it added to the frontier
+};
+
+struct CrawlStats {
+    size_t fetched = 0;
+    size_t failed = 0;
+    size_t non_2xx = 0;
+    size_t discovered = 0;        // URLs queued, seeds included
+    size_t duplicates = 0;        // links already seen
+    size_t bloom_false_positives = 0;
+    size_t pending = 0;           // queued and not fetched yet
+    size_t hosts = 0;
+    size_t body_bytes = 0;
+    size_t checkpoints = 0;
+    size_t bloom_bytes = 0;
+    size_t seen_bytes = 0;        // seen-URL store memory: index, write buffer, block cache
+    double seconds = 0;           // this run() so far
+};
+
+// Breadth-first crawler over AsyncFetcher. URLs wait in a frontier split per host into
+// append-only files under state_dir, with only a short read-ahead of each in memory, and
+// each host gets at most `per_host_concurrency` requests at a time spaced `host_delay`
+// apart. A URL is queued at most once: a scalable Bloom filter answers "new" for almost every
+// unseen URL, and its "maybe" (a duplicate link, or a rare false positive) is settled by a
+// SeenUrlStore on disk. Memory therefore stays bounded by the read-ahead, the Bloom filter
+// and the store's sparse index and block cache, whatever the frontier holds. checkpoint() records
+// the whole state; a crawler constructed with `resume` continues from it, re-queuing
+// whatever was in flight.
+class Crawler {
+public:
+    // Throws std::runtime_error when state_dir cannot be used, or on `resume` without a
+    // checkpoint there.
+    explicit Crawler(CrawlOptions options);
+    ~Crawler();
+
+    Crawler(const Crawler&) = delete;
+    Crawler& operator=(const Crawler&) = delete;
+
+    // Crawls until the frontier is empty, max_pages have been fetched or stop() is called,
+    // then checkpoints. `on_page` runs on this thread for every page fetched.
+    CrawlStats run(const std::function<void(const CrawlPage&)>& on_page = {});
+    // Safe from any thread, including from `on_page`.
+    void stop();
+    void checkpoint();
+    CrawlStats stats() const;
+
+    struct State;
+
+private:
+    std::unique_ptr<State> state_;
+    std::atomic<bool> stopping_{false};
+};
+
+}  // namespace browser
@@ -1,97 +1,259 @@
 #include "css.h"
 
 #include <algorithm>
+#include <chrono>
 #include <cctype>
-#include <sstream>
+#include <cstddef>
+#include <cstring>
+#include <iomanip>
+#include <ostream>
+#include <string_view>
 
 namespace browser {
 namespace {
 
-std::string lower(std::string s) {
-    std::transform(s.begin(), s.end(), s.begin(), [](unsigned char c) { return static_cast<char>(std::tolower(c)); });
-    return s;
+thread_local SelectorProfile* t_selector_profile = nullptr;
+
+bool is_space(char c) { return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\f'; }
+
+char lower_char(char c) { return (c >= 'A' && c <= 'Z') ? static_cast<char>(c - 'A' + 'a') : c; }
+
+std::string lower(std::string_view s) {
+    std::string out(s);
+    for (char& c : out) c = lower_char(c);
+    return out;
 }
 
-std::string trim(const std::string& s) {
-    const size_t b = s.find_first_not_of(" \t\r\n");
-    if (b == std::string::npos) return "";
-    const size_t e = s.find_last_not_of(" \t\r\n");
-    return s.substr(b, e - b + 1);
+std::string_view trim(std::string_view s) {
+    size_t b = 0;
+    size_t e = s.size();
+    while (b < e && is_space(s[b])) ++b;
+    while (e > b && is_space(s[e - 1])) --e;
+    return s.substr(b, e - b);
 }
 
-int parse_px(const std::string& s) {
-    std::string n;
-    for (char c : s) {
-        if ((c >= '0' && c <= '9') || c == '-') n.push_back(c);
-        else break;
+bool iequals(std::string_view a, std::string_view b) {
+    if (a.size() != b.size()) return false;
+    for (size_t i = 0; i < a.size(); ++i) {
+        if (lower_char(a[i]) != b[i]) return false;
     }
-    if (n.empty() || n == "-") return 0;
-    return std::stoi(n);
+    return true;
+}
+
+bool istarts_with(std::string_view s, std::string_view prefix) { return s.size() >= prefix.size() && iequals(s.substr(0, prefix.size()), prefix); }
+
+int parse_px(std::string_view s) {
+    size_t i = 0;
+    const bool negative = !s.empty() && s[0] == '-';
+    if (negative) ++i;
+    int v = 0;
+    for (; i < s.size() && s[i] >= '0' && s[i] <= '9'; ++i) v = std::min(v * 10 + (s[i] - '0'), 1000000);
+    return negative ? -v : v;
 }
 
-Color parse_color(const std::string& s) {
-    const std::string v = lower(trim(s));
-    if (v == "red") return {255, 0, 0, 255};
-    if (v == "green") return {0, 128, 0, 255};
-    if (v == "blue") return {0, 0, 255, 255};
-    if (v == "black") return {0, 0, 0, 255};
-    if (v == "white") return {255, 255, 255, 255};
-    if (v.size() == 7 && v[0] == '#') {
+bool parse_color(std::string_view s, Color& out) {
+    const std::string_view v = trim(s);
+    if (iequals(v, "red")) out = {255, 0, 0, 255};
+    else if (iequals(v, "green")) out = {0, 128, 0, 255};
+    else if (iequals(v, "blue")) out = {0, 0, 255, 255};
+    else if (iequals(v, "black")) out = {0, 0, 0, 255};
+    else if (iequals(v, "white")) out = {255, 255, 255, 255};
+    else if (v.size() == 7 && v[0] == '#') {
         auto h = [](char c) -> int {
+            c = lower_char(c);
             if (c >= '0' && c <= '9') return c - '0';
-            c = static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
             if (c >= 'a' && c <= 'f') return 10 + c - 'a';
             return 0;
         };
-        return {h(v[1]) * 16 + h(v[2]), h(v[3]) * 16 + h(v[4]), h(v[5]) * 16 + h(v[6]), 255};
+        auto byte = [&](size_t i) { return static_cast<uint8_t>(h(v[i]) * 16 + h(v[i + 1])); };
+        out = {byte(1), byte(3), byte(5), 255};
+    } else {
+        return false;
     }
-    return {};
+    return true;
 }
 
-std::string strip_comments(const std::string& in) {
-    std::string out;
-    for (size_t i = 0; i < in.size();) {
-        if (i + 1 < in.size() && in[i] == '/' && in[i + 1] == '*') {
-            size_t end = in.find("*/", i + 2);
-            if (end == std::string::npos) break;
-            i = end + 2;
+bool parse_display(std::string_view v, Display& out) {
+    if (iequals(v, "inline")) out = Display::INLINE;
+    else if (iequals(v, "block")) out = Display::BLOCK;
+    else if (iequals(v, "inline-block")) out = Display::INLINE_BLOCK;
+    else if (iequals(v, "list-item")) out = Display::LIST_ITEM;
+    else if (iequals(v, "flex") || iequals(v, "inline-flex")) out = Display::FLEX;
+    else if (iequals(v, "grid") || iequals(v, "inline-grid")) out = Display::GRID;
+    else if (iequals(v, "table")) out = Display::TABLE;
+    else if (iequals(v, "none")) out = Display::NONE;
+    else return false;
+    return true;
+}
+
+bool parse_visibility(std::string_view v, Visibility& out) {
+    if (iequals(v, "visible")) out = Visibility::VISIBLE;
+    else if (iequals(v, "hidden")) out = Visibility::HIDDEN;
+    else if (iequals(v, "collapse")) out = Visibility::COLLAPSE;
+    else return false;
+    return true;
+}
+
+int16_t clamp16(int v) { return static_cast<int16_t>(std::max(-32768, std::min(32767, v))); }
+
+// 1-4 value box shorthand (top right bottom left), as used by padding and margin.
+void parse_edges(std::string_view value, int16_t* edges) {
+    int16_t v[4] = {0, 0, 0, 0};
+    size_t n = 0;
+    size_t i = 0;
+    while (n < 4 && i < value.size()) {
+        while (i < value.size() && is_space(value[i])) ++i;
+        if (i >= value.size()) break;
+        size_t end = i;
+        while (end < value.size() && !is_space(value[end])) ++end;
+        v[n++] = clamp16(parse_px(value.substr(i, end - i)));
+        i = end;
+    }
+    if (n == 0) n = 1;
+    edges[0] = v[0];
+    edges[1] = n > 1 ? v[1] : v[0];
+    edges[2] = n > 2 ? v[2] : v[0];
+    edges[3] = n > 3 ? v[3] : edges[1];
+}
+
+struct FieldSpan {
+    size_t offset;
+    size_t size;
+};
+
+// Storage of each property inside StyleProperties, indexed by Property.
+const FieldSpan kPropertyFields[kPropertyCount] = {
+    {offsetof(StyleProperties, display), sizeof(Display)},
+    {offsetof(StyleProperties, visibility), sizeof(Visibility)},
+    {offsetof(StyleProperties, color), sizeof(Color)},
+    {offsetof(StyleProperties, font_size), sizeof(int16_t)},
+    {offsetof(StyleProperties, font_weight), sizeof(int16_t)},
+    {offsetof(StyleProperties, width), sizeof(int16_t)},
+    {offsetof(StyleProperties, padding_top), 4 * sizeof(int16_t)},
+    {offsetof(StyleProperties, margin_top), 4 * sizeof(int16_t)},
+};
+
+static_assert(offsetof(StyleProperties, padding_left) == offsetof(StyleProperties, padding_top) + 3 * sizeof(int16_t),
+              "padding edges must be contiguous");
+static_assert(offsetof(StyleProperties, margin_left) == offsetof(StyleProperties, margin_top) + 3 * sizeof(int16_t),
+              "margin edges must be contiguous");
+
+// Scanning primitives shared by the rule, selector and declaration passes. Each one
+// steps over comments and quoted strings so delimiters inside them are not seen.
+
+size_t skip_comment(std::string_view s, size_t i) {
+    const size_t end = s.find("*/", i + 2);
+    return end == std::string_view::npos ? s.size() : end + 2;
+}
+
+size_t skip_string(std::string_view s, size_t i) {
+    const char q = s[i++];
+    while (i < s.size() && s[i] != q) {
+        if (s[i] == '\\') ++i;
+        else if (s[i] == '\n') return i;
+        ++i;
+    }
+    return std::min(i + 1, s.size());
+}
+
+bool at_comment(std::string_view s, size_t i) { return s[i] == '/' && i + 1 < s.size() && s[i + 1] == '*'; }
+
+size_t skip_space_and_comments(std::string_view s, size_t i) {
+    while (i < s.size()) {
+        if (is_space(s[i])) ++i;
+        else if (at_comment(s, i)) i = skip_comment(s, i);
+        else break;
+    }
+    return i;
+}
+
+// Byte tables for find_top_level: what it has to look at, and where it stops. Built once
+// per stop set.
+struct StopSet {
+    bool special[256] = {};
+    bool stop[256] = {};
+
+    constexpr explicit StopSet(std::string_view stops) {
+        for (unsigned char c : std::string_view("\"'/()[]{}")) special[c] = true;
+        for (unsigned char c : stops) special[c] = stop[c] = true;
+    }
+};
+
+constexpr StopSet kDeclarationEnd(";");
+constexpr StopSet kNameEnd(":");
+constexpr StopSet kSelectorEnd(",");
+constexpr StopSet kPreludeEnd("{;");
+constexpr StopSet kBlockEnd("");
+
+// Position of the first byte in `stops` outside strings, comments and (), [], {} nesting,
+// or s.size(). A closing bracket that was never opened also stops the scan.
+size_t find_top_level(std::string_view s, size_t i, const StopSet& stops) {
+    int depth = 0;
+    while (i < s.size()) {
+        const unsigned char c = static_cast<unsigned char>(s[i]);
+        if (!stops.special[c]) {
+            ++i;
             continue;
         }
-        out.push_back(in[i++]);
+        if (c == '"' || c == '\'') {
+            i = skip_string(s, i);
+            continue;
+        }
+        if (at_comment(s, i)) {
+            i = skip_comment(s, i);
+            continue;
+        }
+        if (depth == 0 && stops.stop[c]) return i;
+        if (c == '(' || c == '[' || c == '{') ++depth;
+        else if (c == ')' || c == ']' || c == '}') {
+            if (depth == 0) return i;
+            --depth;
+        }
+        ++i;
+    }
+    return s.size();
+}
+
+// Copy of `s` without comments; only needed for the rare value or selector containing one.
+std::string without_comments(std::string_view s) {
+    std::string out;
+    out.reserve(s.size());
+    for (size_t i = 0; i < s.size();) {
+        if (s[i] == '"' || s[i] == '\'') {
+            const size_t end = skip_string(s, i);
+            out.append(s.substr(i, end - i));
+            i = end;
+        } else if (at_comment(s, i)) {
+            i = skip_comment(s, i);
+            out.push_back(' ');
+        } else {
+            out.push_back(s[i++]);
+        }
     }
     return out;
 }
 
-Selector parse_selector(std::string text) {
+Selector parse_selector(std::string_view text) {
     Selector s;
-    text = trim(lower(text));
+    text = trim(text);
 
-    size_t space = text.find(' ');
-    if (space != std::string::npos) {
-        s.ancestor_tag = trim(text.substr(0, space));
+    size_t space = 0;
+    while (space < text.size() && !is_space(text[space])) ++space;
+    if (space < text.size()) {
+        s.ancestor_tag = lower(text.substr(0, space));
         text = trim(text.substr(space + 1));
     }
 
-    std::string token;
-    for (size_t i = 0; i <= text.size(); ++i) {
-        const char c = (i < text.size()) ? text[i] : '\0';
-        if (c == '#' || c == '.' || c == '\0') {
-            if (!token.empty() && s.tag.empty()) s.tag = token;
-            token.clear();
-            if (c == '#') {
-                size_t j = i + 1;
-                while (j < text.size() && text[j] != '.' && text[j] != '#') ++j;
-                s.id = text.substr(i + 1, j - (i + 1));
-                i = j - 1;
-            } else if (c == '.') {
-                size_t j = i + 1;
-                while (j < text.size() && text[j] != '.' && text[j] != '#') ++j;
-                s.classes.push_back(text.substr(i + 1, j - (i + 1)));
-                i = j - 1;
-            }
-        } else {
-            token.push_back(c);
-        }
+    size_t i = 0;
+    while (i < text.size() && text[i] != '#' && text[i] != '.') ++i;
+    if (i > 0) s.tag = lower(text.substr(0, i));
+    while (i < text.size()) {
+        const char c = text[i];
+        size_t j = i + 1;
+        while (j < text.size() && text[j] != '.' && text[j] != '#') ++j;
+        if (c == '#') s.id = lower(text.substr(i + 1, j - i - 1));
+        else s.classes.push_back(lower(text.substr(i + 1, j - i - 1)));
+        i = j;
     }
 
     return s;
@@ -106,22 +268,27 @@ int specificity_of(const Selector& s) {
     return sp;
 }
 
-bool matches(const Selector& s, const ElementPtr& el) {
-    if (!s.tag.empty() && s.tag != el->tag_name) return false;
-    if (!s.id.empty() && el->getAttribute("id") != s.id) return false;
+bool matches(const Selector& s, const Element& el) {
+    if (!s.tag.empty() && s.tag != el.tag_name) return false;
+    if (!s.id.empty() && el.getAttribute("id") != s.id) return false;
 
     if (!s.classes.empty()) {
-        std::istringstream iss(el->getAttribute("class"));
-        std::vector<std::string> cls;
-        std::string c;
-        while (iss >> c) cls.push_back(c);
+        const std::string_view cls = el.getAttribute("class");
         for (const auto& need : s.classes) {
-            if (std::find(cls.begin(), cls.end(), need) == cls.end()) return false;
+            bool found = false;
+            for (size_t i = 0; i < cls.size() && !found;) {
+                while (i < cls.size() && std::isspace(static_cast<unsigned char>(cls[i]))) ++i;
+                size_t end = i;
+                while (end < cls.size() && !std::isspace(static_cast<unsigned char>(cls[end]))) ++end;
+                found = end > i && cls.substr(i, end - i) == need;
+                i = end;
+            }
+            if (!found) return false;
         }
     }
 
     if (!s.ancestor_tag.empty()) {
-        auto p = el->parent.lock();
+        auto p = el.parent.lock();
         bool found = false;
         while (p) {
             if (p->tag_name == s.ancestor_tag) {
@@ -136,103 +303,273 @@ bool matches(const Selector& s, const ElementPtr& el) {
     return true;
 }
 
-void apply_decl(StyleProperties& p, std::string name, std::string value) {
-    name = lower(trim(name));
+void apply_decl(StyleProperties& p, std::string_view name, std::string_view value) {
+    name = trim(name);
     value = trim(value);
-    if (name == "display") {
-        p.display = lower(value);
-        p.has_display = true;
-    } else if (name == "color") {
-        p.color = parse_color(value);
-        p.has_color = true;
-    } else if (name == "font-size") {
-        p.font_size = parse_px(value);
-        p.has_font_size = true;
-    } else if (name == "padding") {
-        const int v = parse_px(value);
-        p.padding_top = p.padding_right = p.padding_bottom = p.padding_left = v;
-        p.has_padding = true;
+    if (value.size() >= 10 && iequals(trim(value.substr(value.size() - 10)), "!important")) value = trim(value.substr(0, value.size() - 10));
+
+    if (iequals(name, "display")) {
+        if (parse_display(value, p.display)) p.set(Property::DISPLAY);
+    } else if (iequals(name, "visibility")) {
+        if (parse_visibility(value, p.visibility)) p.set(Property::VISIBILITY);
+    } else if (iequals(name, "color")) {
+        if (parse_color(value, p.color)) p.set(Property::COLOR);
+    } else if (iequals(name, "font-size")) {
+        p.font_size = clamp16(parse_px(value));
+        p.set(Property::FONT_SIZE);
+    } else if (iequals(name, "font-weight")) {
+        if (iequals(value, "normal")) p.font_weight = 400;
+        else if (iequals(value, "bold")) p.font_weight = 700;
+        else p.font_weight = clamp16(parse_px(value));
+        if (p.font_weight > 0) p.set(Property::FONT_WEIGHT);
+    } else if (iequals(name, "width")) {
+        if (iequals(value, "auto")) return;
+        p.width = clamp16(parse_px(value));
+        p.set(Property::WIDTH);
+    } else if (iequals(name, "padding")) {
+        parse_edges(value, &p.padding_top);
+        p.set(Property::PADDING);
+    } else if (iequals(name, "margin")) {
+        parse_edges(value, &p.margin_top);
+        p.set(Property::MARGIN);
     }
 }
 
-}  // namespace
+StyleProperties parse_declarations(std::string_view body) {
+    StyleProperties props;
+    size_t i = 0;
+    while (i < body.size()) {
+        const size_t end = find_top_level(body, i, kDeclarationEnd);
+        const std::string_view decl = body.substr(i, end - i);
+        i = end + 1;
 
-void StyleSheet::addRule(const Selector& selector, const StyleProperties& properties) {
-    rules_.push_back({selector, properties, specificity_of(selector), next_order_++});
+        const size_t colon = find_top_level(decl, 0, kNameEnd);
+        if (colon >= decl.size()) continue;
+        std::string_view name = decl.substr(0, colon);
+        std::string_view value = decl.substr(colon + 1);
+        if (name.find("/*") != std::string_view::npos || value.find("/*") != std::string_view::npos) {
+            const std::string clean_name = without_comments(name);
+            const std::string clean_value = without_comments(value);
+            apply_decl(props, clean_name, clean_value);
+        } else {
+            apply_decl(props, name, value);
+        }
+    }
+    return props;
 }
 
-StyleProperties StyleSheet::computeStyle(const ElementPtr& element) const {
-    StyleProperties out;
-    std::vector<Rule> applicable;
-    for (const auto& r : rules_) {
-        if (matches(r.selector, element)) applicable.push_back(r);
+// Calls `f` with each non-empty selector of a comma-separated list.
+template <typename F>
+void for_each_selector(std::string_view selectors, F&& f) {
+    std::string clean;
+    if (selectors.find("/*") != std::string_view::npos) {
+        clean = without_comments(selectors);
+        selectors = clean;
     }
 
-    std::sort(applicable.begin(), applicable.end(), [](const Rule& a, const Rule& b) {
-        if (a.specificity != b.specificity) return a.specificity < b.specificity;
-        return a.order < b.order;
-    });
+    size_t i = 0;
+    while (i <= selectors.size()) {
+        const size_t end = find_top_level(selectors, i, kSelectorEnd);
+        Selector parsed = parse_selector(selectors.substr(i, end - i));
+        if (!parsed.tag.empty() || !parsed.id.empty() || !parsed.classes.empty() || !parsed.ancestor_tag.empty()) f(std::move(parsed));
+        i = end + 1;
+    }
+}
+
+void add_rules(StyleSheet& sheet, std::string_view selectors, const StyleProperties& props) {
+    for_each_selector(selectors, [&](Selector&& parsed) { sheet.addRule(std::move(parsed), props); });
+}
+
+bool media_applies(std::string_view query) {
+    const std::string q = lower(query);
+    const bool print_only = q.find("print") != std::string::npos && q.find("screen") == std::string::npos && q.find("all") == std::string::npos;
+    return !print_only && q.find("speech") == std::string::npos;
+}
+
+constexpr int kMaxBlockNesting = 16;
 
-    for (const auto& r : applicable) {
-        if (r.properties.has_display) {
-            out.display = r.properties.display;
-            out.has_display = true;
+void parse_rule_list(std::string_view css, StyleSheet& sheet, int depth) {
+    size_t i = 0;
+    while (i < css.size()) {
+        i = skip_space_and_comments(css, i);
+        if (i >= css.size()) break;
+        if (css[i] == '}' || css[i] == ';') {
+            ++i;
+            continue;
         }
-        if (r.properties.has_color) {
-            out.color = r.properties.color;
-            out.has_color = true;
+
+        const size_t open = find_top_level(css, i, kPreludeEnd);
+        if (open >= css.size()) break;
+        const std::string_view prelude = trim(css.substr(i, open - i));
+        if (css[open] != '{') {
+            i = open + 1;
+            continue;
         }
-        if (r.properties.has_font_size) {
-            out.font_size = r.properties.font_size;
-            out.has_font_size = true;
+
+        const size_t close = find_top_level(css, open + 1, kBlockEnd);
+        const std::string_view body = css.substr(open + 1, close - open - 1);
+        i = close + 1;
+
+        if (prelude.empty()) continue;
+        if (prelude[0] != '@') {
+            add_rules(sheet, prelude, parse_declarations(body));
+            continue;
         }
-        if (r.properties.has_padding) {
-            out.padding_top = r.properties.padding_top;
-            out.padding_right = r.properties.padding_right;
-            out.padding_bottom = r.properties.padding_bottom;
-            out.padding_left = r.properties.padding_left;
-            out.has_padding = true;
+
+        // Conditional group rules contribute their nested rules; other at-rule blocks
+        // (@font-face, @keyframes, @page, ...) carry nothing this engine applies.
+        if (depth >= kMaxBlockNesting) continue;
+        if (istarts_with(prelude, "@media")) {
+            if (media_applies(prelude.substr(6))) parse_rule_list(body, sheet, depth + 1);
+        } else if (istarts_with(prelude, "@supports") || istarts_with(prelude, "@layer") || istarts_with(prelude, "@document")) {
+            parse_rule_list(body, sheet, depth + 1);
         }
     }
+}
 
-    return out;
+}  // namespace
+
+void StyleProperties::merge(const StyleProperties& other) {
+    if (!other.mask) return;
+    auto* dst = reinterpret_cast<unsigned char*>(this);
+    const auto* src = reinterpret_cast<const unsigned char*>(&other);
+    for (size_t p = 0; p < kPropertyCount; ++p) {
+        if (other.mask & (1u << p)) std::memcpy(dst + kPropertyFields[p].offset, src + kPropertyFields[p].offset, kPropertyFields[p].size);
+    }
+    mask = static_cast<uint16_t>(mask | other.mask);
 }
 
-StyleSheet parse_css(const std::string& css_text) {
-    StyleSheet sheet;
-    const std::string clean = strip_comments(css_text);
-
-    size_t pos = 0;
-    while (pos < clean.size()) {
-        const size_t open = clean.find('{', pos);
-        if (open == std::string::npos) break;
-        const size_t close = clean.find('}', open + 1);
-        if (close == std::string::npos) break;
-
-        const std::string selectors = clean.substr(pos, open - pos);
-        const std::string body = clean.substr(open + 1, close - open - 1);
-
-        StyleProperties props;
-        std::istringstream decls(body);
-        std::string d;
-        while (std::getline(decls, d, ';')) {
-            size_t colon = d.find(':');
-            if (colon == std::string::npos) continue;
-            apply_decl(props, d.substr(0, colon), d.substr(colon + 1));
-        }
+void StyleSheet::addRule(Selector selector, const StyleProperties& properties) {
+    const int specificity = specificity_of(selector);
+    rules_.push_back({std::move(selector), properties, specificity, next_order_++});
+
+    const Rule& r = rules_.back();
+    const std::string* strings[] = {&r.selector.ancestor_tag, &r.selector.tag, &r.selector.id};
+    for (const std::string* str : strings) {
+        rule_heap_bytes_ += string_heap_bytes(*str);
+        rule_heap_allocations_ += string_heap_bytes(*str) ? 1 : 0;
+    }
+    if (r.selector.classes.capacity()) {
+        rule_heap_bytes_ += r.selector.classes.capacity() * sizeof(std::string);
+        ++rule_heap_allocations_;
+    }
+    for (const auto& c : r.selector.classes) {
+        rule_heap_bytes_ += string_heap_bytes(c);
+        rule_heap_allocations_ += string_heap_bytes(c) ? 1 : 0;
+    }
+    memory_.set(footprintBytes(), 1 + rule_heap_allocations_);
+}
+
+size_t StyleSheet::footprintBytes() const { return sizeof(StyleSheet) + rules_.capacity() * sizeof(Rule) + rule_heap_bytes_; }
+
+StyleProperties StyleSheet::computeStyle(const ElementPtr& element) const { return computeStyle(*element); }
 
-        std::istringstream sels(selectors);
-        std::string s;
-        while (std::getline(sels, s, ',')) {
-            Selector parsed = parse_selector(s);
-            if (!parsed.tag.empty() || !parsed.id.empty() || !parsed.classes.empty() || !parsed.ancestor_tag.empty()) {
-                sheet.addRule(parsed, props);
+StyleProperties StyleSheet::computeStyle(const Element& element) const {
+    std::vector<const Rule*> applicable;
+    SelectorProfile* const profile = t_selector_profile && t_selector_profile->sheet_.get() == this ? t_selector_profile : nullptr;
+    if (profile) {
+        ++profile->elements_;
+        for (size_t i = 0; i < rules_.size(); ++i) {
+            const auto start = std::chrono::steady_clock::now();
+            const bool hit = matches(rules_[i].selector, element);
+            SelectorProfile::Counters& c = profile->counters_[i];
+            c.nanoseconds += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+            ++c.attempts;
+            if (hit) {
+                ++c.matches;
+                applicable.push_back(&rules_[i]);
             }
         }
+    } else {
+        for (const auto& r : rules_) {
+            if (matches(r.selector, element)) applicable.push_back(&r);
+        }
+    }
+
+    std::sort(applicable.begin(), applicable.end(), [](const Rule* a, const Rule* b) {
+        if (a->specificity != b->specificity) return a->specificity < b->specificity;
+        return a->order < b->order;
+    });
 
-        pos = close + 1;
+    StyleProperties out;
+    for (const Rule* r : applicable) out.merge(r->properties);
+    return out;
+}
+
+StyleDependencies StyleSheet::dependencies() const {
+    StyleDependencies out;
+    for (const auto& r : rules_) {
+        if (!r.selector.id.empty()) out.ids.insert(r.selector.id);
+        out.classes.insert(r.selector.classes.begin(), r.selector.classes.end());
     }
+    return out;
+}
+
+std::vector<Selector> parse_selector_list(std::string_view selectors) {
+    std::vector<Selector> out;
+    for_each_selector(selectors, [&](Selector&& parsed) { out.push_back(std::move(parsed)); });
+    return out;
+}
+
+bool selector_matches(const Selector& selector, const Element& element) { return matches(selector, element); }
+
+std::string selector_text(const Selector& selector) {
+    std::string out;
+    if (!selector.ancestor_tag.empty()) out += selector.ancestor_tag + " ";
+    out += selector.tag;
+    if (!selector.id.empty()) out += "#" + selector.id;
+    for (const auto& c : selector.classes) out += "." + c;
+    if (out.empty() || out.back() == ' ') out += "*";
+    return out;
+}
+
+SelectorProfile::SelectorProfile(StyleSheetPtr sheet) : sheet_(std::move(sheet)), counters_(sheet_ ? sheet_->ruleCount() : 0) {}
 
+double SelectorProfile::milliseconds() const {
+    int64_t total = 0;
+    for (const auto& c : counters_) total += c.nanoseconds;
+    return total / 1e6;
+}
+
+std::vector<RuleProfile> SelectorProfile::report() const {
+    std::vector<RuleProfile> out;
+    out.reserve(counters_.size());
+    for (size_t i = 0; i < counters_.size(); ++i) {
+        const Counters& c = counters_[i];
+        out.push_back({i, selector_text(sheet_->rules()[i].selector), c.attempts, c.matches, c.nanoseconds / 1e6});
+    }
+    std::stable_sort(out.begin(), out.end(), [](const RuleProfile& a, const RuleProfile& b) { return a.milliseconds > b.milliseconds; });
+    return out;
+}
+
+void SelectorProfile::write(std::ostream& out, size_t limit) const {
+    const std::ios::fmtflags flags = out.flags();
+    const std::streamsize precision = out.precision();
+    const double total = milliseconds();
+    out << "selector matching: " << elements_ << " elements x " << counters_.size() << " rules, " << std::fixed << std::setprecision(3) << total << " ms\n";
+    out << std::setw(10) << "ms" << std::setw(7) << "%" << std::setw(12) << "attempts" << std::setw(10) << "matches" << "  rule\n";
+    const std::vector<RuleProfile> rules = report();
+    for (size_t i = 0; i < rules.size() && i < limit; ++i) {
+        const RuleProfile& r = rules[i];
+        out << std::setw(10) << r.milliseconds << std::setw(7) << std::setprecision(1) << (total > 0 ? r.milliseconds * 100.0 / total : 0.0) << std::setprecision(3)
+            << std::setw(12) << r.attempts << std::setw(10) << r.matches << "  #" << r.rule << " " << r.selector << "\n";
+    }
+    out.flags(flags);
+    out.precision(precision);
+}
+
+void SelectorProfile::reset() {
+    elements_ = 0;
+    std::fill(counters_.begin(), counters_.end(), Counters());
+}
+
+SelectorProfileScope::SelectorProfileScope(SelectorProfile& profile) : previous_(t_selector_profile) { t_selector_profile = &profile; }
+
+SelectorProfileScope::~SelectorProfileScope() { t_selector_profile = previous_; }
+
+StyleSheet parse_css(const std::string& css_text) {
+    StyleSheet sheet;
+    parse_rule_list(css_text, sheet, 0);
     return sheet;
 }
 
@@ -2,33 +2,64 @@
 
 #include "dom.h"
 
+#include <cstdint>
+#include <cstring>
+#include <iosfwd>
+#include <memory>
 #include <string>
+#include <string_view>
+#include <type_traits>
+#include <unordered_map>
 #include <vector>
 
 namespace browser {
 
 struct Color {
-    int r = 0;
-    int g = 0;
-    int b = 0;
-    int a = 255;
+    uint8_t r = 0;
+    uint8_t g = 0;
+    uint8_t b = 0;
+    uint8_t a = 255;
 };
 
+enum class Display : uint8_t { INLINE, BLOCK, INLINE_BLOCK, LIST_ITEM, FLEX, GRID, TABLE, NONE };
+enum class Visibility : uint8_t { VISIBLE, HIDDEN, COLLAPSE };
+
+enum class Property : uint8_t { DISPLAY, VISIBILITY, COLOR, FONT_SIZE, FONT_WEIGHT, WIDTH, PADDING, MARGIN };
+
+constexpr size_t kPropertyCount = 8;
+
+// Compiled declaration block: keywords are enum-coded, lengths are px, and `mask` says
+// which properties were declared. Trivially copyable so the cascade is a masked blend.
 struct StyleProperties {
-    std::string display;
+    uint16_t mask = 0;
+    Display display = Display::INLINE;
+    Visibility visibility = Visibility::VISIBLE;
     Color color;
-    int font_size = 16;
-    int padding_top = 0;
-    int padding_right = 0;
-    int padding_bottom = 0;
-    int padding_left = 0;
-
-    bool has_display = false;
-    bool has_color = false;
-    bool has_font_size = false;
-    bool has_padding = false;
+    int16_t font_size = 16;
+    int16_t font_weight = 400;
+    int16_t width = 0;
+    int16_t padding_top = 0;
+    int16_t padding_right = 0;
+    int16_t padding_bottom = 0;
+    int16_t padding_left = 0;
+    int16_t margin_top = 0;
+    int16_t margin_right = 0;
+    int16_t margin_bottom = 0;
+    int16_t margin_left = 0;
+
+    bool has(Property p) const { return (mask & (1u << static_cast<unsigned>(p))) != 0; }
+    void set(Property p) { mask = static_cast<uint16_t>(mask | (1u << static_cast<unsigned>(p))); }
+
+    // Overwrites every property declared in `other`, leaving the rest untouched.
+    void merge(const StyleProperties& other);
 };
 
+static_assert(std::is_trivially_copyable<StyleProperties>::value, "StyleProperties must stay trivially copyable");
+static_assert(std::has_unique_object_representations_v<StyleProperties>, "StyleProperties must have no padding, so it compares bytewise");
+
+inline bool operator==(const StyleProperties& a, const StyleProperties& b) { return std::memcmp(&a, &b, sizeof(StyleProperties)) == 0; }
+inline bool operator!=(const StyleProperties& a, const StyleProperties& b) { return !(a == b); }
+
 struct Selector {
     std::string ancestor_tag;
     std::string tag;
@@ -38,10 +69,6 @@ struct Selector {
 
 class StyleSheet {
 public:
-    void addRule(const Selector& selector, const StyleProperties& properties);
-    StyleProperties computeStyle(const ElementPtr& element) const;
-
-private:
     struct Rule {
         Selector selector;
         StyleProperties properties;
@@ -49,10 +76,83 @@ private:
         size_t order = 0;
     };
 
+    void addRule(Selector selector, const StyleProperties& properties);
+    StyleProperties computeStyle(const ElementPtr& element) const;
+    StyleProperties computeStyle(const Element& element) const;
+    // Ids and classes the rules' selectors test on the element being styled.
+    StyleDependencies dependencies() const;
+    size_t ruleCount() const { return rules_.size(); }
+    const std::vector<Rule>& rules() const { return rules_; }
+    size_t footprintBytes() const;
+
+private:
     std::vector<Rule> rules_;
     size_t next_order_ = 0;
+    size_t rule_heap_bytes_ = 0;
+    size_t rule_heap_allocations_ = 0;
+    MemoryCharge memory_{MemoryCategory::STYLE_RULES};
 };
 
+using StyleSheetPtr = std::shared_ptr<const StyleSheet>;
+using ComputedStyles = std::unordered_map<const Element*, StyleProperties>;
+
 StyleSheet parse_css(const std::string& css_text);
 
+// Comma-separated selectors; empty ones are dropped.
+std::vector<Selector> parse_selector_list(std::string_view selectors);
+bool selector_matches(const Selector& selector, const Element& element);
+// Selector in CSS syntax, e.g. "ul li.item".
+std::string selector_text(const Selector& selector);
+
+struct RuleProfile {
+    size_t rule = 0;  // index into StyleSheet::rules()
+    std::string selector;
+    uint64_t attempts = 0;
+    uint64_t matches = 0;
+    double milliseconds = 0;  // in the matcher, ancestor walks included
+};
+
+// Per-rule selector-matching counters for one stylesheet. The sheet itself stays immutable:
+// computeStyle records into the profile installed on the calling thread by a
+// SelectorProfileScope, which costs two clock reads per rule tried. A profile must not be
+// installed on two threads at once.
+class SelectorProfile {
+public:
+    explicit SelectorProfile(StyleSheetPtr sheet);
+
+    const StyleSheetPtr& sheet() const { return sheet_; }
+    size_t elements() const { return elements_; }
+    double milliseconds() const;
+    // Every rule, most time spent first.
+    std::vector<RuleProfile> report() const;
+    // The first `limit` entries of report() as a table.
+    void write(std::ostream& out, size_t limit = 20) const;
+    void reset();
+
+private:
+    friend class StyleSheet;
+
+    struct Counters {
+        uint64_t attempts = 0;
+        uint64_t matches = 0;
+        int64_t nanoseconds = 0;
+    };
+
+    StyleSheetPtr sheet_;
+    std::vector<Counters> counters_;
+    size_t elements_ = 0;
+};
+
+class SelectorProfileScope {
+public:
+    explicit SelectorProfileScope(SelectorProfile& profile);
+    ~SelectorProfileScope();
+
+    SelectorProfileScope(const SelectorProfileScope&) = delete;
+    SelectorProfileScope& operator=(const SelectorProfileScope&) = delete;
+
+private:
+    SelectorProfile* previous_;
+};
+
 }  // namespace browser
@@ -2,8 +2,7 @@
 
 #include <algorithm>
 #include <cctype>
-#include <stack>
-#include <unordered_set>
+#include <iterator>
 
 namespace browser {
 namespace {
@@ -13,141 +12,756 @@ std::string lower(std::string s) {
     return s;
 }
 
-std::string trim(const std::string& s) {
-    const size_t b = s.find_first_not_of(" \t\r\n");
-    if (b == std::string::npos) return "";
-    const size_t e = s.find_last_not_of(" \t\r\n");
-    return s.substr(b, e - b + 1);
+// make_shared places the object and its control block in a single allocation.
+constexpr size_t kControlBlockBytes = 16;
+constexpr size_t kMapNodeOverheadBytes = 32;
+
+size_t heap_allocations(const std::string& s) { return string_heap_bytes(s) ? 1 : 0; }
+
+void adjust(MemoryAccount& account, MemoryCategory category, uint32_t& bytes, uint32_t& allocations, int64_t dbytes, int64_t dallocations) {
+    if (dbytes > 0 || dallocations > 0) account.charge(category, dbytes > 0 ? dbytes : 0, dallocations > 0 ? dallocations : 0);
+    if (dbytes < 0 || dallocations < 0) account.release(category, dbytes < 0 ? -dbytes : 0, dallocations < 0 ? -dallocations : 0);
+    bytes = static_cast<uint32_t>(bytes + dbytes);
+    allocations = static_cast<uint32_t>(allocations + dallocations);
 }
 
-bool is_void(const std::string& tag) {
-    static const std::unordered_set<std::string> kVoid = {
+bool is_void(std::string_view tag) {
+    static constexpr std::string_view kVoid[] = {
         "area", "base", "br", "col", "embed", "hr", "img", "input", "link", "meta", "param", "source", "track", "wbr"};
-    return kVoid.find(tag) != kVoid.end();
+    return std::find(std::begin(kVoid), std::end(kVoid), tag) != std::end(kVoid);
 }
 
-void parse_attributes(const std::string& src, ElementPtr& el) {
-    size_t i = 0;
-    while (i < src.size()) {
-        while (i < src.size() && std::isspace(static_cast<unsigned char>(src[i]))) ++i;
-        if (i >= src.size()) break;
+bool is_space(char c) { return std::isspace(static_cast<unsigned char>(c)) != 0; }
+
+void trim_range(std::string_view s, size_t& b, size_t& e) {
+    while (b < e && is_space(s[b])) ++b;
+    while (e > b && is_space(s[e - 1])) --e;
+}
+
+// `needle` must be lowercase.
+size_t find_ci(std::string_view hay, std::string_view needle, size_t from) {
+    for (size_t i = from; i + needle.size() <= hay.size(); ++i) {
+        size_t k = 0;
+        while (k < needle.size() && std::tolower(static_cast<unsigned char>(hay[i + k])) == needle[k]) ++k;
+        if (k == needle.size()) return i;
+    }
+    return std::string_view::npos;
+}
+
+// Element::style_flags_ bits. Every ancestor of a marked element has STYLE_DESCENDANT.
+constexpr uint8_t STYLE_SELF = 1;
+constexpr uint8_t STYLE_SUBTREE = 2;
+constexpr uint8_t STYLE_DESCENDANT = 4;
+
+// Element::layout_flags_ bits. Marking always walks to the root, since a layout pass skips
+// hidden subtrees and leaves their marks behind.
+constexpr uint8_t LAYOUT_SELF = 1;
+constexpr uint8_t LAYOUT_DESCENDANT = 2;
+
+// Calls `f` once per distinct whitespace-separated class name.
+template <typename F>
+void for_each_class(std::string_view cls, F&& f) {
+    for (size_t i = 0; i < cls.size();) {
+        while (i < cls.size() && is_space(cls[i])) ++i;
+        size_t end = i;
+        while (end < cls.size() && !is_space(cls[end])) ++end;
+        const std::string_view name = cls.substr(i, end - i);
+        bool repeated = false;
+        for (size_t j = 0; j < i && !repeated;) {
+            while (j < i && is_space(cls[j])) ++j;
+            size_t k = j;
+            while (k < i && !is_space(cls[k])) ++k;
+            repeated = k > j && cls.substr(j, k - j) == name;
+            j = k;
+        }
+        if (!name.empty() && !repeated) f(name);
+        i = end;
+    }
+}
+
+// [begin, end) of the source, shared with it unless entity decoding changes the bytes.
+BufferSlice source_text(const SharedBuffer& source, size_t begin, size_t end, MemoryCategory category) {
+    const std::string_view text = source.view().substr(begin, end - begin);
+    if (text.find('&') == std::string_view::npos) return source.slice(begin, end - begin);
+    return BufferSlice::copy(decode_html_entities(text), category);
+}
+
+const BufferSlice& true_value() {
+    static const BufferSlice value = [] {
+        MemoryAccountScope unaccounted(nullptr);
+        return BufferSlice::copy("true", MemoryCategory::DOM_ATTRIBUTES);
+    }();
+    return value;
+}
+
+// Appends lowercase `s` to `names`, which the caller has reserved so views stay valid.
+std::string_view append_lower(std::string& names, std::string_view s) {
+    const size_t at = names.size();
+    for (char c : s) names.push_back(static_cast<char>(std::tolower(static_cast<unsigned char>(c))));
+    return std::string_view(names).substr(at);
+}
+
+void tokenize_attributes(std::string_view src, size_t i, size_t end, std::string& names, std::vector<HtmlAttribute>& out) {
+    while (i < end) {
+        while (i < end && is_space(src[i])) ++i;
+        if (i >= end) break;
 
         size_t name_end = i;
-        while (name_end < src.size() && !std::isspace(static_cast<unsigned char>(src[name_end])) && src[name_end] != '=') ++name_end;
-        std::string key = lower(src.substr(i, name_end - i));
+        while (name_end < end && !is_space(src[name_end]) && src[name_end] != '=') ++name_end;
+        const std::string_view key = append_lower(names, src.substr(i, name_end - i));
         i = name_end;
 
-        while (i < src.size() && std::isspace(static_cast<unsigned char>(src[i]))) ++i;
-        if (i >= src.size() || src[i] != '=') {
-            if (!key.empty()) el->setAttribute(key, "true");
+        while (i < end && is_space(src[i])) ++i;
+        if (i >= end || src[i] != '=') {
+            if (!key.empty()) out.push_back({key, std::string_view(), false});
             continue;
         }
 
         ++i;
-        while (i < src.size() && std::isspace(static_cast<unsigned char>(src[i]))) ++i;
-        if (i >= src.size()) break;
+        while (i < end && is_space(src[i])) ++i;
+        if (i >= end) break;
 
-        std::string value;
+        size_t value_begin = i;
+        size_t value_end = i;
         if (src[i] == '"' || src[i] == '\'') {
             const char q = src[i++];
-            size_t end = src.find(q, i);
-            if (end == std::string::npos) end = src.size();
-            value = src.substr(i, end - i);
-            i = (end < src.size()) ? end + 1 : end;
+            size_t close = src.find(q, i);
+            if (close == std::string_view::npos || close > end) close = end;
+            value_begin = i;
+            value_end = close;
+            i = (close < end) ? close + 1 : close;
         } else {
-            size_t end = i;
-            while (end < src.size() && !std::isspace(static_cast<unsigned char>(src[end]))) ++end;
-            value = src.substr(i, end - i);
-            i = end;
+            while (value_end < end && !is_space(src[value_end])) ++value_end;
+            i = value_end;
         }
 
-        if (!key.empty()) el->setAttribute(key, trim(value));
+        trim_range(src, value_begin, value_end);
+        if (!key.empty()) out.push_back({key, src.substr(value_begin, value_end - value_begin), true});
     }
 }
 
+class TreeBuilder : public HtmlVisitor {
+public:
+    TreeBuilder(const SharedBuffer& source, ElementPtr root, const ParseOptions& options) : source_(source), options_(options) {
+        open_.push_back(std::move(root));
+    }
+
+    // Builds `html`, a view of the source, beneath the root.
+    void build(std::string_view html) { tokenizer_.finish(html); }
+
+    struct Deferred {
+        ElementPtr element;
+        size_t begin = 0;
+        size_t end = 0;
+    };
+
+    // Content deferred by options.defer, in document order.
+    std::vector<Deferred>& deferred() { return deferred_; }
+
+    void startTag(std::string_view name, const std::vector<HtmlAttribute>& attributes, bool self_closing) override {
+        if (skip_depth_) {
+            if (!self_closing) ++skip_depth_;
+            return;
+        }
+        auto el = Element::create(std::string(name));
+        for (const auto& a : attributes) {
+            el->setAttribute(std::string(a.name), a.has_value ? sourceText(a.value, MemoryCategory::DOM_ATTRIBUTES) : true_value());
+        }
+        open_.back()->appendChild(el);
+        if (self_closing) return;
+        if (options_.defer && options_.defer(el)) {
+            // Only the nesting is tracked until the matching end tag.
+            deferred_.push_back({std::move(el), tokenizer_.tagBegin(), source_.size()});
+            skip_depth_ = 1;
+            return;
+        }
+        open_.push_back(std::move(el));
+    }
+
+    void endTag(std::string_view) override {
+        if (skip_depth_) {
+            if (--skip_depth_ == 0) deferred_.back().end = tokenizer_.tagEnd();
+            return;
+        }
+        if (open_.size() > 1) open_.pop_back();
+    }
+
+    void text(std::string_view text) override {
+        if (skip_depth_ || text.find_first_not_of(" \t\r\n") == std::string_view::npos) return;
+        open_.back()->appendChild(TextNode::create(sourceText(text, MemoryCategory::DOM_TEXT)));
+    }
+
+    void rawText(std::string_view, std::string_view text) override {
+        if (!skip_depth_ && !text.empty()) open_.back()->appendChild(TextNode::create(source_.slice(offset(text), text.size())));
+    }
+
+private:
+    size_t offset(std::string_view part) const { return static_cast<size_t>(part.data() - source_.data()); }
+
+    BufferSlice sourceText(std::string_view part, MemoryCategory category) const {
+        return source_text(source_, offset(part), offset(part) + part.size(), category);
+    }
+
+    const SharedBuffer& source_;
+    const ParseOptions& options_;
+    HtmlTokenizer tokenizer_{*this};
+    std::vector<ElementPtr> open_;
+    std::vector<Deferred> deferred_;
+    size_t skip_depth_ = 0;  // open elements of deferred content, the deferred one included
+};
+
 }  // namespace
 
-Element::Element(const std::string& name) : Node(NodeType::ELEMENT), tag_name(lower(name)) {}
+Node::~Node() {
+    if (!memory_) return;
+    memory_->release(MemoryCategory::DOM_NODES, node_bytes_, node_allocations_);
+    memory_->release(payloadCategory(), payload_bytes_, payload_allocations_);
+}
+
+void Node::chargeNode(int64_t bytes, int64_t allocations) {
+    if (memory_) adjust(*memory_, MemoryCategory::DOM_NODES, node_bytes_, node_allocations_, bytes, allocations);
+}
+
+void Node::chargePayload(int64_t bytes, int64_t allocations) {
+    if (memory_) adjust(*memory_, payloadCategory(), payload_bytes_, payload_allocations_, bytes, allocations);
+}
+
+MemoryCategory Node::payloadCategory() const {
+    return type == NodeType::TEXT ? MemoryCategory::DOM_TEXT : MemoryCategory::DOM_ATTRIBUTES;
+}
+
+Element::Element(const std::string& name) : Node(NodeType::ELEMENT), tag_name(lower(name)) {
+    chargeNode(sizeof(Element) + kControlBlockBytes + string_heap_bytes(tag_name), 1 + heap_allocations(tag_name));
+}
+
+Element::~Element() {
+    if (document_ && document_ != this) document_->detach(*this, false);
+}
+
 ElementPtr Element::create(const std::string& name) { return std::make_shared<Element>(name); }
 
 void Element::appendChild(const NodePtr& child) {
+    const size_t capacity = children.capacity();
     children.push_back(child);
     child->parent = shared_from_this();
+    if (children.capacity() != capacity) {
+        chargeNode(static_cast<int64_t>((children.capacity() - capacity) * sizeof(NodePtr)), capacity ? 0 : 1);
+    }
+    if (document_ && child->type == NodeType::ELEMENT) document_->attach(static_cast<Element&>(*child));
+    if (document_ && document_->tracking_style_) document_->invalidateLayout(*this);
+}
+
+bool Element::removeChild(const NodePtr& node) {
+    // `node` may be the very entry being erased.
+    const NodePtr child = node;
+    const auto it = std::find(children.begin(), children.end(), child);
+    if (it == children.end()) return false;
+    children.erase(it);
+    child->parent.reset();
+    if (document_ && child->type == NodeType::ELEMENT) document_->detach(static_cast<Element&>(*child), true);
+    if (document_ && document_->tracking_style_) document_->invalidateLayout(*this);
+    return true;
+}
+
+bool Element::materialize() {
+    if (!deferred_) return false;
+    const std::unique_ptr<DeferredContent> content = std::move(deferred_);
+    chargeNode(-static_cast<int64_t>(sizeof(DeferredContent)), -1);
+    // The range parses back into a copy of this element; its children move over.
+    const ElementPtr holder = Element::create("#fragment");
+    const ParseOptions full;
+    TreeBuilder builder(content->source, holder, full);
+    builder.build(content->source.view().substr(content->begin, content->end - content->begin));
+    if (holder->children.empty() || holder->children.front()->type != NodeType::ELEMENT) return true;
+    const std::vector<NodePtr> children = std::move(static_cast<Element&>(*holder->children.front()).children);
+    for (const NodePtr& child : children) appendChild(child);
+    return true;
 }
 
-std::string Element::getAttribute(const std::string& key) const {
+std::string_view Element::getAttribute(const std::string& key) const {
     auto it = attributes.find(lower(key));
-    return it == attributes.end() ? "" : it->second;
+    return it == attributes.end() ? std::string_view() : it->second.view();
 }
 
-void Element::setAttribute(const std::string& key, const std::string& value) { attributes[lower(key)] = value; }
+void Element::setAttribute(const std::string& key, const std::string& value) {
+    setAttribute(key, BufferSlice::copy(value, MemoryCategory::DOM_ATTRIBUTES));
+}
+
+void Element::setAttribute(const std::string& key, BufferSlice value) {
+    auto inserted = attributes.emplace(lower(key), BufferSlice());
+    const BufferSlice before = std::move(inserted.first->second);
+    inserted.first->second = std::move(value);
+
+    // Values are charged by the buffer they live in; the map node and key are ours.
+    const std::string& name = inserted.first->first;
+    if (inserted.second) {
+        chargePayload(static_cast<int64_t>(kMapNodeOverheadBytes + sizeof(*inserted.first) + string_heap_bytes(name)),
+                      static_cast<int64_t>(1 + heap_allocations(name)));
+    }
+    if (document_ && document_ != this && (name == "id" || name == "class")) {
+        document_->attributeChanged(*this, name, before.view(), inserted.first->second.view());
+    }
+    // Inline display:none hides the element from layout.
+    if (document_ && document_ != this && name == "style" && document_->tracking_style_) document_->invalidateLayout(*this);
+}
+
+Document::Document() : Element("document") {
+    document_ = this;
+    chargeNode(sizeof(Document) - sizeof(Element), 0);
+}
+
+Document::~Document() {
+    // Children outlive this body; stop them from reporting back to a dead index.
+    for (const auto& [tag, bucket] : by_tag_) {
+        for (Element* el : bucket) el->document_ = nullptr;
+    }
+}
+
+DocumentPtr Document::create() { return std::make_shared<Document>(); }
+
+bool Document::byOrder(const Element* a, const Element* b) { return a->order_ < b->order_; }
+
+void Document::attach(Element& root) {
+    if (tracking_style_) markStyle(root, STYLE_SUBTREE);
+    // Parsing appends in document order: each new subtree hangs off the last indexed
+    // element or one of its ancestors. Anything else is renumbered before the next query.
+    if (in_order_) {
+        const ElementPtr parent = root.parent.lock();
+        bool at_end = false;
+        for (Element* p = last_; p && !at_end; p = p->parent.lock().get()) at_end = p == parent.get();
+        if (!at_end) in_order_ = false;
+    }
+
+    std::vector<Element*> stack{&root};
+    while (!stack.empty()) {
+        Element* el = stack.back();
+        stack.pop_back();
+        if (el->document_ == this) continue;
+        if (el->document_) el->document_->detach(*el, false);
+
+        el->document_ = this;
+        el->order_ = next_order_++;
+        // A new element may reuse a removed one's address; never let it pass for that one.
+        if (tracking_style_) el->layout_flags_ |= LAYOUT_SELF;
+        ++indexed_;
+        insert(by_tag_, el->tag_name, el);
+        const std::string_view id = el->getAttribute("id");
+        if (!id.empty()) insert(by_id_, id, el);
+        for_each_class(el->getAttribute("class"), [&](std::string_view name) { insert(by_class_, name, el); });
+        last_ = el;
+
+        for (auto it = el->children.rbegin(); it != el->children.rend(); ++it) {
+            if ((*it)->type == NodeType::ELEMENT) stack.push_back(static_cast<Element*>(it->get()));
+        }
+    }
+}
+
+void Document::detach(Element& root, bool subtree) {
+    std::vector<Element*> stack{&root};
+    while (!stack.empty()) {
+        Element* el = stack.back();
+        stack.pop_back();
+        if (el->document_ != this) continue;
+
+        if (tracking_style_) removed_.push_back(el);
+        erase(by_tag_, el->tag_name, el);
+        const std::string_view id = el->getAttribute("id");
+        if (!id.empty()) erase(by_id_, id, el);
+        for_each_class(el->getAttribute("class"), [&](std::string_view name) { erase(by_class_, name, el); });
+        el->document_ = nullptr;
+        --indexed_;
+        if (el == last_) last_ = this;
+
+        if (!subtree) continue;
+        for (const auto& child : el->children) {
+            if (child->type == NodeType::ELEMENT) stack.push_back(static_cast<Element*>(child.get()));
+        }
+    }
+}
+
+void Document::attributeChanged(Element& el, const std::string& key, std::string_view before, std::string_view after) {
+    if (key == "id") {
+        if (!before.empty()) erase(by_id_, before, &el);
+        if (!after.empty()) insert(by_id_, after, &el);
+        if (tracking_style_ && (style_dependencies_.ids.count(std::string(before)) || style_dependencies_.ids.count(std::string(after)))) {
+            markStyle(el, STYLE_SELF);
+        }
+        return;
+    }
+    bool restyle = false;
+    const auto changed = [&](std::string_view from, std::string_view to) {
+        for_each_class(from, [&](std::string_view name) {
+            if (restyle || !style_dependencies_.classes.count(std::string(name))) return;
+            bool kept = false;
+            for_each_class(to, [&](std::string_view other) { kept = kept || other == name; });
+            restyle = !kept;
+        });
+    };
+    for_each_class(before, [&](std::string_view name) { erase(by_class_, name, &el); });
+    for_each_class(after, [&](std::string_view name) { insert(by_class_, name, &el); });
+    if (!tracking_style_) return;
+    changed(before, after);
+    changed(after, before);
+    if (restyle) markStyle(el, STYLE_SELF);
+}
+
+void Document::trackStyle(StyleDependencies dependencies) {
+    style_dependencies_ = std::move(dependencies);
+    tracking_style_ = true;
+    removed_.clear();
+    markStyle(*this, STYLE_SUBTREE);
+}
+
+void Document::stopTrackingStyle() {
+    tracking_style_ = false;
+    style_dependencies_ = StyleDependencies();
+    removed_ = std::vector<const Element*>();
+}
+
+void Document::markStyle(Element& el, uint8_t flags) {
+    el.style_flags_ |= flags;
+    for (ElementPtr p = el.parent.lock(); p && !(p->style_flags_ & STYLE_DESCENDANT); p = p->parent.lock()) {
+        p->style_flags_ |= STYLE_DESCENDANT;
+    }
+}
+
+size_t Document::flushStyle(const std::function<void(Element&)>& restyle) {
+    size_t visited = 0;
+    std::vector<std::pair<Element*, bool>> stack{{this, false}};
+    while (!stack.empty()) {
+        auto [el, forced] = stack.back();
+        stack.pop_back();
+        const uint8_t flags = el->style_flags_;
+        el->style_flags_ = 0;
+        forced = forced || (flags & STYLE_SUBTREE);
+        if (forced || (flags & STYLE_SELF)) {
+            restyle(*el);
+            ++visited;
+        }
+        if (!forced && !(flags & STYLE_DESCENDANT)) continue;
+        for (auto it = el->children.rbegin(); it != el->children.rend(); ++it) {
+            if ((*it)->type != NodeType::ELEMENT) continue;
+            Element* child = static_cast<Element*>(it->get());
+            if (forced || child->style_flags_) stack.emplace_back(child, forced);
+        }
+    }
+    return visited;
+}
+
+void Document::invalidateLayout(Element& el) {
+    el.layout_flags_ |= LAYOUT_SELF;
+    for (ElementPtr p = el.parent.lock(); p; p = p->parent.lock()) p->layout_flags_ |= LAYOUT_DESCENDANT;
+}
+
+Document::LayoutMarks Document::takeLayoutMarks(Element& el) {
+    LayoutMarks marks;
+    marks.self = el.layout_flags_ & LAYOUT_SELF;
+    marks.descendants = el.layout_flags_ & LAYOUT_DESCENDANT;
+    el.layout_flags_ = 0;
+    return marks;
+}
+
+std::vector<const Element*> Document::takeRemovedElements() {
+    std::vector<const Element*> out;
+    out.swap(removed_);
+    return out;
+}
+
+void Document::insert(Index& index, std::string_view key, Element* el) {
+    auto it = index.find(std::string(key));
+    if (it == index.end()) {
+        it = index.emplace(std::string(key), Bucket()).first;
+        chargeNode(static_cast<int64_t>(kMapNodeOverheadBytes + sizeof(Index::value_type) + string_heap_bytes(it->first)),
+                   static_cast<int64_t>(1 + heap_allocations(it->first)));
+    }
+    Bucket& bucket = it->second;
+    const size_t capacity = bucket.capacity();
+    const auto pos = in_order_ ? std::upper_bound(bucket.begin(), bucket.end(), el, byOrder) : bucket.end();
+    bucket.insert(pos, el);
+    if (bucket.capacity() != capacity) {
+        chargeNode(static_cast<int64_t>((bucket.capacity() - capacity) * sizeof(Element*)), capacity ? 0 : 1);
+    }
+}
+
+void Document::erase(Index& index, std::string_view key, Element* el) {
+    const auto it = index.find(std::string(key));
+    if (it == index.end()) return;
+    Bucket& bucket = it->second;
+    auto pos = in_order_ ? std::lower_bound(bucket.begin(), bucket.end(), el, byOrder) : bucket.begin();
+    pos = std::find(pos, bucket.end(), el);
+    if (pos != bucket.end()) bucket.erase(pos);
+    if (!bucket.empty()) return;
+
+    chargeNode(-static_cast<int64_t>(kMapNodeOverheadBytes + sizeof(Index::value_type) + string_heap_bytes(it->first) + bucket.capacity() * sizeof(Element*)),
+               -static_cast<int64_t>(1 + heap_allocations(it->first) + (bucket.capacity() ? 1 : 0)));
+    index.erase(it);
+}
+
+const Document::Bucket* Document::find(const Index& index, std::string_view key) const {
+    ensureOrder();
+    const auto it = index.find(std::string(key));
+    return it == index.end() ? nullptr : &it->second;
+}
+
+void Document::ensureOrder() const {
+    if (in_order_) return;
+    next_order_ = 1;
+    std::vector<Element*> stack;
+    for (auto it = children.rbegin(); it != children.rend(); ++it) {
+        if ((*it)->type == NodeType::ELEMENT) stack.push_back(static_cast<Element*>(it->get()));
+    }
+    while (!stack.empty()) {
+        Element* el = stack.back();
+        stack.pop_back();
+        el->order_ = next_order_++;
+        last_ = el;
+        for (auto it = el->children.rbegin(); it != el->children.rend(); ++it) {
+            if ((*it)->type == NodeType::ELEMENT) stack.push_back(static_cast<Element*>(it->get()));
+        }
+    }
+    for (Index* index : {&by_id_, &by_class_, &by_tag_}) {
+        for (auto& [key, bucket] : *index) std::sort(bucket.begin(), bucket.end(), byOrder);
+    }
+    in_order_ = true;
+}
+
+ElementPtr Document::getElementById(std::string_view id) const {
+    const Bucket* bucket = find(by_id_, id);
+    return bucket ? bucket->front()->shared_from_this() : nullptr;
+}
+
+std::vector<ElementPtr> Document::getElementsByClassName(std::string_view name) const {
+    std::vector<ElementPtr> out;
+    if (const Bucket* bucket = find(by_class_, name)) {
+        for (Element* el : *bucket) out.push_back(el->shared_from_this());
+    }
+    return out;
+}
+
+std::vector<ElementPtr> Document::getElementsByTagName(std::string_view name) const {
+    std::vector<ElementPtr> out;
+    if (const Bucket* bucket = find(by_tag_, lower(std::string(name)))) {
+        for (Element* el : *bucket) out.push_back(el->shared_from_this());
+    }
+    return out;
+}
+
+TextNode::TextNode(BufferSlice t) : Node(NodeType::TEXT), text(std::move(t)) { chargeNode(sizeof(TextNode) + kControlBlockBytes, 1); }
+
+TextNode::TextNode(const std::string& t) : TextNode(BufferSlice::copy(t, MemoryCategory::DOM_TEXT)) {}
+
+std::shared_ptr<TextNode> TextNode::create(BufferSlice t) { return std::make_shared<TextNode>(std::move(t)); }
 
-TextNode::TextNode(const std::string& t) : Node(NodeType::TEXT), text(t) {}
 std::shared_ptr<TextNode> TextNode::create(const std::string& t) { return std::make_shared<TextNode>(t); }
 
-ElementPtr parse_html(const std::string& html) {
-    auto root = Element::create("document");
-    std::stack<ElementPtr> st;
-    st.push(root);
+std::string decode_html_entities(std::string_view text) {
+    std::string out;
+    out.reserve(text.size());
+    for (size_t i = 0; i < text.size(); ++i) {
+        if (text[i] != '&') {
+            out.push_back(text[i]);
+            continue;
+        }
+
+        const size_t semi = text.find(';', i + 1);
+        if (semi == std::string_view::npos) {
+            out.push_back('&');
+            continue;
+        }
+
+        const std::string ent(text.substr(i + 1, semi - i - 1));
+        if (ent == "amp") out.push_back('&');
+        else if (ent == "lt") out.push_back('<');
+        else if (ent == "gt") out.push_back('>');
+        else if (ent == "quot") out.push_back('"');
+        else if (ent == "apos" || ent == "#39") out.push_back('\'');
+        else if (ent == "nbsp") out.push_back(' ');
+        else if (!ent.empty() && ent[0] == '#') {
+            int code = -1;
+            try {
+                if (ent.size() > 2 && (ent[1] == 'x' || ent[1] == 'X')) code = std::stoi(ent.substr(2), nullptr, 16);
+                else code = std::stoi(ent.substr(1));
+            } catch (...) {
+                code = -1;
+            }
+            if (code >= 0 && code <= 127) out.push_back(static_cast<char>(code));
+        }
+
+        i = semi;
+    }
+    return out;
+}
+
+void HtmlTokenizer::feed(std::string_view chunk) {
+    if (pending_.empty()) {
+        const size_t consumed = scan(chunk, false);
+        pending_.assign(chunk.substr(consumed));
+        offset_ += consumed;
+        return;
+    }
+    pending_.append(chunk.data(), chunk.size());
+    const size_t consumed = scan(pending_, false);
+    pending_.erase(0, consumed);
+    offset_ += consumed;
+}
+
+void HtmlTokenizer::finish(std::string_view last) {
+    if (pending_.empty()) {
+        offset_ += scan(last, true);
+        return;
+    }
+    pending_.append(last.data(), last.size());
+    offset_ += scan(pending_, true);
+    pending_.clear();
+}
 
+size_t HtmlTokenizer::scan(std::string_view html, bool eof) {
+    constexpr size_t kMaxEntityBytes = 32;
     size_t i = 0;
     while (i < html.size()) {
+        switch (state_) {
+            case State::COMMENT: {
+                const size_t end = html.find("-->", i);
+                if (end != std::string_view::npos) {
+                    visitor_.comment(html.substr(i, end - i));
+                    state_ = State::TEXT;
+                    i = end + 3;
+                    continue;
+                }
+                // Keep what could be the start of "-->".
+                const size_t stop = eof ? html.size() : html.size() - std::min<size_t>(2, html.size() - i);
+                if (stop > i) visitor_.comment(html.substr(i, stop - i));
+                return stop;
+            }
+            case State::RAW: {
+                const std::string_view close_tag = (raw_tag_ == "script") ? "</script>" : "</style>";
+                const size_t close = find_ci(html, close_tag, i);
+                if (close != std::string_view::npos || eof) {
+                    const size_t stop = (close == std::string_view::npos) ? html.size() : close;
+                    visitor_.rawText(raw_tag_, html.substr(i, stop - i));
+                    tag_begin_ = offset_ + stop;
+                    tag_end_ = (close == std::string_view::npos) ? tag_begin_ : tag_begin_ + close_tag.size();
+                    visitor_.endTag(raw_tag_);
+                    state_ = State::TEXT;
+                    i = (close == std::string_view::npos) ? stop : close + close_tag.size();
+                    continue;
+                }
+                const size_t stop = html.size() - std::min(close_tag.size() - 1, html.size() - i);
+                if (stop > i) visitor_.rawText(raw_tag_, html.substr(i, stop - i));
+                return stop;
+            }
+            case State::SKIP_TAG: {
+                const size_t end = html.find('>', i);
+                if (end == std::string_view::npos) return html.size();
+                state_ = State::TEXT;
+                i = end + 1;
+                continue;
+            }
+            case State::TEXT:
+                break;
+        }
+
         if (html[i] != '<') {
             size_t end = html.find('<', i);
-            if (end == std::string::npos) end = html.size();
-            std::string text = html.substr(i, end - i);
-            if (text.find_first_not_of(" \t\r\n") != std::string::npos) st.top()->appendChild(TextNode::create(text));
+            if (end == std::string_view::npos) {
+                end = html.size();
+                // Hold back an entity that the next chunk may finish.
+                const size_t amp = eof ? std::string_view::npos : html.rfind('&');
+                if (amp != std::string_view::npos && amp >= i && end - amp <= kMaxEntityBytes && html.find(';', amp) == std::string_view::npos) {
+                    end = amp;
+                }
+            }
+            if (end > i) visitor_.text(html.substr(i, end - i));
+            if (end < html.size() && html[end] != '<') return end;
             i = end;
             continue;
         }
 
+        if (!eof && html.size() - i < 4 && std::string_view("<!--").substr(0, html.size() - i) == html.substr(i)) return i;
         if (html.compare(i, 4, "<!--") == 0) {
-            size_t end = html.find("-->", i + 4);
-            i = (end == std::string::npos) ? html.size() : end + 3;
+            state_ = State::COMMENT;
+            i += 4;
             continue;
         }
 
-        size_t end = html.find('>', i + 1);
-        if (end == std::string::npos) break;
-
-        std::string raw = trim(html.substr(i + 1, end - i - 1));
+        const size_t end = html.find('>', i + 1);
+        if (end == std::string_view::npos) {
+            if (eof) return html.size();
+            if (html.size() - i > kMaxTagBytes) {
+                state_ = State::SKIP_TAG;
+                return html.size();
+            }
+            return i;
+        }
+        tag_begin_ = offset_ + i;
+        tag_end_ = offset_ + end + 1;
+        tag(html, i + 1, end);
         i = end + 1;
-        if (raw.empty() || raw[0] == '!') continue;
+    }
+    if (eof && state_ == State::RAW) {
+        tag_begin_ = tag_end_ = offset_ + html.size();
+        visitor_.endTag(raw_tag_);
+        state_ = State::TEXT;
+    }
+    return i;
+}
 
-        if (raw[0] == '/') {
-            if (st.size() > 1) st.pop();
-            continue;
-        }
+void HtmlTokenizer::tag(std::string_view html, size_t b, size_t e) {
+    trim_range(html, b, e);
+    if (b == e || html[b] == '!') return;
 
-        bool self_close = false;
-        if (!raw.empty() && raw.back() == '/') {
-            self_close = true;
-            raw.pop_back();
-            raw = trim(raw);
-        }
+    names_.clear();
+    names_.reserve(e - b);
 
-        size_t sp = raw.find_first_of(" \t\r\n");
-        std::string tag = (sp == std::string::npos) ? raw : raw.substr(0, sp);
-        auto el = Element::create(tag);
-        if (sp != std::string::npos) parse_attributes(raw.substr(sp + 1), el);
-        st.top()->appendChild(el);
+    if (html[b] == '/') {
+        size_t sp = b + 1;
+        while (sp < e && !is_space(html[sp])) ++sp;
+        visitor_.endTag(append_lower(names_, html.substr(b + 1, sp - b - 1)));
+        return;
+    }
 
-        if (is_void(el->tag_name) || self_close) continue;
+    bool self_close = false;
+    if (html[e - 1] == '/') {
+        self_close = true;
+        --e;
+        trim_range(html, b, e);
+    }
 
-        if (el->tag_name == "script" || el->tag_name == "style") {
-            const std::string close_tag = "</" + el->tag_name + ">";
-            std::string lower_html = lower(html);
-            size_t close_pos = lower_html.find(close_tag, i);
-            if (close_pos == std::string::npos) close_pos = html.size();
-            if (close_pos > i) el->appendChild(TextNode::create(html.substr(i, close_pos - i)));
-            i = (close_pos >= html.size()) ? close_pos : close_pos + close_tag.size();
-            continue;
-        }
+    size_t sp = b;
+    while (sp < e && !is_space(html[sp])) ++sp;
+    const std::string_view name = append_lower(names_, html.substr(b, sp - b));
+    attributes_.clear();
+    if (sp < e) tokenize_attributes(html, sp + 1, e, names_, attributes_);
 
-        st.push(el);
+    if (is_void(name) || self_close) {
+        visitor_.startTag(name, attributes_, true);
+        return;
     }
+    visitor_.startTag(name, attributes_, false);
+
+    if (name == "script") raw_tag_ = "script";
+    else if (name == "style") raw_tag_ = "style";
+    else return;
+    state_ = State::RAW;
+}
+
+void tokenize_html(std::string_view html, HtmlVisitor& visitor) {
+    HtmlTokenizer tokenizer(visitor);
+    tokenizer.finish(html);
+}
 
-    return root;
+DocumentPtr parse_html(const SharedBuffer& source) { return parse_html(source, ParseOptions()); }
+
+DocumentPtr parse_html(const SharedBuffer& source, const ParseOptions& options) {
+    const DocumentPtr doc = Document::create();
+    TreeBuilder builder(source, doc, options);
+    builder.build(source.view());
+    for (TreeBuilder::Deferred& d : builder.deferred()) {
+        Element& el = *d.element;
+        el.deferred_ = std::make_unique<Element::DeferredContent>(Element::DeferredContent{source, d.begin, d.end});
+        el.chargeNode(sizeof(Element::DeferredContent), 1);
+    }
+    return doc;
 }
 
 }  // namespace browser
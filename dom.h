@@ -1,10 +1,18 @@
 #pragma once
 
+#include <cstdint>
+#include <functional>
 #include <map>
 #include <memory>
 #include <string>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
+#include "accounting.h"
+#include "buffer.h"
+
 namespace browser {
 
 enum class NodeType { ELEMENT, TEXT, COMMENT };
@@ -12,43 +20,266 @@ enum class NodeType { ELEMENT, TEXT, COMMENT };
 class Node;
 class Element;
 class TextNode;
+class Document;
+struct ParseOptions;
 
 using NodePtr = std::shared_ptr<Node>;
 using ElementPtr = std::shared_ptr<Element>;
+using DocumentPtr = std::shared_ptr<Document>;
 
 class Node {
 public:
-    explicit Node(NodeType t) : type(t) {}
-    virtual ~Node() = default;
+    explicit Node(NodeType t) : type(t), memory_(active_memory_account()) {}
+    virtual ~Node();
 
     NodeType type;
     std::weak_ptr<Element> parent;
+
+protected:
+    // Deltas against the account active at construction; released again by ~Node.
+    // Payload is attribute storage for elements and character data for text nodes.
+    void chargeNode(int64_t bytes, int64_t allocations);
+    void chargePayload(int64_t bytes, int64_t allocations);
+
+private:
+    MemoryCategory payloadCategory() const;
+
+    MemoryAccountPtr memory_;
+    uint32_t node_bytes_ = 0;
+    uint32_t node_allocations_ = 0;
+    uint32_t payload_bytes_ = 0;
+    uint32_t payload_allocations_ = 0;
 };
 
 class Element : public Node, public std::enable_shared_from_this<Element> {
 public:
     explicit Element(const std::string& name);
+    ~Element() override;
 
     static ElementPtr create(const std::string& name);
 
+    // Editing `children`, `attributes` or `tag_name` directly bypasses the document's
+    // indexes; use the methods below for elements that are in a Document.
     std::string tag_name;
-    std::map<std::string, std::string> attributes;
+    std::map<std::string, BufferSlice> attributes;
     std::vector<NodePtr> children;
 
     void appendChild(const NodePtr& child);
-    std::string getAttribute(const std::string& key) const;
+    // Returns false when `child` is not a child of this element.
+    bool removeChild(const NodePtr& child);
+    // Valid until the attribute is next set or the element is destroyed.
+    std::string_view getAttribute(const std::string& key) const;
     void setAttribute(const std::string& key, const std::string& value);
+    void setAttribute(const std::string& key, BufferSlice value);
+
+    // The document this element is attached to, if any.
+    Document* ownerDocument() const { return document_; }
+    // Marked for the document's next style flush.
+    bool styleDirty() const { return style_flags_ != 0; }
+    // Marked for relayout, itself or somewhere beneath it.
+    bool layoutDirty() const { return layout_flags_ != 0; }
+
+    // Set when the parse left this element's content unbuilt (see ParseOptions::defer).
+    bool deferred() const { return deferred_ != nullptr; }
+    // Builds a deferred element's content from the source, as a full parse would have, and
+    // appends it. Returns false, doing nothing, for an element that was not deferred.
+    bool materialize();
+
+private:
+    friend class Document;
+    friend DocumentPtr parse_html(const SharedBuffer& html, const ParseOptions& options);
+
+    // Source range from the start tag's `<` through the end tag's `>`.
+    struct DeferredContent {
+        SharedBuffer source;
+        size_t begin = 0;
+        size_t end = 0;
+    };
+
+    std::unique_ptr<DeferredContent> deferred_;
+    Document* document_ = nullptr;
+    uint64_t order_ = 0;  // preorder position while the document is in order
+    uint8_t style_flags_ = 0;
+    uint8_t layout_flags_ = 0;
+};
+
+// The ids and classes some style rule tests, so a document can tell which attribute
+// changes may alter a computed style. Tags are left out: an element's tag never changes,
+// and inserted subtrees are restyled regardless.
+struct StyleDependencies {
+    std::unordered_set<std::string> ids;
+    std::unordered_set<std::string> classes;
+};
+
+// Root of a parsed page, with id, class and tag indexes that follow appendChild,
+// removeChild and setAttribute. Lookups cost a hash probe plus the size of the answer;
+// results are in document order.
+class Document : public Element {
+public:
+    Document();
+    ~Document() override;
+
+    static DocumentPtr create();
+
+    ElementPtr getElementById(std::string_view id) const;
+    std::vector<ElementPtr> getElementsByClassName(std::string_view name) const;
+    std::vector<ElementPtr> getElementsByTagName(std::string_view name) const;
+
+    // Comma-separated selectors in the stylesheet syntax (`tag`, `#id`, `.class`, one
+    // ancestor tag), matched like stylesheet rules. Each selector starts from its most
+    // selective index.
+    std::vector<ElementPtr> querySelectorAll(std::string_view selectors) const;
+    ElementPtr querySelector(std::string_view selectors) const;
+
+    size_t indexedElements() const { return indexed_; }
+
+    // Style invalidation, off until trackStyle(). While on, mutations mark the elements
+    // whose computed style may have changed: every element of an inserted subtree, and an
+    // element gaining or losing an id or class listed in `dependencies`. Starting to track
+    // marks the whole document.
+    void trackStyle(StyleDependencies dependencies);
+    void stopTrackingStyle();
+    // Calls `restyle` for each marked element, parents before children, and clears the
+    // marks. Only marked paths are walked. Returns the number of elements visited.
+    size_t flushStyle(const std::function<void(Element&)>& restyle);
+    // Elements detached while tracking, for dropping cached styles. The pointers may dangle
+    // and are only good as keys.
+    std::vector<const Element*> takeRemovedElements();
+
+    // Layout invalidation, on while style is tracked. Adding or removing a child marks the
+    // parent, and a StyleEngine marks elements whose computed style changed; every ancestor
+    // of a marked element learns that something beneath it changed.
+    void invalidateLayout(Element& el);
+    struct LayoutMarks {
+        bool self = false;
+        bool descendants = false;
+    };
+    // Returns and clears `el`'s marks, for a layout pass visiting it.
+    LayoutMarks takeLayoutMarks(Element& el);
+
+private:
+    friend class Element;
+
+    using Bucket = std::vector<Element*>;
+    using Index = std::unordered_map<std::string, Bucket>;
+
+    void attach(Element& root);
+    // Drops `root`, and its descendants when `subtree` is set, from the indexes.
+    void detach(Element& root, bool subtree);
+    void attributeChanged(Element& el, const std::string& key, std::string_view before, std::string_view after);
+
+    void markStyle(Element& el, uint8_t flags);
+    void insert(Index& index, std::string_view key, Element* el);
+    void erase(Index& index, std::string_view key, Element* el);
+    const Bucket* find(const Index& index, std::string_view key) const;
+    // Renumbers the tree and re-sorts the buckets after out-of-order insertions.
+    void ensureOrder() const;
+    static bool byOrder(const Element* a, const Element* b);
+
+    mutable Index by_id_;
+    mutable Index by_class_;
+    mutable Index by_tag_;
+    mutable bool in_order_ = true;
+    mutable uint64_t next_order_ = 1;
+    mutable Element* last_ = this;
+    size_t indexed_ = 0;
+    bool tracking_style_ = false;
+    StyleDependencies style_dependencies_;
+    std::vector<const Element*> removed_;
 };
 
 class TextNode : public Node {
 public:
+    explicit TextNode(BufferSlice t);
     explicit TextNode(const std::string& t);
 
+    static std::shared_ptr<TextNode> create(BufferSlice t);
     static std::shared_ptr<TextNode> create(const std::string& t);
 
-    std::string text;
+    // Entity-decoded character data; a slice of the source document unless decoding
+    // changed it.
+    BufferSlice text;
+};
+
+std::string decode_html_entities(std::string_view text);
+
+struct HtmlAttribute {
+    std::string_view name;   // lowercase
+    std::string_view value;  // as written, minus quotes and surrounding space
+    bool has_value = true;   // false for bare attributes such as `disabled`
+};
+
+// Receives tokens from tokenize_html or HtmlTokenizer. Names are lowercase; text, comments
+// and attribute values are views of the input with entities left encoded. Views are only
+// valid for the duration of the call.
+class HtmlVisitor {
+public:
+    virtual ~HtmlVisitor() = default;
+
+    // `self_closing` is set for void elements and `<x/>`; no endTag follows those.
+    virtual void startTag(std::string_view /*name*/, const std::vector<HtmlAttribute>& /*attributes*/, bool /*self_closing*/) {}
+    virtual void endTag(std::string_view /*name*/) {}
+    virtual void text(std::string_view /*text*/) {}
+    virtual void comment(std::string_view /*text*/) {}
+    // Body of a <script> or <style>, between its startTag and endTag. The endTag is sent
+    // even when the document ends before the close tag.
+    virtual void rawText(std::string_view /*name*/, std::string_view /*text*/) {}
+};
+
+// Push tokenizer for input that arrives in pieces. Only an unfinished tag is buffered
+// between calls (tags longer than kMaxTagBytes are dropped); text, comments and raw text
+// are passed on as they arrive, so one of them may reach the visitor in several
+// consecutive calls. Entities are never split across text calls.
+class HtmlTokenizer {
+public:
+    static constexpr size_t kMaxTagBytes = 64 * 1024;
+
+    explicit HtmlTokenizer(HtmlVisitor& visitor) : visitor_(visitor) {}
+
+    void feed(std::string_view chunk);
+    // Ends the input, with `last` as its final piece. When nothing is buffered, views
+    // handed to the visitor point into `last`.
+    void finish(std::string_view last = {});
+
+    size_t bufferedBytes() const { return pending_.size(); }
+    // Offsets in the whole input of the tag being reported, from its `<` through its `>`;
+    // only meaningful during startTag and endTag. An endTag the end of input implies is
+    // empty, at the end.
+    size_t tagBegin() const { return tag_begin_; }
+    size_t tagEnd() const { return tag_end_; }
+
+private:
+    enum class State { TEXT, COMMENT, RAW, SKIP_TAG };
+
+    // Returns how much of `html` was consumed; the rest is an unfinished token.
+    size_t scan(std::string_view html, bool eof);
+    void tag(std::string_view html, size_t b, size_t e);
+
+    HtmlVisitor& visitor_;
+    State state_ = State::TEXT;
+    std::string_view raw_tag_;
+    size_t offset_ = 0;  // of pending_'s first byte, or of the next chunk
+    size_t tag_begin_ = 0;
+    size_t tag_end_ = 0;
+    std::string pending_;
+    std::string names_;
+    std::vector<HtmlAttribute> attributes_;
+};
+
+// The tokenizer behind parse_html, over a complete document. Builds nothing and allocates
+// only scratch space for the current tag; every view points into `html`.
+void tokenize_html(std::string_view html, HtmlVisitor& visitor);
+
+struct ParseOptions {
+    // Called for each element that has content, once it is in the tree with its attributes.
+    // Returning true leaves the content unbuilt: the element stays empty, keeping only its
+    // source range for Element::materialize. Lookups and the document's indexes do not see
+    // deferred content. A renderer uses this for subtrees it would never show.
+    std::function<bool(const ElementPtr&)> defer;
 };
 
-ElementPtr parse_html(const std::string& html);
+// Text nodes and attribute values reference `html` instead of copying it.
+DocumentPtr parse_html(const SharedBuffer& html);
+DocumentPtr parse_html(const SharedBuffer& html, const ParseOptions& options);
 
 }  // namespace browser
@@ -0,0 +1,769 @@
+#include "fetch.h"
+#include "content_decoder.h"
+#include "http_parser.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#ifdef ZEPHYR_USE_CURL
+#include <curl/curl.h>
+#else
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#pragma comment(lib, "Ws2_32.lib")
+#else
+#include <cerrno>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unistd.h>
+#define INVALID_SOCKET (-1)
+#define SOCKET int
+#endif
+#endif
+
+namespace browser {
+namespace {
+
+constexpr size_t kMaxResponseBytes = 2 * 1024 * 1024;
+
+using Clock = std::chrono::steady_clock;
+
+void record_span(Phase phase, Clock::time_point start, Clock::time_point end) {
+#if ZEPHYR_METRICS
+    if (auto* m = active_metrics()) m->record(phase, start, std::chrono::duration<double, std::micro>(end - start).count());
+#else
+    (void)phase;
+    (void)start;
+    (void)end;
+#endif
+}
+
+void account_response(HttpResponse& resp) {
+    size_t bytes = string_heap_bytes(resp.status_line);
+    size_t allocations = bytes ? 1 : 0;
+    for (const auto& h : resp.headers) {
+        bytes += 32 + sizeof(h) + string_heap_bytes(h.first) + string_heap_bytes(h.second);
+        allocations += 1 + (string_heap_bytes(h.first) ? 1 : 0) + (string_heap_bytes(h.second) ? 1 : 0);
+    }
+    resp.header_memory.set(bytes, allocations);
+}
+
+#ifdef ZEPHYR_USE_CURL
+std::string lower(std::string s) {
+    std::transform(s.begin(), s.end(), s.begin(), [](unsigned char c) { return static_cast<char>(std::tolower(c)); });
+    return s;
+}
+
+std::string trim(const std::string& s) {
+    size_t b = 0;
+    while (b < s.size() && std::isspace(static_cast<unsigned char>(s[b]))) ++b;
+    size_t e = s.size();
+    while (e > b && std::isspace(static_cast<unsigned char>(s[e - 1]))) --e;
+    return s.substr(b, e - b);
+}
+#else
+#ifdef _WIN32
+using PollFd = WSAPOLLFD;
+constexpr int kSendFlags = 0;
+
+int poll_sockets(PollFd* fds, size_t count, int timeout_ms) { return WSAPoll(fds, static_cast<ULONG>(count), timeout_ms); }
+
+bool would_block() { return WSAGetLastError() == WSAEWOULDBLOCK; }
+
+void set_nonblocking(SOCKET s) {
+    u_long on = 1;
+    ioctlsocket(s, FIONBIO, &on);
+}
+
+void close_socket(SOCKET s) { closesocket(s); }
+#else
+using PollFd = pollfd;
+#ifdef MSG_NOSIGNAL
+constexpr int kSendFlags = MSG_NOSIGNAL;
+#else
+constexpr int kSendFlags = 0;
+#endif
+
+int poll_sockets(PollFd* fds, size_t count, int timeout_ms) { return ::poll(fds, static_cast<nfds_t>(count), timeout_ms); }
+
+bool would_block() { return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINPROGRESS || errno == EINTR; }
+
+void set_nonblocking(SOCKET s) { fcntl(s, F_SETFL, fcntl(s, F_GETFL, 0) | O_NONBLOCK); }
+
+void close_socket(SOCKET s) { close(s); }
+#endif
+
+// A few detached threads running getaddrinfo, which has no portable non-blocking form.
+// Never destroyed: a lookup cannot be interrupted, so exit must not wait for one.
+class Resolver {
+public:
+    static Resolver& shared() {
+        static Resolver* resolver = new Resolver(4);
+        return *resolver;
+    }
+
+    void post(std::function<void()> job) {
+        {
+            std::lock_guard<std::mutex> lock(mu_);
+            queue_.push_back(std::move(job));
+        }
+        cv_.notify_one();
+    }
+
+private:
+    explicit Resolver(size_t threads) {
+        for (size_t i = 0; i < threads; ++i) std::thread([this] { run(); }).detach();
+    }
+
+    void run() {
+        for (;;) {
+            std::function<void()> job;
+            {
+                std::unique_lock<std::mutex> lock(mu_);
+                cv_.wait(lock, [this] { return !queue_.empty(); });
+                job = std::move(queue_.front());
+                queue_.pop_front();
+            }
+            job();
+        }
+    }
+
+    std::mutex mu_;
+    std::condition_variable cv_;
+    std::deque<std::function<void()>> queue_;
+};
+#endif
+
+}  // namespace
+
+struct FetchRequest : std::enable_shared_from_this<FetchRequest> {
+    struct Span {
+        Phase phase;
+        Clock::time_point start;
+        Clock::time_point end;
+    };
+
+    string url;
+    int timeout_seconds = 10;
+    int redirect_limit = 3;
+    FetchCallbacks callbacks;
+    // Constructed on the caller's thread, and the body is adopted under `memory`, so the
+    // response is charged to the caller's account.
+    HttpResponse resp;
+    MemoryAccountPtr memory;
+    std::promise<HttpResponse> promise;
+    std::weak_ptr<AsyncFetcher::Loop> loop;
+
+    std::atomic<bool> cancelled{false};
+    std::atomic<bool> settled{false};
+
+    // I/O thread only.
+    bool finished = false;
+    bool headers_reported = false;
+    size_t expected = 0;
+    string error;
+    string body;
+    std::vector<Span> spans;
+    Clock::time_point started;
+#ifdef ZEPHYR_USE_CURL
+    CURL* easy = nullptr;
+#else
+    enum class Step { RESOLVE, CONNECT, SEND, RECEIVE };
+
+    Step step = Step::RESOLVE;
+    UrlParts parts;
+    int redirects_left = 0;
+    addrinfo* addrs = nullptr;
+    addrinfo* next_addr = nullptr;
+    SOCKET sock = INVALID_SOCKET;
+    string request;
+    size_t sent = 0;
+    std::unique_ptr<HttpResponseParser> parser;
+    Clock::time_point mark;
+    bool first_byte = false;
+#endif
+};
+
+namespace {
+
+// Resolves the promise exactly once, whichever of the I/O thread and cancel() gets there
+// first.
+bool settle(FetchRequest& req, const string& error) {
+    if (req.settled.exchange(true)) return false;
+    if (error.empty()) {
+        MemoryAccountScope scope(req.memory);
+        req.resp.body = std::move(req.body);
+        account_response(req.resp);
+        req.promise.set_value(std::move(req.resp));
+    } else {
+        req.promise.set_exception(std::make_exception_ptr(std::runtime_error(error)));
+    }
+    return true;
+}
+
+void report_headers(FetchRequest& req) {
+    if (req.headers_reported) return;
+    req.headers_reported = true;
+    if (!req.cancelled && req.callbacks.on_headers) req.callbacks.on_headers(req.resp);
+}
+
+void report_progress(FetchRequest& req, size_t received) {
+    if (!req.cancelled && req.callbacks.on_progress) req.callbacks.on_progress(received, req.expected);
+}
+
+#ifdef ZEPHYR_USE_CURL
+size_t write_cb(char* ptr, size_t size, size_t nmemb, void* userdata) {
+    const size_t bytes = size * nmemb;
+    auto& req = *static_cast<FetchRequest*>(userdata);
+    if (req.cancelled) return 0;
+    if (!req.headers_reported) {
+        curl_off_t length = -1;
+        curl_easy_getinfo(req.easy, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &length);
+        req.expected = length > 0 ? static_cast<size_t>(length) : 0;
+        report_headers(req);
+    }
+    if (req.body.size() + bytes > kMaxResponseBytes) {
+        req.error = "response body exceeds " + std::to_string(kMaxResponseBytes) + " bytes";
+        return 0;
+    }
+    req.body.append(ptr, bytes);
+    report_progress(req, req.body.size());
+    return bytes;
+}
+
+size_t header_cb(char* ptr, size_t size, size_t nmemb, void* userdata) {
+    const size_t bytes = size * nmemb;
+    auto& req = *static_cast<FetchRequest*>(userdata);
+    std::string line = trim(std::string(ptr, bytes));
+    if (line.empty()) return bytes;
+
+    if (line.rfind("HTTP/", 0) == 0) {
+        // A new status line starts the next response of a redirect chain.
+        req.resp.status_line = line;
+        req.resp.headers.clear();
+    } else {
+        const size_t colon = line.find(':');
+        if (colon != std::string::npos) req.resp.headers[lower(trim(line.substr(0, colon)))] = trim(line.substr(colon + 1));
+    }
+    return bytes;
+}
+
+void record_curl_timings(FetchRequest& req) {
+    curl_off_t dns = 0, connect = 0, tls = 0, first_byte = 0, total = 0;
+    curl_easy_getinfo(req.easy, CURLINFO_NAMELOOKUP_TIME_T, &dns);
+    curl_easy_getinfo(req.easy, CURLINFO_CONNECT_TIME_T, &connect);
+    curl_easy_getinfo(req.easy, CURLINFO_APPCONNECT_TIME_T, &tls);
+    curl_easy_getinfo(req.easy, CURLINFO_STARTTRANSFER_TIME_T, &first_byte);
+    curl_easy_getinfo(req.easy, CURLINFO_TOTAL_TIME_T, &total);
+
+    const curl_off_t handshake_done = std::max(connect, tls);
+    auto at = [&](curl_off_t us) { return req.started + std::chrono::microseconds(us); };
+    req.spans.push_back({Phase::DNS, at(0), at(dns)});
+    req.spans.push_back({Phase::CONNECT, at(dns), at(connect)});
+    if (tls > 0) req.spans.push_back({Phase::TLS, at(connect), at(tls)});
+    req.spans.push_back({Phase::FIRST_BYTE, at(handshake_done), at(std::max(first_byte, handshake_done))});
+    req.spans.push_back({Phase::DOWNLOAD, at(std::max(first_byte, handshake_done)), at(std::max(total, first_byte))});
+}
+#endif
+
+}  // namespace
+
+struct AsyncFetcher::Loop {
+    Loop();
+    ~Loop();
+
+    void wake();
+    void run();
+
+    void start(FetchRequest& req);
+    void poll();
+    void release(FetchRequest& req);
+    void finish(FetchRequest& req, const string& error);
+#ifndef ZEPHYR_USE_CURL
+    void begin(FetchRequest& req);
+    void connectNext(FetchRequest& req);
+    void sendRequest(FetchRequest& req);
+    void onWritable(FetchRequest& req);
+    void onReadable(FetchRequest& req);
+    string redirectTarget(const FetchRequest& req) const;
+    void followRedirect(FetchRequest& req);
+    void onResolved(const std::weak_ptr<FetchRequest>& request, addrinfo* addrs, Clock::time_point done);
+#endif
+
+    std::mutex mu;
+    std::vector<std::shared_ptr<FetchRequest>> incoming;
+    bool stopping = false;
+    std::atomic<size_t> pending{0};
+
+    // I/O thread only.
+    std::vector<std::shared_ptr<FetchRequest>> active;
+#ifdef ZEPHYR_USE_CURL
+    CURLM* multi = nullptr;
+#else
+    // A loopback datagram socket connected to itself; wake() sends it a byte to interrupt
+    // poll().
+    SOCKET wake_sock = INVALID_SOCKET;
+
+    // Finished lookups posted by the resolver threads, guarded by `mu`.
+    struct Lookup {
+        std::weak_ptr<FetchRequest> request;
+        addrinfo* addrs;
+        Clock::time_point done;
+    };
+    std::vector<Lookup> resolved;
+#endif
+};
+
+AsyncFetcher::Loop::Loop() {
+#ifdef ZEPHYR_USE_CURL
+    static std::once_flag global_init;
+    std::call_once(global_init, [] { curl_global_init(CURL_GLOBAL_DEFAULT); });
+    multi = curl_multi_init();
+    if (!multi) throw std::runtime_error("curl initialization failed");
+    curl_multi_setopt(multi, CURLMOPT_MAX_HOST_CONNECTIONS, 6L);
+#else
+#ifdef _WIN32
+    WSADATA wsa_data;
+    WSAStartup(MAKEWORD(2, 2), &wsa_data);
+#endif
+    wake_sock = socket(AF_INET, SOCK_DGRAM, 0);
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(addr);
+    if (wake_sock == INVALID_SOCKET || bind(wake_sock, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 ||
+        getsockname(wake_sock, reinterpret_cast<sockaddr*>(&addr), &len) != 0 ||
+        connect(wake_sock, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0) {
+        if (wake_sock != INVALID_SOCKET) close_socket(wake_sock);
+        throw std::runtime_error("cannot create the fetcher wakeup socket");
+    }
+    set_nonblocking(wake_sock);
+#endif
+}
+
+AsyncFetcher::Loop::~Loop() {
+#ifdef ZEPHYR_USE_CURL
+    curl_multi_cleanup(multi);
+#else
+    for (const auto& lookup : resolved) {
+        if (lookup.addrs) freeaddrinfo(lookup.addrs);
+    }
+    close_socket(wake_sock);
+#ifdef _WIN32
+    WSACleanup();
+#endif
+#endif
+}
+
+void AsyncFetcher::Loop::wake() {
+#ifdef ZEPHYR_USE_CURL
+    curl_multi_wakeup(multi);
+#else
+    const char byte = 0;
+    send(wake_sock, &byte, 1, 0);
+#endif
+}
+
+void AsyncFetcher::Loop::run() {
+    for (;;) {
+        std::vector<std::shared_ptr<FetchRequest>> fresh;
+        bool stop = false;
+        {
+            std::lock_guard<std::mutex> lock(mu);
+            fresh.swap(incoming);
+            stop = stopping;
+        }
+        for (auto& req : fresh) {
+            active.push_back(req);
+            if (!stop) start(*req);
+        }
+#ifndef ZEPHYR_USE_CURL
+        if (!stop) {
+            std::vector<Lookup> lookups;
+            {
+                std::lock_guard<std::mutex> lock(mu);
+                lookups.swap(resolved);
+            }
+            for (const auto& lookup : lookups) onResolved(lookup.request, lookup.addrs, lookup.done);
+        }
+#endif
+        if (stop) {
+            for (auto& req : active) finish(*req, "fetcher stopped");
+            active.clear();
+            return;
+        }
+
+        for (auto& req : active) {
+            if (req->cancelled && !req->finished) {
+                release(*req);
+                req->finished = true;
+            }
+        }
+        active.erase(std::remove_if(active.begin(), active.end(), [](const auto& r) { return r->finished; }), active.end());
+
+        poll();
+    }
+}
+
+void AsyncFetcher::Loop::finish(FetchRequest& req, const string& error) {
+    if (req.finished) return;
+    req.finished = true;
+    release(req);
+    if (settle(req, error)) {
+        --pending;
+        if (req.callbacks.on_done) req.callbacks.on_done();
+    }
+}
+
+#ifdef ZEPHYR_USE_CURL
+void AsyncFetcher::Loop::start(FetchRequest& req) {
+    UrlParts p;
+    if (!parse_url(req.url, p)) return finish(req, "Only http:// and https:// URLs are supported");
+    req.easy = curl_easy_init();
+    if (!req.easy) return finish(req, "curl initialization failed");
+
+    CURL* curl = req.easy;
+    curl_easy_setopt(curl, CURLOPT_URL, req.url.c_str());
+    curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1L);
+    curl_easy_setopt(curl, CURLOPT_MAXREDIRS, static_cast<long>(req.redirect_limit));
+    curl_easy_setopt(curl, CURLOPT_TIMEOUT, static_cast<long>(req.timeout_seconds));
+    curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, static_cast<long>(req.timeout_seconds));
+    curl_easy_setopt(curl, CURLOPT_ACCEPT_ENCODING, "");
+    curl_easy_setopt(curl, CURLOPT_PROTOCOLS_STR, "http,https");
+    curl_easy_setopt(curl, CURLOPT_REDIR_PROTOCOLS_STR, "http,https");
+    curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 1L);
+    curl_easy_setopt(curl, CURLOPT_SSL_VERIFYHOST, 2L);
+    curl_easy_setopt(curl, CURLOPT_USERAGENT, "Zephyr/Rewrite");
+    curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+    curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_cb);
+    curl_easy_setopt(curl, CURLOPT_WRITEDATA, &req);
+    curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, header_cb);
+    curl_easy_setopt(curl, CURLOPT_HEADERDATA, &req);
+    curl_easy_setopt(curl, CURLOPT_PRIVATE, &req);
+
+    req.started = Clock::now();
+    if (curl_multi_add_handle(multi, curl) != CURLM_OK) finish(req, "curl initialization failed");
+}
+
+void AsyncFetcher::Loop::poll() {
+    int running = 0;
+    curl_multi_perform(multi, &running);
+
+    int left = 0;
+    while (CURLMsg* msg = curl_multi_info_read(multi, &left)) {
+        if (msg->msg != CURLMSG_DONE) continue;
+        char* priv = nullptr;
+        curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, &priv);
+        auto& req = *reinterpret_cast<FetchRequest*>(priv);
+        const CURLcode rc = msg->data.result;
+        if (rc != CURLE_OK) {
+            finish(req, req.error.empty() ? "curl request failed: " + std::string(curl_easy_strerror(rc)) : req.error);
+            continue;
+        }
+        long status = 0;
+        curl_easy_getinfo(req.easy, CURLINFO_RESPONSE_CODE, &status);
+        if (req.resp.status_line.empty()) req.resp.status_line = "HTTP/1.1 " + std::to_string(status);
+        report_headers(req);
+        record_curl_timings(req);
+        finish(req, "");
+    }
+
+    curl_multi_poll(multi, nullptr, 0, 1000, nullptr);
+}
+
+void AsyncFetcher::Loop::release(FetchRequest& req) {
+    if (!req.easy) return;
+    // Removing an unfinished transfer closes its connection instead of returning it to
+    // the pool.
+    curl_multi_remove_handle(multi, req.easy);
+    curl_easy_cleanup(req.easy);
+    req.easy = nullptr;
+}
+#else
+void AsyncFetcher::Loop::start(FetchRequest& req) {
+    req.started = Clock::now();
+    req.redirects_left = req.redirect_limit;
+    begin(req);
+}
+
+void AsyncFetcher::Loop::begin(FetchRequest& req) {
+    if (!parse_url(req.url, req.parts)) return finish(req, "Only http:// and https:// URLs are supported");
+    if (req.parts.scheme == "https") return finish(req, "HTTPS requires libcurl in this build");
+
+    // Name resolution blocks, so it runs on the resolver threads and the result comes back
+    // through `resolved`; poll() skips the request until then but still times it out.
+    req.step = FetchRequest::Step::RESOLVE;
+    req.mark = Clock::now();
+    Resolver::shared().post([loop = req.loop, request = req.weak_from_this(), host = req.parts.host, port = std::to_string(req.parts.port)] {
+        addrinfo hints{};
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        addrinfo* addrs = nullptr;
+        if (getaddrinfo(host.c_str(), port.c_str(), &hints, &addrs) != 0) addrs = nullptr;
+
+        auto owner = loop.lock();
+        if (!owner) {
+            if (addrs) freeaddrinfo(addrs);
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(owner->mu);
+            owner->resolved.push_back({request, addrs, Clock::now()});
+        }
+        owner->wake();
+    });
+}
+
+void AsyncFetcher::Loop::onResolved(const std::weak_ptr<FetchRequest>& request, addrinfo* addrs, Clock::time_point done) {
+    auto req = request.lock();
+    if (!req || req->finished || req->cancelled || req->step != FetchRequest::Step::RESOLVE) {
+        if (addrs) freeaddrinfo(addrs);
+        return;
+    }
+    if (!addrs) return finish(*req, "getaddrinfo failed");
+    req->spans.push_back({Phase::DNS, req->mark, done});
+    req->addrs = req->next_addr = addrs;
+    req->mark = Clock::now();
+    connectNext(*req);
+}
+
+void AsyncFetcher::Loop::connectNext(FetchRequest& req) {
+    if (req.sock != INVALID_SOCKET) close_socket(req.sock);
+    req.sock = INVALID_SOCKET;
+
+    while (req.next_addr) {
+        addrinfo* cur = req.next_addr;
+        req.next_addr = cur->ai_next;
+        req.sock = socket(cur->ai_family, cur->ai_socktype, cur->ai_protocol);
+        if (req.sock == INVALID_SOCKET) continue;
+        set_nonblocking(req.sock);
+        if (connect(req.sock, cur->ai_addr, static_cast<int>(cur->ai_addrlen)) == 0) return sendRequest(req);
+        if (would_block()) {
+            req.step = FetchRequest::Step::CONNECT;
+            return;
+        }
+        close_socket(req.sock);
+        req.sock = INVALID_SOCKET;
+    }
+    finish(req, "connection failed");
+}
+
+void AsyncFetcher::Loop::sendRequest(FetchRequest& req) {
+    freeaddrinfo(req.addrs);
+    req.addrs = req.next_addr = nullptr;
+    req.spans.push_back({Phase::CONNECT, req.mark, Clock::now()});
+
+    std::ostringstream out;
+    out << "GET " << req.parts.path << " HTTP/1.1\r\n";
+    out << "Host: " << req.parts.host;
+    if (req.parts.port != 80) out << ':' << req.parts.port;
+    out << "\r\nUser-Agent: Zephyr/Rewrite\r\n";
+    if (*accepted_content_encodings()) out << "Accept-Encoding: " << accepted_content_encodings() << "\r\n";
+    out << "Connection: close\r\n\r\n";
+    req.request = out.str();
+    req.sent = 0;
+    req.parser = std::make_unique<HttpResponseParser>(req.resp, kMaxResponseBytes);
+    req.parser->onHeaders([this, &req] {
+        if (redirectTarget(req).empty()) {
+            req.expected = req.parser->expectedBytes();
+            report_headers(req);
+        }
+    });
+    req.first_byte = false;
+    req.step = FetchRequest::Step::SEND;
+    req.mark = Clock::now();
+}
+
+void AsyncFetcher::Loop::onWritable(FetchRequest& req) {
+    if (req.step == FetchRequest::Step::CONNECT) {
+        int err = 0;
+        socklen_t len = sizeof(err);
+        getsockopt(req.sock, SOL_SOCKET, SO_ERROR, reinterpret_cast<char*>(&err), &len);
+        if (err != 0) return connectNext(req);
+        sendRequest(req);
+    }
+
+    const int n = send(req.sock, req.request.data() + req.sent, static_cast<int>(req.request.size() - req.sent), kSendFlags);
+    if (n < 0 && !would_block()) return finish(req, "send failed");
+    if (n > 0) req.sent += static_cast<size_t>(n);
+    if (req.sent == req.request.size()) req.step = FetchRequest::Step::RECEIVE;
+}
+
+void AsyncFetcher::Loop::onReadable(FetchRequest& req) {
+    char buf[16 * 1024];
+    const int n = static_cast<int>(recv(req.sock, buf, sizeof(buf), 0));
+    if (n < 0) {
+        if (!would_block()) finish(req, "receive failed");
+        return;
+    }
+    if (!req.first_byte) {
+        req.first_byte = true;
+        const Clock::time_point now = Clock::now();
+        req.spans.push_back({Phase::FIRST_BYTE, req.mark, now});
+        req.mark = now;
+    }
+
+    HttpResponseParser& parser = *req.parser;
+    const size_t before = parser.bodyBytes();
+    if (n == 0) parser.finishEof();
+    else parser.feed(buf, static_cast<size_t>(n));
+    if (parser.failed()) return finish(req, parser.error());
+
+    if (parser.headersDone() && !redirectTarget(req).empty()) return followRedirect(req);
+    if (parser.bodyBytes() != before) report_progress(req, parser.bodyBytes());
+    if (parser.done()) {
+        req.body = parser.takeBody();
+        req.spans.push_back({Phase::DOWNLOAD, req.mark, Clock::now()});
+        finish(req, "");
+    }
+}
+
+string AsyncFetcher::Loop::redirectTarget(const FetchRequest& req) const {
+    const int status = req.parser->statusCode();
+    if (status != 301 && status != 302 && status != 303 && status != 307 && status != 308) return "";
+    const auto location = req.resp.headers.find("location");
+    return location == req.resp.headers.end() ? "" : location->second;
+}
+
+void AsyncFetcher::Loop::followRedirect(FetchRequest& req) {
+    if (req.redirects_left-- <= 0) return finish(req, "too many redirects");
+
+    req.url = resolve_url(req.url, redirectTarget(req));
+    close_socket(req.sock);
+    req.sock = INVALID_SOCKET;
+    req.parser.reset();
+    req.resp.status_line.clear();
+    req.resp.headers.clear();
+    begin(req);
+}
+
+void AsyncFetcher::Loop::poll() {
+    std::vector<PollFd> fds;
+    std::vector<FetchRequest*> owners;
+    fds.push_back(PollFd{});
+    fds.back().fd = wake_sock;
+    fds.back().events = POLLIN;
+
+    const Clock::time_point now = Clock::now();
+    auto wait = std::chrono::milliseconds(1000);
+    for (auto& req : active) {
+        if (req->finished) continue;
+        const auto deadline = req->started + std::chrono::seconds(req->timeout_seconds);
+        wait = std::min(wait, std::max(std::chrono::milliseconds(0), std::chrono::duration_cast<std::chrono::milliseconds>(deadline - now)));
+        if (req->sock == INVALID_SOCKET) continue;
+        PollFd fd{};
+        fd.fd = req->sock;
+        fd.events = req->step == FetchRequest::Step::RECEIVE ? POLLIN : POLLOUT;
+        fds.push_back(fd);
+        owners.push_back(req.get());
+    }
+
+    const int ready = poll_sockets(fds.data(), fds.size(), static_cast<int>(wait.count()) + 1);
+    if (ready > 0) {
+        if (fds[0].revents) {
+            char drain[64];
+            while (recv(wake_sock, drain, sizeof(drain), 0) > 0) {
+            }
+        }
+        for (size_t i = 1; i < fds.size(); ++i) {
+            FetchRequest& req = *owners[i - 1];
+            if (!fds[i].revents || req.finished || req.cancelled) continue;
+            if (req.step == FetchRequest::Step::RECEIVE) onReadable(req);
+            else onWritable(req);
+        }
+    }
+
+    const Clock::time_point after = Clock::now();
+    for (auto& req : active) {
+        if (!req->finished && after - req->started >= std::chrono::seconds(req->timeout_seconds)) finish(*req, "request timed out");
+    }
+}
+
+void AsyncFetcher::Loop::release(FetchRequest& req) {
+    if (req.sock != INVALID_SOCKET) close_socket(req.sock);
+    req.sock = INVALID_SOCKET;
+    if (req.addrs) freeaddrinfo(req.addrs);
+    req.addrs = req.next_addr = nullptr;
+    req.parser.reset();
+}
+#endif
+
+void FetchHandle::cancel() {
+    if (!request_ || request_->cancelled.exchange(true)) return;
+    auto loop = request_->loop.lock();
+    if (settle(*request_, "fetch cancelled") && loop) --loop->pending;
+    if (loop) loop->wake();
+}
+
+bool FetchHandle::cancelled() const { return request_ && request_->cancelled; }
+
+bool FetchHandle::ready() const {
+    return result_.valid() && result_.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+}
+
+HttpResponse FetchHandle::get() {
+    if (!result_.valid()) throw std::runtime_error("fetch result already taken");
+    HttpResponse resp = result_.get();
+    for (const auto& span : request_->spans) record_span(span.phase, span.start, span.end);
+    return resp;
+}
+
+AsyncFetcher::AsyncFetcher() : loop_(std::make_shared<Loop>()) {
+    io_ = std::thread([loop = loop_] { loop->run(); });
+}
+
+AsyncFetcher::~AsyncFetcher() {
+    {
+        std::lock_guard<std::mutex> lock(loop_->mu);
+        loop_->stopping = true;
+    }
+    loop_->wake();
+    io_.join();
+}
+
+FetchHandle AsyncFetcher::fetch(const string& url, FetchCallbacks callbacks, int timeout_seconds, int redirect_limit) {
+    auto req = std::make_shared<FetchRequest>();
+    req->url = url;
+    req->timeout_seconds = timeout_seconds;
+    req->redirect_limit = redirect_limit;
+    req->callbacks = std::move(callbacks);
+    req->loop = loop_;
+    req->memory = active_memory_account();
+
+    FetchHandle handle;
+    handle.request_ = req;
+    handle.result_ = req->promise.get_future();
+
+    ++loop_->pending;
+    {
+        std::lock_guard<std::mutex> lock(loop_->mu);
+        loop_->incoming.push_back(std::move(req));
+    }
+    loop_->wake();
+    return handle;
+}
+
+size_t AsyncFetcher::pending() const { return loop_->pending; }
+
+AsyncFetcher& AsyncFetcher::shared() {
+    static AsyncFetcher fetcher;
+    return fetcher;
+}
+
+}  // namespace browser
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <cstddef>
+#include <functional>
+#include <future>
+#include <memory>
+#include <thread>
+
+#include "browser_core.h"
+
+namespace browser {
+
+// Callbacks run on the fetcher's I/O thread and should return quickly; none is started
+// after the fetch has been cancelled.
+struct FetchCallbacks {
+    // The final response's status line and headers have arrived (after redirects); the
+    // body is still empty.
+    std::function<void(const HttpResponse& headers)> on_headers;
+    // Body bytes received so far; `expected` is 0 when the length is not known up front.
+    std::function<void(size_t received, size_t expected)> on_progress;
+    // The result is ready: get() will not block.
+    std::function<void()> on_done;
+};
+
+struct FetchRequest;
+
+// One in-flight fetch. Move-only; dropping the handle does not cancel the fetch.
+class FetchHandle {
+public:
+    FetchHandle() = default;
+
+    bool valid() const { return request_ != nullptr; }
+    // Abandons the fetch without waiting: the result fails with "fetch cancelled" right
+    // away and the I/O thread closes the connection on its next wakeup.
+    void cancel();
+    bool cancelled() const;
+    bool ready() const;
+
+    // Blocks for the response and throws std::runtime_error on failure or cancellation.
+    // The transfer's network phases are recorded into the calling thread's metrics.
+    HttpResponse get();
+    std::future<HttpResponse>& future() { return result_; }
+
+private:
+    friend class AsyncFetcher;
+
+    std::shared_ptr<FetchRequest> request_;
+    std::future<HttpResponse> result_;
+};
+
+// Runs any number of concurrent GETs on a single I/O thread: a libcurl multi handle when
+// built with curl, non-blocking sockets and poll() otherwise. Same limits, redirects and
+// timeouts as http_get.
+class AsyncFetcher {
+public:
+    AsyncFetcher();
+    // Fails whatever is still in flight and joins the I/O thread.
+    ~AsyncFetcher();
+
+    AsyncFetcher(const AsyncFetcher&) = delete;
+    AsyncFetcher& operator=(const AsyncFetcher&) = delete;
+
+    FetchHandle fetch(const string& url, FetchCallbacks callbacks = {}, int timeout_seconds = 10, int redirect_limit = 3);
+
+    // Fetches started and not yet finished or cancelled.
+    size_t pending() const;
+
+    static AsyncFetcher& shared();
+
+    struct Loop;
+
+private:
+    std::shared_ptr<Loop> loop_;
+    std::thread io_;
+};
+
+}  // namespace browser
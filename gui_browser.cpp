@@ -7,10 +7,14 @@
 #include <windows.h>
 #include <commctrl.h>
 
+#include <memory>
 #include <string>
 #include <vector>
 
 #include "browser_core.h"
+#include "charset.h"
+#include "fetch.h"
+#include "thread_pool.h"
 
 #pragma comment(lib, "Comctl32.lib")
 
@@ -21,6 +25,12 @@ constexpr int IDC_RELOAD = 1003;
 constexpr int IDC_HOME = 1004;
 constexpr int IDC_GO = 1005;
 
+// Posted from the fetcher's I/O thread and the render thread; wParam is the navigation
+// generation so results of superseded loads can be dropped.
+constexpr UINT WM_APP_PROGRESS = WM_APP + 1;
+constexpr UINT WM_APP_FETCHED = WM_APP + 2;
+constexpr UINT WM_APP_RENDERED = WM_APP + 3;
+
 HWND g_tab = nullptr;
 HWND g_address = nullptr;
 HWND g_page = nullptr;
@@ -29,6 +39,21 @@ HWND g_status = nullptr;
 std::vector<std::string> g_history;
 int g_history_index = -1;
 
+struct Navigation {
+    std::string url;
+    bool push_history = false;
+    browser::FetchHandle fetch;
+};
+
+struct RenderedPage {
+    std::string text;
+    bool ok = false;
+};
+
+WPARAM g_generation = 0;
+Navigation g_nav;
+browser::ThreadPool g_render(1);
+
 std::string normalize(std::string u) {
     if (u.find("://") == std::string::npos) u = "https://" + u;
     return u;
@@ -84,28 +109,70 @@ void layout(HWND hwnd) {
 }
 
 void load(HWND hwnd, const std::string& url, bool push_history) {
+    // A new navigation abandons the previous one, closing its connection.
+    g_nav.fetch.cancel();
+    const WPARAM generation = ++g_generation;
+    set_status("Loading " + url + " ...");
+
+    browser::FetchCallbacks callbacks;
+    callbacks.on_progress = [hwnd, generation](size_t received, size_t) {
+        PostMessageW(hwnd, WM_APP_PROGRESS, generation, static_cast<LPARAM>(received));
+    };
+    callbacks.on_done = [hwnd, generation] { PostMessageW(hwnd, WM_APP_FETCHED, generation, 0); };
+
+    g_nav.url = url;
+    g_nav.push_history = push_history;
+    g_nav.fetch = browser::AsyncFetcher::shared().fetch(url, callbacks);
+}
+
+void show_error(HWND hwnd, const std::string& what) {
+    SetWindowTextA(g_page, what.c_str());
+    set_status("Load error: " + what);
+    update_nav(hwnd);
+}
+
+// The response is in; render off the UI thread.
+void on_fetched(HWND hwnd, WPARAM generation) {
+    HttpResponse resp;
     try {
-        set_status("Loading " + url + " ...");
-        const HttpResponse resp = http_get(url);
-        const std::string page = render_page_text(resp.body, 110);
-
-        SetWindowTextA(g_address, url.c_str());
-        SetWindowTextA(g_page, page.empty() ? "(No renderable content)" : page.c_str());
-
-        if (push_history) {
-            if (g_history_index + 1 < static_cast<int>(g_history.size())) g_history.resize(g_history_index + 1);
-            if (g_history.empty() || g_history.back() != url) {
-                g_history.push_back(url);
-                g_history_index = static_cast<int>(g_history.size()) - 1;
-            }
+        resp = g_nav.fetch.get();
+    } catch (const std::exception& ex) {
+        show_error(hwnd, ex.what());
+        return;
+    }
+
+    set_status("Rendering " + g_nav.url + " ...");
+    g_render.post([hwnd, generation, url = g_nav.url, body = browser::decode_response_body(resp)] {
+        auto page = std::make_unique<RenderedPage>();
+        try {
+            page->text = render_page_text(body, url, 110);
+            page->ok = true;
+        } catch (const std::exception& ex) {
+            page->text = ex.what();
         }
+        if (PostMessageW(hwnd, WM_APP_RENDERED, generation, reinterpret_cast<LPARAM>(page.get()))) page.release();
+    });
+}
 
-        set_status("Done");
-    } catch (const std::exception& ex) {
-        SetWindowTextA(g_page, ex.what());
-        set_status(std::string("Load error: ") + ex.what());
+void on_rendered(HWND hwnd, const RenderedPage& page) {
+    if (!page.ok) {
+        show_error(hwnd, page.text);
+        return;
     }
 
+    const std::string& url = g_nav.url;
+    SetWindowTextA(g_address, url.c_str());
+    SetWindowTextA(g_page, page.text.empty() ? "(No renderable content)" : page.text.c_str());
+
+    if (g_nav.push_history) {
+        if (g_history_index + 1 < static_cast<int>(g_history.size())) g_history.resize(g_history_index + 1);
+        if (g_history.empty() || g_history.back() != url) {
+            g_history.push_back(url);
+            g_history_index = static_cast<int>(g_history.size()) - 1;
+        }
+    }
+
+    set_status("Done");
     update_nav(hwnd);
 }
 
@@ -166,7 +233,22 @@ LRESULT CALLBACK WndProc(HWND hwnd, UINT msg, WPARAM wParam, LPARAM lParam) {
             return 0;
         }
 
+        case WM_APP_PROGRESS:
+            if (wParam == g_generation) set_status("Loading " + g_nav.url + " ... " + std::to_string(static_cast<size_t>(lParam) / 1024) + " KB");
+            return 0;
+
+        case WM_APP_FETCHED:
+            if (wParam == g_generation) on_fetched(hwnd, wParam);
+            return 0;
+
+        case WM_APP_RENDERED: {
+            std::unique_ptr<RenderedPage> page(reinterpret_cast<RenderedPage*>(lParam));
+            if (wParam == g_generation) on_rendered(hwnd, *page);
+            return 0;
+        }
+
         case WM_DESTROY:
+            g_nav.fetch.cancel();
             PostQuitMessage(0);
             return 0;
     }
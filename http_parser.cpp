@@ -0,0 +1,217 @@
+#include "http_parser.h"
+#include "browser_core.h"
+#include "content_decoder.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <stdexcept>
+
+namespace browser {
+namespace {
+
+constexpr size_t kMaxLineBytes = 16 * 1024;
+
+std::string lower(std::string s) {
+    std::transform(s.begin(), s.end(), s.begin(), [](unsigned char c) { return static_cast<char>(std::tolower(c)); });
+    return s;
+}
+
+std::string trim(const std::string& s) {
+    size_t b = 0;
+    while (b < s.size() && std::isspace(static_cast<unsigned char>(s[b]))) ++b;
+    size_t e = s.size();
+    while (e > b && std::isspace(static_cast<unsigned char>(s[e - 1]))) --e;
+    return s.substr(b, e - b);
+}
+
+bool parse_size(const std::string& text, int base, size_t& out) {
+    if (text.empty()) return false;
+    size_t value = 0;
+    for (char c : text) {
+        int digit = -1;
+        if (c >= '0' && c <= '9') digit = c - '0';
+        else if (base == 16 && c >= 'a' && c <= 'f') digit = c - 'a' + 10;
+        else if (base == 16 && c >= 'A' && c <= 'F') digit = c - 'A' + 10;
+        if (digit < 0) return false;
+        if (value > (static_cast<size_t>(-1) - digit) / base) return false;
+        value = value * base + digit;
+    }
+    out = value;
+    return true;
+}
+
+}  // namespace
+
+HttpResponseParser::HttpResponseParser(HttpResponse& out, size_t max_body_bytes) : out_(out), max_body_bytes_(max_body_bytes) {}
+
+HttpResponseParser::~HttpResponseParser() = default;
+
+bool HttpResponseParser::feed(const char* data, size_t size) {
+    size_t i = 0;
+    while (i < size && state_ != State::DONE && state_ != State::FAILED) {
+        switch (state_) {
+            case State::BODY_LENGTH:
+            case State::CHUNK_DATA: {
+                const size_t n = std::min(remaining_, size - i);
+                if (!appendBody(data + i, n)) return false;
+                remaining_ -= n;
+                i += n;
+                if (remaining_ == 0 && state_ == State::CHUNK_DATA) state_ = State::CHUNK_CRLF;
+                else if (remaining_ == 0 && !complete()) return false;
+                break;
+            }
+            case State::BODY_EOF:
+                if (!appendBody(data + i, size - i)) return false;
+                i = size;
+                break;
+            default: {
+                const char* nl = static_cast<const char*>(std::memchr(data + i, '\n', size - i));
+                const size_t end = nl ? static_cast<size_t>(nl - data) : size;
+                pending_.append(data + i, end - i);
+                if (pending_.size() > kMaxLineBytes) return fail("response header line too long");
+                i = nl ? end + 1 : size;
+                if (!nl) break;
+                if (!pending_.empty() && pending_.back() == '\r') pending_.pop_back();
+                std::string text;
+                text.swap(pending_);
+                if (!line(text)) return false;
+                break;
+            }
+        }
+    }
+    return state_ != State::FAILED;
+}
+
+void HttpResponseParser::finishEof() {
+    if (state_ == State::BODY_EOF) complete();
+    else if (state_ == State::STATUS && out_.status_line.empty()) fail("empty response");
+    else if (state_ != State::DONE && state_ != State::FAILED) fail("connection closed before the response was complete");
+}
+
+bool HttpResponseParser::line(std::string& text) {
+    switch (state_) {
+        case State::STATUS: {
+            if (text.empty()) return true;
+            if (text.rfind("HTTP/", 0) != 0) return fail("malformed status line");
+            const size_t sp = text.find(' ');
+            size_t code = 0;
+            if (sp == std::string::npos || !parse_size(text.substr(sp + 1, 3), 10, code) || code < 100 || code > 999) {
+                return fail("malformed status line");
+            }
+            status_ = static_cast<int>(code);
+            keep_alive_ = text.compare(0, 8, "HTTP/1.0") != 0;
+            out_.status_line = text;
+            out_.headers.clear();
+            state_ = State::HEADERS;
+            return true;
+        }
+        case State::HEADERS: {
+            if (text.empty()) {
+                headersComplete();
+                return true;
+            }
+            const size_t colon = text.find(':');
+            if (colon == std::string::npos) return fail("malformed header line");
+            out_.headers[lower(trim(text.substr(0, colon)))] = trim(text.substr(colon + 1));
+            return true;
+        }
+        case State::CHUNK_SIZE: {
+            size_t size = 0;
+            if (!parse_size(trim(text.substr(0, text.find(';'))), 16, size)) return fail("malformed chunk size");
+            if (size == 0) {
+                state_ = State::TRAILERS;
+            } else {
+                if (size > max_body_bytes_) return fail("response body exceeds " + std::to_string(max_body_bytes_) + " bytes");
+                remaining_ = size;
+                state_ = State::CHUNK_DATA;
+            }
+            return true;
+        }
+        case State::CHUNK_CRLF:
+            if (!text.empty()) return fail("malformed chunk terminator");
+            state_ = State::CHUNK_SIZE;
+            return true;
+        case State::TRAILERS:
+            return !text.empty() || complete();
+        default:
+            return true;
+    }
+}
+
+void HttpResponseParser::headersComplete() {
+    // Interim 1xx responses are followed by the real one.
+    if (status_ < 200) {
+        state_ = State::STATUS;
+        return;
+    }
+    frame();
+    if (state_ != State::FAILED && on_headers_) on_headers_();
+}
+
+void HttpResponseParser::frame() {
+    const auto header = [&](const char* name) {
+        const auto it = out_.headers.find(name);
+        return it == out_.headers.end() ? std::string() : lower(it->second);
+    };
+    const std::string connection = header("connection");
+    if (connection.find("close") != std::string::npos) keep_alive_ = false;
+    else if (connection.find("keep-alive") != std::string::npos) keep_alive_ = true;
+
+    if (status_ == 204 || status_ == 304) {
+        state_ = State::DONE;
+        return;
+    }
+    try {
+        decoder_ = ContentDecoder::create(header("content-encoding"));
+    } catch (const std::runtime_error& e) {
+        fail(e.what());
+        return;
+    }
+    if (header("transfer-encoding").find("chunked") != std::string::npos) {
+        state_ = State::CHUNK_SIZE;
+        return;
+    }
+    const std::string length = trim(header("content-length"));
+    if (!length.empty()) {
+        if (!parse_size(length, 10, content_length_)) {
+            fail("malformed Content-Length");
+            return;
+        }
+        if (content_length_ > max_body_bytes_) {
+            fail("response body exceeds " + std::to_string(max_body_bytes_) + " bytes");
+            return;
+        }
+        length_known_ = true;
+        remaining_ = content_length_;
+        state_ = State::BODY_LENGTH;
+        if (!remaining_) complete();
+        return;
+    }
+    keep_alive_ = false;
+    state_ = State::BODY_EOF;
+}
+
+bool HttpResponseParser::appendBody(const char* data, size_t size) {
+    if (decoder_) {
+        encoded_bytes_ += size;
+        return decoder_->decode(data, size, body_, max_body_bytes_) || fail(decoder_->error());
+    }
+    if (body_.size() + size > max_body_bytes_) return fail("response body exceeds " + std::to_string(max_body_bytes_) + " bytes");
+    body_.append(data, size);
+    return true;
+}
+
+bool HttpResponseParser::complete() {
+    if (decoder_ && encoded_bytes_ && !decoder_->finished()) return fail("encoded response body ended early");
+    state_ = State::DONE;
+    return true;
+}
+
+bool HttpResponseParser::fail(const std::string& why) {
+    state_ = State::FAILED;
+    error_ = why;
+    return false;
+}
+
+}  // namespace browser
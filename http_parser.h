@@ -0,0 +1,71 @@
+#pragma once
+
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <string>
+
+struct HttpResponse;
+
+namespace browser {
+
+class ContentDecoder;
+
+// Incremental HTTP/1.x response parser: status line, headers, then a body framed by
+// Content-Length, chunked transfer coding, or the end of the connection. The status line
+// and headers are written to the response as they arrive; the body is collected here
+// until takeBody(). A Content-Encoding the build supports is decoded as the bytes arrive,
+// and `max_body_bytes` then limits the decoded size.
+class HttpResponseParser {
+public:
+    explicit HttpResponseParser(HttpResponse& out, size_t max_body_bytes);
+    ~HttpResponseParser();
+
+    // Consumes bytes from the connection; returns false once the input is malformed or
+    // the body exceeds the limit (see error()).
+    bool feed(const char* data, size_t size);
+    // The peer closed the connection.
+    void finishEof();
+    // Called from feed() once the final (non-1xx) headers are in, before any body bytes.
+    void onHeaders(std::function<void()> fn) { on_headers_ = std::move(fn); }
+
+    bool headersDone() const { return state_ > State::HEADERS; }
+    bool done() const { return state_ == State::DONE; }
+    bool failed() const { return state_ == State::FAILED; }
+    const std::string& error() const { return error_; }
+    int statusCode() const { return status_; }
+    // Declared body length, or 0 when unknown (always for an encoded body).
+    size_t expectedBytes() const { return length_known_ && !decoder_ ? content_length_ : 0; }
+    size_t bodyBytes() const { return body_.size(); }
+    std::string takeBody() { return std::move(body_); }
+    // True when the connection can carry another request after this response.
+    bool keepAlive() const { return keep_alive_; }
+
+private:
+    enum class State { STATUS, HEADERS, BODY_LENGTH, CHUNK_SIZE, CHUNK_DATA, CHUNK_CRLF, TRAILERS, BODY_EOF, DONE, FAILED };
+
+    bool line(std::string& text);
+    void headersComplete();
+    void frame();
+    bool appendBody(const char* data, size_t size);
+    // The framing is complete; an encoded body must have ended with it, unless it was empty.
+    bool complete();
+    bool fail(const std::string& why);
+
+    HttpResponse& out_;
+    size_t max_body_bytes_;
+    State state_ = State::STATUS;
+    std::function<void()> on_headers_;
+    std::unique_ptr<ContentDecoder> decoder_;
+    std::string pending_;
+    std::string body_;
+    std::string error_;
+    int status_ = 0;
+    bool length_known_ = false;
+    bool keep_alive_ = true;
+    size_t content_length_ = 0;
+    size_t remaining_ = 0;
+    size_t encoded_bytes_ = 0;  // fed to decoder_
+};
+
+}  // namespace browser
@@ -0,0 +1,319 @@
+#include "layout.h"
+#include "metrics.h"
+#include "style_engine.h"
+
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <unordered_set>
+
+namespace browser {
+namespace {
+
+bool is_space(char c) { return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\f'; }
+
+std::string lower(std::string s) {
+    for (char& c : s) c = static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+    return s;
+}
+
+bool skips_subtree(const std::string& tag) {
+    return tag == "script" || tag == "style" || tag == "noscript" || tag == "meta" || tag == "link" || tag == "head";
+}
+
+bool is_block_tag(const std::string& tag) {
+    static const std::unordered_set<std::string> blocks = {
+        "html", "body", "main", "article", "section", "header", "footer", "nav", "aside", "div", "p", "ul", "ol", "li",
+        "h1", "h2", "h3", "h4", "h5", "h6", "pre", "blockquote", "table", "tr", "td", "th", "form"};
+    return blocks.count(tag) != 0;
+}
+
+bool is_block_level(const Element& el, const StyleProperties& style) {
+    if (!style.has(Property::DISPLAY)) return is_block_tag(el.tag_name);
+    return style.display != Display::INLINE && style.display != Display::INLINE_BLOCK;
+}
+
+bool is_hidden(const Element& el, const StyleProperties& style) {
+    if (skips_subtree(el.tag_name)) return true;
+    if (style.has(Property::DISPLAY) && style.display == Display::NONE) return true;
+    const std::string_view inline_style = el.getAttribute("style");
+    return !inline_style.empty() && lower(std::string(inline_style)).find("display:none") != std::string::npos;
+}
+
+// What a user-agent sheet would give headings and bold tags when the page says nothing.
+int16_t default_font_size(const std::string& tag, int16_t inherited) {
+    if (tag.size() != 2 || tag[0] != 'h' || tag[1] < '1' || tag[1] > '6') return inherited;
+    static const int16_t kPercent[] = {200, 150, 117, 100, 83, 67};
+    return static_cast<int16_t>(inherited * kPercent[tag[1] - '1'] / 100);
+}
+
+bool default_bold(const std::string& tag) {
+    return tag == "b" || tag == "strong" || tag == "th" || (tag.size() == 2 && tag[0] == 'h' && tag[1] >= '1' && tag[1] <= '6');
+}
+
+StyleProperties inherit(const StyleProperties& computed, const StyleProperties& parent, const std::string& tag) {
+    StyleProperties out = computed;
+    if (!out.has(Property::FONT_SIZE)) out.font_size = default_font_size(tag, parent.font_size);
+    if (!out.has(Property::FONT_WEIGHT)) out.font_weight = default_bold(tag) ? 700 : parent.font_weight;
+    if (!out.has(Property::COLOR)) out.color = parent.color;
+    if (!out.has(Property::VISIBILITY)) out.visibility = parent.visibility;
+    return out;
+}
+
+// Advances at 16px, in 1/4 px.
+int32_t advance(unsigned char c) {
+    if (c >= 0x80) return 36;
+    switch (c) {
+        case 'i': case 'j': case 'l': case '.': case ',': case ':': case ';': case '\'': case '!': case '|': return 16;
+        case 'f': case 'r': case 't': case '(': case ')': case '[': case ']': case '-': return 22;
+        case 'm': case 'w': return 50;
+        case 'M': case 'W': case '@': return 56;
+        default: break;
+    }
+    if (c >= 'A' && c <= 'Z') return 42;
+    if (c >= '0' && c <= '9') return 36;
+    return 32;
+}
+
+}  // namespace
+
+int32_t TextMetrics::width(std::string_view word, int16_t font_size, bool bold) {
+    key_.assign(reinterpret_cast<const char*>(&font_size), sizeof(font_size));
+    key_.push_back(bold ? 'b' : 'r');
+    key_.append(word.data(), word.size());
+    const auto it = cache_.find(key_);
+    if (it != cache_.end()) {
+        ++hits_;
+        return it->second;
+    }
+    ++misses_;
+
+    int64_t quarter_px = 0;
+    for (const char c : word) {
+        // One advance per code point: UTF-8 continuation bytes add nothing.
+        if ((static_cast<unsigned char>(c) & 0xC0) != 0x80) quarter_px += advance(static_cast<unsigned char>(c));
+    }
+    if (bold) quarter_px += quarter_px / 10;
+    const int32_t w = static_cast<int32_t>((quarter_px * font_size + 32) / 64);
+
+    if (cache_.size() >= kMaxCachedWords) cache_.clear();
+    cache_.emplace(key_, w);
+    return w;
+}
+
+void TextMetrics::glyphEdges(std::string_view text, int16_t font_size, bool bold, std::vector<int32_t>& edges) {
+    edges.clear();
+    int32_t word_left = 0;
+    int64_t quarter_px = 0;
+    const auto at = [&](int64_t q) { return word_left + static_cast<int32_t>(((bold ? q + q / 10 : q) * font_size + 32) / 64); };
+    for (const char c : text) {
+        if ((static_cast<unsigned char>(c) & 0xC0) == 0x80) continue;
+        if (c == ' ') {
+            edges.push_back(at(quarter_px));
+            word_left = edges.back() + spaceWidth(font_size);
+            quarter_px = 0;
+            continue;
+        }
+        edges.push_back(at(quarter_px));
+        quarter_px += advance(static_cast<unsigned char>(c));
+    }
+    edges.push_back(at(quarter_px));
+}
+
+int32_t TextMetrics::spaceWidth(int16_t font_size) { return (font_size + 2) / 4; }
+
+int32_t TextMetrics::lineHeight(int16_t font_size) { return (font_size * 5 + 2) / 4; }
+
+void TextMetrics::clear() {
+    cache_.clear();
+    hits_ = 0;
+    misses_ = 0;
+}
+
+// Inline formatting state of the block being laid out.
+struct LayoutEngine::Flow {
+    LayoutBox& block;
+    int32_t left;   // content box, in the block's coordinates
+    int32_t width;
+    int32_t y;
+    LayoutBox* line = nullptr;
+    int32_t line_x = 0;
+    int32_t line_height = 0;
+    bool space = false;  // whitespace since the last word on this line
+};
+
+// A block's child blocks from the last pass. Children usually come back in the same order,
+// so lookups try the next one before falling back to a map.
+struct LayoutEngine::Reusable {
+    std::vector<std::unique_ptr<LayoutBox>> boxes;
+    size_t next = 0;
+    std::unordered_map<const Element*, size_t> index;
+
+    std::unique_ptr<LayoutBox> take(const Element* el) {
+        if (next < boxes.size() && boxes[next] && boxes[next]->element == el) return std::move(boxes[next++]);
+        if (index.empty()) {
+            for (size_t i = 0; i < boxes.size(); ++i) {
+                if (boxes[i]) index.emplace(boxes[i]->element, i);
+            }
+        }
+        const auto it = index.find(el);
+        return it == index.end() ? nullptr : std::move(boxes[it->second]);
+    }
+};
+
+LayoutEngine::LayoutEngine(StyleEngine& styles) : styles_(styles) {}
+
+const LayoutBox& LayoutEngine::layout(int32_t viewport_width) {
+    ZEPHYR_TRACE_PHASE(Phase::LAYOUT);
+    const auto start = std::chrono::steady_clock::now();
+    styles_.restyle();
+
+    stats_ = LayoutStats();
+    const size_t hits = metrics_.hits();
+    const size_t misses = metrics_.misses();
+
+    Document& doc = *styles_.document();
+    const auto computed = styles_.styles().find(&doc);
+    const StyleProperties style = inherit(computed == styles_.styles().end() ? StyleProperties() : computed->second, StyleProperties(), doc.tag_name);
+    root_ = layoutBlock(doc, std::move(root_), style, std::max<int32_t>(0, viewport_width));
+
+    stats_.full = stats_.blocks_reused == 0;
+    stats_.measure_hits = metrics_.hits() - hits;
+    stats_.measure_misses = metrics_.misses() - misses;
+    stats_.milliseconds = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    return *root_;
+}
+
+std::unique_ptr<LayoutBox> LayoutEngine::layoutBlock(Element& el, std::unique_ptr<LayoutBox> old, const StyleProperties& style, int32_t available) {
+    const Document::LayoutMarks marks = styles_.document()->takeLayoutMarks(el);
+    if (old && !marks.self && !marks.descendants && old->available_width == available && old->style == style) {
+        ++stats_.blocks_reused;
+        return old;
+    }
+    ++stats_.blocks_laid_out;
+
+    // Child blocks from the last pass, to be kept where they did not change.
+    Reusable previous;
+    std::unique_ptr<LayoutBox> box = old ? std::move(old) : std::make_unique<LayoutBox>();
+    for (auto& child : box->children) {
+        if (child->kind == LayoutBox::Kind::BLOCK) previous.boxes.push_back(std::move(child));
+    }
+    box->children.clear();
+    box->kind = LayoutBox::Kind::BLOCK;
+    box->element = &el;
+    box->style = style;
+    box->available_width = available;
+
+    const int32_t horizontal_padding = style.padding_left + style.padding_right;
+    int32_t width = available - style.margin_left - style.margin_right;
+    if (style.has(Property::WIDTH)) width = std::min(width, style.width + horizontal_padding);
+    box->width = std::max<int32_t>(0, width);
+
+    Flow flow{*box, style.padding_left, std::max<int32_t>(0, box->width - horizontal_padding), style.padding_top};
+    flowChildren(el, style, flow, previous);
+    finishLine(flow);
+    box->height = flow.y + style.padding_bottom;
+    return box;
+}
+
+void LayoutEngine::flowChildren(Element& parent, const StyleProperties& style, Flow& flow, Reusable& previous) {
+    Document& doc = *styles_.document();
+    for (const auto& node : parent.children) {
+        if (node->type == NodeType::TEXT) {
+            const std::string_view text = static_cast<const TextNode&>(*node).text.view();
+            for (size_t i = 0; i < text.size();) {
+                if (is_space(text[i])) {
+                    flow.space = true;
+                    ++i;
+                    continue;
+                }
+                size_t end = i;
+                while (end < text.size() && !is_space(text[end])) ++end;
+                placeWord(text.substr(i, end - i), parent, style, flow);
+                i = end;
+            }
+            continue;
+        }
+        if (node->type != NodeType::ELEMENT) continue;
+
+        Element& el = static_cast<Element&>(*node);
+        const auto computed = styles_.styles().find(&el);
+        const StyleProperties child_style = inherit(computed == styles_.styles().end() ? StyleProperties() : computed->second, style, el.tag_name);
+        if (is_hidden(el, child_style)) continue;
+
+        if (el.tag_name == "br") {
+            doc.takeLayoutMarks(el);
+            if (flow.line) finishLine(flow);
+            else flow.y += TextMetrics::lineHeight(style.font_size);
+            continue;
+        }
+        if (!is_block_level(el, child_style)) {
+            doc.takeLayoutMarks(el);
+            flowChildren(el, child_style, flow, previous);
+            continue;
+        }
+
+        finishLine(flow);
+        flow.y += child_style.margin_top;
+        std::unique_ptr<LayoutBox> child = layoutBlock(el, previous.take(&el), child_style, flow.width);
+        child->x = flow.left + child_style.margin_left;
+        child->y = flow.y;
+        flow.y += child->height + child_style.margin_bottom;
+        flow.block.children.push_back(std::move(child));
+    }
+}
+
+void LayoutEngine::placeWord(std::string_view word, const Element& owner, const StyleProperties& style, Flow& flow) {
+    ++stats_.words;
+    const int32_t w = metrics_.width(word, style.font_size, style.font_weight >= 600);
+    const int32_t space = (flow.line && flow.space) ? TextMetrics::spaceWidth(style.font_size) : 0;
+    if (flow.line && flow.line_x + space + w > flow.width) finishLine(flow);
+
+    if (!flow.line) {
+        auto line = std::make_unique<LayoutBox>();
+        line->kind = LayoutBox::Kind::LINE;
+        line->element = flow.block.element;
+        line->x = flow.left;
+        line->y = flow.y;
+        line->width = flow.width;
+        line->style = flow.block.style;
+        flow.line = line.get();
+        flow.block.children.push_back(std::move(line));
+        flow.line_x = 0;
+        flow.line_height = 0;
+        ++stats_.lines;
+    }
+
+    const bool separated = flow.space && flow.line_x > 0;
+    LayoutBox* run = flow.line->children.empty() ? nullptr : flow.line->children.back().get();
+    if (run && run->element == &owner && run->style == style && (separated || run->x + run->width == flow.line_x)) {
+        if (separated) run->text.push_back(' ');
+        run->text.append(word.data(), word.size());
+        run->width = flow.line_x + (separated ? TextMetrics::spaceWidth(style.font_size) : 0) + w - run->x;
+    } else {
+        auto text = std::make_unique<LayoutBox>();
+        text->kind = LayoutBox::Kind::TEXT;
+        text->element = &owner;
+        text->x = flow.line_x + (separated ? TextMetrics::spaceWidth(style.font_size) : 0);
+        text->width = w;
+        text->style = style;
+        text->text.assign(word.data(), word.size());
+        run = text.get();
+        flow.line->children.push_back(std::move(text));
+    }
+    flow.line_x = run->x + run->width;
+    flow.line_height = std::max(flow.line_height, TextMetrics::lineHeight(style.font_size));
+    flow.space = false;
+}
+
+void LayoutEngine::finishLine(Flow& flow) {
+    flow.space = false;
+    if (!flow.line) return;
+    for (auto& run : flow.line->children) run->height = TextMetrics::lineHeight(run->style.font_size);
+    flow.line->height = flow.line_height;
+    flow.y += flow.line_height;
+    flow.line = nullptr;
+    flow.line_x = 0;
+}
+
+}  // namespace browser
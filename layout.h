@@ -0,0 +1,106 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include "css.h"
+#include "dom.h"
+
+namespace browser {
+
+class StyleEngine;
+
+// Word widths in the built-in proportional face: per-character advances at 16px, scaled to
+// the font size and widened for bold. Words are cached per size and weight.
+class TextMetrics {
+public:
+    static constexpr size_t kMaxCachedWords = 64 * 1024;
+
+    int32_t width(std::string_view word, int16_t font_size, bool bold);
+    static int32_t spaceWidth(int16_t font_size);
+    static int32_t lineHeight(int16_t font_size);
+    // Sets `edges` to the left edge of each code point of `text` followed by its right
+    // end, with the same rounding as width() and spaces as wide as spaceWidth().
+    static void glyphEdges(std::string_view text, int16_t font_size, bool bold, std::vector<int32_t>& edges);
+
+    size_t hits() const { return hits_; }
+    size_t misses() const { return misses_; }
+    size_t cachedWords() const { return cache_.size(); }
+    void clear();
+
+private:
+    std::unordered_map<std::string, int32_t> cache_;
+    std::string key_;
+    size_t hits_ = 0;
+    size_t misses_ = 0;
+};
+
+struct LayoutBox {
+    enum class Kind : uint8_t { BLOCK, LINE, TEXT };
+
+    Kind kind = Kind::BLOCK;
+    // BLOCK: the element laid out. TEXT: the element whose text this is.
+    const Element* element = nullptr;
+    // Border box, relative to the parent box, so a cached subtree moves without being
+    // touched. Margins sit outside it.
+    int32_t x = 0;
+    int32_t y = 0;
+    int32_t width = 0;
+    int32_t height = 0;
+    // Computed style with font size, weight, color and visibility inherited.
+    StyleProperties style;
+    std::string text;  // TEXT only: words joined by single spaces
+    std::vector<std::unique_ptr<LayoutBox>> children;
+
+    // BLOCK only: the width offered by the parent when this box was laid out.
+    int32_t available_width = -1;
+};
+
+struct LayoutStats {
+    bool full = false;  // nothing could be reused
+    double milliseconds = 0;
+    size_t blocks_laid_out = 0;
+    size_t blocks_reused = 0;
+    size_t lines = 0;
+    size_t words = 0;
+    size_t measure_hits = 0;
+    size_t measure_misses = 0;
+};
+
+// Block and inline layout of a StyleEngine's document. The box tree is its own cache: a
+// block is kept as is when neither its element nor anything beneath it was marked by the
+// document since the last pass and its style and available width are unchanged. After a
+// mutation only the blocks on the path to it are laid out again, and on a resize only
+// those whose width depends on the viewport.
+class LayoutEngine {
+public:
+    explicit LayoutEngine(StyleEngine& styles);
+
+    // Restyles, then lays out for a viewport `viewport_width` px wide.
+    const LayoutBox& layout(int32_t viewport_width);
+
+    const LayoutBox* root() const { return root_.get(); }
+    const LayoutStats& lastStats() const { return stats_; }
+    TextMetrics& metrics() { return metrics_; }
+
+private:
+    struct Flow;
+    struct Reusable;
+
+    std::unique_ptr<LayoutBox> layoutBlock(Element& el, std::unique_ptr<LayoutBox> old, const StyleProperties& style, int32_t available);
+    void flowChildren(Element& parent, const StyleProperties& style, Flow& flow, Reusable& previous);
+    void placeWord(std::string_view word, const Element& owner, const StyleProperties& style, Flow& flow);
+    void finishLine(Flow& flow);
+
+    StyleEngine& styles_;
+    TextMetrics metrics_;
+    std::unique_ptr<LayoutBox> root_;
+    LayoutStats stats_;
+};
+
+}  // namespace browser
@@ -0,0 +1,70 @@
+#include "load_test.h"
+#include "fetch.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+
+namespace browser {
+namespace {
+
+double percentile(const std::vector<double>& sorted, double p) {
+    if (sorted.empty()) return 0;
+    const size_t rank = static_cast<size_t>(p * static_cast<double>(sorted.size() - 1) + 0.5);
+    return sorted[std::min(rank, sorted.size() - 1)];
+}
+
+}  // namespace
+
+LoadTestReport run_load_test(const LoadTestOptions& options) {
+    if (options.urls.empty()) throw std::runtime_error("load test needs at least one URL");
+    LoadTestReport report;
+    std::vector<double> latencies(options.requests, 0.0);
+    std::atomic<size_t> next{0};
+    std::atomic<size_t> errors{0};
+    std::atomic<size_t> non_2xx{0};
+    std::atomic<size_t> bytes{0};
+    std::mutex error_mutex;
+
+    const auto worker = [&] {
+        for (size_t i = next++; i < options.requests; i = next++) {
+            const std::string& url = options.urls[i % options.urls.size()];
+            const auto start = std::chrono::steady_clock::now();
+            try {
+                const HttpResponse resp = options.async ? AsyncFetcher::shared().fetch(url, {}, options.timeout_seconds).get() : http_get(url, options.timeout_seconds);
+                bytes += resp.body.size();
+                if (resp.status_line.size() < 10 || resp.status_line[9] != '2') ++non_2xx;
+            } catch (const std::exception& e) {
+                if (errors++ == 0) {
+                    std::lock_guard<std::mutex> lock(error_mutex);
+                    report.first_error = e.what();
+                }
+            }
+            latencies[i] = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+        }
+    };
+
+    const auto started = std::chrono::steady_clock::now();
+    std::vector<std::thread> workers;
+    const size_t threads = std::max<size_t>(1, std::min(options.concurrency, options.requests));
+    for (size_t i = 0; i < threads; ++i) workers.emplace_back(worker);
+    for (auto& t : workers) t.join();
+    report.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - started).count();
+
+    std::sort(latencies.begin(), latencies.end());
+    report.requests = options.requests;
+    report.errors = errors;
+    report.non_2xx = non_2xx;
+    report.body_bytes = bytes;
+    report.requests_per_second = report.seconds > 0 ? options.requests / report.seconds : 0;
+    report.p50_ms = percentile(latencies, 0.50);
+    report.p90_ms = percentile(latencies, 0.90);
+    report.p99_ms = percentile(latencies, 0.99);
+    report.max_ms = latencies.empty() ? 0 : latencies.back();
+    return report;
+}
+
+}  // namespace browser
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+namespace browser {
+
+struct LoadTestOptions {
+    std::vector<std::string> urls;  // requested round-robin
+    size_t requests = 1000;
+    size_t concurrency = 8;
+    // Drives the shared AsyncFetcher instead of calling http_get from each worker.
+    bool async = false;
+    int timeout_seconds = 10;
+};
+
+struct LoadTestReport {
+    size_t requests = 0;
+    size_t errors = 0;   // the fetch threw
+    size_t non_2xx = 0;  // answered, but not with a 2xx status
+    size_t body_bytes = 0;
+    double seconds = 0;
+    double requests_per_second = 0;
+    double p50_ms = 0;
+    double p90_ms = 0;
+    double p99_ms = 0;
+    double max_ms = 0;
+    std::string first_error;
+};
+
+// Closed-loop load: `concurrency` workers each issue their next request as soon as the
+// previous one completes, until `requests` have been made. Latency covers the whole
+// fetch, connection setup and redirects included.
+LoadTestReport run_load_test(const LoadTestOptions& options);
+
+}  // namespace browser
@@ -0,0 +1,105 @@
+#include "browser_core.h"
+#include "load_test.h"
+#include "test_server.h"
+
+#include <cstdio>
+#include <iostream>
+#include <string>
+#include <vector>
+
+namespace {
+
+struct Scenario {
+    std::string name;
+    std::string path;
+};
+
+void print_header() { std::printf("%-10s %9s %9s %9s %9s %9s %7s %6s %6s\n", "scenario", "req/s", "p50 ms", "p90 ms", "p99 ms", "max ms", "reuse", "errors", "!2xx"); }
+
+void print_row(const std::string& name, const browser::LoadTestReport& r, double reuse) {
+    std::printf("%-10s %9.0f %9.3f %9.3f %9.3f %9.3f ", name.c_str(), r.requests_per_second, r.p50_ms, r.p90_ms, r.p99_ms, r.max_ms);
+    if (reuse >= 0) std::printf("%6.1f%%", reuse * 100.0);
+    else std::printf("%7s", "-");
+    std::printf(" %6zu %6zu\n", r.errors, r.non_2xx);
+}
+
+}  // namespace
+
+// Load driver for the HTTP stack. Without --url it starts the local test server and runs
+// every scenario against it; "reuse" is the share of requests that did not need a new
+// connection, as counted by the server. Exits non-zero when any request failed.
+int main(int argc, char** argv) {
+    browser::LoadTestOptions options;
+    options.requests = 500;
+    for (int i = 1; i < argc; ++i) {
+        const std::string arg = argv[i];
+        if (arg == "--requests" && i + 1 < argc) options.requests = std::stoul(argv[++i]);
+        else if (arg == "--concurrency" && i + 1 < argc) options.concurrency = std::stoul(argv[++i]);
+        else if (arg == "--url" && i + 1 < argc) options.urls.push_back(argv[++i]);
+        else if (arg == "--async") options.async = true;
+        else {
+            std::cerr << "Usage: zephyr_loadtest [--requests N] [--concurrency N] [--async] [--url URL]...\n";
+            return 1;
+        }
+    }
+
+    std::cout << "backend: " << http_backend() << (options.async ? " (AsyncFetcher)" : " (http_get)") << ", " << options.requests << " requests per scenario, concurrency "
+              << options.concurrency << "\n";
+    bool failed = false;
+    try {
+        if (!options.urls.empty()) {
+            print_header();
+            const browser::LoadTestReport r = browser::run_load_test(options);
+            print_row("url", r, -1);
+            failed = r.errors > 0;
+            if (failed) std::cerr << "first error: " << r.first_error << "\n";
+            return failed ? 2 : 0;
+        }
+
+        browser::TestHttpServer server;
+        browser::TestRoute small;
+        small.body = std::string(1024, 'x');
+        server.route("/small", small);
+        browser::TestRoute large;
+        large.body = std::string(1024 * 1024, 'y');
+        server.route("/large", large);
+        browser::TestRoute chunked;
+        chunked.body = std::string(64 * 1024, 'z');
+        chunked.chunk_size = 4096;
+        server.route("/chunked", chunked);
+        browser::TestRoute gzip;
+        gzip.body = std::string(64 * 1024, 'g');
+        gzip.gzip = true;
+        server.route("/gzip", gzip);
+        server.route("/redirect", browser::redirect_route("/small"));
+        browser::TestRoute trickle;
+        trickle.body = std::string(4096, 't');
+        trickle.trickle_bytes = 1024;
+        trickle.trickle_delay = std::chrono::milliseconds(2);
+        server.route("/trickle", trickle);
+        browser::TestRoute close;
+        close.body = small.body;
+        close.close = true;
+        server.route("/close", close);
+
+        const std::vector<Scenario> scenarios = {{"small", "/small"},     {"large", "/large"},    {"chunked", "/chunked"}, {"gzip", "/gzip"},
+                                                 {"redirect", "/redirect"}, {"trickle", "/trickle"}, {"close", "/close"}};
+        print_header();
+        for (const Scenario& s : scenarios) {
+            browser::LoadTestOptions run = options;
+            run.urls = {server.url(s.path)};
+            server.resetCounts();
+            const browser::LoadTestReport r = browser::run_load_test(run);
+            const double reuse = server.requests() ? 1.0 - static_cast<double>(server.connections()) / server.requests() : 0;
+            print_row(s.name, r, reuse);
+            if (r.errors) {
+                std::cerr << s.name << ": " << r.errors << " failed, first error: " << r.first_error << "\n";
+                failed = true;
+            }
+        }
+    } catch (const std::exception& e) {
+        std::cerr << "Error: " << e.what() << "\n";
+        return 1;
+    }
+    return failed ? 2 : 0;
+}
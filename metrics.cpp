@@ -0,0 +1,101 @@
+#include "metrics.h"
+
+#include <atomic>
+
+namespace browser {
+namespace {
+
+std::atomic<bool> g_enabled{true};
+thread_local PageMetrics* t_active = nullptr;
+
+const char* phase_category(Phase phase) {
+    switch (phase) {
+        case Phase::DNS:
+        case Phase::CONNECT:
+        case Phase::TLS:
+        case Phase::FIRST_BYTE:
+        case Phase::DOWNLOAD:
+            return "net";
+        case Phase::HTML_PARSE:
+        case Phase::CSS_PARSE:
+            return "parse";
+        default:
+            return "render";
+    }
+}
+
+}  // namespace
+
+const char* phase_name(Phase phase) {
+    switch (phase) {
+        case Phase::DNS: return "dns";
+        case Phase::CONNECT: return "connect";
+        case Phase::TLS: return "tls";
+        case Phase::FIRST_BYTE: return "first_byte";
+        case Phase::DOWNLOAD: return "download";
+        case Phase::HTML_PARSE: return "html_parse";
+        case Phase::CSS_PARSE: return "css_parse";
+        case Phase::STYLE: return "style";
+        case Phase::RENDER: return "render";
+        case Phase::LAYOUT: return "layout";
+    }
+    return "unknown";
+}
+
+double PageMetrics::network_ms() const {
+    return ms(Phase::DNS) + ms(Phase::CONNECT) + ms(Phase::TLS) + ms(Phase::FIRST_BYTE) + ms(Phase::DOWNLOAD);
+}
+
+double PageMetrics::total_ms() const {
+    // STYLE runs inside RENDER, so it is not added a second time.
+    return network_ms() + ms(Phase::HTML_PARSE) + ms(Phase::CSS_PARSE) + ms(Phase::RENDER) + ms(Phase::LAYOUT);
+}
+
+void PageMetrics::record(Phase phase, std::chrono::steady_clock::time_point start, double duration_us, bool trace) {
+    phase_ms[static_cast<size_t>(phase)] += duration_us / 1000.0;
+    if (!trace) return;
+    const double start_us = std::chrono::duration<double, std::micro>(start - epoch).count();
+    events.push_back({phase, start_us, duration_us});
+}
+
+void PageMetrics::merge(const PageMetrics& other) {
+    for (size_t i = 0; i < kPhaseCount; ++i) phase_ms[i] += other.phase_ms[i];
+    const double shift_us = std::chrono::duration<double, std::micro>(other.epoch - epoch).count();
+    for (TraceEvent e : other.events) {
+        e.start_us += shift_us;
+        events.push_back(e);
+    }
+}
+
+void set_metrics_enabled(bool enabled) { g_enabled.store(enabled, std::memory_order_relaxed); }
+bool metrics_enabled() { return g_enabled.load(std::memory_order_relaxed); }
+
+PageMetrics* active_metrics() { return t_active; }
+
+MetricsScope::MetricsScope(PageMetrics& metrics) : previous_(t_active) {
+    if (ZEPHYR_METRICS && metrics_enabled()) t_active = &metrics;
+}
+
+MetricsScope::~MetricsScope() { t_active = previous_; }
+
+void write_chrome_trace(const PageMetrics& metrics, std::ostream& out) {
+    out << "{\"traceEvents\":[";
+    bool first = true;
+    for (const auto& e : metrics.events) {
+        if (!first) out << ',';
+        first = false;
+        out << "{\"name\":\"" << phase_name(e.phase) << "\",\"cat\":\"" << phase_category(e.phase)
+            << "\",\"ph\":\"X\",\"pid\":1,\"tid\":1,\"ts\":" << e.start_us << ",\"dur\":" << e.duration_us << '}';
+    }
+
+    // Accumulated phases (style lookups) have no single span, so totals ride along as a metadata event.
+    if (!first) out << ',';
+    out << "{\"name\":\"page_totals\",\"ph\":\"M\",\"pid\":1,\"tid\":1,\"args\":{";
+    for (size_t i = 0; i < kPhaseCount; ++i) {
+        if (i) out << ',';
+        out << '"' << phase_name(static_cast<Phase>(i)) << "_ms\":" << metrics.phase_ms[i];
+    }
+    out << "}}],\"displayTimeUnit\":\"ms\"}";
+}
+
+}  // namespace browser
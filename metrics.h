@@ -0,0 +1,96 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <ostream>
+#include <vector>
+
+// Build with -DZEPHYR_METRICS=0 (CMake: ZEPHYR_ENABLE_METRICS=OFF) to compile the
+// instrumentation points out entirely.
+#ifndef ZEPHYR_METRICS
+#define ZEPHYR_METRICS 1
+#endif
+
+namespace browser {
+
+enum class Phase { DNS, CONNECT, TLS, FIRST_BYTE, DOWNLOAD, HTML_PARSE, CSS_PARSE, STYLE, RENDER, LAYOUT };
+
+constexpr size_t kPhaseCount = 10;
+
+const char* phase_name(Phase phase);
+
+struct TraceEvent {
+    Phase phase = Phase::DNS;
+    double start_us = 0;
+    double duration_us = 0;
+};
+
+struct PageMetrics {
+    std::chrono::steady_clock::time_point epoch = std::chrono::steady_clock::now();
+    double phase_ms[kPhaseCount] = {};
+    std::vector<TraceEvent> events;
+
+    double ms(Phase phase) const { return phase_ms[static_cast<size_t>(phase)]; }
+    double network_ms() const;
+    double total_ms() const;
+
+    // Adds to the phase total; traced spans also become a Chrome trace event.
+    void record(Phase phase, std::chrono::steady_clock::time_point start, double duration_us, bool trace = true);
+    // Adds `other`'s totals and events, rebased onto this epoch. PageMetrics is not
+    // thread-safe, so a worker records into its own and the owner merges it afterwards.
+    void merge(const PageMetrics& other);
+};
+
+// Runtime switch; when off, MetricsScope installs nothing and every probe is a null check.
+void set_metrics_enabled(bool enabled);
+bool metrics_enabled();
+
+// The PageMetrics that probes on this thread report into, or nullptr.
+PageMetrics* active_metrics();
+
+class MetricsScope {
+public:
+    explicit MetricsScope(PageMetrics& metrics);
+    ~MetricsScope();
+
+    MetricsScope(const MetricsScope&) = delete;
+    MetricsScope& operator=(const MetricsScope&) = delete;
+
+private:
+    PageMetrics* previous_;
+};
+
+class ScopedPhase {
+public:
+    explicit ScopedPhase(Phase phase, bool trace = true) : metrics_(active_metrics()), phase_(phase), trace_(trace) {
+        if (metrics_) start_ = std::chrono::steady_clock::now();
+    }
+    ~ScopedPhase() {
+        if (!metrics_) return;
+        const auto end = std::chrono::steady_clock::now();
+        metrics_->record(phase_, start_, std::chrono::duration<double, std::micro>(end - start_).count(), trace_);
+    }
+
+    ScopedPhase(const ScopedPhase&) = delete;
+    ScopedPhase& operator=(const ScopedPhase&) = delete;
+
+private:
+    PageMetrics* metrics_;
+    Phase phase_;
+    bool trace_;
+    std::chrono::steady_clock::time_point start_;
+};
+
+void write_chrome_trace(const PageMetrics& metrics, std::ostream& out);
+
+}  // namespace browser
+
+#if ZEPHYR_METRICS
+#define ZEPHYR_PHASE_CAT2(a, b) a##b
+#define ZEPHYR_PHASE_CAT(a, b) ZEPHYR_PHASE_CAT2(a, b)
+#define ZEPHYR_TRACE_PHASE(phase) ::browser::ScopedPhase ZEPHYR_PHASE_CAT(zephyr_phase_, __LINE__)(phase)
+#define ZEPHYR_ACCUMULATE_PHASE(phase) ::browser::ScopedPhase ZEPHYR_PHASE_CAT(zephyr_phase_, __LINE__)(phase, false)
+#else
+#define ZEPHYR_TRACE_PHASE(phase) ((void)0)
+#define ZEPHYR_ACCUMULATE_PHASE(phase) ((void)0)
+#endif
@@ -0,0 +1,334 @@
+#include "paint.h"
+#include "stylesheet_cache.h"
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <future>
+#include <stdexcept>
+
+namespace browser {
+namespace {
+
+const Color kBorderColor{128, 128, 128, 255};
+
+// Top of the text box to the baseline: half the leading, then the ascent.
+int32_t baseline(int32_t line_height, int16_t font_size) { return (line_height - font_size) / 2 + font_size * 4 / 5; }
+
+bool in_link(const Element* el) {
+    while (el) {
+        if (el->tag_name == "a" && !el->getAttribute("href").empty()) return true;
+        const ElementPtr parent = el->parent.lock();
+        el = parent.get();
+    }
+    return false;
+}
+
+bool bordered(const Element& el) {
+    if (el.tag_name != "table" && el.tag_name != "td" && el.tag_name != "th") return false;
+    const Element* table = &el;
+    while (table && table->tag_name != "table") {
+        const ElementPtr parent = table->parent.lock();
+        table = parent.get();
+    }
+    if (!table) return false;
+    const auto it = table->attributes.find("border");
+    return it != table->attributes.end() && it->second.view() != "0";
+}
+
+void seal(DisplayItem& item) {
+    const int32_t header[] = {static_cast<int32_t>(item.type), item.x, item.y, item.width, item.height,
+                              item.color.r << 24 | item.color.g << 16 | item.color.b << 8 | item.color.a, item.font_size, item.bold};
+    item.hash = hash_bytes(item.text.data(), item.text.size(), hash_bytes(reinterpret_cast<const char*>(header), sizeof(header)));
+}
+
+void add_rect(DisplayList& out, DisplayItem::Type type, int32_t x, int32_t y, int32_t width, int32_t height, Color color) {
+    DisplayItem item;
+    item.type = type;
+    item.x = x;
+    item.y = y;
+    item.width = width;
+    item.height = height;
+    item.color = color;
+    seal(item);
+    out.items.push_back(std::move(item));
+}
+
+void collect(const LayoutBox& box, int32_t ox, int32_t oy, DisplayList& out) {
+    const int32_t x = ox + box.x;
+    const int32_t y = oy + box.y;
+    const StyleProperties& st = box.style;
+    if (box.kind == LayoutBox::Kind::TEXT) {
+        if (st.visibility != Visibility::VISIBLE) return;
+        DisplayItem item;
+        item.type = DisplayItem::Type::TEXT;
+        item.x = x;
+        item.y = y;
+        item.width = box.width;
+        item.height = box.height;
+        item.color = st.color;
+        item.font_size = st.font_size;
+        item.bold = st.font_weight >= 600;
+        item.text = box.text;
+        seal(item);
+        out.items.push_back(std::move(item));
+        if (in_link(box.element)) {
+            add_rect(out, DisplayItem::Type::RECT, x, y + baseline(box.height, st.font_size) + 1, box.width, std::max(1, st.font_size / 16), st.color);
+        }
+        return;
+    }
+
+    if (box.kind == LayoutBox::Kind::BLOCK && box.element) {
+        if (bordered(*box.element)) add_rect(out, DisplayItem::Type::BORDER, x, y, box.width, box.height, kBorderColor);
+        const bool list_item = st.has(Property::DISPLAY) ? st.display == Display::LIST_ITEM : box.element->tag_name == "li";
+        if (list_item && st.visibility == Visibility::VISIBLE && !box.children.empty() && box.children[0]->kind == LayoutBox::Kind::LINE) {
+            const LayoutBox& line = *box.children[0];
+            const int32_t size = std::max(2, st.font_size / 3);
+            add_rect(out, DisplayItem::Type::RECT, x + line.x - st.font_size * 3 / 4, y + line.y + (line.height - size) / 2, size, size, st.color);
+        }
+    }
+    for (const auto& child : box.children) collect(*child, x, y, out);
+}
+
+uint32_t crc32(const uint8_t* data, size_t size, uint32_t crc = 0) {
+    static const auto table = [] {
+        std::vector<uint32_t> t(256);
+        for (uint32_t n = 0; n < 256; ++n) {
+            uint32_t c = n;
+            for (int k = 0; k < 8; ++k) c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            t[n] = c;
+        }
+        return t;
+    }();
+    crc = ~crc;
+    for (size_t i = 0; i < size; ++i) crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
+
+void put_be32(std::string& out, uint32_t v) {
+    out.push_back(static_cast<char>(v >> 24));
+    out.push_back(static_cast<char>(v >> 16));
+    out.push_back(static_cast<char>(v >> 8));
+    out.push_back(static_cast<char>(v));
+}
+
+void put_chunk(std::string& out, const char* type, const std::string& data) {
+    put_be32(out, static_cast<uint32_t>(data.size()));
+    const size_t start = out.size();
+    out.append(type, 4);
+    out += data;
+    put_be32(out, crc32(reinterpret_cast<const uint8_t*>(out.data() + start), out.size() - start));
+}
+
+// Clips to [x0, x1) x [y0, y1) and blends `color` over what is there.
+void fill(Image& image, int32_t x0, int32_t y0, int32_t x1, int32_t y1, Color color, int32_t cx0, int32_t cy0, int32_t cx1, int32_t cy1) {
+    x0 = std::max(x0, cx0);
+    y0 = std::max(y0, cy0);
+    x1 = std::min(x1, cx1);
+    y1 = std::min(y1, cy1);
+    if (x0 >= x1 || y0 >= y1 || color.a == 0) return;
+    for (int32_t py = y0; py < y1; ++py) {
+        uint8_t* p = image.rgba.data() + (static_cast<size_t>(py) * image.width + x0) * 4;
+        for (int32_t px = x0; px < x1; ++px, p += 4) {
+            if (color.a == 255) {
+                p[0] = color.r;
+                p[1] = color.g;
+                p[2] = color.b;
+            } else {
+                p[0] = static_cast<uint8_t>((color.r * color.a + p[0] * (255 - color.a) + 127) / 255);
+                p[1] = static_cast<uint8_t>((color.g * color.a + p[1] * (255 - color.a) + 127) / 255);
+                p[2] = static_cast<uint8_t>((color.b * color.a + p[2] * (255 - color.a) + 127) / 255);
+            }
+            p[3] = 255;
+        }
+    }
+}
+
+// Vertical ink of a glyph relative to the baseline, as [top, bottom).
+void glyph_extent(unsigned char c, int16_t size, int32_t& top, int32_t& bottom) {
+    const int32_t x_height = size / 2;
+    const int32_t cap = size * 7 / 10;
+    top = -x_height;
+    bottom = 0;
+    if ((c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == 'b' || c == 'd' || c == 'f' || c == 'h' || c == 'k' || c == 'l' || c == 't') top = -cap;
+    else if (c == 'g' || c == 'j' || c == 'p' || c == 'q' || c == 'y') bottom = size / 5;
+    else if (c == '.' || c == ',' || c == '_') top = -std::max(1, size / 8);
+    else if (c == '-' || c == '~') {
+        top = -size / 3;
+        bottom = top + std::max(1, size / 12);
+    }
+}
+
+}  // namespace
+
+DisplayList build_display_list(const LayoutBox& root) {
+    DisplayList list;
+    list.width = root.width;
+    list.height = root.height;
+    collect(root, 0, 0, list);
+    return list;
+}
+
+std::string encode_png(const Image& image) {
+    std::string out("\x89PNG\r\n\x1a\n", 8);
+    std::string header;
+    put_be32(header, static_cast<uint32_t>(image.width));
+    put_be32(header, static_cast<uint32_t>(image.height));
+    header += std::string("\x08\x06\x00\x00\x00", 5);  // 8-bit RGBA, no interlace
+    put_chunk(out, "IHDR", header);
+
+    // Each row is a filter byte (none) and the pixels; deflate "stored" blocks carry at
+    // most 65535 bytes.
+    const size_t row = static_cast<size_t>(image.width) * 4;
+    std::string raw;
+    raw.reserve((row + 1) * image.height);
+    for (int32_t y = 0; y < image.height; ++y) {
+        raw.push_back('\0');
+        raw.append(reinterpret_cast<const char*>(image.rgba.data() + y * row), row);
+    }
+    std::string zlib("\x78\x01", 2);
+    for (size_t i = 0; i < raw.size() || i == 0; i += 65535) {
+        const size_t n = std::min<size_t>(65535, raw.size() - i);
+        zlib.push_back(i + n >= raw.size() ? '\x01' : '\x00');
+        zlib.push_back(static_cast<char>(n & 0xFF));
+        zlib.push_back(static_cast<char>(n >> 8));
+        zlib.push_back(static_cast<char>(~n & 0xFF));
+        zlib.push_back(static_cast<char>((~n >> 8) & 0xFF));
+        zlib.append(raw, i, n);
+        if (raw.empty()) break;
+    }
+    uint32_t a = 1;
+    uint32_t b = 0;
+    for (const char c : raw) {
+        a = (a + static_cast<uint8_t>(c)) % 65521;
+        b = (b + a) % 65521;
+    }
+    put_be32(zlib, b << 16 | a);
+    put_chunk(out, "IDAT", zlib);
+    put_chunk(out, "IEND", "");
+    return out;
+}
+
+std::string encode_ppm(const Image& image) {
+    std::string out = "P6\n" + std::to_string(image.width) + " " + std::to_string(image.height) + "\n255\n";
+    out.reserve(out.size() + static_cast<size_t>(image.width) * image.height * 3);
+    for (size_t i = 0; i + 3 < image.rgba.size(); i += 4) out.append(reinterpret_cast<const char*>(image.rgba.data() + i), 3);
+    return out;
+}
+
+void write_image(const std::string& path, const Image& image) {
+    const bool ppm = path.size() >= 4 && path.compare(path.size() - 4, 4, ".ppm") == 0;
+    const std::string bytes = ppm ? encode_ppm(image) : encode_png(image);
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    if (!out) throw std::runtime_error("cannot write image: " + path);
+    out.write(bytes.data(), static_cast<std::streamsize>(bytes.size()));
+    if (!out) throw std::runtime_error("cannot write image: " + path);
+}
+
+TileRasterizer::TileRasterizer(size_t threads) {
+    if (threads) pool_ = std::make_unique<ThreadPool>(threads);
+}
+
+const Image& TileRasterizer::render(const DisplayList& list, int32_t width, int32_t height, int32_t scroll_y) {
+    const auto start = std::chrono::steady_clock::now();
+    width = std::max(0, width);
+    height = std::max(0, height);
+    bool fresh = false;
+    if (width != image_.width || height != image_.height) {
+        image_.width = width;
+        image_.height = height;
+        image_.rgba.assign(static_cast<size_t>(width) * height * 4, 255);
+        columns_ = (width + kTileSize - 1) / kTileSize;
+        rows_ = (height + kTileSize - 1) / kTileSize;
+        bins_.assign(static_cast<size_t>(columns_) * rows_, {});
+        tile_hashes_.assign(bins_.size(), 0);
+        fresh = true;
+    }
+    for (auto& bin : bins_) bin.clear();
+
+    for (size_t i = 0; i < list.items.size(); ++i) {
+        const DisplayItem& item = list.items[i];
+        const int32_t top = item.y - scroll_y;
+        if (item.width <= 0 || item.height <= 0 || item.x >= width || top >= height || item.x + item.width <= 0 || top + item.height <= 0) continue;
+        const int32_t c0 = std::max(0, item.x) / kTileSize;
+        const int32_t c1 = (std::min(width, item.x + item.width) - 1) / kTileSize;
+        const int32_t r0 = std::max(0, top) / kTileSize;
+        const int32_t r1 = (std::min(height, top + item.height) - 1) / kTileSize;
+        for (int32_t r = r0; r <= r1; ++r) {
+            for (int32_t c = c0; c <= c1; ++c) bins_[static_cast<size_t>(r) * columns_ + c].push_back(static_cast<uint32_t>(i));
+        }
+    }
+
+    std::vector<size_t> dirty;
+    for (size_t t = 0; t < bins_.size(); ++t) {
+        const int64_t seed[] = {static_cast<int64_t>(t), scroll_y};
+        uint64_t h = hash_bytes(reinterpret_cast<const char*>(seed), sizeof(seed));
+        for (const uint32_t i : bins_[t]) h = hash_bytes(reinterpret_cast<const char*>(&list.items[i].hash), sizeof(uint64_t), h);
+        if (fresh || h != tile_hashes_[t]) dirty.push_back(t);
+        tile_hashes_[t] = h;
+    }
+
+    if (pool_ && dirty.size() > 1) {
+        std::vector<std::future<void>> done;
+        done.reserve(dirty.size());
+        for (const size_t t : dirty) done.push_back(pool_->submit([this, &list, t, scroll_y] { paintTile(list, t, scroll_y); }));
+        for (auto& f : done) f.get();
+    } else {
+        for (const size_t t : dirty) paintTile(list, t, scroll_y);
+    }
+
+    stats_.tiles = bins_.size();
+    stats_.painted = dirty.size();
+    stats_.reused = bins_.size() - dirty.size();
+    stats_.milliseconds = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    return image_;
+}
+
+void TileRasterizer::paintTile(const DisplayList& list, size_t tile, int32_t scroll_y) {
+    const int32_t x0 = static_cast<int32_t>(tile % columns_) * kTileSize;
+    const int32_t y0 = static_cast<int32_t>(tile / columns_) * kTileSize;
+    const int32_t x1 = std::min(x0 + kTileSize, image_.width);
+    const int32_t y1 = std::min(y0 + kTileSize, image_.height);
+    fill(image_, x0, y0, x1, y1, Color{255, 255, 255, 255}, x0, y0, x1, y1);
+
+    std::vector<int32_t> edges;
+    for (const uint32_t i : bins_[tile]) {
+        const DisplayItem& item = list.items[i];
+        const int32_t top = item.y - scroll_y;
+        switch (item.type) {
+            case DisplayItem::Type::RECT:
+                fill(image_, item.x, top, item.x + item.width, top + item.height, item.color, x0, y0, x1, y1);
+                break;
+            case DisplayItem::Type::BORDER: {
+                const int32_t right = item.x + item.width;
+                const int32_t bottom = top + item.height;
+                fill(image_, item.x, top, right, top + 1, item.color, x0, y0, x1, y1);
+                fill(image_, item.x, bottom - 1, right, bottom, item.color, x0, y0, x1, y1);
+                fill(image_, item.x, top, item.x + 1, bottom, item.color, x0, y0, x1, y1);
+                fill(image_, right - 1, top, right, bottom, item.color, x0, y0, x1, y1);
+                break;
+            }
+            case DisplayItem::Type::TEXT: {
+                TextMetrics::glyphEdges(item.text, item.font_size, item.bold, edges);
+                const int32_t base = top + baseline(item.height, item.font_size);
+                const int32_t gap = std::max(1, item.font_size / 16);
+                size_t g = 0;
+                for (const char c : item.text) {
+                    if ((static_cast<unsigned char>(c) & 0xC0) == 0x80) continue;
+                    if (c != ' ') {
+                        int32_t above = 0;
+                        int32_t below = 0;
+                        glyph_extent(static_cast<unsigned char>(c), item.font_size, above, below);
+                        const int32_t left = item.x + edges[g];
+                        const int32_t right = std::max(left + 1, item.x + edges[g + 1] - gap);
+                        fill(image_, left, base + above, right, base + below, item.color, x0, y0, x1, y1);
+                    }
+                    ++g;
+                }
+                break;
+            }
+        }
+    }
+}
+
+}  // namespace browser
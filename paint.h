@@ -0,0 +1,92 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "css.h"
+#include "layout.h"
+#include "thread_pool.h"
+
+namespace browser {
+
+struct DisplayItem {
+    enum class Type : uint8_t { RECT, TEXT, BORDER };
+
+    Type type = Type::RECT;
+    // Page coordinates. A BORDER is a 1px outline of this rectangle.
+    int32_t x = 0;
+    int32_t y = 0;
+    int32_t width = 0;
+    int32_t height = 0;
+    Color color;
+    int16_t font_size = 16;  // TEXT only
+    bool bold = false;       // TEXT only
+    std::string text;        // TEXT only
+    uint64_t hash = 0;       // of everything above, so unchanged items are recognised
+};
+
+// Items in paint order, over a white page.
+struct DisplayList {
+    std::vector<DisplayItem> items;
+    int32_t width = 0;
+    int32_t height = 0;
+};
+
+// Text runs, link underlines, list bullets and the borders of tables that have a border
+// attribute, in tree order. Hidden text is left out.
+DisplayList build_display_list(const LayoutBox& root);
+
+struct Image {
+    int32_t width = 0;
+    int32_t height = 0;
+    std::vector<uint8_t> rgba;  // row-major, 4 bytes per pixel
+};
+
+// PNG with stored (uncompressed) deflate blocks, so no compression library is needed.
+std::string encode_png(const Image& image);
+// Binary P6; alpha is dropped.
+std::string encode_ppm(const Image& image);
+// Picks the format from the extension (".ppm", anything else PNG). Throws
+// std::runtime_error when the file cannot be written.
+void write_image(const std::string& path, const Image& image);
+
+// Software rasterizer: the viewport is cut into square tiles that are painted in parallel.
+// Glyphs are drawn as solid blocks of their ink extent, which is enough for thumbnails and
+// pixel diffs without a font engine. The image persists between frames, and a tile whose
+// items hash the same as last frame keeps its pixels.
+class TileRasterizer {
+public:
+    static constexpr int32_t kTileSize = 64;
+
+    struct Stats {
+        size_t tiles = 0;
+        size_t painted = 0;
+        size_t reused = 0;
+        double milliseconds = 0;
+    };
+
+    // Paints on the calling thread when `threads` is 0.
+    explicit TileRasterizer(size_t threads);
+
+    // Paints the part of `list` from `scroll_y` down that fits a `width` x `height` viewport.
+    const Image& render(const DisplayList& list, int32_t width, int32_t height, int32_t scroll_y = 0);
+
+    const Image& image() const { return image_; }
+    const Stats& lastStats() const { return stats_; }
+
+private:
+    void paintTile(const DisplayList& list, size_t tile, int32_t scroll_y);
+
+    std::unique_ptr<ThreadPool> pool_;
+    Image image_;
+    int32_t columns_ = 0;
+    int32_t rows_ = 0;
+    std::vector<std::vector<uint32_t>> bins_;  // per tile, the items touching it
+    std::vector<uint64_t> tile_hashes_;
+    Stats stats_;
+};
+
+}  // namespace browser
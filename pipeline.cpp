@@ -0,0 +1,303 @@
+#include "pipeline.h"
+#include "charset.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <sstream>
+#include <stdexcept>
+
+namespace browser {
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+constexpr size_t kFetch = static_cast<size_t>(Stage::FETCH);
+constexpr size_t kParse = static_cast<size_t>(Stage::PARSE);
+constexpr size_t kStyle = static_cast<size_t>(Stage::STYLE);
+constexpr size_t kRender = static_cast<size_t>(Stage::RENDER);
+// Not a Stage of its own: the fetch threads fetch a page's subresources between its parse
+// and style stages.
+constexpr size_t kSubresources = kStageCount;
+
+}  // namespace
+
+const char* stage_name(Stage stage) {
+    switch (stage) {
+        case Stage::FETCH: return "fetch";
+        case Stage::PARSE: return "parse";
+        case Stage::STYLE: return "style";
+        case Stage::RENDER: return "render";
+    }
+    return "unknown";
+}
+
+string json_escape(const string& s) {
+    string out;
+    out.reserve(s.size() + 2);
+    for (unsigned char c : s) {
+        switch (c) {
+            case '"': out += "\\\""; break;
+            case '\\': out += "\\\\"; break;
+            case '\n': out += "\\n"; break;
+            case '\r': out += "\\r"; break;
+            case '\t': out += "\\t"; break;
+            default:
+                if (c < 0x20) {
+                    char buf[8];
+                    std::snprintf(buf, sizeof(buf), "\\u%04x", c);
+                    out += buf;
+                } else {
+                    out.push_back(static_cast<char>(c));
+                }
+        }
+    }
+    return out;
+}
+
+string page_result_json(const PageResult& r, bool with_text) {
+    std::ostringstream out;
+    out << "{\"index\":" << r.index << ",\"input\":\"" << json_escape(r.url) << "\",\"status\":\"" << (r.ok ? "ok" : "error") << '"';
+    if (!r.status_line.empty()) out << ",\"http_status\":\"" << json_escape(r.status_line) << '"';
+    if (!r.error.empty()) out << ",\"error\":\"" << json_escape(r.error) << '"';
+    out << ",\"bytes\":" << r.bytes << ",\"latency_ms\":" << r.latency_ms << ",\"phases_ms\":{";
+    for (size_t i = 0; i < kPhaseCount; ++i) {
+        if (i) out << ',';
+        out << '"' << phase_name(static_cast<Phase>(i)) << "\":" << r.metrics.phase_ms[i];
+    }
+    out << '}';
+    if (with_text) out << ",\"text\":\"" << json_escape(r.text) << '"';
+    out << '}';
+    return out.str();
+}
+
+struct PagePipeline::Job {
+    PageResult result;
+    Clock::time_point submitted = Clock::now();
+    HttpResponse response;
+    PreloadScan scan;
+    RenderContext ctx;
+    ComputedStyles styles;
+};
+
+PagePipeline::PagePipeline(PipelineOptions options, Sink sink) : options_(std::move(options)), sink_(std::move(sink)) {
+    options_.queue_capacity = std::max<size_t>(1, options_.queue_capacity);
+    cpu_workers_ = options_.cpu_workers ? options_.cpu_workers : std::max(1u, std::thread::hardware_concurrency());
+    started_ = Clock::now();
+    for (size_t i = 0; i < std::max<size_t>(1, options_.fetch_workers); ++i) fetchers_.emplace_back([this] { fetchLoop(); });
+    for (size_t i = 0; i < cpu_workers_; ++i) cpu_.emplace_back([this, i] { cpuLoop(kParse + i % 3); });
+}
+
+PagePipeline::~PagePipeline() { finish(); }
+
+void PagePipeline::submit(const string& url) {
+    auto job = std::make_unique<Job>();
+    job->result.url = url;
+
+    std::unique_lock<std::mutex> lock(mu_);
+    space_cv_.wait(lock, [&] { return closed_ || queues_[kFetch].items.size() < options_.queue_capacity; });
+    if (closed_) throw std::logic_error("PagePipeline::submit called after finish");
+    job->result.index = next_index_++;
+    ++in_flight_;
+    Queue& q = queues_[kFetch];
+    q.items.push_back(std::move(job));
+    q.max_depth = std::max(q.max_depth, q.items.size());
+    fetch_cv_.notify_one();
+}
+
+void PagePipeline::finish() {
+    {
+        std::lock_guard<std::mutex> lock(mu_);
+        if (finished_) return;
+        finished_ = true;
+        closed_ = true;
+    }
+    space_cv_.notify_all();
+    fetch_cv_.notify_all();
+    cpu_cv_.notify_all();
+    for (auto& t : fetchers_) t.join();
+    for (auto& t : cpu_) t.join();
+}
+
+std::vector<StageStats> PagePipeline::stats() const {
+    std::lock_guard<std::mutex> lock(mu_);
+    const double elapsed_us = std::chrono::duration<double, std::micro>(Clock::now() - started_).count();
+    std::vector<StageStats> out;
+    for (size_t s = 0; s < kStageCount; ++s) {
+        StageStats st;
+        st.stage = static_cast<Stage>(s);
+        st.processed = queues_[s].processed;
+        st.queue_depth = queues_[s].items.size();
+        st.max_queue_depth = queues_[s].max_depth;
+        // Subresource fetches run on the fetch threads, so their time counts as fetching.
+        st.busy_ms = (queues_[s].busy_us + (s == kFetch ? queues_[kSubresources].busy_us : 0)) / 1000.0;
+        const double workers = static_cast<double>(s == kFetch ? fetchers_.size() : cpu_workers_);
+        st.utilization = elapsed_us > 0 ? st.busy_ms * 1000.0 / (elapsed_us * workers) : 0;
+        out.push_back(st);
+    }
+    return out;
+}
+
+size_t PagePipeline::next(size_t stage) const {
+    switch (stage) {
+        case kFetch: return kParse;
+        case kParse: return options_.fetch_subresources ? kSubresources : kStyle;
+        case kSubresources: return kStyle;
+        case kStyle: return kRender;
+    }
+    return kRender;  // not reached: render delivers
+}
+
+bool PagePipeline::hasRoom(size_t stage) const {
+    const Queue& q = queues_[stage];
+    return q.items.size() + q.reserved < options_.queue_capacity;
+}
+
+PagePipeline::JobPtr PagePipeline::take(std::initializer_list<size_t> order, size_t& stage) {
+    for (size_t s : order) {
+        if (queues_[s].items.empty() || (s != kRender && !hasRoom(next(s)))) continue;
+        stage = s;
+        JobPtr job = std::move(queues_[s].items.front());
+        queues_[s].items.pop_front();
+        if (s != kRender) ++queues_[next(s)].reserved;
+        // A slot was freed upstream, and whoever serves the freed queue may now proceed.
+        if (s == kFetch) space_cv_.notify_all();
+        fetch_cv_.notify_all();
+        cpu_cv_.notify_all();
+        return job;
+    }
+    return nullptr;
+}
+
+void PagePipeline::push(size_t stage, JobPtr job) {
+    Queue& q = queues_[stage];
+    q.items.push_back(std::move(job));
+    q.max_depth = std::max(q.max_depth, q.items.size());
+    if (stage == kSubresources) fetch_cv_.notify_one();
+    else cpu_cv_.notify_one();
+}
+
+void PagePipeline::complete(size_t stage, JobPtr job, double busy_us) {
+    const bool done = stage == kRender || !job->result.error.empty();
+    {
+        std::lock_guard<std::mutex> lock(mu_);
+        queues_[stage].busy_us += busy_us;
+        if (stage != kSubresources) ++queues_[stage].processed;
+        if (stage != kRender) --queues_[next(stage)].reserved;
+        if (!done) {
+            push(next(stage), std::move(job));
+        } else if (stage != kRender) {
+            fetch_cv_.notify_all();
+            cpu_cv_.notify_all();
+        }
+    }
+    if (done) deliver(std::move(job));
+}
+
+void PagePipeline::fetchLoop() {
+    for (;;) {
+        JobPtr job;
+        size_t stage = 0;
+        {
+            // Like the CPU workers, a fetcher only starts a job whose output has a reserved
+            // slot, so it never holds a page while waiting on a stage it also serves.
+            std::unique_lock<std::mutex> lock(mu_);
+            for (;;) {
+                job = take({kSubresources, kFetch}, stage);
+                if (job) break;
+                if (closed_ && in_flight_ == 0) return;
+                fetch_cv_.wait(lock);
+            }
+        }
+
+        const Clock::time_point t0 = Clock::now();
+        runStage(stage, *job);
+        complete(stage, std::move(job), std::chrono::duration<double, std::micro>(Clock::now() - t0).count());
+    }
+}
+
+void PagePipeline::cpuLoop(size_t home) {
+    for (;;) {
+        JobPtr job;
+        size_t stage = 0;
+        {
+            std::unique_lock<std::mutex> lock(mu_);
+            for (;;) {
+                job = take({home, kRender, kStyle, kParse}, stage);
+                if (job) break;
+                if (closed_ && in_flight_ == 0) return;
+                cpu_cv_.wait(lock);
+            }
+        }
+
+        const Clock::time_point t0 = Clock::now();
+        runStage(stage, *job);
+        complete(stage, std::move(job), std::chrono::duration<double, std::micro>(Clock::now() - t0).count());
+    }
+}
+
+void PagePipeline::runStage(size_t stage, Job& job) {
+    MetricsScope scope(job.result.metrics);
+    try {
+        switch (stage) {
+            case kFetch: {
+                job.response = fetcher()(job.result.url);
+                job.result.status_line = job.response.status_line;
+                job.result.bytes = job.response.body.size();
+                break;
+            }
+            case kParse: {
+                const SharedBuffer html = decode_response_body(job.response);
+                job.response = HttpResponse();
+                if (options_.fetch_subresources) {
+                    job.scan = scan_subresources(html.bytes(), job.result.url);
+                    // The external sheets are fetched after this, so only inline styles can
+                    // defer anything, as in load_document.
+                    job.ctx = parse_document(html, "", true);
+                } else {
+                    job.ctx = parse_document(html, extract_style_blocks(html.bytes()), true);
+                }
+                break;
+            }
+            case kSubresources: {
+                LoadOptions load = options_.subresource_options;
+                if (!load.fetcher) load.fetcher = fetcher();
+                fetch_subresources(job.scan, load);
+                break;
+            }
+            case kStyle:
+                if (options_.fetch_subresources) attach_subresources(job.ctx, job.scan);
+                job.styles = resolve_styles(job.ctx);
+                break;
+            case kRender:
+                job.result.text = render_text(job.ctx, options_.wrap_width, &job.styles);
+                job.result.ok = true;
+                job.styles = ComputedStyles();
+                job.ctx = RenderContext();
+                break;
+        }
+    } catch (const std::exception& ex) {
+        job.result.error = ex.what();
+    }
+}
+
+Fetcher PagePipeline::fetcher() const {
+    return options_.fetcher ? options_.fetcher : Fetcher([](const string& url) { return http_get(url); });
+}
+
+void PagePipeline::deliver(JobPtr job) {
+    job->result.latency_ms = std::chrono::duration<double, std::milli>(Clock::now() - job->submitted).count();
+    {
+        std::lock_guard<std::mutex> lock(sink_mu_);
+        if (sink_) sink_(std::move(job->result));
+    }
+    job.reset();
+
+    std::lock_guard<std::mutex> lock(mu_);
+    --in_flight_;
+    if (in_flight_ == 0) {
+        fetch_cv_.notify_all();
+        cpu_cv_.notify_all();
+    }
+}
+
+}  // namespace browser
@@ -0,0 +1,131 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <initializer_list>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "browser_core.h"
+
+namespace browser {
+
+enum class Stage { FETCH, PARSE, STYLE, RENDER };
+
+constexpr size_t kStageCount = 4;
+
+const char* stage_name(Stage stage);
+
+struct PipelineOptions {
+    size_t fetch_workers = 16;
+    size_t cpu_workers = 0;  // hardware_concurrency when 0
+    size_t queue_capacity = 16;
+    size_t wrap_width = 100;
+    bool fetch_subresources = true;
+    LoadOptions subresource_options;
+    Fetcher fetcher;  // http_get when empty
+};
+
+struct PageResult {
+    size_t index = 0;
+    string url;
+    bool ok = false;
+    string status_line;
+    string error;
+    size_t bytes = 0;
+    string text;
+    PageMetrics metrics;
+    double latency_ms = 0;  // submit() to delivery, including time spent queued
+};
+
+struct StageStats {
+    Stage stage = Stage::FETCH;
+    size_t processed = 0;
+    size_t queue_depth = 0;
+    size_t max_queue_depth = 0;
+    double busy_ms = 0;
+    double utilization = 0;  // busy time over the time the stage's workers existed
+};
+
+// `s` as the inside of a JSON string literal: quotes, backslashes and control bytes escaped.
+string json_escape(const string& s);
+
+// One NDJSON line for `r` (no trailing newline), the record zephyr_cli --batch prints:
+// index, input, status ("ok" or "error"), http_status and error when set, bytes,
+// latency_ms, phases_ms by phase name, and the rendered text when `with_text` is set.
+string page_result_json(const PageResult& r, bool with_text = true);
+
+// Runs fetch -> parse -> style -> render as separate stages joined by bounded queues.
+// Fetch threads do only network I/O: the page, and after its parse has scanned them, its
+// stylesheet subresources. Slow hosts therefore never occupy a CPU worker, and CPU work
+// never holds up a fetch. CPU workers each have a home stage but take work from any
+// stage, most-downstream first. Every worker only starts a page when the next queue has
+// room for its output, which keeps the number of pages in memory bounded by the queue
+// capacities.
+class PagePipeline {
+public:
+    using Sink = std::function<void(PageResult&&)>;
+
+    // `sink` is called once per page, from worker threads, one call at a time.
+    PagePipeline(PipelineOptions options, Sink sink);
+    ~PagePipeline();
+
+    PagePipeline(const PagePipeline&) = delete;
+    PagePipeline& operator=(const PagePipeline&) = delete;
+
+    // Blocks while the fetch queue is full. Throws std::logic_error after finish().
+    void submit(const string& url);
+    // Stops accepting input, drains every stage and joins the workers.
+    void finish();
+
+    std::vector<StageStats> stats() const;
+
+private:
+    struct Job;
+    using JobPtr = std::unique_ptr<Job>;
+
+    struct Queue {
+        std::deque<JobPtr> items;
+        size_t reserved = 0;
+        size_t max_depth = 0;
+        size_t processed = 0;
+        double busy_us = 0;
+    };
+
+    void fetchLoop();
+    void cpuLoop(size_t home);
+    size_t next(size_t stage) const;
+    bool hasRoom(size_t stage) const;
+    // The first job in `order` whose next queue has room, with that room reserved.
+    JobPtr take(std::initializer_list<size_t> order, size_t& stage);
+    void push(size_t stage, JobPtr job);
+    void complete(size_t stage, JobPtr job, double busy_us);
+    void runStage(size_t stage, Job& job);
+    void deliver(JobPtr job);
+    Fetcher fetcher() const;
+
+    PipelineOptions options_;
+    Sink sink_;
+    size_t cpu_workers_ = 0;
+
+    mutable std::mutex mu_;
+    std::condition_variable fetch_cv_;
+    std::condition_variable cpu_cv_;
+    std::condition_variable space_cv_;
+    Queue queues_[kStageCount + 1];  // the stages, then subresource fetches
+    size_t in_flight_ = 0;
+    size_t next_index_ = 0;
+    bool closed_ = false;
+    bool finished_ = false;
+    std::chrono::steady_clock::time_point started_;
+
+    std::mutex sink_mu_;
+    std::vector<std::thread> fetchers_;
+    std::vector<std::thread> cpu_;
+};
+
+}  // namespace browser
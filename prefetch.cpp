@@ -0,0 +1,222 @@
+#include "prefetch.h"
+#include "url.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <stdexcept>
+#include <unordered_set>
+
+namespace browser {
+namespace {
+
+std::string without_fragment(const std::string& url) { return url.substr(0, url.find('#')); }
+
+bool same_origin(const UrlView& a, const UrlView& b) {
+    if (a.https != b.https || a.port != b.port || a.host.size() != b.host.size()) return false;
+    return std::equal(a.host.begin(), a.host.end(), b.host.begin(), [](char x, char y) {
+        return std::tolower(static_cast<unsigned char>(x)) == std::tolower(static_cast<unsigned char>(y));
+    });
+}
+
+bool cacheable(const HttpResponse& resp) {
+    const size_t sp = resp.status_line.find(' ');
+    const int status = sp == std::string::npos ? 0 : std::atoi(resp.status_line.c_str() + sp + 1);
+    if (status < 200 || status >= 300) return false;
+    const auto it = resp.headers.find("cache-control");
+    return it == resp.headers.end() || it->second.find("no-store") == std::string::npos;
+}
+
+}  // namespace
+
+Prefetcher::Prefetcher(PrefetchOptions options) : options_(options) {}
+
+Prefetcher::~Prefetcher() {
+    std::lock_guard<std::mutex> lock(mu_);
+    stopping_ = true;
+    queue_.clear();
+    for (Entry& e : lru_) {
+        if (!e.done) e.handle.cancel();
+    }
+}
+
+std::vector<std::string> Prefetcher::candidates(const std::string& page_url, const std::string& html, size_t limit) {
+    std::vector<std::string> out;
+    const std::string page = without_fragment(page_url);
+    UrlView origin;
+    if (limit == 0 || !UrlView::parse(page, origin)) return out;
+    std::string text;
+    std::vector<std::pair<std::string, std::string>> links;
+    extract_text_and_links(html, text, links);
+    const BaseUrl base(page);
+    std::unordered_set<std::string> seen{page};
+    for (const auto& link : links) {
+        std::string url = without_fragment(base.resolve(link.second));
+        UrlView view;
+        if (url.empty() || !UrlView::parse(url, view) || !same_origin(origin, view) || !seen.insert(url).second) continue;
+        out.push_back(std::move(url));
+        if (out.size() == limit) break;
+    }
+    return out;
+}
+
+size_t Prefetcher::prefetch(const std::string& page_url, const std::string& html) {
+    const std::vector<std::string> urls = candidates(page_url, html, options_.max_links);
+    const std::unordered_set<std::string> wanted(urls.begin(), urls.end());
+    const auto now = std::chrono::steady_clock::now();
+
+    std::lock_guard<std::mutex> lock(mu_);
+    if (stopping_) return 0;
+    ++generation_;
+    page_bytes_ = 0;
+    queue_.clear();
+    // The previous page's prefetches give way unless this page links to them too.
+    for (auto it = lru_.begin(); it != lru_.end();) {
+        const auto next = std::next(it);
+        if (!it->done && !wanted.count(it->url)) {
+            ++stats_.cancelled;
+            dropLocked(it);
+        } else if (!it->done) {
+            it->generation = generation_;
+            page_bytes_ += it->received;
+        } else if (now - it->fetched > options_.max_age) {
+            if (!it->used) ++stats_.unused;
+            dropLocked(it);
+        }
+        it = next;
+    }
+    for (const std::string& url : urls) {
+        if (!index_.count(url)) queue_.push_back(url);
+    }
+    const size_t queued = queue_.size();
+    startLocked();
+    return queued;
+}
+
+std::optional<HttpResponse> Prefetcher::take(const std::string& url) {
+    const std::string key = without_fragment(url);
+    std::lock_guard<std::mutex> lock(mu_);
+    ++stats_.lookups;
+    // A link still waiting for its turn is a miss; the caller fetches it now.
+    const auto queued = std::find(queue_.begin(), queue_.end(), key);
+    if (queued != queue_.end()) {
+        queue_.erase(queued);
+        return std::nullopt;
+    }
+    const auto found = index_.find(key);
+    if (found == index_.end()) return std::nullopt;
+    const EntryList::iterator it = found->second;
+    // So is one still in flight: waiting here would show no progress and could not be
+    // interrupted, so the prefetch gives way to the caller's own fetch.
+    if (!it->done) {
+        ++stats_.cancelled;
+        dropLocked(it);
+        return std::nullopt;
+    }
+    if (std::chrono::steady_clock::now() - it->fetched > options_.max_age) {
+        if (!it->used) ++stats_.unused;
+        dropLocked(it);
+        return std::nullopt;
+    }
+    ++stats_.hits;
+    it->used = true;
+    lru_.splice(lru_.begin(), lru_, it);
+    return it->response;
+}
+
+Prefetcher::Stats Prefetcher::stats() const {
+    std::lock_guard<std::mutex> lock(mu_);
+    Stats s = stats_;
+    s.entries = index_.size();
+    s.cached_bytes = cached_bytes_;
+    return s;
+}
+
+void Prefetcher::startLocked() {
+    while (!stopping_ && !queue_.empty() && in_flight_ < options_.max_concurrent && page_bytes_ < options_.max_page_bytes) {
+        const std::string url = std::move(queue_.front());
+        queue_.pop_front();
+        if (!index_.count(url)) launchLocked(url);
+    }
+}
+
+void Prefetcher::launchLocked(const std::string& url) {
+    const size_t id = ++next_id_;
+    FetchCallbacks callbacks;
+    callbacks.on_progress = [this, url, id](size_t received, size_t) { progress(url, id, received); };
+    callbacks.on_done = [this, url, id] { finished(url, id); };
+    Entry entry;
+    entry.url = url;
+    entry.id = id;
+    entry.generation = generation_;
+    lru_.push_front(std::move(entry));
+    index_[url] = lru_.begin();
+    ++in_flight_;
+    ++stats_.started;
+    lru_.front().handle = fetcher_.fetch(url, std::move(callbacks), options_.timeout_seconds);
+}
+
+void Prefetcher::progress(const std::string& url, size_t id, size_t received) {
+    std::lock_guard<std::mutex> lock(mu_);
+    const auto found = index_.find(url);
+    if (found == index_.end() || found->second->id != id) return;
+    Entry& e = *found->second;
+    if (e.generation == generation_ && received > e.received) page_bytes_ += received - e.received;
+    e.received = received;
+    if (e.generation == generation_ && page_bytes_ > options_.max_page_bytes) {
+        ++stats_.cancelled;
+        dropLocked(found->second);
+    }
+}
+
+void Prefetcher::finished(const std::string& url, size_t id) {
+    std::lock_guard<std::mutex> lock(mu_);
+    const auto found = index_.find(url);
+    if (found == index_.end() || found->second->id != id) return;
+    const EntryList::iterator it = found->second;
+    --in_flight_;
+    it->done = true;
+    try {
+        HttpResponse resp = it->handle.get();
+        stats_.bytes += resp.body.size();
+        if (cacheable(resp)) {
+            ++stats_.completed;
+            cached_bytes_ += resp.body.size();
+            it->response = std::move(resp);
+            it->fetched = std::chrono::steady_clock::now();
+        } else {
+            ++stats_.failed;
+            dropLocked(it);
+        }
+    } catch (const std::exception&) {
+        ++stats_.failed;
+        dropLocked(it);
+    }
+    evictLocked();
+    startLocked();
+}
+
+void Prefetcher::dropLocked(EntryList::iterator it) {
+    if (it->done) {
+        if (it->response) cached_bytes_ -= it->response->body.size();
+    } else {
+        it->handle.cancel();
+        --in_flight_;
+    }
+    index_.erase(it->url);
+    lru_.erase(it);
+}
+
+void Prefetcher::evictLocked() {
+    auto it = lru_.end();
+    while (it != lru_.begin() && (cached_bytes_ > options_.max_cache_bytes || index_.size() > options_.max_entries)) {
+        --it;
+        if (!it->done) continue;
+        const auto victim = it++;
+        ++stats_.evictions;
+        if (!victim->used) ++stats_.unused;
+        dropLocked(victim);
+    }
+}
+
+}  // namespace browser
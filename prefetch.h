@@ -0,0 +1,113 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <deque>
+#include <list>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "fetch.h"
+
+namespace browser {
+
+struct PrefetchOptions {
+    // Same-origin links taken from each page, in document order.
+    size_t max_links = 4;
+    // Prefetches in flight at once; the rest wait their turn.
+    size_t max_concurrent = 2;
+    // Bytes one page's prefetches may pull in total; a fetch that would go past it is
+    // cancelled.
+    size_t max_page_bytes = 4 * 1024 * 1024;
+    // Completed responses kept, least-recently-used evicted first.
+    size_t max_cache_bytes = 16 * 1024 * 1024;
+    size_t max_entries = 32;
+    std::chrono::seconds max_age{120};
+    int timeout_seconds = 10;
+};
+
+// Idle-time fetches of the links a reader is likely to follow next. Runs on its own
+// AsyncFetcher so it never queues behind (or ahead of) a navigation, and keeps what it
+// fetched in a small bounded cache that take() serves from. Safe to share between threads.
+class Prefetcher {
+public:
+    struct Stats {
+        size_t lookups = 0;
+        size_t hits = 0;
+        size_t started = 0;
+        size_t completed = 0;
+        size_t failed = 0;
+        size_t cancelled = 0;  // over budget, superseded by the next page, or taken early
+        size_t evictions = 0;
+        size_t unused = 0;     // evicted or expired without ever being taken
+        size_t bytes = 0;      // body bytes fetched
+        size_t entries = 0;
+        size_t cached_bytes = 0;
+
+        double hitRate() const { return lookups ? static_cast<double>(hits) / lookups : 0.0; }
+    };
+
+    explicit Prefetcher(PrefetchOptions options = {});
+    // Cancels whatever is still queued or in flight.
+    ~Prefetcher();
+
+    Prefetcher(const Prefetcher&) = delete;
+    Prefetcher& operator=(const Prefetcher&) = delete;
+
+    // Queues the first same-origin links of `html` that are not cached or in flight yet;
+    // prefetches still running for an earlier page are cancelled. Returns how many were
+    // queued.
+    size_t prefetch(const std::string& page_url, const std::string& html);
+    // The prefetched response for `url`, or nullopt (a miss) when it was never prefetched,
+    // failed, or has not finished yet. Never blocks: a prefetch still queued or in flight is
+    // abandoned, since the caller is about to fetch the page itself.
+    std::optional<HttpResponse> take(const std::string& url);
+
+    Stats stats() const;
+
+    // Absolute, fragment-free URLs of the same-origin links in `html`, in document order,
+    // without duplicates or `page_url` itself.
+    static std::vector<std::string> candidates(const std::string& page_url, const std::string& html, size_t limit);
+
+private:
+    struct Entry {
+        std::string url;
+        size_t id = 0;
+        size_t generation = 0;  // the prefetch() call it counts against
+        bool done = false;
+        bool used = false;
+        size_t received = 0;
+        FetchHandle handle;
+        std::optional<HttpResponse> response;
+        std::chrono::steady_clock::time_point fetched;
+    };
+    using EntryList = std::list<Entry>;
+
+    void startLocked();
+    void launchLocked(const std::string& url);
+    // Fetcher callbacks, on its I/O thread.
+    void finished(const std::string& url, size_t id);
+    void progress(const std::string& url, size_t id, size_t received);
+    void dropLocked(EntryList::iterator it);
+    void evictLocked();
+
+    PrefetchOptions options_;
+    mutable std::mutex mu_;
+    std::deque<std::string> queue_;  // this page's links not started yet
+    EntryList lru_;  // most recently used first; in-flight entries included
+    std::unordered_map<std::string, EntryList::iterator> index_;
+    size_t generation_ = 0;
+    size_t next_id_ = 0;
+    size_t in_flight_ = 0;
+    size_t page_bytes_ = 0;
+    size_t cached_bytes_ = 0;
+    bool stopping_ = false;
+    Stats stats_;
+    // Last, so its I/O thread is joined before the state its callbacks touch goes away.
+    AsyncFetcher fetcher_;
+};
+
+}  // namespace browser
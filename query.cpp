@@ -0,0 +1,77 @@
+#include "css.h"
+#include "dom.h"
+
+#include <algorithm>
+
+namespace browser {
+
+std::vector<ElementPtr> Document::querySelectorAll(std::string_view selectors) const {
+    const std::vector<Selector> list = parse_selector_list(selectors);
+    std::vector<ElementPtr> out;
+    if (list.empty()) return out;
+    ensureOrder();
+
+    std::vector<Element*> found;
+    for (const Selector& s : list) {
+        // The smallest bucket among the selector's id, classes and tag; a key with no
+        // bucket means nothing can match.
+        const Bucket* candidates = nullptr;
+        bool empty = false;
+        const auto narrow = [&](const Index& index, const std::string& key) {
+            const auto it = index.find(key);
+            if (it == index.end()) empty = true;
+            else if (!candidates || it->second.size() < candidates->size()) candidates = &it->second;
+        };
+        if (!s.id.empty()) narrow(by_id_, s.id);
+        for (const auto& cls : s.classes) narrow(by_class_, cls);
+        if (!s.tag.empty()) narrow(by_tag_, s.tag);
+        if (empty) continue;
+
+        if (candidates) {
+            for (Element* el : *candidates) {
+                if (selector_matches(s, *el)) found.push_back(el);
+            }
+            continue;
+        }
+
+        // Only an ancestor tag: walk the tree below each element with that tag.
+        Bucket roots;
+        if (s.ancestor_tag == tag_name) roots.push_back(const_cast<Document*>(this));
+        else if (const auto anc = by_tag_.find(s.ancestor_tag); anc != by_tag_.end()) roots = anc->second;
+        const Element* skip_below = nullptr;
+        for (Element* root : roots) {
+            // Buckets are in document order, so a nested ancestor lies inside the previous walk.
+            bool nested = false;
+            for (auto p = root->parent.lock(); p && !nested; p = p->parent.lock()) nested = p.get() == skip_below;
+            if (nested) continue;
+            skip_below = root;
+            std::vector<Element*> stack;
+            for (auto it = root->children.rbegin(); it != root->children.rend(); ++it) {
+                if ((*it)->type == NodeType::ELEMENT) stack.push_back(static_cast<Element*>(it->get()));
+            }
+            while (!stack.empty()) {
+                Element* el = stack.back();
+                stack.pop_back();
+                found.push_back(el);
+                for (auto it = el->children.rbegin(); it != el->children.rend(); ++it) {
+                    if ((*it)->type == NodeType::ELEMENT) stack.push_back(static_cast<Element*>(it->get()));
+                }
+            }
+        }
+    }
+
+    if (list.size() > 1) {
+        std::sort(found.begin(), found.end(), byOrder);
+        found.erase(std::unique(found.begin(), found.end()), found.end());
+    }
+    out.reserve(found.size());
+    for (Element* el : found) out.push_back(el->shared_from_this());
+    return out;
+}
+
+ElementPtr Document::querySelector(std::string_view selectors) const {
+    const std::vector<ElementPtr> all = querySelectorAll(selectors);
+    return all.empty() ? nullptr : all.front();
+}
+
+}  // namespace browser
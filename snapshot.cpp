@@ -0,0 +1,453 @@
+#include "snapshot.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <unordered_map>
+#include <vector>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace browser {
+
+struct DomSnapshot::StringRef {
+    uint32_t offset;
+    uint32_t length;
+};
+
+struct DomSnapshot::Header {
+    char magic[8];
+    uint32_t version;
+    uint32_t layout;
+    uint32_t size;
+    uint32_t node_count;
+    uint32_t node_offset;
+    uint32_t attribute_count;
+    uint32_t attribute_offset;
+    uint32_t rule_count;
+    uint32_t rule_offset;
+    uint32_t class_count;
+    uint32_t class_offset;
+    uint32_t string_bytes;
+    uint32_t string_offset;
+};
+
+struct DomSnapshot::NodeRecord {
+    uint32_t type;
+    StringRef name;  // tag name for elements, character data for text
+    uint32_t parent;
+    uint32_t first_child;
+    uint32_t child_count;
+    uint32_t first_attribute;
+    uint32_t attribute_count;
+};
+
+struct DomSnapshot::AttributeRecord {
+    StringRef name;
+    StringRef value;
+};
+
+struct DomSnapshot::RuleRecord {
+    StringRef ancestor_tag;
+    StringRef tag;
+    StringRef id;
+    uint32_t first_class;
+    uint32_t class_count;
+    int32_t specificity;
+    uint32_t order;
+    StyleProperties properties;
+};
+
+namespace {
+
+constexpr char kMagic[8] = {'Z', 'E', 'P', 'H', 'S', 'N', 'P', '1'};
+constexpr uint32_t kVersion = 1;
+constexpr uint32_t kNoParent = 0xFFFFFFFFu;
+constexpr size_t kAlign = 8;
+
+[[noreturn]] void corrupt(const std::string& why) { throw std::runtime_error("invalid DOM snapshot: " + why); }
+
+uint32_t checked_u32(size_t value) {
+    if (value > 0xFFFFFFFFu) throw std::runtime_error("DOM snapshot exceeds 4 GB");
+    return static_cast<uint32_t>(value);
+}
+
+void align(std::string& out) { out.resize((out.size() + kAlign - 1) / kAlign * kAlign, '\0'); }
+
+template <typename T>
+uint32_t append_section(std::string& out, const std::vector<T>& records) {
+    align(out);
+    const uint32_t offset = checked_u32(out.size());
+    if (!records.empty()) out.append(reinterpret_cast<const char*>(records.data()), records.size() * sizeof(T));
+    return offset;
+}
+
+}  // namespace
+
+// Catches snapshots written by a build whose records (including StyleProperties) differ
+// in size from ours.
+uint32_t DomSnapshot::layoutSignature() {
+    return static_cast<uint32_t>(sizeof(Header) | sizeof(NodeRecord) << 8 | sizeof(AttributeRecord) << 16 | sizeof(RuleRecord) << 24);
+}
+
+SharedBuffer DomSnapshot::serialize(const ElementPtr& document, const StyleSheet* stylesheet) {
+    if (!document) throw std::runtime_error("cannot snapshot a null document");
+
+    std::string strings;
+    std::unordered_map<std::string_view, StringRef> interned;
+    auto intern = [&](std::string_view s) {
+        if (s.empty()) return StringRef{0, 0};
+        const auto it = interned.find(s);
+        if (it != interned.end()) return it->second;
+        const StringRef ref{checked_u32(strings.size()), checked_u32(s.size())};
+        strings.append(s.data(), s.size());
+        interned.emplace(s, ref);
+        return ref;
+    };
+
+    // Breadth-first, so the children of each element end up next to each other.
+    std::vector<NodeRecord> nodes;
+    std::vector<AttributeRecord> attributes;
+    std::vector<browser::Node*> queue{document.get()};
+    for (size_t i = 0; i < queue.size(); ++i) {
+        NodeRecord rec{};
+        rec.type = static_cast<uint32_t>(queue[i]->type);
+        rec.parent = kNoParent;
+        if (queue[i]->type == NodeType::TEXT) {
+            rec.name = intern(static_cast<const TextNode*>(queue[i])->text.view());
+        } else {
+            auto* el = static_cast<Element*>(queue[i]);
+            // Content a render-only parse deferred is built now, so the snapshot holds the
+            // whole document.
+            el->materialize();
+            rec.name = intern(el->tag_name);
+            rec.first_attribute = checked_u32(attributes.size());
+            rec.attribute_count = checked_u32(el->attributes.size());
+            for (const auto& [name, value] : el->attributes) attributes.push_back({intern(name), intern(value.view())});
+            rec.first_child = checked_u32(queue.size());
+            for (const auto& child : el->children) {
+                if (child->type == NodeType::COMMENT) continue;
+                queue.push_back(child.get());
+                ++rec.child_count;
+            }
+        }
+        nodes.push_back(rec);
+    }
+    for (uint32_t i = 0; i < nodes.size(); ++i) {
+        for (uint32_t c = 0; c < nodes[i].child_count; ++c) nodes[nodes[i].first_child + c].parent = i;
+    }
+
+    std::vector<RuleRecord> rules;
+    std::vector<StringRef> classes;
+    if (stylesheet) {
+        for (const auto& r : stylesheet->rules()) {
+            RuleRecord rec{};
+            rec.ancestor_tag = intern(r.selector.ancestor_tag);
+            rec.tag = intern(r.selector.tag);
+            rec.id = intern(r.selector.id);
+            rec.first_class = checked_u32(classes.size());
+            rec.class_count = checked_u32(r.selector.classes.size());
+            for (const auto& c : r.selector.classes) classes.push_back(intern(c));
+            rec.specificity = r.specificity;
+            rec.order = checked_u32(r.order);
+            rec.properties = r.properties;
+            rules.push_back(rec);
+        }
+    }
+
+    Header header{};
+    std::memcpy(header.magic, kMagic, sizeof(kMagic));
+    header.version = kVersion;
+    header.layout = layoutSignature();
+    header.node_count = checked_u32(nodes.size());
+    header.attribute_count = checked_u32(attributes.size());
+    header.rule_count = checked_u32(rules.size());
+    header.class_count = checked_u32(classes.size());
+    header.string_bytes = checked_u32(strings.size());
+
+    std::string out(sizeof(Header), '\0');
+    header.node_offset = append_section(out, nodes);
+    header.attribute_offset = append_section(out, attributes);
+    header.rule_offset = append_section(out, rules);
+    header.class_offset = append_section(out, classes);
+    align(out);
+    header.string_offset = checked_u32(out.size());
+    out += strings;
+    header.size = checked_u32(out.size());
+    std::memcpy(&out[0], &header, sizeof(header));
+    return SharedBuffer(std::move(out), MemoryCategory::DOM_NODES);
+}
+
+DomSnapshot::DomSnapshot(std::shared_ptr<const void> owner, const char* data, size_t size)
+    : owner_(std::move(owner)), data_(data), size_(size) {
+    validate();
+}
+
+DomSnapshot DomSnapshot::load(SharedBuffer bytes) {
+    auto owner = std::make_shared<const SharedBuffer>(std::move(bytes));
+    const char* data = owner->data();
+    const size_t size = owner->size();
+    return DomSnapshot(std::move(owner), data, size);
+}
+
+DomSnapshot DomSnapshot::map(const std::string& path) {
+#ifdef _WIN32
+    HANDLE file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (file == INVALID_HANDLE_VALUE) throw std::runtime_error("cannot open snapshot: " + path);
+    LARGE_INTEGER file_size;
+    if (!GetFileSizeEx(file, &file_size) || file_size.QuadPart == 0) {
+        CloseHandle(file);
+        corrupt("empty or unreadable file " + path);
+    }
+    HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    CloseHandle(file);
+    if (!mapping) throw std::runtime_error("cannot map snapshot: " + path);
+    const void* view = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    CloseHandle(mapping);
+    if (!view) throw std::runtime_error("cannot map snapshot: " + path);
+    std::shared_ptr<const void> owner(view, [](const void* p) { UnmapViewOfFile(p); });
+    const size_t size = static_cast<size_t>(file_size.QuadPart);
+#else
+    const int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) throw std::runtime_error("cannot open snapshot: " + path);
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+        close(fd);
+        corrupt("empty or unreadable file " + path);
+    }
+    const size_t size = static_cast<size_t>(st.st_size);
+    void* view = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (view == MAP_FAILED) throw std::runtime_error("cannot map snapshot: " + path);
+    std::shared_ptr<const void> owner(view, [size](const void* p) { munmap(const_cast<void*>(p), size); });
+#endif
+    const char* data = static_cast<const char*>(owner.get());
+    return DomSnapshot(std::move(owner), data, size);
+}
+
+void DomSnapshot::write(const std::string& path, const SharedBuffer& bytes) {
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    if (!out) throw std::runtime_error("cannot write snapshot: " + path);
+    out.write(bytes.data(), static_cast<std::streamsize>(bytes.size()));
+    if (!out) throw std::runtime_error("cannot write snapshot: " + path);
+}
+
+void DomSnapshot::validate() const {
+    if (size_ < sizeof(Header)) corrupt("truncated header");
+    if (reinterpret_cast<uintptr_t>(data_) % alignof(Header) != 0) corrupt("misaligned data");
+    const Header& h = header();
+    if (std::memcmp(h.magic, kMagic, sizeof(kMagic)) != 0) corrupt("bad magic");
+    if (h.version != kVersion) corrupt("unsupported version " + std::to_string(h.version));
+    if (h.layout != layoutSignature()) corrupt("built for a different record layout");
+    if (h.size != size_) corrupt("size mismatch");
+
+    const auto section = [&](uint32_t offset, uint32_t count, size_t record, const char* what) {
+        if (offset % kAlign != 0 || offset < sizeof(Header) || offset > size_ || static_cast<uint64_t>(count) * record > size_ - offset) {
+            corrupt(std::string(what) + " out of bounds");
+        }
+    };
+    section(h.node_offset, h.node_count, sizeof(NodeRecord), "nodes");
+    section(h.attribute_offset, h.attribute_count, sizeof(AttributeRecord), "attributes");
+    section(h.rule_offset, h.rule_count, sizeof(RuleRecord), "rules");
+    section(h.class_offset, h.class_count, sizeof(StringRef), "classes");
+    section(h.string_offset, h.string_bytes, 1, "strings");
+
+    const auto check = [&](const StringRef& ref) {
+        if (ref.offset > h.string_bytes || ref.length > h.string_bytes - ref.offset) corrupt("string out of bounds");
+    };
+    const auto range = [](uint32_t first, uint32_t count, uint32_t limit) { return first <= limit && count <= limit - first; };
+
+    if (h.node_count == 0 || node(0).type != static_cast<uint32_t>(NodeType::ELEMENT) || node(0).parent != kNoParent) corrupt("bad root");
+    for (uint32_t i = 0; i < h.node_count; ++i) {
+        const NodeRecord& n = node(i);
+        check(n.name);
+        if (n.type != static_cast<uint32_t>(NodeType::ELEMENT) && n.type != static_cast<uint32_t>(NodeType::TEXT)) corrupt("bad node type");
+        if (i != 0 && (n.parent >= i || node(n.parent).type != static_cast<uint32_t>(NodeType::ELEMENT))) corrupt("bad parent");
+        // Children always come after their parent, which rules out cycles.
+        if (!range(n.first_child, n.child_count, h.node_count) || (n.child_count && n.first_child <= i)) corrupt("bad child range");
+        if (!range(n.first_attribute, n.attribute_count, h.attribute_count)) corrupt("bad attribute range");
+        for (uint32_t c = 0; c < n.child_count; ++c) {
+            if (node(n.first_child + c).parent != i) corrupt("child does not point back to its parent");
+        }
+    }
+    for (uint32_t i = 0; i < h.attribute_count; ++i) {
+        check(attribute(i).name);
+        check(attribute(i).value);
+    }
+    for (uint32_t i = 0; i < h.rule_count; ++i) {
+        const RuleRecord& r = rule(i);
+        check(r.ancestor_tag);
+        check(r.tag);
+        check(r.id);
+        if (!range(r.first_class, r.class_count, h.class_count)) corrupt("bad class range");
+    }
+    for (uint32_t i = 0; i < h.class_count; ++i) check(ruleClass(i));
+}
+
+const DomSnapshot::Header& DomSnapshot::header() const { return *reinterpret_cast<const Header*>(data_); }
+
+const DomSnapshot::NodeRecord& DomSnapshot::node(uint32_t index) const {
+    return reinterpret_cast<const NodeRecord*>(data_ + header().node_offset)[index];
+}
+
+const DomSnapshot::AttributeRecord& DomSnapshot::attribute(uint32_t index) const {
+    return reinterpret_cast<const AttributeRecord*>(data_ + header().attribute_offset)[index];
+}
+
+const DomSnapshot::RuleRecord& DomSnapshot::rule(uint32_t index) const {
+    return reinterpret_cast<const RuleRecord*>(data_ + header().rule_offset)[index];
+}
+
+const DomSnapshot::StringRef& DomSnapshot::ruleClass(uint32_t index) const {
+    return reinterpret_cast<const StringRef*>(data_ + header().class_offset)[index];
+}
+
+std::string_view DomSnapshot::str(const StringRef& ref) const {
+    return std::string_view(data_ + header().string_offset + ref.offset, ref.length);
+}
+
+size_t DomSnapshot::nodeCount() const { return header().node_count; }
+
+size_t DomSnapshot::ruleCount() const { return header().rule_count; }
+
+NodeType DomSnapshot::Node::type() const { return static_cast<NodeType>(snapshot_->node(index_).type); }
+
+std::string_view DomSnapshot::Node::tagName() const {
+    return type() == NodeType::ELEMENT ? snapshot_->str(snapshot_->node(index_).name) : std::string_view();
+}
+
+std::string_view DomSnapshot::Node::text() const {
+    return type() == NodeType::TEXT ? snapshot_->str(snapshot_->node(index_).name) : std::string_view();
+}
+
+bool DomSnapshot::Node::hasParent() const { return snapshot_->node(index_).parent != kNoParent; }
+
+DomSnapshot::Node DomSnapshot::Node::parent() const { return Node(snapshot_, snapshot_->node(index_).parent); }
+
+size_t DomSnapshot::Node::childCount() const { return snapshot_->node(index_).child_count; }
+
+DomSnapshot::Node DomSnapshot::Node::child(size_t i) const {
+    const NodeRecord& n = snapshot_->node(index_);
+    if (i >= n.child_count) throw std::out_of_range("snapshot child index");
+    return Node(snapshot_, n.first_child + static_cast<uint32_t>(i));
+}
+
+size_t DomSnapshot::Node::attributeCount() const { return snapshot_->node(index_).attribute_count; }
+
+std::string_view DomSnapshot::Node::attributeName(size_t i) const {
+    const NodeRecord& n = snapshot_->node(index_);
+    if (i >= n.attribute_count) throw std::out_of_range("snapshot attribute index");
+    return snapshot_->str(snapshot_->attribute(n.first_attribute + static_cast<uint32_t>(i)).name);
+}
+
+std::string_view DomSnapshot::Node::attributeValue(size_t i) const {
+    const NodeRecord& n = snapshot_->node(index_);
+    if (i >= n.attribute_count) throw std::out_of_range("snapshot attribute index");
+    return snapshot_->str(snapshot_->attribute(n.first_attribute + static_cast<uint32_t>(i)).value);
+}
+
+std::string_view DomSnapshot::Node::getAttribute(std::string_view name) const {
+    const NodeRecord& n = snapshot_->node(index_);
+    for (uint32_t i = 0; i < n.attribute_count; ++i) {
+        const AttributeRecord& a = snapshot_->attribute(n.first_attribute + i);
+        if (snapshot_->str(a.name) == name) return snapshot_->str(a.value);
+    }
+    return {};
+}
+
+bool DomSnapshot::matches(const RuleRecord& r, const Node& el) const {
+    if (r.tag.length && str(r.tag) != el.tagName()) return false;
+    if (r.id.length && el.getAttribute("id") != str(r.id)) return false;
+
+    if (r.class_count) {
+        const std::string_view cls = el.getAttribute("class");
+        for (uint32_t c = 0; c < r.class_count; ++c) {
+            const std::string_view need = str(ruleClass(r.first_class + c));
+            bool found = false;
+            for (size_t i = 0; i < cls.size() && !found;) {
+                while (i < cls.size() && std::isspace(static_cast<unsigned char>(cls[i]))) ++i;
+                size_t end = i;
+                while (end < cls.size() && !std::isspace(static_cast<unsigned char>(cls[end]))) ++end;
+                found = end > i && cls.substr(i, end - i) == need;
+                i = end;
+            }
+            if (!found) return false;
+        }
+    }
+
+    if (r.ancestor_tag.length) {
+        const std::string_view ancestor = str(r.ancestor_tag);
+        for (Node p = el; p.hasParent();) {
+            p = p.parent();
+            if (p.tagName() == ancestor) return true;
+        }
+        return false;
+    }
+    return true;
+}
+
+StyleProperties DomSnapshot::computeStyle(const Node& element) const {
+    StyleProperties out;
+    if (element.type() != NodeType::ELEMENT) return out;
+
+    std::vector<const RuleRecord*> applicable;
+    for (uint32_t i = 0; i < header().rule_count; ++i) {
+        if (matches(rule(i), element)) applicable.push_back(&rule(i));
+    }
+    std::sort(applicable.begin(), applicable.end(), [](const RuleRecord* a, const RuleRecord* b) {
+        if (a->specificity != b->specificity) return a->specificity < b->specificity;
+        return a->order < b->order;
+    });
+    for (const RuleRecord* r : applicable) out.merge(r->properties);
+    return out;
+}
+
+ElementPtr DomSnapshot::toDocument() const {
+    std::vector<ElementPtr> elements(header().node_count);
+    // A parsed page comes back as an indexed Document.
+    if (root().tagName() == "document") elements[0] = Document::create();
+    else elements[0] = Element::create(std::string(root().tagName()));
+    // Parents precede their children, so one forward pass rebuilds the tree in order.
+    for (uint32_t i = 0; i < header().node_count; ++i) {
+        const Node n(this, i);
+        if (n.type() == NodeType::TEXT) continue;
+        const ElementPtr& el = elements[i];
+        for (size_t a = 0; a < n.attributeCount(); ++a) el->setAttribute(std::string(n.attributeName(a)), std::string(n.attributeValue(a)));
+        for (size_t c = 0; c < n.childCount(); ++c) {
+            const Node child = n.child(c);
+            if (child.type() == NodeType::TEXT) {
+                el->appendChild(TextNode::create(std::string(child.text())));
+            } else {
+                elements[child.index()] = Element::create(std::string(child.tagName()));
+                el->appendChild(elements[child.index()]);
+            }
+        }
+    }
+    return elements[0];
+}
+
+StyleSheet DomSnapshot::toStyleSheet() const {
+    StyleSheet sheet;
+    for (uint32_t i = 0; i < header().rule_count; ++i) {
+        const RuleRecord& r = rule(i);
+        Selector selector;
+        selector.ancestor_tag = std::string(str(r.ancestor_tag));
+        selector.tag = std::string(str(r.tag));
+        selector.id = std::string(str(r.id));
+        for (uint32_t c = 0; c < r.class_count; ++c) selector.classes.emplace_back(str(ruleClass(r.first_class + c)));
+        sheet.addRule(std::move(selector), r.properties);
+    }
+    return sheet;
+}
+
+}  // namespace browser
@@ -0,0 +1,102 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <string_view>
+
+#include "buffer.h"
+#include "css.h"
+#include "dom.h"
+
+namespace browser {
+
+// A parsed page frozen into one flat block of bytes: a header, then a node array
+// (breadth-first, so every element's children are contiguous), an attribute array, the
+// compiled style rules with their class lists, and a deduplicated string table. Every
+// reference is an offset or an index, so the block can be written to disk, mapped back
+// and read in place; opening a snapshot only checks bounds.
+//
+// The layout is the host's byte order and struct layout. Snapshots are a local cache,
+// not an interchange format, and are rejected when the version or layout differs.
+class DomSnapshot {
+public:
+    // Read-only view of one node. Only valid while the snapshot it came from is alive and
+    // has not been moved.
+    class Node {
+    public:
+        NodeType type() const;
+        uint32_t index() const { return index_; }
+
+        // Elements only; empty for text.
+        std::string_view tagName() const;
+        // Text nodes only; empty for elements.
+        std::string_view text() const;
+
+        bool hasParent() const;
+        Node parent() const;
+        size_t childCount() const;
+        Node child(size_t i) const;
+
+        size_t attributeCount() const;
+        std::string_view attributeName(size_t i) const;
+        std::string_view attributeValue(size_t i) const;
+        // `name` must be lowercase.
+        std::string_view getAttribute(std::string_view name) const;
+
+    private:
+        friend class DomSnapshot;
+        Node(const DomSnapshot* snapshot, uint32_t index) : snapshot_(snapshot), index_(index) {}
+
+        const DomSnapshot* snapshot_;
+        uint32_t index_;
+    };
+
+    // Materializes any deferred elements of `document` first (see ParseOptions::defer), so
+    // a render-only parse snapshots the same as a full one.
+    static SharedBuffer serialize(const ElementPtr& document, const StyleSheet* stylesheet = nullptr);
+
+    // Throws std::runtime_error when the bytes are not a valid snapshot.
+    static DomSnapshot load(SharedBuffer bytes);
+    static DomSnapshot map(const std::string& path);
+    static void write(const std::string& path, const SharedBuffer& bytes);
+
+    Node root() const { return Node(this, 0); }
+    size_t nodeCount() const;
+    size_t ruleCount() const;
+    size_t sizeBytes() const { return size_; }
+
+    // Same cascade as StyleSheet::computeStyle, evaluated against the stored rules.
+    StyleProperties computeStyle(const Node& element) const;
+
+    // Rebuilds a live DOM and stylesheet, for callers that need to mutate or render them.
+    ElementPtr toDocument() const;
+    StyleSheet toStyleSheet() const;
+
+private:
+    struct Header;
+    struct StringRef;
+    struct NodeRecord;
+    struct AttributeRecord;
+    struct RuleRecord;
+
+    DomSnapshot(std::shared_ptr<const void> owner, const char* data, size_t size);
+
+    static uint32_t layoutSignature();
+
+    void validate() const;
+    const Header& header() const;
+    const NodeRecord& node(uint32_t index) const;
+    const AttributeRecord& attribute(uint32_t index) const;
+    const RuleRecord& rule(uint32_t index) const;
+    const StringRef& ruleClass(uint32_t index) const;
+    std::string_view str(const StringRef& ref) const;
+    bool matches(const RuleRecord& rule, const Node& element) const;
+
+    std::shared_ptr<const void> owner_;
+    const char* data_ = nullptr;
+    size_t size_ = 0;
+};
+
+}  // namespace browser
@@ -0,0 +1,26 @@
+#include "style_engine.h"
+
+#include <utility>
+
+namespace browser {
+
+StyleEngine::StyleEngine(DocumentPtr document, StyleSheetPtr stylesheet) : document_(std::move(document)), stylesheet_(std::move(stylesheet)) {
+    document_->trackStyle(stylesheet_->dependencies());
+    styles_.reserve(document_->indexedElements() + 1);
+    restyle();
+}
+
+StyleEngine::~StyleEngine() { document_->stopTrackingStyle(); }
+
+size_t StyleEngine::restyle() {
+    for (const Element* gone : document_->takeRemovedElements()) styles_.erase(gone);
+    return document_->flushStyle([&](Element& el) {
+        const StyleProperties style = stylesheet_->computeStyle(el);
+        const auto [it, inserted] = styles_.try_emplace(&el, style);
+        if (inserted || it->second == style) return;
+        it->second = style;
+        document_->invalidateLayout(el);
+    });
+}
+
+}  // namespace browser
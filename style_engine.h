@@ -0,0 +1,37 @@
+#pragma once
+
+#include <cstddef>
+
+#include "css.h"
+#include "dom.h"
+
+namespace browser {
+
+// Computed styles for a live document, kept current across DOM mutations. The document
+// marks what each mutation may have restyled, going by the ids and classes the sheet's
+// selectors mention, and restyle() recomputes only the marked elements. One engine per
+// document at a time.
+class StyleEngine {
+public:
+    // Styles the whole document.
+    StyleEngine(DocumentPtr document, StyleSheetPtr stylesheet);
+    ~StyleEngine();
+
+    StyleEngine(const StyleEngine&) = delete;
+    StyleEngine& operator=(const StyleEngine&) = delete;
+
+    // Returns the number of elements recomputed. Those whose style actually changed are
+    // marked for relayout.
+    size_t restyle();
+
+    // Every element in the document, hidden subtrees included, as of the last restyle().
+    const ComputedStyles& styles() const { return styles_; }
+    const DocumentPtr& document() const { return document_; }
+
+private:
+    DocumentPtr document_;
+    StyleSheetPtr stylesheet_;
+    ComputedStyles styles_;
+};
+
+}  // namespace browser
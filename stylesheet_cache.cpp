@@ -0,0 +1,116 @@
+#include "stylesheet_cache.h"
+
+#include <cstring>
+#include <iterator>
+#include <memory>
+
+namespace browser {
+namespace {
+
+constexpr uint64_t kMulA = 0x9E3779B97F4A7C15ull;
+constexpr uint64_t kMulB = 0xC2B2AE3D27D4EB4Full;
+
+uint64_t mix(uint64_t h) {
+    h ^= h >> 33;
+    h *= kMulB;
+    h ^= h >> 29;
+    return h;
+}
+
+}  // namespace
+
+uint64_t hash_bytes(const char* data, size_t size, uint64_t seed) {
+    uint64_t h = seed ^ (size * kMulA);
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        uint64_t w;
+        std::memcpy(&w, data + i, 8);
+        h = (h ^ mix(w * kMulA)) * kMulB;
+    }
+    uint64_t tail = 0;
+    std::memcpy(&tail, data + i, size - i);
+    h = (h ^ mix(tail * kMulA + size)) * kMulB;
+    return mix(h);
+}
+
+StyleSheetCache::StyleSheetCache(size_t max_bytes) : max_bytes_(max_bytes) {}
+
+StyleSheetPtr StyleSheetCache::get(const std::string& css_text) {
+    const uint64_t h = hash_bytes(css_text.data(), css_text.size());
+    {
+        std::lock_guard<std::mutex> lock(mu_);
+        auto range = index_.equal_range(h);
+        for (auto it = range.first; it != range.second; ++it) {
+            if (it->second->text != css_text) continue;
+            lru_.splice(lru_.begin(), lru_, it->second);
+            ++stats_.hits;
+            return it->second->sheet;
+        }
+        ++stats_.misses;
+    }
+
+    // Parsed outside the lock; a cached sheet belongs to no single page's memory account.
+    StyleSheetPtr sheet;
+    {
+        MemoryAccountScope unaccounted(nullptr);
+        sheet = std::make_shared<const StyleSheet>(parse_css(css_text));
+    }
+
+    const size_t bytes = css_text.size() + sheet->footprintBytes();
+    std::lock_guard<std::mutex> lock(mu_);
+    if (bytes > max_bytes_) return sheet;
+
+    auto range = index_.equal_range(h);
+    for (auto it = range.first; it != range.second; ++it) {
+        if (it->second->text == css_text) return it->second->sheet;
+    }
+
+    lru_.push_front({h, css_text, sheet, bytes});
+    index_.emplace(h, lru_.begin());
+    stats_.bytes += bytes;
+    ++stats_.entries;
+    evictLocked();
+    return sheet;
+}
+
+void StyleSheetCache::clear() {
+    std::lock_guard<std::mutex> lock(mu_);
+    lru_.clear();
+    index_.clear();
+    stats_.bytes = stats_.entries = 0;
+}
+
+void StyleSheetCache::setCapacity(size_t max_bytes) {
+    std::lock_guard<std::mutex> lock(mu_);
+    max_bytes_ = max_bytes;
+    evictLocked();
+}
+
+StyleSheetCache::Stats StyleSheetCache::stats() const {
+    std::lock_guard<std::mutex> lock(mu_);
+    return stats_;
+}
+
+StyleSheetCache& StyleSheetCache::shared() {
+    static StyleSheetCache cache;
+    return cache;
+}
+
+void StyleSheetCache::evictLocked() {
+    while (stats_.bytes > max_bytes_ && !lru_.empty()) {
+        const Entry& victim = lru_.back();
+        auto range = index_.equal_range(victim.hash);
+        for (auto it = range.first; it != range.second; ++it) {
+            if (it->second == std::prev(lru_.end())) {
+                index_.erase(it);
+                break;
+            }
+        }
+        stats_.bytes -= victim.bytes;
+        --stats_.entries;
+        ++stats_.evictions;
+        lru_.pop_back();
+    }
+}
+
+}  // namespace browser
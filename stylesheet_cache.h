@@ -0,0 +1,57 @@
+#pragma once
+
+#include <cstdint>
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include "css.h"
+
+namespace browser {
+
+uint64_t hash_bytes(const char* data, size_t size, uint64_t seed = 0);
+
+// Compiled stylesheets keyed by the hash of their source text. A hit hands back the
+// already parsed, immutable sheet; entries are evicted least-recently-used once the
+// combined footprint (source text plus compiled rules) exceeds the byte budget.
+// Safe to share between threads.
+class StyleSheetCache {
+public:
+    struct Stats {
+        size_t hits = 0;
+        size_t misses = 0;
+        size_t evictions = 0;
+        size_t entries = 0;
+        size_t bytes = 0;
+    };
+
+    explicit StyleSheetCache(size_t max_bytes = 32 * 1024 * 1024);
+
+    StyleSheetPtr get(const std::string& css_text);
+    void clear();
+    void setCapacity(size_t max_bytes);
+    Stats stats() const;
+
+    // Process-wide instance used by parse_document.
+    static StyleSheetCache& shared();
+
+private:
+    struct Entry {
+        uint64_t hash;
+        std::string text;
+        StyleSheetPtr sheet;
+        size_t bytes;
+    };
+    using EntryList = std::list<Entry>;
+
+    void evictLocked();
+
+    mutable std::mutex mu_;
+    EntryList lru_;
+    std::unordered_multimap<uint64_t, EntryList::iterator> index_;
+    size_t max_bytes_;
+    Stats stats_;
+};
+
+}  // namespace browser
@@ -0,0 +1,334 @@
+#include "test_server.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <stdexcept>
+#include <system_error>
+#include <thread>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#ifdef ZEPHYR_HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+namespace browser {
+namespace {
+
+#ifdef MSG_NOSIGNAL
+constexpr int kSendFlags = MSG_NOSIGNAL;
+#else
+constexpr int kSendFlags = 0;
+#endif
+
+constexpr size_t kMaxRequestHead = 64 * 1024;
+
+std::string lower(std::string s) {
+    for (char& c : s) c = (c >= 'A' && c <= 'Z') ? static_cast<char>(c - 'A' + 'a') : c;
+    return s;
+}
+
+std::string trim(const std::string& s) {
+    size_t a = 0;
+    size_t b = s.size();
+    while (a < b && (s[a] == ' ' || s[a] == '\t')) ++a;
+    while (b > a && (s[b - 1] == ' ' || s[b - 1] == '\t')) --b;
+    return s.substr(a, b - a);
+}
+
+const char* reason_phrase(int status) {
+    switch (status) {
+        case 200: return "OK";
+        case 204: return "No Content";
+        case 301: return "Moved Permanently";
+        case 302: return "Found";
+        case 303: return "See Other";
+        case 307: return "Temporary Redirect";
+        case 308: return "Permanent Redirect";
+        case 400: return "Bad Request";
+        case 404: return "Not Found";
+        case 500: return "Internal Server Error";
+        default: return "Status";
+    }
+}
+
+uint32_t crc32(const std::string& data) {
+    static const auto table = [] {
+        std::vector<uint32_t> t(256);
+        for (uint32_t n = 0; n < 256; ++n) {
+            uint32_t c = n;
+            for (int k = 0; k < 8; ++k) c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            t[n] = c;
+        }
+        return t;
+    }();
+    uint32_t crc = ~0u;
+    for (const char ch : data) crc = table[(crc ^ static_cast<uint8_t>(ch)) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
+
+void put_le32(std::string& out, uint32_t v) {
+    for (int i = 0; i < 4; ++i) out.push_back(static_cast<char>(v >> (8 * i)));
+}
+
+bool send_all(int fd, const char* data, size_t size) {
+    while (size > 0) {
+        const ssize_t n = send(fd, data, size, kSendFlags);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return false;
+        data += n;
+        size -= static_cast<size_t>(n);
+    }
+    return true;
+}
+
+}  // namespace
+
+TestRoute redirect_route(const std::string& location, int status) {
+    TestRoute r;
+    r.status = status;
+    r.headers.emplace_back("Location", location);
+    return r;
+}
+
+void add_link_graph(TestHttpServer& server, const std::string& prefix, size_t pages, size_t out_degree, uint32_t seed) {
+    uint64_t state = seed;
+    for (size_t i = 0; i < pages; ++i) {
+        TestRoute page;
+        page.body = "<html><body><h1>Page " + std::to_string(i) + "</h1>";
+        page.body += "<a href='" + prefix + "/" + std::to_string((i + 1) % pages) + "'>next</a> ";
+        for (size_t k = 1; k < out_degree; ++k) {
+            state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+            // Relative and absolute-path links alike.
+            const std::string target = std::to_string((state >> 33) % pages);
+            page.body += "<a href='" + (k % 2 ? target : prefix + "/" + target) + "'>link</a> ";
+        }
+        page.body += "<a href='#top'>top</a> <a href='http://offsite.invalid/'>elsewhere</a></body></html>";
+        server.route(prefix + "/" + std::to_string(i), std::move(page));
+    }
+}
+
+std::string gzip_stored(const std::string& data) {
+    std::string out("\x1f\x8b\x08\x00\x00\x00\x00\x00\x00\xff", 10);
+    size_t i = 0;
+    do {
+        const size_t n = std::min<size_t>(65535, data.size() - i);
+        out.push_back(i + n >= data.size() ? '\x01' : '\x00');
+        out.push_back(static_cast<char>(n & 0xFF));
+        out.push_back(static_cast<char>(n >> 8));
+        out.push_back(static_cast<char>(~n & 0xFF));
+        out.push_back(static_cast<char>((~n >> 8) & 0xFF));
+        out.append(data, i, n);
+        i += n;
+    } while (i < data.size());
+    put_le32(out, crc32(data));
+    put_le32(out, static_cast<uint32_t>(data.size()));
+    return out;
+}
+
+std::string gzip_compress(const std::string& data) {
+#ifdef ZEPHYR_HAVE_ZLIB
+    z_stream zs{};
+    if (deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 16 + MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        throw std::runtime_error("test server: deflateInit failed");
+    }
+    std::string out(deflateBound(&zs, static_cast<uLong>(data.size())), '\0');
+    zs.next_in = reinterpret_cast<Bytef*>(const_cast<char*>(data.data()));
+    zs.avail_in = static_cast<uInt>(data.size());
+    zs.next_out = reinterpret_cast<Bytef*>(&out[0]);
+    zs.avail_out = static_cast<uInt>(out.size());
+    const int rc = deflate(&zs, Z_FINISH);
+    out.resize(zs.total_out);
+    deflateEnd(&zs);
+    if (rc != Z_STREAM_END) throw std::runtime_error("test server: deflate failed");
+    return out;
+#else
+    return gzip_stored(data);
+#endif
+}
+
+TestHttpServer::TestHttpServer() {
+    listener_ = socket(AF_INET, SOCK_STREAM, 0);
+    if (listener_ < 0) throw std::runtime_error("test server: socket failed");
+    const int one = 1;
+    setsockopt(listener_, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(addr);
+    if (bind(listener_, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 || listen(listener_, 128) != 0 ||
+        getsockname(listener_, reinterpret_cast<sockaddr*>(&addr), &len) != 0) {
+        close(listener_);
+        throw std::runtime_error("test server: cannot listen on 127.0.0.1");
+    }
+    port_ = ntohs(addr.sin_port);
+    active_ = 1;
+    std::thread([this] { acceptLoop(); }).detach();
+}
+
+TestHttpServer::~TestHttpServer() {
+    stopping_ = true;
+    std::unique_lock<std::mutex> lock(mutex_);
+    idle_.wait(lock, [this] { return active_ == 0; });
+    close(listener_);
+}
+
+void TestHttpServer::route(const std::string& path, TestRoute route) {
+    auto shared = std::make_shared<const TestRoute>(std::move(route));
+    std::lock_guard<std::mutex> lock(mutex_);
+    routes_[path] = std::move(shared);
+}
+
+std::string TestHttpServer::url(const std::string& path) const { return "http://127.0.0.1:" + std::to_string(port_) + path; }
+
+void TestHttpServer::resetCounts() {
+    connections_ = 0;
+    requests_ = 0;
+}
+
+void TestHttpServer::acceptLoop() {
+    while (!stopping_) {
+        pollfd p{listener_, POLLIN, 0};
+        if (::poll(&p, 1, 50) <= 0) continue;
+        const int fd = accept(listener_, nullptr, nullptr);
+        if (fd < 0) continue;
+        const int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        ++connections_;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            ++active_;
+        }
+        try {
+            std::thread([this, fd] { serve(fd); }).detach();
+        } catch (const std::system_error&) {
+            close(fd);
+            std::lock_guard<std::mutex> lock(mutex_);
+            --active_;
+        }
+    }
+    // Notified under the lock so the destructor cannot return before this thread is done
+    // with the server.
+    std::lock_guard<std::mutex> lock(mutex_);
+    --active_;
+    idle_.notify_all();
+}
+
+void TestHttpServer::serve(int fd) {
+    std::string buffer;
+    char chunk[16 * 1024];
+    bool open = true;
+    while (open && !stopping_) {
+        const size_t end = buffer.find("\r\n\r\n");
+        if (end == std::string::npos) {
+            if (buffer.size() > kMaxRequestHead) break;
+            pollfd p{fd, POLLIN, 0};
+            const int ready = ::poll(&p, 1, 50);
+            if (ready < 0 && errno != EINTR) break;
+            if (ready <= 0) continue;
+            const ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+            if (n <= 0) break;
+            buffer.append(chunk, static_cast<size_t>(n));
+            continue;
+        }
+        const std::string head = buffer.substr(0, end + 2);
+        buffer.erase(0, end + 4);
+        ++requests_;
+        open = respond(fd, head);
+    }
+    close(fd);
+    std::lock_guard<std::mutex> lock(mutex_);
+    --active_;
+    idle_.notify_all();
+}
+
+bool TestHttpServer::respond(int fd, const std::string& head) {
+    size_t line_end = head.find("\r\n");
+    const std::string request_line = head.substr(0, line_end);
+    const size_t sp1 = request_line.find(' ');
+    const size_t sp2 = request_line.rfind(' ');
+    if (sp1 == std::string::npos || sp2 <= sp1) {
+        const std::string bad = "HTTP/1.1 400 Bad Request\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+        send_all(fd, bad.data(), bad.size());
+        return false;
+    }
+    const std::string method = request_line.substr(0, sp1);
+    const std::string target = request_line.substr(sp1 + 1, sp2 - sp1 - 1);
+    bool keep_alive = request_line.compare(sp2 + 1, std::string::npos, "HTTP/1.1") == 0;
+    bool accepts_gzip = false;
+    for (size_t pos = line_end + 2; pos < head.size(); pos = line_end + 2) {
+        line_end = head.find("\r\n", pos);
+        if (line_end == std::string::npos) break;
+        const std::string line = head.substr(pos, line_end - pos);
+        const size_t colon = line.find(':');
+        if (colon == std::string::npos) continue;
+        const std::string name = lower(trim(line.substr(0, colon)));
+        const std::string value = lower(trim(line.substr(colon + 1)));
+        if (name == "connection") {
+            if (value.find("close") != std::string::npos) keep_alive = false;
+            else if (value.find("keep-alive") != std::string::npos) keep_alive = true;
+        } else if (name == "accept-encoding") {
+            accepts_gzip = value.find("gzip") != std::string::npos;
+        }
+    }
+
+    std::shared_ptr<const TestRoute> route;
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        const auto it = routes_.find(target.substr(0, target.find('?')));
+        if (it != routes_.end()) route = it->second;
+    }
+    if (!route) {
+        TestRoute missing;
+        missing.status = 404;
+        missing.content_type = "text/plain";
+        missing.body = "not found";
+        route = std::make_shared<const TestRoute>(std::move(missing));
+    }
+    if (route->close) keep_alive = false;
+
+    const bool gzip = route->gzip && accepts_gzip;
+    std::string payload = gzip ? gzip_compress(route->body) : route->body;
+    std::string out = "HTTP/1.1 " + std::to_string(route->status) + " " + reason_phrase(route->status) + "\r\n";
+    out += "Content-Type: " + route->content_type + "\r\n";
+    if (gzip) out += "Content-Encoding: gzip\r\n";
+    if (route->chunk_size) {
+        out += "Transfer-Encoding: chunked\r\n";
+        std::string chunked;
+        for (size_t i = 0; i < payload.size(); i += route->chunk_size) {
+            const size_t n = std::min(route->chunk_size, payload.size() - i);
+            char size_line[24];
+            std::snprintf(size_line, sizeof(size_line), "%zx\r\n", n);
+            chunked += size_line;
+            chunked.append(payload, i, n);
+            chunked += "\r\n";
+        }
+        chunked += "0\r\n\r\n";
+        payload.swap(chunked);
+    } else {
+        out += "Content-Length: " + std::to_string(payload.size()) + "\r\n";
+    }
+    for (const auto& [name, value] : route->headers) out += name + ": " + value + "\r\n";
+    if (!keep_alive) out += "Connection: close\r\n";
+    out += "\r\n";
+    if (method == "HEAD") payload.clear();
+
+    if (!route->trickle_bytes) {
+        out += payload;
+        return send_all(fd, out.data(), out.size()) && keep_alive;
+    }
+    if (!send_all(fd, out.data(), out.size())) return false;
+    for (size_t i = 0; i < payload.size() && !stopping_; i += route->trickle_bytes) {
+        if (i) std::this_thread::sleep_for(route->trickle_delay);
+        if (!send_all(fd, payload.data() + i, std::min(route->trickle_bytes, payload.size() - i))) return false;
+    }
+    return keep_alive && !stopping_;
+}
+
+}  // namespace browser
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace browser {
+
+// What the server sends for one path.
+struct TestRoute {
+    int status = 200;
+    std::string body;
+    std::string content_type = "text/html";
+    std::vector<std::pair<std::string, std::string>> headers;  // extra response headers
+    // Transfer-Encoding: chunked in chunks of at most this many bytes; 0 sends Content-Length.
+    size_t chunk_size = 0;
+    // Writes the encoded body this many bytes at a time, sleeping `trickle_delay` between
+    // writes; 0 sends it at once.
+    size_t trickle_bytes = 0;
+    std::chrono::milliseconds trickle_delay{0};
+    // Content-Encoding: gzip when the request's Accept-Encoding allows it.
+    bool gzip = false;
+    // Closes the connection after this response even when the client would keep it.
+    bool close = false;
+};
+
+TestRoute redirect_route(const std::string& location, int status = 302);
+
+// gzip member with stored (uncompressed) deflate blocks.
+std::string gzip_stored(const std::string& data);
+// gzip member as a route sends it: compressed with zlib when the build has it, otherwise
+// gzip_stored().
+std::string gzip_compress(const std::string& data);
+
+// Scripted HTTP/1.1 server on 127.0.0.1 for tests and load runs, one thread per
+// connection. Connections persist unless the request or the route asks to close. Unknown
+// paths get a 404; the query string is ignored when looking up a route.
+class TestHttpServer {
+public:
+    // Listens on an ephemeral port; throws std::runtime_error when it cannot.
+    TestHttpServer();
+    // Stops accepting, closes every connection and waits for their threads.
+    ~TestHttpServer();
+
+    TestHttpServer(const TestHttpServer&) = delete;
+    TestHttpServer& operator=(const TestHttpServer&) = delete;
+
+    void route(const std::string& path, TestRoute route);
+
+    uint16_t port() const { return port_; }
+    std::string url(const std::string& path) const;
+
+    // Since construction or the last resetCounts().
+    size_t connections() const { return connections_; }
+    size_t requests() const { return requests_; }
+    void resetCounts();
+
+private:
+    void acceptLoop();
+    void serve(int fd);
+    // False when the connection should be closed after this response.
+    bool respond(int fd, const std::string& head);
+
+    int listener_ = -1;
+    uint16_t port_ = 0;
+    std::atomic<bool> stopping_{false};
+    std::atomic<size_t> connections_{0};
+    std::atomic<size_t> requests_{0};
+
+    mutable std::mutex mutex_;
+    std::condition_variable idle_;
+    std::map<std::string, std::shared_ptr<const TestRoute>> routes_;
+    size_t active_ = 0;  // connection threads still running, acceptor included
+};
+
+// Routes a generated site: pages `prefix`/0 .. `prefix`/(pages - 1), where page i links to
+// page i + 1 (so all are reachable from `prefix`/0), to `out_degree` - 1 more chosen by
+// `seed`, back to itself through a fragment, and to a page on another origin.
+void add_link_graph(TestHttpServer& server, const std::string& prefix, size_t pages, size_t out_degree, uint32_t seed = 1);
+
+}  // namespace browser
@@ -0,0 +1,149 @@
+#include "url.h"
+
+#include <cctype>
+
+namespace browser {
+namespace {
+
+std::string_view trim(std::string_view s) {
+    const size_t b = s.find_first_not_of(" \t\r\n");
+    if (b == std::string_view::npos) return {};
+    const size_t e = s.find_last_not_of(" \t\r\n");
+    return s.substr(b, e - b + 1);
+}
+
+// `prefix` must be lowercase.
+bool starts_with_ci(std::string_view s, std::string_view prefix) {
+    if (s.size() < prefix.size()) return false;
+    for (size_t i = 0; i < prefix.size(); ++i) {
+        if (std::tolower(static_cast<unsigned char>(s[i])) != prefix[i]) return false;
+    }
+    return true;
+}
+
+// Appends the "/"-rooted, dot-segment-free form of `first` followed by `second` (which
+// must start on a segment boundary), collapsing empty segments; a trailing slash is kept.
+void append_normalized_path(std::string& out, std::string_view first, std::string_view second) {
+    const size_t root = out.size();
+    out.push_back('/');
+    size_t segments = 0;
+    for (const std::string_view part : {first, second}) {
+        for (size_t i = 0; i < part.size();) {
+            size_t end = part.find('/', i);
+            if (end == std::string_view::npos) end = part.size();
+            const std::string_view seg = part.substr(i, end - i);
+            i = end + 1;
+            if (seg.empty() || seg == ".") continue;
+            if (seg == "..") {
+                if (segments && --segments) out.resize(out.rfind('/'));
+                else out.resize(root + 1);
+                continue;
+            }
+            if (segments++) out.push_back('/');
+            out.append(seg.data(), seg.size());
+        }
+    }
+    const std::string_view last = second.empty() ? first : second;
+    if (segments && !last.empty() && last.back() == '/') out.push_back('/');
+}
+
+}  // namespace
+
+bool UrlView::parse(std::string_view url, UrlView& out) {
+    const size_t sep = url.find("://");
+    if (sep == std::string_view::npos) return false;
+
+    out.scheme = url.substr(0, sep);
+    out.https = out.scheme.size() == 5 && starts_with_ci(out.scheme, "https");
+    if (!out.https && !(out.scheme.size() == 4 && starts_with_ci(out.scheme, "http"))) return false;
+
+    const std::string_view rest = url.substr(sep + 3);
+    const size_t slash = rest.find('/');
+    const std::string_view host_port = rest.substr(0, slash);
+    out.path = (slash == std::string_view::npos) ? std::string_view("/") : rest.substr(slash);
+
+    out.port = out.https ? 443 : 80;
+    out.explicit_port = false;
+    const size_t colon = host_port.rfind(':');
+    if (colon != std::string_view::npos && host_port.find(']') == std::string_view::npos) {
+        out.host = host_port.substr(0, colon);
+        const std::string_view digits = host_port.substr(colon + 1);
+        if (!digits.empty()) {
+            int port = 0;
+            for (char c : digits) {
+                if (c < '0' || c > '9' || port > 6553) return false;
+                port = port * 10 + (c - '0');
+            }
+            if (port > 65535) return false;
+            out.port = port;
+            out.explicit_port = true;
+        }
+    } else {
+        out.host = host_port;
+    }
+    return !out.host.empty();
+}
+
+bool is_safe_navigation_target(std::string_view href) {
+    const std::string_view h = trim(href);
+    return !(starts_with_ci(h, "javascript:") || starts_with_ci(h, "data:") || starts_with_ci(h, "file:") || starts_with_ci(h, "vbscript:"));
+}
+
+void ResolvedUrls::clear() {
+    arena_.clear();
+    spans_.clear();
+}
+
+BaseUrl::BaseUrl(std::string url) : url_(std::move(url)) {
+    UrlView v;
+    if (!UrlView::parse(url_, v)) return;
+    origin_ = v.https ? "https://" : "http://";
+    origin_.append(v.host.data(), v.host.size());
+    if (v.port != (v.https ? 443 : 80)) origin_ += ":" + std::to_string(v.port);
+    // The path view may be a static "/" when the URL has none, so locate it in url_.
+    const size_t slash = url_.find('/', static_cast<size_t>(v.host.data() - url_.data()));
+    if (slash != std::string::npos) {
+        dir_begin_ = slash;
+        dir_size_ = url_.rfind('/') + 1 - slash;
+    }
+    valid_ = true;
+}
+
+bool BaseUrl::resolveInto(std::string_view href, std::string& out) const {
+    const std::string_view clean = trim(href);
+    if (clean.empty() || !is_safe_navigation_target(clean)) return false;
+    if (clean.compare(0, 7, "http://") == 0 || clean.compare(0, 8, "https://") == 0) {
+        out.append(clean.data(), clean.size());
+        return true;
+    }
+    if (!valid_) return false;
+
+    if (clean[0] == '#') {
+        out += url_;
+    } else if (clean.compare(0, 2, "//") == 0) {
+        out.append(origin_, 0, origin_.find(':') + 1);
+        out.append(clean.data(), clean.size());
+    } else {
+        out += origin_;
+        const std::string_view dir = (clean[0] == '/') ? std::string_view() : std::string_view(url_).substr(dir_begin_, dir_size_);
+        append_normalized_path(out, dir, clean);
+    }
+    return true;
+}
+
+std::string BaseUrl::resolve(std::string_view href) const {
+    std::string out;
+    resolveInto(href, out);
+    return out;
+}
+
+void BaseUrl::resolveAll(const std::vector<std::string_view>& hrefs, ResolvedUrls& out) const {
+    out.spans_.reserve(out.spans_.size() + hrefs.size());
+    for (const std::string_view href : hrefs) {
+        const size_t start = out.arena_.size();
+        const bool ok = resolveInto(href, out.arena_);
+        out.spans_.emplace_back(static_cast<uint32_t>(start), static_cast<uint32_t>(ok ? out.arena_.size() - start : 0));
+    }
+}
+
+}  // namespace browser
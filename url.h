@@ -0,0 +1,74 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace browser {
+
+// An absolute http(s) URL split in place. Views point into the parsed string.
+struct UrlView {
+    std::string_view scheme;  // as written; `https` says which one
+    std::string_view host;
+    std::string_view path;    // from the first '/' after the host, query and fragment included
+    int port = 80;
+    bool https = false;
+    bool explicit_port = false;
+
+    // False for anything but http(s)://host[:port][/...] with a numeric port.
+    static bool parse(std::string_view url, UrlView& out);
+};
+
+// Trims surrounding whitespace and rejects javascript:, data:, file: and vbscript: targets
+// without copying.
+bool is_safe_navigation_target(std::string_view href);
+
+// Resolved URLs packed end to end into one arena, so resolving a page's links costs a
+// couple of allocations in total, none at all once the arena has grown.
+class ResolvedUrls {
+public:
+    size_t size() const { return spans_.size(); }
+    // Empty when the reference did not resolve.
+    std::string_view operator[](size_t i) const { return std::string_view(arena_).substr(spans_[i].first, spans_[i].second); }
+    size_t arenaBytes() const { return arena_.size(); }
+    // Keeps the capacity for the next batch.
+    void clear();
+
+private:
+    friend class BaseUrl;
+
+    std::string arena_;
+    std::vector<std::pair<uint32_t, uint32_t>> spans_;
+};
+
+// A base URL parsed once, for resolving many references against it; resolve_url() wraps it.
+// Resolved URLs keep a non-default port and a trailing '/' on the path, so
+// "../api/./x.html" against http://h:8080/docs/guide/index.html gives
+// http://h:8080/docs/api/x.html and "img/" gives http://h:8080/docs/guide/img/.
+class BaseUrl {
+public:
+    BaseUrl() = default;
+    explicit BaseUrl(std::string url);
+
+    bool valid() const { return valid_; }
+    const std::string& str() const { return url_; }
+
+    // Appends the resolved URL to `out`; appends nothing and returns false when `href` is
+    // empty, unsafe or the base is invalid.
+    bool resolveInto(std::string_view href, std::string& out) const;
+    std::string resolve(std::string_view href) const;
+
+    // Appends one entry per reference to `out`.
+    void resolveAll(const std::vector<std::string_view>& hrefs, ResolvedUrls& out) const;
+
+private:
+    std::string url_;
+    std::string origin_;  // lowercase scheme, host and any non-default port
+    size_t dir_begin_ = 0;  // the base path up to and including its last '/'
+    size_t dir_size_ = 0;
+    bool valid_ = false;
+};
+
+}  // namespace browser